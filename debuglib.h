@@ -3,36 +3,41 @@
    Author: Dustin Fast, 2018
 */
 
+// Populates buf with a string representing the given inode's data.
+// Returns: The size of the data at buf.
+// NOTE: buf should be pre-sized with malloc(inode->file_size_b)
+static size_t inode_data_get(FSHandle *fs, Inode *inode, const char *buf) {
+    return inode_data_read(fs, inode, (char*)buf, inode->file_size_b,
+                           0);
+}
+
 // Returns number of free bytes in the fs, as based on num free mem blocks.
 static size_t fs_freespace_debug(FSHandle *fs) {
     size_t num_memblocks = memblocks_numfree(fs);
-    return num_memblocks * DATAFIELD_SZ_B;
+    return num_memblocks * DATAFIELD_SZ_B(fs);
 }
 
 // Returns the number of free inodes in the filesystem
 static size_t inodes_numfree_debug(FSHandle *fs) {
-    Inode *inode = fs->inode_seg;
     size_t num_inodes = fs->num_inodes;
     size_t num_free = 0;
 
-    for (int i = 0; i < num_inodes; i++) {
-        if (inode_isfree(inode))
+    for (size_t i = 0; i < num_inodes; i++)
+        if (inode_isfree(fs, inode_at(fs, i)))
             num_free++;
-        inode++;
-    }
     return num_free;
 }
 
 // Print filesystem's data structure sizes
-static void print_struct_debug() {
+static void print_struct_debug(FSHandle *fs) {
     printf("File system's data structures:\n");
     printf("    FSHandle        : %lu bytes\n", ST_SZ_FSHANDLE);
     printf("    Inode           : %lu bytes\n", ST_SZ_INODE);
-    printf("    MemHead         : %lu bytes\n", ST_SZ_MEMHEAD);
-    printf("    Data Field      : %lu bytes\n", DATAFIELD_SZ_B);
+    printf("    Extent          : %lu bytes\n", ST_SZ_EXTENT);
+    printf("    Data Field      : %lu bytes\n", DATAFIELD_SZ_B(fs));
     printf("    Memory Block    : %lu bytes (%lu kb)\n", 
-           MEMBLOCK_SZ_B,
-           bytes_to_kb(MEMBLOCK_SZ_B));
+           MEMBLOCK_SZ_B(fs),
+           bytes_to_kb(MEMBLOCK_SZ_B(fs)));
 }
 
 // Print filesystem stats
@@ -43,14 +48,33 @@ static void print_fs_debug(FSHandle *fs) {
     printf("    fs->num_memblks : %lu\n", (lui)fs->num_memblocks);
     printf("    fs->size_b      : %lu (%lu kb)\n", fs->size_b, 
         bytes_to_kb(fs->size_b));
+    printf("    fs->block_sz_b  : %lu\n", (lui)fs->block_sz_b);
+    printf("    fs->inode_ratio : %lu\n", (lui)fs->inode_ratio);
+    printf("    fs->journal_sz_b: %lu\n", (lui)fs->journal_sz_b);
     printf("    fs->inode_seg   : %lu\n", (lui)fs->inode_seg);
     printf("    fs->mem_seg     : %lu\n", (lui)fs->mem_seg);
+    printf("    Inode groups    : %lu\n", (lui)fs->num_groups);
     printf("    Free Inodes     : %lu\n", inodes_numfree_debug(fs));
     printf("    Num Memblocks   : %lu\n", memblocks_numfree(fs));
     printf("    Free space      : %lu bytes (%lu kb)\n", 
         fs_freespace_debug(fs), bytes_to_kb(fs_freespace_debug(fs)));
 }
 
+// Print the dentry cache's counters (if the fs is mounted by this process)
+static void print_dcache_debug(FSHandle *fs) {
+    FSRuntime *rt = fs_runtime(fs);
+    if (rt == NULL) {
+        printf("\nDentry cache: none (fs not mounted)\n");
+        return;
+    }
+
+    printf("\nDentry cache: \n");
+    printf("    Path hits       : %lu\n", (lui)rt->path_hits);
+    printf("    Path misses     : %lu\n", (lui)rt->path_misses);
+    printf("    Child hits      : %lu\n", (lui)rt->child_hits);
+    printf("    Child misses    : %lu\n", (lui)rt->child_misses);
+}
+
 // Prints an inode's properties
 static void print_inode_debug(FSHandle *fs, Inode *inode) {
     if (inode == NULL) {
@@ -61,23 +85,35 @@ static void print_inode_debug(FSHandle *fs, Inode *inode) {
     printf("Inode -\n");
     printf("   addr                : %lu\n", (lui)inode);
     printf("   offset              : %lu\n", (lui)offset_from_ptr(fs, inode));
-    printf("   name                : %s\n", inode->name);
+    printf("   index               : %lu\n", (lui)inode_index(fs, inode));
     printf("   is_dir              : %lu\n", (lui)inode->is_dir);
+    printf("   flags               : %lu\n", (lui)inode->flags);
     printf("   subdirs             : %lu\n", (lui)inode->subdirs);
     printf("   file_size_b         : %lu\n", (lui)inode->file_size_b);
-    printf("   last_acc            : %09ld\n", inode->last_acc->tv_sec);
-    printf("   last_mod            : %09ld\n", inode->last_mod->tv_sec);
-    printf("   offset_firstblk     : %lu\n", (lui)inode->offset_firstblk);  
-
-    MemHead *memhead = inode_firstmemblock(fs, inode);
-    printf("   first mem block -\n");
-    printf("      addr           : %lu\n", (lui)memhead);
-    printf("      offset         : %lu\n", (lui)offset_from_ptr(fs, memhead));
-    printf("      not_free       : %lu\n", (lui)memhead->not_free);
-    printf("      data_size_b    : %lu\n", (lui)memhead->data_size_b);
-    printf("      offset_nextblk : %lu\n", (lui)memhead->offset_nextblk);
-    printf("      data           :\n");
-    printf("'%s'\n",  (char*)(memhead + ST_SZ_MEMHEAD));
+    printf("   last_acc_ns         : %lld\n", (long long)inode->last_acc_ns);
+    printf("   last_mod_ns         : %lld\n", (long long)inode->last_mod_ns);
+    printf("   in_use              : %d\n", !inode_isfree(fs, inode));
+    printf("   num_extents         : %lu\n", (lui)inode->num_extents);
+    printf("   ext_table_blk       : %lu\n", (lui)inode->ext_table_blk);
+    printf("   ext_table_len       : %lu\n", (lui)inode->ext_table_len);
+
+    Extent *extents = inode_extents_get(fs, inode);
+    for (size_t i = 0; i < inode->num_extents; i++)
+        printf("   extent %-4lu         : file_blk=%lu start_blk=%lu len=%lu\n",
+               (lui)i, (lui)extents[i].file_blk, (lui)extents[i].start_blk, 
+               (lui)extents[i].len);
+
+    if (inode->flags & INODE_INLINE) {
+        printf("   inline data          :\n");
+        printf("'%.*s'\n", (int)inode->file_size_b, 
+               inode_inline_data(fs, inode));
+    } else if (inode->num_extents) {
+        size_t sz = inode->file_size_b;
+        if (sz > DATAFIELD_SZ_B(fs))
+            sz = DATAFIELD_SZ_B(fs);
+        printf("   first mem block data :\n");
+        printf("'%.*s'\n", (int)sz, (char*)memblock_at(fs, extents->start_blk));
+    }
 }
 
 // Prints either a PASS or FAIL to the console based on the given params
@@ -110,7 +146,7 @@ static void init_files_debug(FSHandle *fs) {
     file_new(fs, "/dir2", "file3", "hello from file 3", 17);
     
     // Init /file5, consisting of a lg string of a's & b's & terminated w/ 'c'.
-    size_t data_sz = DATAFIELD_SZ_B * 1.25;
+    size_t data_sz = DATAFIELD_SZ_B(fs) * 1.25;
     char *lg_data = malloc(data_sz);
     for (size_t i = 0; i < data_sz; i++) {
         char *c = lg_data + i;
@@ -129,7 +165,6 @@ int main()
 {
     printf("------------- File System Test Space -------------\n");
     printf("--------------------------------------------------\n\n");
-    print_struct_debug();
       
     /////////////////////////////////////////////////////////////////////////
     // Init a fs for testing purposes
@@ -138,6 +173,9 @@ int main()
     size_t fssize = kb_to_bytes(128) + ST_SZ_FSHANDLE;
     void *fsptr = malloc(fssize); 
     FSHandle *fs = fs_init(fsptr, fssize);
+    print_struct_debug(fs);
+    int mount_e;
+    __myfs_mount_implem(fsptr, fssize, &mount_e);
 
     print_fs_debug(fs);      // Display fs properties
     init_files_debug(fs);    // Init test files/dirs
@@ -229,10 +267,10 @@ int main()
     print_result_debug("statfs_implem(SUCCESS):\n", r, 0);
 
     // open
-    r = __myfs_open_implem(fsptr, fssize, &e, filepath);
+    r = __myfs_open_implem(fsptr, fssize, &e, filepath, NULL);
     print_result_debug("open_implem(SUCCESS):\n", r, 0);
 
-    r = __myfs_open_implem(fsptr, fssize, &e, nofilepath);
+    r = __myfs_open_implem(fsptr, fssize, &e, nofilepath, NULL);
     print_result_debug("open_implem(FAIL/NOEXIST):\n", r, -1);
 
     // readdir_implem
@@ -283,7 +321,10 @@ int main()
     /////////////////////////////////////////////////////////////////////////
     // Cleanup
     
+    print_dcache_debug(fs);
+
     printf("\n\nExiting...\n");
+    __myfs_unmount_implem(fsptr, fssize);
     free(fsptr);
 
     return 0; 
@@ -0,0 +1,456 @@
+/*
+
+  fsbench: Measures the latency of myfs operations, w/o FUSE or the kernel.
+
+  Formats a filesystem in an anonymous mapping and drives the
+  __myfs_*_implem calls of implementation.c against it directly, timing each
+  call. For each of the following, the ops done, their rate and their
+  latency percentiles are reported -
+
+    create      mknod of new files in one directory
+    stat        getattr of random files of that directory
+    lookup      getattr of files at the end of a chain of dirs of the given
+                depth, w/ the dentry cache (mounted) and w/out (unmounted)
+    readdir     readdir of directories of the given num of entries, into an
+                array of names, and streamed (w/out and w/ attributes)
+    seq write   appending fixed-size chunks to a new file, via its handle
+    seq read    reading that file's chunks in order
+    rand write  overwriting random (chunk aligned) chunks of that file
+    rand read   reading random (chunk aligned) chunks of that file
+    rename      moving files between two directories
+
+  As no FUSE or syscalls are involved (aside from the journal's msyncs), the
+  results reflect the filesystem's own data structures, so a change that
+  makes an op scale worse w/ file or directory size shows up here first.
+
+  Compile with:
+    gcc -O2 -Wall fsbench.c implementation.c -o fsbench -lpthread
+
+  Usage:
+    ./fsbench [OPS] [FILE_MB] [CHUNK_KB] [BLOCK_KB] [FS_MB]
+
+  Ex:
+    ./fsbench 20000 64 4 4 512
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file LICENSE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+
+#define LOOKUP_FILES (64)                   // Num files at each lookup depth
+#define PATH_MAXLEN (1024)                  // Longest path the bench builds
+
+/* Declaration for the implementations of the operations used */
+int __myfs_format_implem(void *, size_t, int *, size_t, size_t);
+int __myfs_mount_implem(void *, size_t, int *);
+void __myfs_unmount_implem(void *, size_t);
+int __myfs_getattr_implem(void *, size_t, int *, uid_t, gid_t, const char *, struct stat *);
+int __myfs_readdir_implem(void *, size_t, int *, const char *, char ***);
+int __myfs_readdir_cursor_implem(void *, size_t, int *, uid_t, gid_t, const char *, off_t, int, int (*)(void *, const char *, const struct stat *, off_t), void *);
+int __myfs_mknod_implem(void *, size_t, int *, const char *);
+int __myfs_mkdir_implem(void *, size_t, int *, const char *);
+int __myfs_rename_implem(void *, size_t, int *, const char *, const char*);
+int __myfs_create_implem(void *, size_t, int *, const char *, uint64_t *);
+int __myfs_release_implem(void *, size_t, int *, uint64_t);
+int __myfs_fread_implem(void *, size_t, int *, uint64_t, char *, size_t, off_t);
+int __myfs_fwrite_implem(void *, size_t, int *, uint64_t, const char *, size_t, off_t);
+
+// The filesystem under test
+typedef struct BenchFS {
+    void *mem;                              // Its mapping
+    size_t size;                            // Its size, in bytes
+} BenchFS;
+
+// Latency samples of a run of one op
+typedef struct BenchRun {
+    uint64_t *lat_ns;                       // Latency of each op, in ns
+    size_t n;                               // Num ops done
+    size_t max;                             // Num ops lat_ns has room for
+    uint64_t start_ns;                      // When the run began
+} BenchRun;
+
+// Returns the current monotonic time, in nanoseconds.
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Orders latencies ascending, for qsort.
+static int lat_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Begins a run of max ops.
+static void run_begin(BenchRun *run, uint64_t *lat_ns, size_t max) {
+    run->lat_ns = lat_ns;
+    run->n = 0;
+    run->max = max;
+    run->start_ns = now_ns();
+}
+
+// Records an op of the run that began at start_ns.
+static void run_note(BenchRun *run, uint64_t start_ns) {
+    if (run->n < run->max)
+        run->lat_ns[run->n++] = now_ns() - start_ns;
+}
+
+// Returns the latency (in us) at the given percentile of the run's sorted ops.
+static double run_pct(BenchRun *run, double pct) {
+    size_t i = (size_t)(pct / 100 * run->n);
+    if (i >= run->n)
+        i = run->n - 1;
+    return run->lat_ns[i] / 1e3;
+}
+
+// Ends the run and prints its results under the given label.
+static void run_end(BenchRun *run, const char *label) {
+    double elapsed = (now_ns() - run->start_ns) / 1e9;
+
+    if (!run->n) {
+        printf("%-22s %9s\n", label, "-");
+        return;
+    }
+    qsort(run->lat_ns, run->n, sizeof(uint64_t), lat_cmp);
+    printf("%-22s %9lu %11.0f %9.2f %9.2f %9.2f %9.2f\n", label,
+           (unsigned long)run->n, run->n / elapsed, run_pct(run, 50),
+           run_pct(run, 90), run_pct(run, 99), run_pct(run, 100));
+}
+
+// Prints the failure of the given op on the given path. Returns -1.
+static int bench_fail(const char *op, const char *path, int err) {
+    fprintf(stderr, "%s %s failed: %s\n", op, path, strerror(err));
+    return -1;
+}
+
+// Creates the given dir, or fails. Returns 0 on success, else -1.
+static int bench_mkdir(BenchFS *bfs, const char *path) {
+    int err;
+    if (__myfs_mkdir_implem(bfs->mem, bfs->size, &err, path) != 0)
+        return bench_fail("mkdir", path, err);
+    return 0;
+}
+
+// Frees the names given by __myfs_readdir_implem.
+static void names_free(char **names, int n) {
+    for (int i = 0; i < n; i++)
+        free(names[i]);
+    free(names);
+}
+
+// Counts the names streamed by __myfs_readdir_cursor_implem at *arg.
+static int names_count(void *arg, const char *name, const struct stat *st,
+                       off_t next) {
+    (*(int*)arg)++;
+    return 0;
+}
+
+// Times mknod of ops files in /create, then getattr of random ones of them.
+static int bench_create_stat(BenchFS *bfs, uint64_t *lat, size_t ops) {
+    BenchRun run;
+    char path[PATH_MAXLEN];
+    struct stat st;
+    unsigned int seed = 1;
+    int err;
+
+    if (bench_mkdir(bfs, "/create") != 0) return -1;
+
+    run_begin(&run, lat, ops);
+    for (size_t i = 0; i < ops; i++) {
+        snprintf(path, sizeof(path), "/create/file%lu", (unsigned long)i);
+        uint64_t t = now_ns();
+        if (__myfs_mknod_implem(bfs->mem, bfs->size, &err, path) != 0)
+            return bench_fail("mknod", path, err);
+        run_note(&run, t);
+    }
+    run_end(&run, "create");
+
+    run_begin(&run, lat, ops);
+    for (size_t i = 0; i < ops; i++) {
+        snprintf(path, sizeof(path), "/create/file%lu",
+                 (unsigned long)(rand_r(&seed) % ops));
+        uint64_t t = now_ns();
+        if (__myfs_getattr_implem(bfs->mem, bfs->size, &err, 0, 0, path,
+                                  &st) != 0)
+            return bench_fail("getattr", path, err);
+        run_note(&run, t);
+    }
+    run_end(&run, "stat");
+
+    return 0;
+}
+
+// Times getattr of random ones of LOOKUP_FILES files at the end of a chain of
+// dirs of each given depth, w/ the fs mounted and then unmounted (i.e. w/ and
+// w/out the dentry cache).
+static int bench_lookup(BenchFS *bfs, uint64_t *lat, size_t ops) {
+    static const int depths[] = { 1, 4, 16, 64 };
+    const int num_depths = sizeof(depths) / sizeof(depths[0]);
+    char dirs[sizeof(depths) / sizeof(depths[0])][PATH_MAXLEN];
+    int dir_lens[sizeof(depths) / sizeof(depths[0])];
+    char path[PATH_MAXLEN], label[64];
+    struct stat st;
+    BenchRun run;
+    int err;
+
+    for (int d = 0; d < num_depths; d++) {
+        int len = snprintf(dirs[d], PATH_MAXLEN, "/depth%d", depths[d]);
+        if (bench_mkdir(bfs, dirs[d]) != 0) return -1;
+        for (int i = 1; i < depths[d]; i++) {
+            len += snprintf(dirs[d] + len, PATH_MAXLEN - len, "/d%d", i);
+            if (bench_mkdir(bfs, dirs[d]) != 0) return -1;
+        }
+        dir_lens[d] = len;
+        memcpy(path, dirs[d], len);
+        for (int i = 0; i < LOOKUP_FILES; i++) {
+            snprintf(path + len, sizeof(path) - len, "/file%d", i);
+            if (__myfs_mknod_implem(bfs->mem, bfs->size, &err, path) != 0)
+                return bench_fail("mknod", path, err);
+        }
+    }
+
+    for (int cached = 1; cached >= 0; cached--) {
+        if (!cached)
+            __myfs_unmount_implem(bfs->mem, bfs->size);
+
+        for (int d = 0; d < num_depths; d++) {
+            unsigned int seed = 1;
+            int len = dir_lens[d];
+            memcpy(path, dirs[d], len);
+            run_begin(&run, lat, ops);
+            for (size_t i = 0; i < ops; i++) {
+                snprintf(path + len, sizeof(path) - len, "/file%d",
+                         rand_r(&seed) % LOOKUP_FILES);
+                uint64_t t = now_ns();
+                if (__myfs_getattr_implem(bfs->mem, bfs->size, &err, 0, 0,
+                                          path, &st) != 0)
+                    return bench_fail("getattr", path, err);
+                run_note(&run, t);
+            }
+            snprintf(label, sizeof(label), "lookup d=%d%s", depths[d],
+                     cached ? "" : " nocache");
+            run_end(&run, label);
+        }
+
+        if (!cached &&
+            __myfs_mount_implem(bfs->mem, bfs->size, &err) != 0)
+            return bench_fail("mount", "/", err);
+    }
+
+    return 0;
+}
+
+// Times readdir of directories of each given num of entries.
+static int bench_readdir(BenchFS *bfs, uint64_t *lat, size_t ops) {
+    static const int sizes[] = { 16, 256, 4096 };
+    char dir[64], path[PATH_MAXLEN], label[64];
+    char **names;
+    BenchRun run;
+    int err;
+
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+        snprintf(dir, sizeof(dir), "/readdir%d", sizes[s]);
+        if (bench_mkdir(bfs, dir) != 0) return -1;
+        for (int i = 0; i < sizes[s]; i++) {
+            snprintf(path, sizeof(path), "%s/file%d", dir, i);
+            if (__myfs_mknod_implem(bfs->mem, bfs->size, &err, path) != 0)
+                return bench_fail("mknod", path, err);
+        }
+
+        // Bigger dirs take longer, so list them fewer times
+        size_t n = ops * 16 / sizes[s];
+        if (n < 16)
+            n = 16;
+        if (n > ops)
+            n = ops;
+
+        // Mode 0 lists into an array, 1 streams names, 2 streams attrs too
+        for (int mode = 0; mode < 3; mode++) {
+            static const char *modes[] = { "", " stream", " plus" };
+            run_begin(&run, lat, n);
+            for (size_t i = 0; i < n; i++) {
+                int count = 0;
+                uint64_t t = now_ns();
+                if (mode == 0) {
+                    count = __myfs_readdir_implem(bfs->mem, bfs->size, &err,
+                                                  dir, &names);
+                    if (count > 0)
+                        names_free(names, count);
+                } else if (__myfs_readdir_cursor_implem(bfs->mem, bfs->size,
+                               &err, 0, 0, dir, 0, mode == 2, names_count,
+                               &count) != 0) {
+                    count = -1;
+                }
+                run_note(&run, t);
+                if (count < 0)
+                    return bench_fail("readdir", dir, err);
+                if (count != sizes[s]) {
+                    fprintf(stderr, "readdir %s gave %d names\n", dir, count);
+                    return -1;
+                }
+            }
+            snprintf(label, sizeof(label), "readdir%s n=%d", modes[mode],
+                     sizes[s]);
+            run_end(&run, label);
+        }
+    }
+
+    return 0;
+}
+
+// Times chunk_sz writes and reads of a file of file_sz bytes, in order and
+// then at random.
+static int bench_data(BenchFS *bfs, uint64_t *lat, size_t ops,
+                      size_t file_sz, size_t chunk_sz) {
+    const char *path = "/data";
+    size_t num_chunks = file_sz / chunk_sz;
+    unsigned int seed = 1;
+    uint64_t fh;
+    BenchRun run;
+    int err;
+
+    char *buf = malloc(chunk_sz);
+    if (!buf) return bench_fail("malloc", path, ENOMEM);
+    memset(buf, 'x', chunk_sz);
+
+    if (__myfs_create_implem(bfs->mem, bfs->size, &err, path, &fh) != 0) {
+        free(buf);
+        return bench_fail("create", path, err);
+    }
+
+    // Each pass is one of: seq write, seq read, rand write, rand read
+    for (int pass = 0; pass < 4; pass++) {
+        int writing = !(pass & 1), random = pass >> 1;
+        size_t n = random ? ops : num_chunks;
+        static const char *labels[] = { "seq write", "seq read",
+                                        "rand write", "rand read" };
+
+        run_begin(&run, lat, n);
+        for (size_t i = 0; i < n; i++) {
+            size_t chunk = random ? rand_r(&seed) % num_chunks : i;
+            off_t off = (off_t)(chunk * chunk_sz);
+            uint64_t t = now_ns();
+            int res = writing ?
+                __myfs_fwrite_implem(bfs->mem, bfs->size, &err, fh, buf,
+                                     chunk_sz, off) :
+                __myfs_fread_implem(bfs->mem, bfs->size, &err, fh, buf,
+                                    chunk_sz, off);
+            run_note(&run, t);
+            if (res != (int)chunk_sz) {
+                __myfs_release_implem(bfs->mem, bfs->size, &err, fh);
+                free(buf);
+                return bench_fail(labels[pass], path, res < 0 ? err : EIO);
+            }
+        }
+        run_end(&run, labels[pass]);
+    }
+
+    free(buf);
+    if (__myfs_release_implem(bfs->mem, bfs->size, &err, fh) != 0)
+        return bench_fail("release", path, err);
+    return 0;
+}
+
+// Times moving ops files from /rename1 to /rename2 (under new names).
+static int bench_rename(BenchFS *bfs, uint64_t *lat, size_t ops) {
+    char from[PATH_MAXLEN], to[PATH_MAXLEN];
+    BenchRun run;
+    int err;
+
+    if (bench_mkdir(bfs, "/rename1") != 0 || bench_mkdir(bfs, "/rename2") != 0)
+        return -1;
+    for (size_t i = 0; i < ops; i++) {
+        snprintf(from, sizeof(from), "/rename1/file%lu", (unsigned long)i);
+        if (__myfs_mknod_implem(bfs->mem, bfs->size, &err, from) != 0)
+            return bench_fail("mknod", from, err);
+    }
+
+    run_begin(&run, lat, ops);
+    for (size_t i = 0; i < ops; i++) {
+        snprintf(from, sizeof(from), "/rename1/file%lu", (unsigned long)i);
+        snprintf(to, sizeof(to), "/rename2/moved%lu", (unsigned long)i);
+        uint64_t t = now_ns();
+        if (__myfs_rename_implem(bfs->mem, bfs->size, &err, from, to) != 0)
+            return bench_fail("rename", from, err);
+        run_note(&run, t);
+    }
+    run_end(&run, "rename");
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    BenchFS bfs;
+    int err;
+
+    if (argc > 1 && argv[1][0] == '-') {
+        printf("usage: %s [OPS] [FILE_MB] [CHUNK_KB] [BLOCK_KB] [FS_MB]\n",
+               argv[0]);
+        return 1;
+    }
+
+    size_t ops = (argc > 1) ? (size_t)atol(argv[1]) : 10000;
+    size_t file_sz = ((argc > 2) ? (size_t)atol(argv[2]) : 16) * 1024 * 1024;
+    size_t chunk_sz = ((argc > 3) ? (size_t)atol(argv[3]) : 4) * 1024;
+    size_t block_sz = ((argc > 4) ? (size_t)atol(argv[4]) : 4) * 1024;
+    bfs.size = ((argc > 5) ? (size_t)atol(argv[5]) : 256) * 1024 * 1024;
+
+    if (ops == 0 || chunk_sz == 0 || file_sz < chunk_sz ||
+        bfs.size <= file_sz) {
+        fprintf(stderr, "Invalid argument(s)\n");
+        return 1;
+    }
+
+    uint64_t *lat = malloc(sizeof(uint64_t) *
+                           (ops > file_sz / chunk_sz ? ops :
+                            file_sz / chunk_sz));
+    if (!lat) {
+        perror("Cannot allocate latency samples");
+        return 1;
+    }
+
+    bfs.mem = mmap(NULL, bfs.size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (bfs.mem == MAP_FAILED) {
+        perror("Cannot map in memory");
+        free(lat);
+        return 1;
+    }
+    if (__myfs_format_implem(bfs.mem, bfs.size, &err, block_sz, 0) != 0 ||
+        __myfs_mount_implem(bfs.mem, bfs.size, &err) != 0) {
+        fprintf(stderr, "Cannot mount file system: %s\n", strerror(err));
+        munmap(bfs.mem, bfs.size);
+        free(lat);
+        return 1;
+    }
+
+    printf("%lu MB fs, %lu KB blocks, %lu ops, %lu MB file, %lu KB chunks\n",
+           (unsigned long)(bfs.size >> 20), (unsigned long)(block_sz >> 10),
+           (unsigned long)ops, (unsigned long)(file_sz >> 20),
+           (unsigned long)(chunk_sz >> 10));
+    printf("%-22s %9s %11s %9s %9s %9s %9s\n", "op", "ops", "ops/s",
+           "p50 us", "p90 us", "p99 us", "max us");
+
+    int result = bench_create_stat(&bfs, lat, ops) == 0 &&
+                 bench_lookup(&bfs, lat, ops) == 0 &&
+                 bench_readdir(&bfs, lat, ops) == 0 &&
+                 bench_data(&bfs, lat, ops, file_sz, chunk_sz) == 0 &&
+                 bench_rename(&bfs, lat, ops) == 0;
+
+    __myfs_unmount_implem(bfs.mem, bfs.size);
+    munmap(bfs.mem, bfs.size);
+    free(lat);
+    return result ? 0 : 1;
+}
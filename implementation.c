@@ -51,14 +51,36 @@
 #include <errno.h>
 #include <stdio.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <stdarg.h>
+#include <limits.h>
 
 
 /* Begin Configurables  -------------------------------------------------- */
 
 
-#define FS_BLOCK_SZ_KB (4)                 // Total kbs of each memory block
+#define FS_BLOCK_SZ_KB (4)                 // Default kbs of each memory block
 #define NAME_MAXLEN (256)                  // Max length of any filename
-#define BLOCKS_TO_INODES (1)               // Num of mem blocks to each inode
+#define BLOCKS_TO_INODES (1)               // Default num mem blocks per inode
+#define DCACHE_PATH_SLOTS (4096)           // Full-path dentry cache slots (pow 2)
+#define DCACHE_CHILD_SLOTS (4096)          // Dir child cache slots (pow 2)
+#define DCACHE_PATH_MAXLEN (255)           // Longest path the path cache holds
+#define FS_MOUNTS_MAX (16)                 // Most fs a process mounts at once
+#define JOURNAL_SZ_B (4 * 1024 * 1024)     // Max size of the metadata journal
+#define JOURNAL_GROUP_OPS (64)             // Max num ops per journal commit
+#define JOURNAL_GROUP_MS (5)               // Max age (ms) of an uncommitted op
+#define DIRTY_SLOTS (1024)                 // Dirty file table slots (pow 2)
+#define DIRTY_RUNS (8)                     // Dirty memblock runs kept per file
+#define CHECK_THREADS_MAX (256)            // Most threads a check runs on
+#define CHECK_REPORT_MAX (100)             // Most problems a check reports
+#define CHECK_MSG_MAXLEN (512)             // Longest problem report
+#define DEDUP_LOAD_PCT (75)                // Max % of dedup index slots used
+#define SNAPSHOT_DIR (".snapshots")        // Root dir item holding snapshots
+#define SNAPSHOT_PATH ("/.snapshots")      // Its path
+#define IMPORT_THREADS_MAX (256)           // Most threads an import runs on
+#define IMPORT_CHUNK_SZ_B (1024 * 1024)    // Num bytes filled per claim
 
 
 /* End Configurables  ---------------------------------------------------- */
@@ -67,64 +89,398 @@
 
 #define BYTES_IN_KB (1024)                  // Num bytes in a kb
 #define FS_PATH_SEP ("/")                   // File system's path seperator
-#define FS_DIRDATA_SEP (":")                // Dir data name/offset seperator
-#define FS_DIRDATA_END ("\n")               // Dir data name/offset end char
+#define DIR_MAGIC (UINT32_C(0xd1d1d1d1))    // Num denoting binary dir data
+#define DIR_VERSION (UINT32_C(1))           // Binary dir data format version
+#define DIR_MIN_SLOTS (16)                  // Min dir hash index slots (pow 2)
+#define DIR_WALK_BATCH (16)                 // Dir records read at a time
+#define DIR_SLOT_EMPTY (0)                  // Dir hash index slot never used
+#define DIR_SLOT_TOMB (SIZE_MAX)            // Dir hash index slot vacated
 #define MAGIC_NUM (UINT32_C(0xdeadd0c5))    // Num for denoting block init
+#define FS_VERSION (UINT32_C(13))           // On-"disk" layout version
+#define INODE_EXTENTS (4)                   // Num extents held in an inode
+#define INODE_INLINE (1)                    // Inode flag: data held inline
+#define INODE_FROZEN (2)                    // Inode flag: part of a snapshot
+#define CACHELINE_SZ_B (64)                 // CPU cache line size
+#define FS_BLOCK_SZ_MIN_B (512)             // Min memblock size (pow 2) 
+#define FS_BLOCK_SZ_MAX_B (1024 * 1024)     // Max memblock size (pow 2)
+#define INODE_RATIO_MAX (1024)              // Max num mem blocks per inode
+#define FS_GROW_MAX (16)                    // Max factor a fs may grow by
+#define FS_GROUPS_MAX (32)                  // Max num inode groups
+#define HASH_SEED (UINT32_C(2166136261))    // 32-bit FNV-1a offset basis
+#define JOURNAL_MAGIC (UINT32_C(0x10c510c5)) // Num denoting a journal header
+#define JOURNAL_REC_MAGIC (UINT32_C(0x7ec07ec0)) // Num denoting a journal rec
+#define JOURNAL_ALIGN_B (4096)              // Journal alignment (a page)
+#define JOURNAL_FS_SHARE (16)               // Journal is at most 1/this of fs
+#define JOURNAL_MIN_SZ_B (64 * 1024)        // Min journal size (else none)
+#define JOURNAL_HDR_SZ_B (CACHELINE_SZ_B)   // Bytes reserved for its header
+#define JREC_UNDO (1)                       // Rec of a range's prior bytes
+#define JREC_REDO (2)                       // Rec of a range's new bytes
+#define JREC_REVOKE (3)                     // Rec of a range no longer meta
+#define JREC_COMMIT (4)                     // Rec of a txn's completion
+#define DIRTY_DATA (1)                      // File's data blocks written
+#define DIRTY_META (2)                      // File's size or mapping changed
+#define DIRTY_TIME (4)                      // File's times changed
+#define ATIME_STRICT (0)                    // Atime set on every access
+#define ATIME_RELATIME (1)                  // Atime set on an access only if
+                                            // not after mtime, or a day old
+#define ATIME_NONE (2)                      // Atime never set on an access
+#define ATIME_RELATIME_NS (INT64_C(86400000000000))  // A day
+#define DEDUP_SLOT_EMPTY (0)                // Dedup index slot never used
+#define DEDUP_SLOT_TOMB (SIZE_MAX)          // Dedup index slot vacated
+
+// Extent -
+// A run of len contiguous memblocks, starting at memblock index start_blk,
+// holding the file's/dir's data blocks [file_blk, file_blk + len).
+typedef struct Extent {
+    size_t file_blk;                    // Index of run's 1st block in the data
+    size_t start_blk;                   // Index of run's 1st memblock
+    size_t len;                         // Num memblocks in the run
+} Extent;
 
 // Inode -
-// An Inode represents the meta-data of a file or folder.
+// An Inode represents the meta-data of a file or folder, in one cache line.
+// Its name is held only by its parent dir's entry for it, and whether it is
+// in use only by the fs's inode bitmap. Its data is mapped by num_extents
+// extents, sorted by file_blk. Up to INODE_EXTENTS of them are held inline,
+// in the inode's slot of the fs's extents segment; beyond that, all of them 
+// are held in an extent table occupying a run of ext_table_len memblocks.
+// If flagged INODE_INLINE, its data (of at most INODE_INLINE_SZ_B bytes) is 
+// instead held in that slot itself, and it maps no blocks.
 typedef struct Inode { 
-    char name[NAME_MAXLEN];             // Inode's label (file/folder name)
-    int *is_dir;                        // if 1, is a dir, else a file
-    int *subdirs;                       // Subdir count (unused if not is_dir)
-    size_t *file_size_b;                // File's/folder's data size, in bytes
-    struct timespec *last_acc;          // File/folder last access time
-    struct timespec *last_mod;          // File/Folder last modified time
-    size_t *offset_firstblk;            // Byte offset from fsptr to 1st
-                                        // memblock, or 0 if inode is unused
+    uint16_t is_dir;                    // if 1, is a dir, else a file
+    uint16_t flags;                     // INODE_INLINE | INODE_FROZEN, or 0
+    uint32_t subdirs;                   // Subdir count (unused if not is_dir)
+    size_t file_size_b;                 // File's/folder's data size, in bytes
+    int64_t last_acc_ns;                // File/folder last access time and
+    int64_t last_mod_ns;                // last modified time, in ns since
+                                        // the Epoch
+    size_t num_extents;                 // Num extents mapping the data
+    size_t ext_table_blk;               // 1st memblock of the extent table
+    size_t ext_table_len;               // Num memblocks of the extent table,
+                                        // or 0 if extents are held inline
+    uint64_t generation;                // Num times the inode was freed, so
+                                        // handles to a prior use are stale
 } Inode;
 
-// Memory block header -
-// Each file/dir uses one or more memory blocks.
-typedef struct MemHead {
-    int *not_free;                      // Denotes memblock in use (1 = used)
-    size_t *data_size_b;                // Size of data field occupied
-    size_t *offset_nextblk;             // Bytes offset (from fsptr) to next
-                                        // memblock, if any (else 0)
-} MemHead;
+// Dedup index entry -
+// Maps the hash of an (indexed) memblock's content to it. Held by a slot of
+// the dedup index (open addressing, linear probing).
+typedef struct DedupEntry {
+    uint32_t hash;                      // Hash of the memblock's content
+    uint32_t reserved;
+    size_t blk;                         // Index + 1 of the memblock, or
+                                        // DEDUP_SLOT_EMPTY/DEDUP_SLOT_TOMB
+} DedupEntry;
+
+// Inode group -
+// A run of len memblocks from start_blk, allocated when the fs grew, holding
+// num_inodes inodes (those from index first_inode onward) followed by their
+// inline extents.
+typedef struct InodeGroup {
+    size_t start_blk;                   // Index of the run's 1st memblock
+    size_t len;                         // Num memblocks in the run
+    size_t first_inode;                 // Index of the group's 1st inode
+    size_t num_inodes;                  // Num inodes in the group
+} InodeGroup;
 
 // Top-level filesystem handle
-// A file system is a list of inodes where each knows the offset of the first 
-// memory block for that file/dir.
+// A file system is a list of inodes where each maps the memory blocks of its
+// file/dir by extents. The handle is followed by the metadata journal, 
+// starting on the next page. Memblock usage is tracked by a bitmap that 
+// immediately follows the journal, and inode usage by a bitmap following 
+// that. The inodes segment (starting on a cache line) and then their inline
+// extents segment come next. The memblocks segment starts on a 
+// memblock-aligned offset. Growing the fs appends memblocks, and inodes in 
+// an inode group held by some of them, so nothing is relocated: the bitmaps
+// have room for FS_GROW_MAX times the num of each the fs was formatted w/.
+// Once dedup is enabled (or a snapshot taken), a run of memblocks holds the
+// dedup index's slots, followed by a bitmap of the memblocks it indexes and 
+// by a count per memblock of the file data blocks sharing it but the first
+// (both w/ room for as many memblocks as the memblock bitmap). Files' data 
+// blocks may share a memblock either way, which is then copied on write.
 typedef struct FSHandle {
     uint32_t magic;                     // Magic number for denoting mem init
+    uint32_t version;                   // Layout version fs was formatted w/
     size_t size_b;                      // Bytes from inode seg to memblocks end
+    size_t block_sz_b;                  // Size of each memblock, in bytes
+    size_t inode_ratio;                 // Num memblocks per inode
+    size_t journal_sz_b;                // Size of the journal, or 0 if none
     size_t num_inodes;                  // Num inodes the file system contains
     size_t num_memblocks;               // Num memory blocks the fs contains
+    size_t blk_bitmap_cap;              // Num memblocks the bitmap has room for
+    size_t inode_bitmap_cap;            // Num inodes the bitmap has room for
+    size_t base_inodes;                 // Num inodes in the inodes segment
+    size_t num_groups;                  // Num inode groups holding the rest
+    size_t free_inodes;                 // Num inodes currently unused
+    size_t free_memblocks;              // Num memory blocks currently unused
+    size_t blk_cursor;                  // Next-fit cursor (memblock index)
+    size_t inode_cursor;                // Next-fit cursor (inode index)
+    int bitmap_valid;                   // 1 iff blk_bitmap reflects memblocks
+    size_t dedup_blk;                   // 1st memblock of the dedup index
+    size_t dedup_len;                   // Num memblocks of the dedup index,
+                                        // or 0 if nothing was ever shared
+    size_t dedup_slots;                 // Num dedup index slots (a power of 2)
+    size_t dedup_used;                  // Num slots holding an entry
+    size_t dedup_tombs;                 // Num DEDUP_SLOT_TOMB slots
+    uint64_t *blk_bitmap;               // Ptr to memblock bitmap (1 = in use)
+    uint64_t *inode_bitmap;             // Ptr to inode bitmap (1 = in use)
     struct Inode *inode_seg;            // Ptr to start of inodes segment
-    struct MemHead *mem_seg;            // Ptr to start of mem blocks segment
+    struct Extent *ext_seg;             // Ptr to start of inline extents seg
+    char *mem_seg;                      // Ptr to start of mem blocks segment
+    uint64_t reserved[2];               // Unused (mounts' in-memory state is
+                                        // held per process, see fs_runtime)
+    InodeGroup groups[FS_GROUPS_MAX];   // Inode groups, by first_inode
 } FSHandle;
 
+// Directory data header -
+// A directory's data is a DirHeader, followed by a hash index of num_slots
+// slots (open addressing, linear probing), followed by num_records fixed-width
+// DirEntry records. Each slot holds DIR_SLOT_EMPTY, DIR_SLOT_TOMB, or the
+// index + 1 of a record. Free records are chained through offset_inode.
+typedef struct DirHeader {
+    uint32_t magic;                     // DIR_MAGIC
+    uint32_t version;                   // DIR_VERSION
+    size_t num_entries;                 // Num live entries
+    size_t num_tombs;                   // Num DIR_SLOT_TOMB slots
+    size_t num_slots;                   // Num hash index slots (a power of 2)
+    size_t num_records;                 // Num records (live + free)
+    size_t free_record;                 // Index + 1 of 1st free record, or 0
+} DirHeader;
+
+// Directory entry -
+// One fixed-width record per file/sub-directory contained in a directory.
+typedef struct DirEntry {
+    size_t offset_inode;                // Byte offset from fsptr to item's 
+                                        // inode, or if free, next free record
+    uint32_t hash;                      // Hash of name
+    uint32_t name_len;                  // Length of name, or 0 if free
+    char name[NAME_MAXLEN + 1];         // Item's name (null-terminated)
+} DirEntry;
+
+// Path cache entry -
+// Maps a full path to the inode it resolves to. Valid iff gen == path_gen.
+// Read w/out a lock, as a seqlock: seq is odd while the entry is being set,
+// and bumped again once it's set, so a read that saw seq change retries.
+typedef struct DcachePath {
+    uint64_t seq;                       // Seqlock sequence
+    uint64_t gen;                       // Cache generation entry was set in
+    size_t offset_inode;                // Byte offset from fsptr to inode
+    char path[DCACHE_PATH_MAXLEN + 1];  // Full path (null-terminated)
+} DcachePath;
+
+// Child cache entry -
+// Maps a (parent dir, name) pair to the child's inode. Valid iff 
+// gen == child_gen. Read w/out a lock, as a seqlock (see DcachePath).
+typedef struct DcacheChild {
+    uint64_t seq;                       // Seqlock sequence
+    uint64_t gen;                       // Cache generation entry was set in
+    size_t offset_parent;               // Byte offset from fsptr to parent
+    size_t offset_inode;                // Byte offset from fsptr to child
+    char name[NAME_MAXLEN + 1];         // Child's name (null-terminated)
+} DcacheChild;
+
+// Journal header -
+// Heads the metadata journal, which is otherwise a log of JournalRec records.
+// Only the records of txns seq_base onward (w/ consecutive seqs) are live, so
+// bumping it empties the journal.
+typedef struct JournalHeader {
+    uint32_t magic;                     // JOURNAL_MAGIC
+    uint32_t reserved;
+    uint64_t seq_base;                  // Seq of the journal's first txn
+} JournalHeader;
+
+// Journal record -
+// A record of the metadata journal. JREC_UNDO and JREC_REDO records are 
+// followed by the len bytes of their range (padded to 8 bytes).
+typedef struct JournalRec {
+    uint32_t magic;                     // JOURNAL_REC_MAGIC
+    uint32_t type;                      // One of JREC_*
+    uint64_t seq;                       // Seq of the txn it's part of
+    size_t offset;                      // Byte offset from fsptr of the range
+    size_t len;                         // Num bytes in the range
+    uint32_t csum;                      // Hash of the record & its bytes
+    uint32_t reserved;
+} JournalRec;
+
+// Journal run -
+// A run of consecutive cache lines logged by the running txn.
+typedef struct JournalRun {
+    size_t line;                        // Index of its 1st line (from fsptr)
+    size_t num;                         // Num lines
+} JournalRun;
+
+// Dirty memblock run -
+// A run of len memblocks from start_blk holding file data written since the
+// file's last fsync.
+typedef struct DirtyRun {
+    size_t start_blk;                   // Index of run's 1st memblock
+    size_t len;                         // Num memblocks in the run
+} DirtyRun;
+
+// Dirty file -
+// A file's changes since its last fsync, as held by the mount's dirty table:
+// the memblocks written (once DIRTY_RUNS runs are used, a run is widened to 
+// also cover the next ones) and whether its metadata changed, and in which
+// journal txn.
+typedef struct DirtyFile {
+    size_t index;                       // Index + 1 of its inode, or 0 if free
+    uint64_t generation;                // The inode's generation
+    int flags;                          // DIRTY_* flags of its changes
+    uint64_t meta_seq;                  // Seq of txn its metadata changed in
+    uint64_t time_seq;                  // Seq of txn its times changed in
+    size_t num_runs;                    // Num runs at runs
+    DirtyRun runs[DIRTY_RUNS];          // Its dirty memblock runs
+} DirtyFile;
+
+// Internal counter kept by a mount (see __myfs_counters_implem)
+typedef enum FSCounter {
+    CTR_BLOCKS_ALLOCATED,               // Num memblocks allocated
+    CTR_BLOCKS_FREED,                   // Num memblocks freed
+    CTR_INODES_ALLOCATED,               // Num inodes claimed
+    CTR_INODES_FREED,                   // Num inodes freed
+    CTR_DIR_PROBES,                     // Num dir hash index slots probed
+    CTR_JOURNAL_COMMITS,                // Num journal txns committed
+    CTR_JOURNAL_CHECKPOINTS,            // Num times the journal was emptied
+    CTR_BLOCKS_DEDUPED,                 // Num data blocks shared w/ another
+    CTR_BLOCKS_COPIED,                  // Num shared data blocks copied on 
+                                        // write
+    NUM_COUNTERS
+} FSCounter;
+
+// Mount runtime -
+// In-memory (never persisted) state of a mounted fs, allocated by
+// __myfs_mount_implem. Each cache is direct-mapped, so an insert simply 
+// evicts the slot's previous entry, and bumping a generation drops every
+// entry of that cache at once. Lookups update the caches and their counters
+// under a shared fs lock, so w/out a lock of their own (see DcachePath). The running journal txn's logged lines are
+// held by a hash set whose entries are tagged w/ the txn, so starting a txn 
+// empties it. Files changed since their last fsync are held by a hash table
+// (open addressing), which is rebuilt to drop the clean ones when half full.
+typedef struct FSRuntime {
+    uint64_t path_gen;                  // Current path cache generation
+    uint64_t child_gen;                 // Current child cache generation
+    size_t path_hits;                   // Num path cache lookup hits
+    size_t path_misses;                 // Num path cache lookup misses
+    size_t child_hits;                  // Num child cache lookup hits
+    size_t child_misses;                // Num child cache lookup misses
+    DcachePath paths[DCACHE_PATH_SLOTS];
+    DcacheChild children[DCACHE_CHILD_SLOTS];
+    pthread_mutex_t jrnl_lock;          // Guards commits & the dirty table
+                                        // for fsync, as it holds only a
+                                        // shared fs lock
+    int txn_active;                     // 1 iff a txn is running
+    int txn_overflow;                   // 1 iff the txn outgrew the journal
+    uint64_t txn_seq;                   // Seq of the running (or next) txn
+    size_t txn_ops;                     // Num ops in the running txn
+    struct timespec txn_start;          // When the running txn started
+    uint64_t txn_tag;                   // Tag of the txn's line set entries
+    uint64_t *txn_lines;                // Line set (open addressing)
+    size_t txn_lines_mask;              // Num line set slots - 1
+    size_t txn_lines_used;              // Num line set slots used (or vacated)
+    JournalRun *txn_runs;               // Lines logged, in order logged
+    size_t txn_runs_num;                // Num runs at txn_runs
+    size_t txn_runs_cap;                // Num runs txn_runs has room for
+    size_t jrnl_tail;                   // Num bytes of records in journal
+    size_t jrnl_synced;                 // Num bytes of them flushed
+    DirtyFile *dirty;                   // Dirty table (DIRTY_SLOTS slots)
+    size_t dirty_used;                  // Num dirty table slots used
+    int dirty_overflow;                 // 1 iff too many files were dirty to
+                                        // track, so all data must be flushed
+    uint64_t counters[NUM_COUNTERS];    // Internal counters (see fs_count)
+    int atime_mode;                     // ATIME_* mode of access time updates
+    int dedup;                          // 1 iff full data blocks written are
+                                        // deduplicated
+} FSRuntime;
+
 typedef long unsigned int lui;          // For shorthand convenience in casting
+
+// Copies (up to) len bytes into dst, for an op filling in data in place.
+// Returns: The num bytes copied (less than len iff it failed).
+typedef size_t (*DataFillFn)(void *arg, char *dst, size_t len);
 static Inode* resolve_path(FSHandle *fs, const char *path);  // Prototype
+static void journal_log(FSHandle *fs, void *ptr, size_t len);  // Prototype
+static void journal_revoke(FSHandle *fs, size_t start, size_t len); // Proto
+static void fs_count(FSHandle *fs, FSCounter ctr, size_t n);  // Prototype
+static uint32_t mem_hash(const void *data, size_t len, uint32_t hash); // Proto
 
 // Size in bytes of the filesystem's structs (above)
 #define ST_SZ_INODE sizeof(Inode)
-#define ST_SZ_MEMHEAD sizeof(MemHead)
+#define ST_SZ_EXTENT sizeof(Extent)
 #define ST_SZ_FSHANDLE sizeof(FSHandle)  
+#define ST_SZ_DIRHEADER sizeof(DirHeader)
+#define ST_SZ_DIRENTRY sizeof(DirEntry)
+#define ST_SZ_JOURNALREC sizeof(JournalRec)
+#define ST_SZ_DEDUPENTRY sizeof(DedupEntry)
+
+// Memory block size of the given fs, as chosen when it was formatted. 
+// Memblocks are headerless, so all of it holds data.
+#define MEMBLOCK_SZ_B(fs) ((fs)->block_sz_b)
 
 // Size of each memory block's data field
-#define DATAFIELD_SZ_B (FS_BLOCK_SZ_KB * BYTES_IN_KB - sizeof(MemHead))    
+#define DATAFIELD_SZ_B(fs) MEMBLOCK_SZ_B(fs)
+
+// Max size of the data an inode holds inline, in its inline extents slot
+#define INODE_INLINE_SZ_B (INODE_EXTENTS * ST_SZ_EXTENT)
+
+// Num extents held by each memblock of an extent table
+#define EXTENTS_PER_BLK(fs) (MEMBLOCK_SZ_B(fs) / ST_SZ_EXTENT)
+
+// Num bits in each word of the memblock bitmap
+#define BITMAP_WORD_BITS (64)
+
+// Size in bytes of a memblock bitmap for the given number of memblocks
+#define BITMAP_SZ_B(n_blocks) \
+    (((n_blocks) + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS * sizeof(uint64_t))
+
+// Size in bytes of an inode plus (at most) its bitmap bit & inline extents 
+#define INODE_TOTAL_SZ_B (ST_SZ_INODE + 1 + INODE_EXTENTS * ST_SZ_EXTENT)
 
-// Memory block size = MemHead + data field of size DATAFIELD_SZ_B
-#define MEMBLOCK_SZ_B sizeof(MemHead) + DATAFIELD_SZ_B
+// Min requestable fs size for the given memblock size = FSHandle + bitmaps +
+// 1 inode + root dir block + 1 free block + up to 1 page, 1 cache line & 1
+// memblock of alignment padding (such a small fs has no journal)
+#define MIN_FS_SZ_B(blk_sz) (sizeof(FSHandle) + 2 * BITMAP_SZ_B(2) + \
+    INODE_TOTAL_SZ_B + JOURNAL_ALIGN_B + CACHELINE_SZ_B + (3 * (blk_sz)))
 
-// Min requestable fs size = FSHandle + 1 inode + root dir block + 1 free block
-#define MIN_FS_SZ_B sizeof(FSHandle) + sizeof(Inode) + (2 * MEMBLOCK_SZ_B) 
+// Num bits of a file handle denoting the inode's index (+ 1, so that 0 is
+// never a handle). The bits above them denote the inode's generation.
+#define FH_INDEX_BITS (32)
 
-// Offset in bytes from fsptr to start of inodes segment
+// Returns x rounded up to the next multiple of align
+#define ALIGN_UP(x, align) (((x) + (align) - 1) / (align) * (align))
+
+// Offset in bytes from fsptr to the end of the handle
 #define FS_START_OFFSET sizeof(FSHandle)
 
+// Offset in bytes from fsptr to start of the metadata journal, which follows
+// the handle at the next page
+#define FS_JOURNAL_OFFSET ALIGN_UP(FS_START_OFFSET, JOURNAL_ALIGN_B)
+
+// Offset in bytes from fsptr to start of the memblock bitmap (followed by 
+// the inode bitmap), which follows the journal of journal_sz bytes
+#define FS_BITMAP_OFFSET(journal_sz) (FS_JOURNAL_OFFSET + (journal_sz))
+
+// Offset in bytes from fsptr to start of the inodes segment, which follows
+// the bitmaps (w/ room for inode_cap inodes & blk_cap memblocks) at the next
+// cache line. The inline extents segment immediately follows it.
+#define FS_INODESEG_OFFSET(journal_sz, inode_cap, blk_cap) \
+    ALIGN_UP(FS_BITMAP_OFFSET(journal_sz) + BITMAP_SZ_B(blk_cap) + \
+             BITMAP_SZ_B(inode_cap), CACHELINE_SZ_B)
+
+// Offset in bytes from fsptr to start of the memblocks segment, which follows
+// the n_inodes inodes & inline extents at the next memblock-aligned offset
+#define FS_MEMSEG_OFFSET(journal_sz, inode_cap, blk_cap, n_inodes, blk_sz) \
+    ALIGN_UP(FS_INODESEG_OFFSET(journal_sz, inode_cap, blk_cap) + \
+             (n_inodes) * (ST_SZ_INODE + INODE_EXTENTS * ST_SZ_EXTENT), \
+             (blk_sz))
+
+// Num inodes (w/ their inline extents) held by each memblock of an inode 
+// group
+#define INODES_PER_BLK(fs) \
+    (MEMBLOCK_SZ_B(fs) / (ST_SZ_INODE + INODE_EXTENTS * ST_SZ_EXTENT))
+
+// Num bytes of the given fs's journal available for records
+#define JOURNAL_CAPACITY(fs) ((fs)->journal_sz_b - JOURNAL_HDR_SZ_B)
+
 
 /* End FS Definitions ----------------------------------------------------- */
 /* Begin ptr/bytes helpers ------------------------------------------------ */
@@ -162,110 +518,430 @@ int is_kb_blockaligned(size_t kbs_size, size_t block_sz) {
     return is_bytes_blockalignable(kb_to_bytes(kbs_size), block_sz);
 }
 
+// Returns the bit at index of the given bitmap.
+static int bitmap_get(uint64_t *bitmap, size_t index) {
+    return (bitmap[index / BITMAP_WORD_BITS] >> (index % BITMAP_WORD_BITS)) & 1;
+}
+
+// Sets (if set) or clears the bit at index of the given bitmap.
+static void bitmap_mark(uint64_t *bitmap, size_t index, int set) {
+    uint64_t bit = UINT64_C(1) << (index % BITMAP_WORD_BITS);
+
+    if (set)
+        bitmap[index / BITMAP_WORD_BITS] |= bit;
+    else
+        bitmap[index / BITMAP_WORD_BITS] &= ~bit;
+}
+
+// Clears the given bitmap of num_bits bits. Bits past the last of them (in 
+// its last word) are set, so they are never found clear.
+static void bitmap_init(uint64_t *bitmap, size_t num_bits) {
+    size_t num_words = BITMAP_SZ_B(num_bits) / sizeof(uint64_t);
+    
+    memset(bitmap, 0, BITMAP_SZ_B(num_bits));
+    for (size_t i = num_bits; i < num_words * BITMAP_WORD_BITS; i++)
+        bitmap_mark(bitmap, i, 1);
+}
+
+// Extends the given bitmap of num_bits bits to new_bits bits, w/ the bits 
+// added clear (and its padding bits set, as by bitmap_init).
+static void bitmap_extend(uint64_t *bitmap, size_t num_bits, 
+                          size_t new_bits) {
+    size_t num_words = BITMAP_SZ_B(new_bits) / sizeof(uint64_t);
+    size_t word = ALIGN_UP(num_bits, BITMAP_WORD_BITS) / BITMAP_WORD_BITS;
+
+    for (size_t i = num_bits; i < word * BITMAP_WORD_BITS; i++)
+        bitmap_mark(bitmap, i, 0);
+    if (word < num_words)
+        memset(&bitmap[word], 0, (num_words - word) * sizeof(uint64_t));
+    for (size_t i = new_bits; i < num_words * BITMAP_WORD_BITS; i++)
+        bitmap_mark(bitmap, i, 1);
+}
+
+// Returns the index of the first clear bit of the given bitmap (of num_bits
+// bits) at or after cursor (wrapping around), or num_bits if none are clear.
+// Searches a word (64 bits) at a time.
+static size_t bitmap_find(uint64_t *bitmap, size_t num_bits, size_t cursor) {
+    size_t num_words = BITMAP_SZ_B(num_bits) / sizeof(uint64_t);
+    size_t start = cursor / BITMAP_WORD_BITS;
+    uint64_t word;
+
+    for (size_t i = 0; i <= num_words; i++) {
+        size_t w = (start + i) % num_words;
+        word = bitmap[w];
+
+        // On the first word, ignore the bits before the cursor
+        if (i == 0)
+            word |= (UINT64_C(1) << (cursor % BITMAP_WORD_BITS)) - 1;
+
+        if (~word)
+            return w * BITMAP_WORD_BITS + __builtin_ctzll(~word);
+    }
+    return num_bits;
+}
+
+// Flushes the len bytes at ptr to the file backing their mapping (if any), 
+// rounding the range out to whole pages as msync requires. 
+// Returns: 0 on success (incl. if not a mapping), else -1 w/ errno set.
+static int mem_msync(void *ptr, size_t len) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = (size_t)ptr / page * page;
+    size_t end = ALIGN_UP((size_t)ptr + len, page);
+
+    if (!len || msync((void*)start, end - start, MS_SYNC) == 0 || 
+        errno == ENOMEM)
+        return 0;
+    return -1;
+}
+
 /* End ptr/bytes helpers -------------------------------------------------- */
 /* Begin Memblock helpers ------------------------------------------------- */
 
 
-// Returns a ptr to a memory block's data field.
-static void* memblock_datafield(FSHandle *fs, MemHead *memblock){
-    return (void*)(memblock + ST_SZ_MEMHEAD);
+// Returns a ptr to the memblock at the given index of the memblocks segment.
+static void* memblock_at(FSHandle *fs, size_t index) {
+    return fs->mem_seg + index * MEMBLOCK_SZ_B(fs);
 }
 
-// Returns 1 if the given memory block is free, else returns 0.
-static int memblock_isfree(MemHead *memhead) {
-    if (memhead->not_free == 0)
-        return 1;
-    return 0;
+// Returns 1 if the memblock at the given index is free, else returns 0.
+static int memblock_isfree(FSHandle *fs, size_t index) {
+    return !bitmap_get(fs->blk_bitmap, index);
+}
+
+// Sets (if used) or clears the bitmap bit denoting the memblock at index.
+static void memblock_bitmap_mark(FSHandle *fs, size_t index, int used) {
+    bitmap_mark(fs->blk_bitmap, index, used);
 }
 
-// Returns the first free memblock in the given filesystem
-static MemHead* memblock_nextfree(FSHandle *fs) {
-    MemHead *memblock = fs->mem_seg;
-    size_t num_memblocks = fs->num_memblocks;
+// Returns the index of the first free memblock at or after the next-fit 
+// cursor (wrapping around), or num_memblocks if none are free.
+static size_t memblock_bitmap_find(FSHandle *fs) {
+    return bitmap_find(fs->blk_bitmap, fs->num_memblocks, fs->blk_cursor);
+}
+
+// Logs the bitmap words denoting the len memblocks starting at index start
+// as about to change, for the running journal txn.
+static void memblock_bitmap_log(FSHandle *fs, size_t start, size_t len) {
+    size_t first = start / BITMAP_WORD_BITS;
+    size_t last = (start + len - 1) / BITMAP_WORD_BITS;
+
+    if (len)
+        journal_log(fs, &fs->blk_bitmap[first], 
+                    (last - first + 1) * sizeof(uint64_t));
+}
 
-    for (int i = 0; i < num_memblocks; i++)
-    {
-        if (memblock_isfree(memblock))
-            return memblock;
+// Marks the len memblocks starting at index start as in use.
+static void memblock_run_take(FSHandle *fs, size_t start, size_t len) {
+    memblock_bitmap_log(fs, start, len);
+    for (size_t i = start; i < start + len; i++)
+        memblock_bitmap_mark(fs, i, 1);
+    fs->blk_cursor = (start + len) % fs->num_memblocks;
+    fs->free_memblocks -= len;
+    fs_count(fs, CTR_BLOCKS_ALLOCATED, len);
+}
+
+// Allocates a run of up to want contiguous free memblocks, starting at the
+// memblock at index hint if it's free (so a file's successive runs tend to 
+// merge into one extent), else at the next-fit cursor.
+// Returns: The index of the run's 1st memblock w/ its length at len, or 
+// num_memblocks (w/ len = 0) if none are free.
+static size_t memblock_run_alloc(FSHandle *fs, size_t hint, size_t want,
+                                 size_t *len) {
+    size_t start = hint;
+    *len = 0;
+
+    if (start >= fs->num_memblocks || !memblock_isfree(fs, start))
+        start = memblock_bitmap_find(fs);
+    if (start >= fs->num_memblocks)
+        return fs->num_memblocks;
+
+    while (*len < want && start + *len < fs->num_memblocks &&
+           memblock_isfree(fs, start + *len))
+        (*len)++;
+
+    memblock_run_take(fs, start, *len);
+    return start;
+}
 
-        memblock = (MemHead*)((size_t)memblock + MEMBLOCK_SZ_B);
+// Allocates a run of exactly want contiguous free memblocks, first-fit.
+// Returns: The index of the run's 1st memblock, or num_memblocks if there is
+// no such run.
+// Note: Is O(num_memblocks), so is for rarely allocated runs (i.e. extent 
+// tables) only.
+static size_t memblock_run_alloc_exact(FSHandle *fs, size_t want) {
+    size_t start = 0;
+    size_t len;
+
+    while (start + want <= fs->num_memblocks) {
+        if (!memblock_isfree(fs, start)) {
+            start++;
+            continue;
+        }
+        for (len = 1; len < want && memblock_isfree(fs, start + len); len++)
+            ;
+        if (len == want) {
+            memblock_run_take(fs, start, want);
+            return start;
+        }
+        start += len + 1;
     }
-    return NULL;
+    return fs->num_memblocks;
+}
+
+// Releases the len memblocks starting at index start back to the free pool.
+// Note: Their contents are left as is - nothing reads a block past its 
+// owner's data size.
+static void memblock_run_free(FSHandle *fs, size_t start, size_t len) {
+    memblock_bitmap_log(fs, start, len);
+    for (size_t i = start; i < start + len; i++)
+        memblock_bitmap_mark(fs, i, 0);
+    fs->free_memblocks += len;
+    fs_count(fs, CTR_BLOCKS_FREED, len);
 }
 
 // Returns the number of free memblocks in the filesystem
 static size_t memblocks_numfree(FSHandle *fs) {
-    Inode *inode = fs->inode_seg;
-    size_t num_blocks = fs->num_memblocks;
-    size_t blocks_used = 0;
-    size_t node_bytes = 0;
+    return fs->free_memblocks;
+}
+
+
+/* End Memblock helpers -------------------------------------------------- */
+/* Begin Dedup helpers ---------------------------------------------------- */
+
+
+// Returns a ptr to the dedup index's slots.
+static DedupEntry* dedup_slots_get(FSHandle *fs) {
+    return (DedupEntry*)memblock_at(fs, fs->dedup_blk);
+}
+
+// Returns a ptr to the bitmap of the memblocks indexed by the dedup index,
+// which follows its slots.
+static uint64_t* dedup_bitmap_get(FSHandle *fs) {
+    return (uint64_t*)(dedup_slots_get(fs) + fs->dedup_slots);
+}
+
+// Returns a ptr to the counts of the data blocks sharing each memblock but
+// the first (i.e. 0 if just one maps it), which follow the dedup bitmap.
+static uint32_t* dedup_refs_get(FSHandle *fs) {
+    return (uint32_t*)(dedup_bitmap_get(fs) + 
+                       BITMAP_SZ_B(fs->blk_bitmap_cap) / sizeof(uint64_t));
+}
+
+// Returns the num memblocks held by a dedup index of the given num of slots,
+// w/ its bitmap & counts having room for as many memblocks as the memblock 
+// bitmap.
+static size_t dedup_index_len(FSHandle *fs, size_t slots) {
+    return (slots * ST_SZ_DEDUPENTRY + BITMAP_SZ_B(fs->blk_bitmap_cap) + 
+            fs->blk_bitmap_cap * sizeof(uint32_t) + MEMBLOCK_SZ_B(fs) - 1) / 
+           MEMBLOCK_SZ_B(fs);
+}
+
+// Returns 1 iff the memblock at index is indexed by the dedup index (so any
+// num of data blocks may come to share it), else 0.
+static int dedup_isindexed(FSHandle *fs, size_t index) {
+    return fs->dedup_len && bitmap_get(dedup_bitmap_get(fs), index);
+}
+
+// Returns 1 iff the memblock at index is indexed by the dedup index or 
+// shared by more than one data block, so its content must not change, 
+// else 0.
+static int dedup_isshared(FSHandle *fs, size_t index) {
+    return fs->dedup_len && (dedup_refs_get(fs)[index] || 
+                             bitmap_get(dedup_bitmap_get(fs), index));
+}
+
+// Sets (if indexed) or clears the dedup bitmap bit denoting the memblock at
+// index, logging it for the running journal txn.
+static void dedup_bitmap_mark(FSHandle *fs, size_t index, int indexed) {
+    uint64_t *bitmap = dedup_bitmap_get(fs);
+
+    journal_log(fs, &bitmap[index / BITMAP_WORD_BITS], sizeof(uint64_t));
+    bitmap_mark(bitmap, index, indexed);
+}
 
-    // Iterate each inode and determine number of blocks being used
-    for (int i = 0; i < fs->num_inodes; i++) {
-        node_bytes = *(size_t*)(&inode->file_size_b);
+// Returns the hash of the content of the memblock at index.
+static uint32_t dedup_hash(FSHandle *fs, size_t index) {
+    return mem_hash(memblock_at(fs, index), MEMBLOCK_SZ_B(fs), HASH_SEED);
+}
 
-        if (node_bytes % DATAFIELD_SZ_B > 0)
-            blocks_used += 1;
-        blocks_used += node_bytes / DATAFIELD_SZ_B; // Note: integer division
+// Returns the dedup index's entry of the (indexed) memblock at index, probing
+// from the hash of its content - or, if it's not there (ex: a crash undid
+// its unindexing after its content changed), scanning every slot - or NULL
+// if there is none.
+static DedupEntry* dedup_entry_of(FSHandle *fs, size_t index) {
+    DedupEntry *slots = dedup_slots_get(fs);
+    size_t mask = fs->dedup_slots - 1;
+    size_t i = dedup_hash(fs, index) & mask;
+
+    for (size_t n = 0; n <= mask && slots[i].blk != DEDUP_SLOT_EMPTY; n++) {
+        if (slots[i].blk == index + 1)
+            return &slots[i];
+        i = (i + 1) & mask;
+    }
+    for (i = 0; i <= mask; i++)
+        if (slots[i].blk == index + 1)
+            return &slots[i];
+    return NULL;
+}
 
-        inode++;
+// Returns the dedup index's entry of an indexed memblock (but the one at 
+// index) w/ the same content as the memblock at index, whose hash is given,
+// or NULL if there is none.
+static DedupEntry* dedup_match(FSHandle *fs, size_t index, uint32_t hash) {
+    DedupEntry *slots = dedup_slots_get(fs);
+    size_t mask = fs->dedup_slots - 1;
+    size_t i = hash & mask;
+    char *data = memblock_at(fs, index);
+
+    for (size_t n = 0; n <= mask && slots[i].blk != DEDUP_SLOT_EMPTY; n++) {
+        DedupEntry *entry = &slots[i];
+        if (entry->blk != DEDUP_SLOT_TOMB && entry->hash == hash && 
+            entry->blk != index + 1 &&
+            memcmp(memblock_at(fs, entry->blk - 1), data, 
+                   MEMBLOCK_SZ_B(fs)) == 0)
+            return entry;
+        i = (i + 1) & mask;
     }
+    return NULL;
+}
 
-    return num_blocks - blocks_used;
+// Probes the given dedup index slots (num_slots of them) for the 1st empty or
+// vacated one, from the one the given hash denotes.
+static DedupEntry* dedup_slot_free(DedupEntry *slots, size_t num_slots, 
+                                   uint32_t hash) {
+    size_t i = hash & (num_slots - 1);
+
+    while (slots[i].blk != DEDUP_SLOT_EMPTY && slots[i].blk != DEDUP_SLOT_TOMB)
+        i = (i + 1) & (num_slots - 1);
+    return &slots[i];
 }
 
-// Populates buf with the given memblock's data and the data of any subsequent 
-// MemBlocks extending it. Returns: The size of the data at buf.
-// NOTE: buf must be pre-allocated - ex: malloc(inode->file_size_b)
-size_t memblock_data_get(FSHandle *fs, MemHead *memhead, const char *buf) {
-    MemHead *memblock = (MemHead*) memhead;
-    size_t total_sz = 0;
-    size_t old_sz = 0;
-    size_t sz_to_write = 0;
+// Rehashes the dedup index's entries in place, dropping its tombs.
+// Returns: 1 on success, else 0 (out of memory).
+static int dedup_rehash(FSHandle *fs) {
+    DedupEntry *slots = dedup_slots_get(fs);
+    DedupEntry *live = malloc(fs->dedup_used * ST_SZ_DEDUPENTRY + 1);
+    size_t num_live = 0;
 
-    // Iterate each 'next' memblock until we get to one that pts no further
-    while (1) {
-        // Denote new required size of buf based on current pos in data
-        old_sz = total_sz;
-        sz_to_write = (size_t)memblock->data_size_b;
-        total_sz += sz_to_write;
+    if (!live)
+        return 0;
+    for (size_t i = 0; i < fs->dedup_slots; i++)
+        if (slots[i].blk != DEDUP_SLOT_EMPTY && slots[i].blk != DEDUP_SLOT_TOMB)
+            live[num_live++] = slots[i];
+
+    journal_log(fs, slots, fs->dedup_slots * ST_SZ_DEDUPENTRY);
+    memset(slots, 0, fs->dedup_slots * ST_SZ_DEDUPENTRY);
+    for (size_t i = 0; i < num_live; i++)
+        *dedup_slot_free(slots, fs->dedup_slots, live[i].hash) = live[i];
+    fs->dedup_used = num_live;
+    fs->dedup_tombs = 0;
+    free(live);
+    return 1;
+}
 
-        if (!sz_to_write) 
-            break;  // memblock has zero bytes of data
+// Indexes the memblock at index, whose content has the given hash - unless
+// the dedup index is at its load limit (of DEDUP_LOAD_PCT percent of its 
+// slots used or vacated) w/ few enough tombs that rehashing wouldn't make 
+// room.
+// Returns: 1 if indexed, else 0.
+static int dedup_insert(FSHandle *fs, size_t index, uint32_t hash) {
+    if ((fs->dedup_used + fs->dedup_tombs + 1) * 100 > 
+        fs->dedup_slots * DEDUP_LOAD_PCT &&
+        (fs->dedup_tombs < fs->dedup_slots / 8 || !dedup_rehash(fs)))
+        return 0;
 
-        // Get a ptr to memblock's data field
-        char *memblock_data_field = (char *)(memblock + ST_SZ_MEMHEAD);
+    DedupEntry *entry = dedup_slot_free(dedup_slots_get(fs), fs->dedup_slots,
+                                        hash);
+    journal_log(fs, entry, ST_SZ_DEDUPENTRY);
+    if (entry->blk == DEDUP_SLOT_TOMB)
+        fs->dedup_tombs--;
+    entry->hash = hash;
+    entry->blk = index + 1;
+    fs->dedup_used++;
+    dedup_bitmap_mark(fs, index, 1);
+    return 1;
+}
 
-        // Cpy memblock's data into our buffer
-        void *buf_writeat = (char *)buf + old_sz;
-        memcpy(buf_writeat, memblock_data_field, sz_to_write);
-        
-        // If on the last (or only) memblock of the sequence, stop iterating
-        if (memblock->offset_nextblk == 0) 
-            break;
-        // Else, go to the next memblock in the sequence
-        else
-            memblock = (MemHead*)ptr_from_offset(fs, memblock->offset_nextblk);
+// Unindexes the memblock at index, dropping its dedup index entry (if found).
+static void dedup_remove(FSHandle *fs, size_t index, DedupEntry *entry) {
+    if (entry) {
+        journal_log(fs, entry, ST_SZ_DEDUPENTRY);
+        entry->blk = DEDUP_SLOT_TOMB;
+        fs->dedup_used--;
+        fs->dedup_tombs++;
     }
-    return total_sz;
+    dedup_bitmap_mark(fs, index, 0);
 }
 
+// Adds n (which may be -1) to the num of data blocks sharing each of the len
+// memblocks from index start.
+static void dedup_refs_add(FSHandle *fs, size_t start, size_t len, long n) {
+    uint32_t *refs = dedup_refs_get(fs);
 
-/* End Memblock helpers -------------------------------------------------- */
+    journal_log(fs, &refs[start], len * sizeof(uint32_t));
+    for (size_t i = start; i < start + len; i++)
+        refs[i] += n;
+}
+
+// Notes that a data block no longer maps the memblock at index, unindexing 
+// it if that was the last to.
+// Returns: 1 iff no data block maps it anymore (so it may be released), 
+// else 0.
+static int dedup_unref(FSHandle *fs, size_t index) {
+    if (!fs->dedup_len)
+        return 1;
+    if (dedup_refs_get(fs)[index]) {
+        dedup_refs_add(fs, index, 1, -1);
+        return 0;
+    }
+    if (dedup_isindexed(fs, index))
+        dedup_remove(fs, index, dedup_entry_of(fs, index));
+    return 1;
+}
+
+// Sets up the dedup index of the given fs (if it has none yet), as part of 
+// the running txn, w/ a slot per memblock (rounded up to a power of 2) in a
+// run of memblocks.
+// Returns: 1 on success, else 0 (out of space for it).
+static int dedup_create(FSHandle *fs) {
+    size_t slots = DIR_MIN_SLOTS;
+
+    if (fs->dedup_len)
+        return 1;
+
+    while (slots < fs->num_memblocks)
+        slots *= 2;
+    size_t len = dedup_index_len(fs, slots);
+    size_t start = memblock_run_alloc_exact(fs, len);
+    if (start >= fs->num_memblocks)
+        return 0;
+
+    journal_log(fs, memblock_at(fs, start), len * MEMBLOCK_SZ_B(fs));
+    memset(memblock_at(fs, start), 0, len * MEMBLOCK_SZ_B(fs));
+    fs->dedup_blk = start;
+    fs->dedup_len = len;
+    fs->dedup_slots = slots;
+    fs->dedup_used = 0;
+    fs->dedup_tombs = 0;
+    return 1;
+}
+
+
+/* End Dedup helpers ------------------------------------------------------ */
 /* Begin inode helpers --------------------------------------------------- */
 
 
-// Sets the last access time for the given node to the current time.
-// If set_modified, also sets the last modified time to the current time.
-static void inode_lasttimes_set(Inode *inode, int set_modified) {
-    if (!inode) return;
+// Returns the current time of the given clock, in ns since the Epoch.
+static int64_t time_now_ns(clockid_t clock) {
+    struct timespec ts;
 
-    struct timespec tspec;
-    clock_gettime(CLOCK_REALTIME, &tspec);
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
 
-    inode->last_acc = &tspec;
-    if (set_modified)
-        inode->last_mod = &tspec;
+// Sets the last modified time of the given inode to the current time.
+static void inode_modtime_set(Inode *inode) {
+    inode->last_mod_ns = time_now_ns(CLOCK_REALTIME);
 }
 
 // Returns 1 if the given inode is for a directory, else 0
@@ -296,592 +972,4792 @@ static int inode_name_isvalid(char *name) {
     return 1;            // Valid
 }
 
-// Sets the file or directory name (of length sz) for the given inode.
-// Returns: 1 on success, else 0 for invalid filename)
-int inode_name_set(Inode *inode, char *name) {
-    if (!inode_name_isvalid(name))
-        return 0;
-    strcpy(inode->name, name); 
-    return 1;
+// Returns the inode group holding the inode at the given index, which is
+// past the inodes segment.
+static InodeGroup* inode_group_find(FSHandle *fs, size_t index) {
+    InodeGroup *group = fs->groups;
+
+    while (index >= group->first_inode + group->num_inodes)
+        group++;
+    return group;
 }
 
-// Returns a ptr to the given inode's first memory block, or NULL if none.
-static MemHead* inode_firstmemblock(FSHandle *fs, Inode *inode) {
-    return (MemHead*)ptr_from_offset(fs, inode->offset_firstblk);
+// Returns the inode group holding the given inode, which is past the inodes
+// segment.
+static InodeGroup* inode_group_of(FSHandle *fs, Inode *inode) {
+    InodeGroup *group = fs->groups;
+
+    while ((char*)inode >= (char*)memblock_at(fs, group->start_blk + 
+                                                  group->len) ||
+           (char*)inode < (char*)memblock_at(fs, group->start_blk))
+        group++;
+    return group;
 }
 
-// Returns 1 if the given inode is free, else returns 0.
-static int inode_isfree(Inode *inode) {
-    if (inode->offset_firstblk == 0)
-        return 1;
-    return 0;
+// Returns the index of the given inode.
+static size_t inode_index(FSHandle *fs, Inode *inode) {
+    size_t index = inode - fs->inode_seg;
+    if (index < fs->base_inodes)
+        return index;
+
+    InodeGroup *group = inode_group_of(fs, inode);
+    return group->first_inode + 
+           (inode - (Inode*)memblock_at(fs, group->start_blk));
 }
 
-// Returns the first free inode in the given filesystem
-static Inode* inode_nextfree(FSHandle *fs) {
-    Inode *inode = fs->inode_seg;
+// Returns a ptr to the inode at the given index (in the inodes segment, or 
+// past it, in an inode group).
+static Inode* inode_at(FSHandle *fs, size_t index) {
+    if (index < fs->base_inodes)
+        return &fs->inode_seg[index];
 
-    for (int i = 0; i < fs->num_inodes; i++) {
-        if (inode_isfree(inode))
-            return inode;
-        inode++;
-    }
+    InodeGroup *group = inode_group_find(fs, index);
+    return (Inode*)memblock_at(fs, group->start_blk) + 
+           (index - group->first_inode);
+}
 
-    return NULL;
+// Returns 1 if the given inode is free, else returns 0.
+static int inode_isfree(FSHandle *fs, Inode *inode) {
+    return !bitmap_get(fs->inode_bitmap, inode_index(fs, inode));
 }
 
+// Returns 1 if the given inode is part of a snapshot (or is the dir holding
+// them), so may not be changed, else returns 0.
+static int inode_isfrozen(Inode *inode) {
+    return (inode->flags & INODE_FROZEN) != 0;
+}
 
-/* End inode helpers ----------------------------------------------------- */
-/* Begin String Helpers -------------------------------------------------- */
+// Marks the given inode as in use (if used) or free, updating the fs's free
+// inodes count if its usage changed. Freeing it bumps its generation, so any
+// handles to it go stale, and clears its flags.
+static void inode_used_set(FSHandle *fs, Inode *inode, int used) {
+    size_t index = inode_index(fs, inode);
+
+    if (bitmap_get(fs->inode_bitmap, index) == !!used)
+        return;
+    journal_log(fs, &fs->inode_bitmap[index / BITMAP_WORD_BITS], 
+                sizeof(uint64_t));
+    journal_log(fs, inode, ST_SZ_INODE);
+    bitmap_mark(fs->inode_bitmap, index, used);
+    if (used) {
+        fs->free_inodes--;
+        fs->inode_cursor = (index + 1) % fs->num_inodes;
+        inode->last_mod_ns = time_now_ns(CLOCK_REALTIME);
+        inode->last_acc_ns = inode->last_mod_ns;
+    } else {
+        fs->free_inodes++;
+        inode->generation++;
+        inode->flags = 0;
+    }
+    fs_count(fs, used ? CTR_INODES_ALLOCATED : CTR_INODES_FREED, 1);
+}
 
+// Returns the first free inode at or after the next-fit cursor (wrapping 
+// around), or NULL if none are free. As the cursor follows the last inode 
+// allocated, bulk creation is amortized O(1) per inode.
+static Inode* inode_nextfree(FSHandle *fs) {
+    size_t index = bitmap_find(fs->inode_bitmap, fs->num_inodes, 
+                               fs->inode_cursor);
+    return index < fs->num_inodes ? inode_at(fs, index) : NULL;
+}
 
-// Returns the length  of the given null-terminated char array
-size_t str_len(char *arr) {
-    int length = 0;
-    for (char *c = arr; *c != '\0'; c++)
-        length++;
+// Returns the number of free inodes in the filesystem, by counting them.
+// Note: For rebuilding fs->free_inodes only - use that counter instead.
+static size_t inodes_countfree(FSHandle *fs) {
+    size_t num_words = BITMAP_SZ_B(fs->num_inodes) / sizeof(uint64_t);
+    size_t num_used = 0;
 
-    return length;
+    for (size_t i = 0; i < num_words; i++)
+        num_used += __builtin_popcountll(fs->inode_bitmap[i]);
+    return num_words * BITMAP_WORD_BITS - num_used;   // Padding bits are set
 }
 
-// Returns an index to the name element of the given path. Additionaly, sets
-// pathlen to the size in bytes of the path. Ex: path ='/dir1/file1' returns 6
-static size_t str_name_offset(const char *path, size_t *pathlen) {
-    char *start, *token, *next, *name;
+// Returns a handle to the given (in use) inode for the __myfs_f*_implem 
+// calls, denoting both its index and its current generation.
+static uint64_t inode_fh_get(FSHandle *fs, Inode *inode) {
+    return (inode->generation << FH_INDEX_BITS) | (inode_index(fs, inode) + 1);
+}
 
-    start = next = strdup(path);    // Duplicate path so we can manipulate it
-    *pathlen = str_len(next);       // Set pathlen for caller
-    next++;                         // Skip initial seperator
-    
-    while ((token = strsep(&next, FS_PATH_SEP)))
-        if (!next)
-            name = token;
+// Returns a ptr to the given inode's slot of the inline extents segment (or
+// of its inode group's inline extents).
+static Extent* inode_extents_inline(FSHandle *fs, Inode *inode) {
+    size_t index = inode - fs->inode_seg;
+    if (index < fs->base_inodes)
+        return fs->ext_seg + index * INODE_EXTENTS;
+
+    InodeGroup *group = inode_group_of(fs, inode);
+    Inode *inodes = (Inode*)memblock_at(fs, group->start_blk);
+    return (Extent*)(inodes + group->num_inodes) + 
+           (inode - inodes) * INODE_EXTENTS;
+}
 
-    size_t index = name - start; 
-    free(start);
+// Returns a ptr to the given inode's extents (inline, or its extent table).
+static Extent* inode_extents_get(FSHandle *fs, Inode *inode) {
+    if (inode->ext_table_len)
+        return (Extent*)memblock_at(fs, inode->ext_table_blk);
+    return inode_extents_inline(fs, inode);
+}
 
-    return index;
+// Returns a ptr to the given inode's inline data (i.e. its slot of the 
+// inline extents segment), if flagged INODE_INLINE.
+static char* inode_inline_data(FSHandle *fs, Inode *inode) {
+    return (char*)inode_extents_inline(fs, inode);
 }
 
-// Returns number of digits necessary to represent the given num as a string
-static size_t digits_count(size_t num) {
-    int num_digits = 0;
+// Clears the given inode's inline data (if any), so its inline extents slot
+// may map blocks again.
+static void inode_inline_clear(FSHandle *fs, Inode *inode) {
+    if (!(inode->flags & INODE_INLINE))
+        return;
+    journal_log(fs, inode, ST_SZ_INODE);
+    journal_log(fs, inode_inline_data(fs, inode), INODE_INLINE_SZ_B);
+    memset(inode_inline_data(fs, inode), 0, INODE_INLINE_SZ_B);
+    inode->flags &= ~INODE_INLINE;
+}
 
-    while(num != 0) {
-        num_digits++;
-        num /= 10;
-    }
+// Returns the number of data blocks mapped by the given inode's extents (i.e.
+// excluding any holes).
+static size_t inode_blocks_mapped(FSHandle *fs, Inode *inode) {
+    Extent *extents = inode_extents_get(fs, inode);
+    size_t num = 0;
 
-    return num_digits;
+    for (size_t i = 0; i < inode->num_extents; i++)
+        num += extents[i].len;
+    return num;
 }
 
+// Returns the index of the given inode's first extent ending after its data
+// block file_blk (i.e. the extent mapping it, else the one following the hole
+// holding it), found by binary search of the (sorted) extents, or 
+// num_extents if there is none.
+static size_t inode_extent_seek(FSHandle *fs, Inode *inode, size_t file_blk) {
+    Extent *extents = inode_extents_get(fs, inode);
+    size_t lo = 0;
+    size_t hi = inode->num_extents;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (extents[mid].file_blk + extents[mid].len <= file_blk)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
 
-/* End String Helpers ---------------------------------------------------- */
-/* Begin filesystem helpers ---------------------------------------------- */
-
+// Returns a ptr to the given inode's extent mapping its data block file_blk,
+// or NULL if none maps it (i.e. it's in a hole, or past the last extent).
+static Extent* inode_extent_find(FSHandle *fs, Inode *inode, size_t file_blk) {
+    Extent *extents = inode_extents_get(fs, inode);
+    size_t i = inode_extent_seek(fs, inode, file_blk);
 
-// Returns the root directory's inode for the given file system.
-static Inode* fs_rootnode_get(FSHandle *fs) {
-    return fs->inode_seg;
+    if (i == inode->num_extents || extents[i].file_blk > file_blk)
+        return NULL;
+    return &extents[i];
 }
 
-// Returns a handle to a filesystem of size fssize onto fsptr.
-// If the fsptr not yet intitialized as a file system, it is formatted first.
-static FSHandle* fs_init(void *fsptr, size_t size) {
-    // Validate file system size
-    if (size < MIN_FS_SZ_B) {
-        printf("ERROR: File system size too small.\n");
+// Returns a ptr to the memblock holding the given inode's data block 
+// file_blk, or NULL if it's unmapped.
+static char* inode_block_at(FSHandle *fs, Inode *inode, size_t file_blk) {
+    Extent *extent = inode_extent_find(fs, inode, file_blk);
+    if (!extent)
         return NULL;
-    }
+    return memblock_at(fs, extent->start_blk + (file_blk - extent->file_blk));
+}
 
-    // Map file system structure onto the given memory space
-    FSHandle *fs = (FSHandle*)fsptr;
+// Ensures the given inode's extents have room for num more, moving them into
+// a (larger) extent table if not.
+// Returns: 1 on success, else 0 (i.e. no space for a larger table).
+static int inode_extents_reserve(FSHandle *fs, Inode *inode, size_t num) {
+    Extent *extents = inode_extents_get(fs, inode);
+    size_t capacity = inode->ext_table_len ? 
+        inode->ext_table_len * EXTENTS_PER_BLK(fs) : INODE_EXTENTS;
 
-    size_t fs_size = size - FS_START_OFFSET;    // Space available to fs
-    void *segs_start = fsptr + FS_START_OFFSET; // Start of fs's segments
-    void *memblocks_seg = NULL;                 // Mem block segment start addr
-    int n_inodes = 0;                           // Num inodes fs contains
-    int n_blocks = 0;                           // Num memblocks fs contains
+    if (inode->num_extents + num <= capacity)
+        return 1;
 
-    // Determine num inodes & memblocks that will fit in the given size
-    while (n_blocks * DATAFIELD_SZ_B + n_inodes * ST_SZ_INODE < fs_size) {
-        n_inodes++;
-        n_blocks += BLOCKS_TO_INODES;
-    }
-    
-    // Denote memblocks addr & offset
-    memblocks_seg = segs_start + (ST_SZ_INODE * n_inodes);
-    
-    // If first bytes aren't our magic number, format the mem space for the fs
-    if (fs->magic != MAGIC_NUM) {
-        // Format mem space w/zero-fill
-        memset(fsptr, 0, fs_size);
-        
-        // Populate fs data members
-        fs->magic = MAGIC_NUM;
-        fs->size_b = fs_size;
-        fs->num_inodes = n_inodes;
-        fs->num_memblocks = n_blocks;
-        fs->inode_seg = (Inode*) segs_start;
-        fs->mem_seg = (MemHead*) memblocks_seg;
-
-        // Set up 0th inode as the root directory having path FS_PATH_SEP
-        Inode *root_inode = fs_rootnode_get(fs);
-        strncpy(root_inode->name, FS_PATH_SEP, str_len(FS_PATH_SEP));
-        *(int*)(&root_inode->is_dir) = 1;
-        *(int*)(&root_inode->subdirs) = 0;
-        fs->inode_seg->offset_firstblk = (size_t*) (memblocks_seg - fsptr);
-        *(int*)(&fs->mem_seg->not_free) = 1;
-        inode_lasttimes_set(root_inode, 1);
-    } 
+    // Double the extent table (or more, if that's not enough)
+    size_t table_len = inode->ext_table_len ? 2 * inode->ext_table_len : 1;
+    while (table_len * EXTENTS_PER_BLK(fs) < inode->num_extents + num)
+        table_len *= 2;
+    size_t table_blk = memblock_run_alloc_exact(fs, table_len);
+    if (table_blk >= fs->num_memblocks)
+        return 0;
 
-    // Otherwise, file system already intitialized, just populate the handle
-    else {
-        fs->size_b = fs_size;
-        fs->num_inodes = n_inodes;
-        fs->num_memblocks = n_blocks;
-        fs->inode_seg = (Inode*) segs_start;
-        fs->mem_seg = (MemHead*) memblocks_seg;
+    journal_log(fs, inode, ST_SZ_INODE);
+    journal_log(fs, memblock_at(fs, table_blk), 
+                inode->num_extents * ST_SZ_EXTENT);
+    memcpy(memblock_at(fs, table_blk), extents, 
+           inode->num_extents * ST_SZ_EXTENT);
+    if (inode->ext_table_len) {
+        journal_revoke(fs, inode->ext_table_blk, inode->ext_table_len);
+        memblock_run_free(fs, inode->ext_table_blk, inode->ext_table_len);
     }
-
-    return fs;  // Return handle to the file system
+    inode->ext_table_blk = table_blk;
+    inode->ext_table_len = table_len;
+    return 1;
 }
 
-
-// Returns a handle to a myfs filesystem on success.
-// On fail, sets errnoptr to EFAULT and returns NULL.
-static FSHandle *fs_handle(void *fsptr, size_t fssize, int *errnoptr) {
-    FSHandle *fs = fs_init(fsptr, fssize);
-    if (!fs && errnoptr) *errnoptr = EFAULT;
-    return fs;
+// Moves the given inode's extents back inline from its extent table (which
+// is released), if they now fit.
+static void inode_extents_compact(FSHandle *fs, Inode *inode) {
+    Extent *extents = inode_extents_get(fs, inode);
+
+    if (!inode->ext_table_len || inode->num_extents > INODE_EXTENTS)
+        return;
+    journal_log(fs, inode, ST_SZ_INODE);
+    journal_log(fs, inode_extents_inline(fs, inode), 
+                inode->num_extents * ST_SZ_EXTENT);
+    memcpy(inode_extents_inline(fs, inode), extents, 
+           inode->num_extents * ST_SZ_EXTENT);
+    journal_revoke(fs, inode->ext_table_blk, inode->ext_table_len);
+    memblock_run_free(fs, inode->ext_table_blk, inode->ext_table_len);
+    inode->ext_table_blk = 0;
+    inode->ext_table_len = 0;
 }
 
-// A debug function to simulate a resolve_path() call. 
-// Returns some hardcoded test inode (ex: the root dir).
-// On fail, sets errnoptr to ENOENT and returns NULL.
-// Assumes: path is absolute.
-static Inode *fs_pathresolve(FSHandle *fs, const char *path, int *errnoptr) {
-    // Ensure at least root dir symbol present
-    if (strncmp(path, FS_PATH_SEP, 1) != 0) {
-        *errnoptr = EINVAL;
-        return NULL;                
+// Maps the given inode's len (unmapped) data blocks from file_blk onward to 
+// the run of memblocks at start_blk, merging the new extent into its 
+// neighbours where the runs are contiguous. Moves the extents into a 
+// (larger) extent table if full.
+// Returns: 1 on success, else 0 (i.e. no space for a larger table).
+static int inode_extent_insert(FSHandle *fs, Inode *inode, size_t file_blk,
+                               size_t start_blk, size_t len) {
+    Extent *extents = inode_extents_get(fs, inode);
+    size_t i = inode_extent_seek(fs, inode, file_blk);
+    Extent *prev = i ? &extents[i - 1] : NULL;
+    Extent *next = i < inode->num_extents ? &extents[i] : NULL;
+
+    int prev_joins = prev && prev->file_blk + prev->len == file_blk &&
+                     prev->start_blk + prev->len == start_blk;
+    int next_joins = next && file_blk + len == next->file_blk &&
+                     start_blk + len == next->start_blk;
+
+    journal_log(fs, inode, ST_SZ_INODE);
+    if (prev_joins && next_joins) {
+        journal_log(fs, prev, (inode->num_extents - i + 1) * ST_SZ_EXTENT);
+        prev->len += len + next->len;
+        memmove(next, next + 1, 
+                (inode->num_extents - i - 1) * ST_SZ_EXTENT);
+        inode->num_extents--;
+        return 1;
+    }
+    if (prev_joins) {
+        journal_log(fs, prev, ST_SZ_EXTENT);
+        prev->len += len;
+        return 1;
+    }
+    if (next_joins) {
+        journal_log(fs, next, ST_SZ_EXTENT);
+        next->file_blk = file_blk;
+        next->start_blk = start_blk;
+        next->len += len;
+        return 1;
     }
 
-    Inode *inode = resolve_path(fs, path);
-    if (!inode && errnoptr) *errnoptr = ENOENT;
-    return inode;
+    // If out of room for another extent, grow the extent table
+    if (!inode_extents_reserve(fs, inode, 1))
+        return 0;
+    extents = inode_extents_get(fs, inode);
+
+    journal_log(fs, &extents[i], (inode->num_extents - i + 1) * ST_SZ_EXTENT);
+    memmove(&extents[i + 1], &extents[i], 
+            (inode->num_extents - i) * ST_SZ_EXTENT);
+    extents[i].file_blk = file_blk;
+    extents[i].start_blk = start_blk;
+    extents[i].len = len;
+    inode->num_extents++;
+    return 1;
 }
 
-
-/* End Filesystem Helpers ------------------------------------------------- */
-/* Begin Inode helpers ---------------------------------------------------- */
-
-
-// Populates buf with a string representing the given inode's data.
-// Returns: The size of the data at buf.
-// NOTE: buf should be pre-sized with malloc(inode->file_size_b)
-static size_t inode_data_get(FSHandle *fs, Inode *inode, const char *buf) {
-    inode_lasttimes_set(inode, 0);
-    return memblock_data_get(fs, inode_firstmemblock(fs, inode), buf);   
+// Maps up to num of the given inode's (unmapped) data blocks from file_blk
+// onward, allocating them in as few (and as long) runs as are free.
+// Returns: The num data blocks mapped (less than num iff out of space).
+static size_t inode_blocks_map(FSHandle *fs, Inode *inode, size_t file_blk,
+                               size_t num) {
+    size_t added = 0;
+    size_t start, len;
+
+    while (added < num) {
+        // Prefer the memblock following the preceding extent's run, if that
+        // extent ends right at the blocks being mapped
+        size_t hint = fs->num_memblocks;
+        Extent *prev = file_blk + added ?
+            inode_extent_find(fs, inode, file_blk + added - 1) : NULL;
+        if (prev)
+            hint = prev->start_blk + (file_blk + added - prev->file_blk);
+
+        start = memblock_run_alloc(fs, hint, num - added, &len);
+        if (!len)
+            break;                              // Out of space
+        if (!inode_extent_insert(fs, inode, file_blk + added, start, len)) {
+            memblock_run_free(fs, start, len);
+            break;                              // Out of space for extents
+        }
+        added += len;
+    }
+    return added;
 }
 
-// Disassociates any data from inode, formats any previously used memblocks,
-// and, if newblock, assign the inode a new free first memblock.
-static void inode_data_remove(FSHandle *fs, Inode *inode, int newblock) {
-    MemHead *memblock = inode_firstmemblock(fs, inode);
-    MemHead *block_next;     // ptr to memblock->offset_nextblk
-    void *block_end;         // End of memblock's data field
-
-     // Format each memblock used by inode (implicitly sets size& not_free)
-    do {
-        block_next = (MemHead*)ptr_from_offset(fs, memblock->offset_nextblk);
-        block_end = (void*)memblock + MEMBLOCK_SZ_B;         // End of memblock
-        memset(memblock, 0, (block_end - (void*)memblock));  // Format memblock
-        memblock = (MemHead*)block_next;                     // Advance to next
-        
-    } while (block_next != (MemHead*)fs);                    // i.e. nextblk != 0
-
-    // Update the inode to reflect the disassociation
-    *(int*)(&inode->file_size_b) = 0;
-    inode_lasttimes_set(inode, 1);
-
-    // Associate w/ new memblock, if specified
-    if (newblock)
-        inode->offset_firstblk = 
-            (size_t*)offset_from_ptr(fs, memblock_nextfree(fs));
+// Unmaps the given inode's (mapped) data block file_blk, splitting its 
+// extent if it's inside it, w/out releasing its memblock.
+// Assumes: The inode's extents have room for 1 more (see 
+// inode_extents_reserve).
+static void inode_block_unmap(FSHandle *fs, Inode *inode, size_t file_blk) {
+    Extent *extents = inode_extents_get(fs, inode);
+    size_t i = inode_extent_seek(fs, inode, file_blk);
+    Extent *extent = &extents[i];
+    size_t off = file_blk - extent->file_blk;
+
+    journal_log(fs, inode, ST_SZ_INODE);
+    if (extent->len == 1) {
+        journal_log(fs, extent, (inode->num_extents - i) * ST_SZ_EXTENT);
+        memmove(extent, extent + 1, 
+                (inode->num_extents - i - 1) * ST_SZ_EXTENT);
+        inode->num_extents--;
+    } else if (off == 0 || off == extent->len - 1) {
+        journal_log(fs, extent, ST_SZ_EXTENT);
+        if (off == 0) {
+            extent->file_blk++;
+            extent->start_blk++;
+        }
+        extent->len--;
+    } else {
+        journal_log(fs, extent, (inode->num_extents - i + 1) * ST_SZ_EXTENT);
+        memmove(extent + 2, extent + 1, 
+                (inode->num_extents - i - 1) * ST_SZ_EXTENT);
+        extent[1].file_blk = file_blk + 1;
+        extent[1].start_blk = extent->start_blk + off + 1;
+        extent[1].len = extent->len - off - 1;
+        extent->len = off;
+        inode->num_extents++;
+    }
 }
 
-// Sets data field and updates size fields for the file or dir denoted by
-// inode including handling of the  linked list of memory blocks for the data.
-// Assumes: Filesystem has enough free memblocks to accomodate data.
-// Assumes: inode has its offset_firstblk set.
-static void inode_data_set(FSHandle *fs, Inode *inode, char *data, size_t sz) {
-    // If inode has existing data or no memblock associated.
-    if (inode->file_size_b || inode->offset_firstblk == 0)
-        inode_data_remove(fs, inode, 1);
-
-    MemHead *memblock = inode_firstmemblock(fs, inode);
+// Remaps the given inode's (mapped) data block file_blk to the memblock at 
+// index, leaving the memblock it was mapped to as is.
+// Returns: 1 on success, else 0 (i.e. no space for a larger extent table).
+static int inode_block_remap(FSHandle *fs, Inode *inode, size_t file_blk,
+                             size_t index) {
+    // Splitting its extent & mapping it (if not merged) add up to 2 extents
+    if (!inode_extents_reserve(fs, inode, 2))
+        return 0;
+    inode_block_unmap(fs, inode, file_blk);
+    inode_extent_insert(fs, inode, file_blk, index, 1);
+    inode_extents_compact(fs, inode);
+    return 1;
+}
 
-    // Use a single block if sz will fit in one
-    if (sz <= DATAFIELD_SZ_B) {
-        void *data_field = memblock + ST_SZ_MEMHEAD;
-        memcpy(data_field, data, sz);
-        *(int*)(&memblock->not_free) = 1;
-        memblock->data_size_b = (size_t*) sz;
-        memblock->offset_nextblk = 0;
+// Releases the run of len memblocks from start that held some of the given
+// inode's data. A dir's data is metadata, so the journal is told it's not
+// anymore. A file's memblocks shared w/ other data blocks are only released
+// once no data block maps them (see dedup_unref).
+static void inode_run_free(FSHandle *fs, Inode *inode, size_t start, 
+                           size_t len) {
+    size_t first = start;               // 1st memblock of those to release
+
+    if (inode->is_dir)
+        journal_revoke(fs, start, len);
+    if (fs->dedup_len && !inode->is_dir) {
+        for (size_t i = start; i < start + len; i++) {
+            if (!dedup_unref(fs, i)) {
+                memblock_run_free(fs, first, i - first);
+                first = i + 1;
+            }
+        }
     }
+    memblock_run_free(fs, first, start + len - first);
+}
 
-    // Else use multiple blocks, if available
-    else {
-        // Determine num blocks needed
-        size_t num_bytes = sz;
-        
-        // Populate the memory blocks with the data
-        char *data_idx = data;
-        MemHead *prev_block = NULL;
-        size_t write_bytes = 0;
-        
-        while (num_bytes) {
-            // Determine num bytes to write this iteration
-            if (num_bytes > DATAFIELD_SZ_B)
-                write_bytes = DATAFIELD_SZ_B;           // More blocks yet needed
-            else
-                write_bytes = num_bytes;                // Last block needed
-
-            // Write the bytes to the data field
-            char *ptr_writeto = memblock_datafield(fs, memblock);
-            memcpy(ptr_writeto, data_idx, write_bytes);
-            *(int*)(&memblock->not_free) = 1;
-            *(size_t*)(&memblock->data_size_b) = write_bytes;
-
-            // Update next block offsets as needed
-            if (prev_block) 
-                prev_block->offset_nextblk = 
-                    (size_t*)offset_from_ptr(fs, (void*)memblock);
-            prev_block = memblock;
-            memblock->offset_nextblk = 0;
-        
-            // Set up the next iteration
-            data_idx += write_bytes;
-            num_bytes = num_bytes - write_bytes; // Adjust num bytes to write
-            memblock = memblock_nextfree(fs);    // Adavance to next free block
+// Releases all of the given inode's data blocks from data block num onward,
+// moving its extents back inline if they now fit. Inline data is block 0's.
+static void inode_blocks_shrink(FSHandle *fs, Inode *inode, size_t num) {
+    Extent *extents = inode_extents_get(fs, inode);
+
+    journal_log(fs, inode, ST_SZ_INODE);
+    if (!num)
+        inode_inline_clear(fs, inode);
+    while (inode->num_extents) {
+        Extent *last = &extents[inode->num_extents - 1];
+        if (last->file_blk + last->len <= num)
+            break;                              // Nothing more to release
+
+        if (last->file_blk >= num) {
+            inode_run_free(fs, inode, last->start_blk, last->len);
+            inode->num_extents--;
+        } else {
+            size_t keep = num - last->file_blk;
+            inode_run_free(fs, inode, last->start_blk + keep, 
+                           last->len - keep);
+            journal_log(fs, last, ST_SZ_EXTENT);
+            last->len = keep;
         }
     }
 
-    // Update access/mod times and file size
-    inode_lasttimes_set(inode, 1);
-    inode->file_size_b = (size_t*) sz;
+    inode_extents_compact(fs, inode);
 }
 
-// Appends the given data to the given Inode's current data. For appending
-// a file/dir "label:offset\n" line to the directory, for example.
-// No validation is performed on append_data. Assumes: append_data is a string.
-static void inode_data_append(FSHandle *fs, Inode *inode, char *append_data) {
-    // Get parent dir's lookup table
-    size_t data_sz = 0;
-    size_t append_sz = str_len(append_data);
-    char *data = malloc(*(int*)(&inode->file_size_b) + append_sz);
-    data_sz = inode_data_get(fs, inode, data);
-    size_t total_sz = data_sz + append_sz;
+// Rebuilds the memblock bitmap (and free memblocks count) from the inode 
+// groups, the dedup index and the in-use inodes' extents and extent tables.
+// Bits past the last memblock are set so they are never handed out.
+static void memblock_bitmap_rebuild(FSHandle *fs) {
+    bitmap_init(fs->blk_bitmap, fs->num_memblocks);
+
+    fs->free_memblocks = fs->num_memblocks;
+    for (size_t i = 0; i < fs->num_groups; i++)
+        memblock_run_take(fs, fs->groups[i].start_blk, fs->groups[i].len);
+    if (fs->dedup_len)
+        memblock_run_take(fs, fs->dedup_blk, fs->dedup_len);
+    for (size_t i = 0; i < fs->num_inodes; i++) {
+        Inode *inode = inode_at(fs, i);
+        if (inode_isfree(fs, inode))
+            continue;
+
+        // Files may share memblocks (see dedup_unref), taken only once
+        Extent *extents = inode_extents_get(fs, inode);
+        for (size_t j = 0; j < inode->num_extents; j++) {
+            if (!fs->dedup_len || inode->is_dir) {
+                memblock_run_take(fs, extents[j].start_blk, extents[j].len);
+                continue;
+            }
+            for (size_t k = 0; k < extents[j].len; k++)
+                if (memblock_isfree(fs, extents[j].start_blk + k))
+                    memblock_run_take(fs, extents[j].start_blk + k, 1);
+        }
+        if (inode->ext_table_len)
+            memblock_run_take(fs, inode->ext_table_blk, inode->ext_table_len);
+    }
 
-    // Concat append data
-    memcpy(data + data_sz, append_data, append_sz);
-    inode_data_set(fs, inode, data, total_sz);
-    free(data);
+    fs->blk_cursor = 0;
+    fs->bitmap_valid = 1;
 }
 
 
-/* End Inode helpers ------------------------------------------------------ */
-/* Begin Directory helpers ------------------------------------------------ */
+/* End inode helpers ----------------------------------------------------- */
+/* Begin String Helpers -------------------------------------------------- */
 
 
-// Returns the inode for the given item (a sub-directory or file) having the
-// parent directory given by inode (Or NULL if item could not be found).
-static Inode* dir_subitem_get(FSHandle *fs, Inode *inode, char *name) {
-    // Get parent dir's data
-    char *curr_data = malloc(*(int*)(&inode->file_size_b));
-    inode_data_get(fs, inode, curr_data);
+// Returns the length  of the given null-terminated char array
+size_t str_len(char *arr) {
+    int length = 0;
+    for (char *c = arr; *c != '\0'; c++)
+        length++;
 
-    // Get ptr to the items line in the parent dir's file/dir data.
-    char *subdir_ptr = strstr(curr_data, name);
+    return length;
+}
 
-    // If subdir does not exist, return NULL
-    if(subdir_ptr == NULL) {
-        free(curr_data);
-        return NULL;
+// Returns the hash of the given null-terminated string (32-bit FNV-1a).
+static uint32_t str_hash(const char *str) {
+    uint32_t hash = HASH_SEED;
+    for (const char *c = str; *c != '\0'; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= UINT32_C(16777619);
     }
+    return hash;
+}
 
-    // Else, extract the subdir's inode offset
-    char *offset_ptr = strstr(subdir_ptr, FS_DIRDATA_SEP);
-    char *offsetend_ptr = strstr(subdir_ptr, FS_DIRDATA_END);
+// Returns the hash of the len bytes at data (32-bit FNV-1a), continuing from
+// the given hash (HASH_SEED to start afresh).
+static uint32_t mem_hash(const void *data, size_t len, uint32_t hash) {
+    const unsigned char *c = data;
 
-    if (!offset_ptr || !offsetend_ptr) {
-        printf("ERROR: Parse fail - Dir data may be corrupt -\n");
-        free(curr_data);
-        return NULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= c[i];
+        hash *= UINT32_C(16777619);
     }
+    return hash;
+}
 
-    // Get the subitem's offset
-    size_t offset;
-    size_t offset_sz = offsetend_ptr - offset_ptr;
-    char *offset_str = malloc(offset_sz);
-    memcpy(offset_str, offset_ptr + 1, offset_sz - 1);  // +/- 1 excludes sep
-    sscanf(offset_str, "%zu", &offset);                 // str to size_t
-    Inode *subdir_inode = (Inode*)ptr_from_offset(fs, (size_t*)offset);
-
-    // Cleanup
-    free(curr_data);
-    free(offset_str);
-    
-    if (strcmp(subdir_inode->name, name) != 0)
-        return NULL;        // Path not found
 
-    return subdir_inode;    // Success
+/* End String Helpers ---------------------------------------------------- */
+/* Begin filesystem helpers ---------------------------------------------- */
+
+
+// Returns the root directory's inode for the given file system.
+static Inode* fs_rootnode_get(FSHandle *fs) {
+    return fs->inode_seg;
 }
 
-// Creates a new/empty sub-directory under the parent dir specified by inode.
-// Returns: A ptr to the newly created dir's inode on success, else NULL.
-static Inode* dir_new(FSHandle *fs, Inode *inode, char *dirname) {
-    // Validate...
-    if (!inode_isdir(inode)) {
-        // printf("ERROR: %s is not a directory\n", dirname);
-        return NULL; 
-    } 
-    if (!inode_name_isvalid(dirname)) {
-        // printf("ERROR: %s is not a valid directory name\n", dirname);
-        return NULL;
-    }
-    if(dir_subitem_get(fs, inode, dirname) != NULL) {
-        // printf("ERROR: %s already exists\n", dirname);
-        return NULL;
-    }
+// Returns the size of the metadata journal of a fs of fs_size bytes: 
+// JOURNAL_SZ_B, or if less, 1/JOURNAL_FS_SHARE of fs_size (rounded down to a
+// page), unless that's under JOURNAL_MIN_SZ_B (in which case it's 0 - i.e.
+// such a small fs has no journal).
+static size_t fs_journal_sz(size_t fs_size) {
+    size_t journal_sz = fs_size / JOURNAL_FS_SHARE / JOURNAL_ALIGN_B * 
+                        JOURNAL_ALIGN_B;
+
+    if (journal_sz > JOURNAL_SZ_B)
+        journal_sz = JOURNAL_SZ_B;
+    return journal_sz < JOURNAL_MIN_SZ_B ? 0 : journal_sz;
+}
 
-    // Begin creating the new directory...
-    Inode *newdir_inode = inode_nextfree(fs);
-    MemHead *newdir_memblock = memblock_nextfree(fs);
-    newdir_inode->offset_firstblk = (size_t*)offset_from_ptr(fs, 
-        (void*)newdir_memblock);
+// Returns 1 iff a fs having a journal of journal_sz bytes and the given num
+// of inodes (and inode_ratio memblocks of blk_sz bytes per inode) fits in 
+// fs_size bytes following the FSHandle, w/ bitmaps having room to grow.
+static int fs_geometry_fits(size_t fs_size, size_t journal_sz, 
+                            size_t n_inodes, size_t blk_sz,
+                            size_t inode_ratio) {
+    size_t n_blocks = n_inodes * inode_ratio;
+    return FS_MEMSEG_OFFSET(journal_sz, FS_GROW_MAX * n_inodes, 
+                            FS_GROW_MAX * n_blocks, n_inodes, blk_sz) - 
+           FS_START_OFFSET + n_blocks * blk_sz <= fs_size;
+}
 
-    if (newdir_inode == NULL || newdir_memblock == NULL) {
-        printf("ERROR: Failed to get resources adding %s\n", dirname);
-        return NULL;
+// Sets n_inodes & n_blocks to the most inodes & memblocks (and their bitmap)
+// of the given memblock size & inode ratio that fit in the fs_size bytes 
+// following the FSHandle, along w/ a journal of journal_sz bytes.
+static void fs_geometry_get(size_t fs_size, size_t journal_sz, size_t blk_sz,
+                            size_t inode_ratio, size_t *n_inodes, 
+                            size_t *n_blocks) {
+    // Start from the bound ignoring the bitmap & alignment padding, which 
+    // cost at most a few inodes, then back off until they fit too
+    size_t n = fs_size / (INODE_TOTAL_SZ_B + inode_ratio * blk_sz);
+    while (n && !fs_geometry_fits(fs_size, journal_sz, n, blk_sz, 
+                                  inode_ratio))
+        n--;
+
+    *n_inodes = n;
+    *n_blocks = n * inode_ratio;
+}
+
+// Points the handle's segment ptrs into the fs at fsptr, as denoted by its
+// (persisted) geometry. Only writes the ptrs if they changed (ex: the fs was
+// mapped at a new address), so as not to dirty the handle on every call.
+static void fs_segs_bind(FSHandle *fs, void *fsptr) {
+    void *bitmap = fsptr + FS_BITMAP_OFFSET(fs->journal_sz_b);
+    void *used = bitmap + BITMAP_SZ_B(fs->blk_bitmap_cap);
+    void *inodes = fsptr + FS_INODESEG_OFFSET(fs->journal_sz_b, 
+                                              fs->inode_bitmap_cap, 
+                                              fs->blk_bitmap_cap);
+    void *extents = inodes + ST_SZ_INODE * fs->base_inodes;
+    void *memblocks = fsptr + FS_MEMSEG_OFFSET(fs->journal_sz_b,
+                                               fs->inode_bitmap_cap, 
+                                               fs->blk_bitmap_cap,
+                                               fs->base_inodes,
+                                               fs->block_sz_b);
+
+    if (fs->blk_bitmap != bitmap || fs->inode_bitmap != used || 
+        fs->inode_seg != inodes || fs->ext_seg != extents ||
+        fs->mem_seg != memblocks) {
+        fs->blk_bitmap = (uint64_t*) bitmap;
+        fs->inode_bitmap = (uint64_t*) used;
+        fs->inode_seg = (Inode*) inodes;
+        fs->ext_seg = (Extent*) extents;
+        fs->mem_seg = (char*) memblocks;
     }
+}
 
-    // Get the new inode's offset
-    size_t offset = offset_from_ptr(fs, newdir_inode);        
-    char offset_str[digits_count(offset) + 1];      
-    snprintf(offset_str, sizeof(offset_str), "%lu", offset);
+// Returns 1 iff the given memblock size (in bytes) & inode ratio (memblocks
+// per inode) are supported, else 0.
+static int fs_format_isvalid(size_t blk_sz, size_t inode_ratio) {
+    return blk_sz >= FS_BLOCK_SZ_MIN_B && blk_sz <= FS_BLOCK_SZ_MAX_B &&
+           (blk_sz & (blk_sz - 1)) == 0 && inode_ratio >= 1 && 
+           inode_ratio <= INODE_RATIO_MAX;
+}
 
-    // Build new directory's lookup line Ex: "dirname:offset\n"
-    size_t data_sz = 0;
-    data_sz = str_len(dirname) + str_len(offset_str) + 2; // +2 for : and \n
-    char *data = malloc(data_sz);
+// Formats the mem space of size bytes at fsptr as an (empty) file system 
+// having memblocks of blk_sz bytes & inode_ratio memblocks per inode, both of
+// which are recorded in the handle, and an empty journal.
+// Returns: A handle to the file system, or NULL if size is too small.
+// Assumes: blk_sz & inode_ratio are valid (see fs_format_isvalid).
+static FSHandle* fs_format(void *fsptr, size_t size, size_t blk_sz,
+                           size_t inode_ratio) {
+    size_t n_inodes = 0, n_blocks = 0;
+    size_t fs_size = size - FS_START_OFFSET;    // Space available to fs
+    size_t journal_sz = fs_journal_sz(fs_size);
 
-    strcpy(data, dirname);
-    strcat(data, FS_DIRDATA_SEP);
-    strcat(data, offset_str);
-    strcat(data, FS_DIRDATA_END);
+    // Validate file system size
+    if (size >= MIN_FS_SZ_B(blk_sz))
+        fs_geometry_get(fs_size, journal_sz, blk_sz, inode_ratio, &n_inodes,
+                        &n_blocks);
+    if (n_inodes == 0) {
+        printf("ERROR: File system size too small.\n");
+        return NULL;
+    }
 
-    // Append the lookup line to the parent dir's existing lookup table
-    inode_data_append(fs, inode, data);
-    
-    // Update parent dir properties
-    *(int*)(&inode->subdirs) = *(int*)(&inode->subdirs) + 1;
+    // Map file system structure onto the mem space, w/zero-fill
+    FSHandle *fs = (FSHandle*)fsptr;
+    memset(fsptr, 0, fs_size);
     
-    // Set new dir's properties
-    inode_name_set(newdir_inode, dirname);
-    *(int*)(&newdir_inode->is_dir) = 1;
-    inode_data_set(fs, newdir_inode, "", 0); 
+    // Populate fs data members
+    fs->magic = MAGIC_NUM;
+    fs->version = FS_VERSION;
+    fs->size_b = fs_size;
+    fs->block_sz_b = blk_sz;
+    fs->inode_ratio = inode_ratio;
+    fs->journal_sz_b = journal_sz;
+    fs->num_inodes = n_inodes;
+    fs->num_memblocks = n_blocks;
+    fs->blk_bitmap_cap = FS_GROW_MAX * n_blocks;
+    fs->inode_bitmap_cap = FS_GROW_MAX * n_inodes;
+    fs->base_inodes = n_inodes;
+    fs_segs_bind(fs, fsptr);
+    bitmap_init(fs->inode_bitmap, n_inodes);
+    memblock_bitmap_rebuild(fs);
+
+    // Set up 0th inode as the root directory having path FS_PATH_SEP
+    Inode *root_inode = fs_rootnode_get(fs);
+    root_inode->is_dir = 1;
+    root_inode->subdirs = 0;
+    fs->free_inodes = n_inodes;
+    inode_used_set(fs, root_inode, 1);
+
+    // Set up the (empty) journal, if any
+    if (journal_sz) {
+        JournalHeader *hdr = (JournalHeader*)(fsptr + FS_JOURNAL_OFFSET);
+        hdr->magic = JOURNAL_MAGIC;
+        hdr->seq_base = 1;
+    }
 
-    return newdir_inode;
+    return fs;  // Return handle to the file system
 }
 
-// Removes the directory denoted by the given inode from the file system.
-// Returns 1 on success, else 0.
-static int child_remove(FSHandle *fs, const char *path) {
-    Inode *parent;
-    Inode *child;
+// Grows the given fs to fill the size bytes of its mapping (at least its 
+// current size), as part of the running txn: memblocks are appended to the 
+// memblocks segment, the first of them holding an inode group of as many new
+// inodes as keep the fs's inode ratio (as far as the inode bitmap has room 
+// for, and while there are fewer than FS_GROUPS_MAX groups). The bitmaps are
+// extended in place, so nothing is relocated.
+// Returns: 1 on success, else 0 (i.e. the memblock bitmap has no room for 
+// that many memblocks).
+static int fs_grow(FSHandle *fs, size_t size) {
+    size_t blk_sz = MEMBLOCK_SZ_B(fs);
+    size_t num_blocks = (size - (fs->mem_seg - (char*)fs)) / blk_sz;
+    size_t added = num_blocks - fs->num_memblocks;
+    size_t per_blk = INODES_PER_BLK(fs);
+
+    if (num_blocks > fs->blk_bitmap_cap)
+        return 0;
 
-    // Split the given path into seperate path and filename elements
-    char *par_path, *start, *token, *next;
+    // Split the new memblocks between the group & data, by the inode ratio
+    size_t group_len = added / (1 + per_blk * fs->inode_ratio);
+    size_t group_inodes = group_len * per_blk;
+    if (group_inodes > fs->inode_bitmap_cap - fs->num_inodes)
+        group_inodes = fs->inode_bitmap_cap - fs->num_inodes;
+    if (fs->num_groups == FS_GROUPS_MAX)
+        group_inodes = 0;
+    group_len = (group_inodes + per_blk - 1) / per_blk;
+
+    journal_log(fs, fs, ST_SZ_FSHANDLE);
+    memblock_bitmap_log(fs, fs->num_memblocks, 
+                        ALIGN_UP(num_blocks, BITMAP_WORD_BITS) - 
+                        fs->num_memblocks);
+    bitmap_extend(fs->blk_bitmap, fs->num_memblocks, num_blocks);
+    size_t old_blocks = fs->num_memblocks;
+    fs->num_memblocks = num_blocks;
+    fs->free_memblocks += added;
+    fs->size_b = size - FS_START_OFFSET;
+
+    // The group's inodes are free, and (as are their extents) zeroed
+    if (group_inodes) {
+        size_t new_inodes = fs->num_inodes + group_inodes;
+        size_t word = fs->num_inodes / BITMAP_WORD_BITS;
+        journal_log(fs, &fs->inode_bitmap[word], 
+                    BITMAP_SZ_B(new_inodes) - word * sizeof(uint64_t));
+        bitmap_extend(fs->inode_bitmap, fs->num_inodes, new_inodes);
+
+        InodeGroup *group = &fs->groups[fs->num_groups++];
+        journal_log(fs, group, sizeof(InodeGroup));
+        group->start_blk = old_blocks;
+        group->len = group_len;
+        group->first_inode = fs->num_inodes;
+        group->num_inodes = group_inodes;
+        memblock_run_take(fs, group->start_blk, group->len);
+        memset(memblock_at(fs, group->start_blk), 0, group_len * blk_sz);
+
+        fs->num_inodes = new_inodes;
+        fs->free_inodes += group_inodes;
+    }
+    return 1;
+}
 
-    start = next = strdup(path);        // Duplicate path so we can manipulate
-    next++;                             // Skip initial seperator
-    par_path = malloc(1);               // Init abs path str
-    *par_path = '\0';
+// Returns a handle to a filesystem of size fssize onto fsptr.
+// If the fsptr not yet intitialized as a file system, it is formatted first
+// w/ the default memblock size & inode ratio. The layout is computed only 
+// when formatting; afterwards the geometry persisted in the handle is 
+// validated in O(1).
+static FSHandle* fs_init(void *fsptr, size_t size) {
+    // Validate file system size
+    if (size < MIN_FS_SZ_B(FS_BLOCK_SZ_MIN_B)) {
+        printf("ERROR: File system size too small.\n");
+        return NULL;
+    }
 
-    while ((token = strsep(&next, FS_PATH_SEP))) {
-        if (next) {
-            par_path = realloc(par_path, str_len(par_path) + str_len(token) + 1);
-            strcat(par_path, FS_PATH_SEP);
-            strcat(par_path, token);
+    // Map file system structure onto the given memory space
+    FSHandle *fs = (FSHandle*)fsptr;
+    size_t fs_size = size - FS_START_OFFSET;    // Space available to fs
+
+    // If already formatted w/ this layout & (at most) this size, just bind 
+    // the handle (any memory past the fs is unused until it's grown)
+    if (fs->magic == MAGIC_NUM && fs->version == FS_VERSION && 
+        fs->size_b <= fs_size) {
+        fs_segs_bind(fs, fsptr);
+
+        // Rebuild the memblock bitmap & counters if absent (ex: flagged 
+        // invalid)
+        if (!fs->bitmap_valid) {
+            memblock_bitmap_rebuild(fs);
+            fs->free_inodes = inodes_countfree(fs);
         }
+        return fs;
     }
 
-    if (*par_path == '\0')
-        strcat(par_path, FS_PATH_SEP);  // Path is root
+    // If formatted w/ an incompatible layout or size, refuse to clobber it
+    if (fs->magic == MAGIC_NUM && fs->version != FS_VERSION) {
+        printf("ERROR: File system has unsupported layout version.\n");
+        return NULL;
+    }
+    if (fs->magic == MAGIC_NUM) {
+        printf("ERROR: File system is larger than its image.\n");
+        return NULL;
+    }
 
-    // Get the parent and child inode's
-    parent = resolve_path(fs, par_path);
-    child = resolve_path(fs, path);
+    // Else, format it w/ the defaults
+    return fs_format(fsptr, size, FS_BLOCK_SZ_KB * BYTES_IN_KB, 
+                     BLOCKS_TO_INODES);
+}
 
-    // If valid parent/child...
-    if (parent && child) {
-        // Denote child's offset, in str form
-        size_t dir_offset = offset_from_ptr(fs, child);
-        char offset_str[digits_count(dir_offset) + 1];      
-        snprintf(offset_str, sizeof(offset_str), "%lu", dir_offset);
-
-        // Remove child's lookup line (ex: "filename:offset\n")
-        char *dir_name = strdup(child->name);
-        size_t data_sz = 0;
-        data_sz = str_len(dir_name) + str_len(offset_str) + 2; // +2 for : & nl
-        char *rmline = malloc(data_sz);
-
-        strcpy(rmline, dir_name);
-        strcat(rmline, FS_DIRDATA_SEP);
-        strcat(rmline, offset_str);
-        strcat(rmline, FS_DIRDATA_END);
-
-        // Get existing parent lookup table
-        char* par_data = malloc(*(int*)(&parent->file_size_b));
-        size_t par_data_sz = inode_data_get(fs, parent, par_data);
-
-        // Denote the start/end of the child's lookup line
-        size_t line_sz = str_len(rmline);
-        char *line_start = strstr(par_data, rmline);
-        char *offsetend_ptr = line_start + line_sz;
-
-        // Build new parent data without the child's lookup line
-        char *new_data = malloc(par_data_sz - line_sz);
-        size_t sz1 =  line_start - par_data;
-        size_t sz2 = par_data_sz - sz1 - line_sz;
-        memcpy(new_data, par_data, sz1);
-        memcpy(new_data + sz1, offsetend_ptr, sz2);
-        
-        // Update the parent to reflect removal of child
-        inode_data_set(fs, parent, new_data, sz1 + sz2);
-        if (child->is_dir)
-            *(int*)(&parent->subdirs) = *(int*)(&parent->subdirs) - 1;
 
-        // Format/release the child's inode
-        inode_data_remove(fs, child, 0); 
-        *(int*)(&child->is_dir) = 0;
-        *(int*)(&child->subdirs) = 0;
+// A mount of a fs by this process: its in-memory runtime, keyed by the fs's
+// address in the process (never by anything read from the image, as a 
+// process that crashed w/ it mounted may have left it there).
+typedef struct FSMount {
+    FSHandle *fs;                       // The fs, or NULL if a free slot
+    FSRuntime *rt;                      // Its runtime
+} FSMount;
+
+static FSMount fs_mounts[FS_MOUNTS_MAX];  // This process's mounts
+static size_t fs_mounts_used;           // Num slots of them ever used
+static pthread_mutex_t fs_mounts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Drops the mounts inherited by a child forked from the process, as their
+// runtimes belong to the parent.
+static void fs_mounts_reset(void) {
+    memset(fs_mounts, 0, sizeof(fs_mounts));
+    fs_mounts_used = 0;
+    pthread_mutex_init(&fs_mounts_lock, NULL);
+}
 
-        free(par_path);
-        free(start);
-        free(rmline);
-        free(dir_name);
-    
-        return 1; // Success
+// Has the mounts dropped in each child forked from the process.
+static void fs_mounts_init(void) {
+    pthread_atfork(NULL, NULL, fs_mounts_reset);
+}
 
-    } else return 0; // Fail (bad path)
+// Sets the given runtime as the given fs's mount by this process, or drops
+// the fs's mount if rt is NULL.
+// Returns: 1 on success, else 0 (the process holds FS_MOUNTS_MAX mounts).
+static int fs_mount_set(FSHandle *fs, FSRuntime *rt) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    FSMount *free_slot = NULL;
+    int result = rt ? 0 : 1;
+
+    pthread_once(&once, fs_mounts_init);
+    pthread_mutex_lock(&fs_mounts_lock);
+    for (size_t i = 0; i < FS_MOUNTS_MAX; i++) {
+        FSMount *mount = &fs_mounts[i];
+        if (mount->fs == fs && !rt)
+            __atomic_store_n(&mount->fs, NULL, __ATOMIC_RELEASE);
+        else if (!mount->fs && !free_slot)
+            free_slot = mount;
+    }
+    if (rt && free_slot) {
+        // Publish the runtime before the fs it's found by
+        __atomic_store_n(&free_slot->rt, rt, __ATOMIC_RELAXED);
+        __atomic_store_n(&free_slot->fs, fs, __ATOMIC_RELEASE);
+        if ((size_t)(free_slot - fs_mounts) >= fs_mounts_used)
+            __atomic_store_n(&fs_mounts_used,
+                             (size_t)(free_slot - fs_mounts) + 1,
+                             __ATOMIC_RELEASE);
+        result = 1;
+    }
+    pthread_mutex_unlock(&fs_mounts_lock);
+    return result;
 }
 
+// Returns the in-memory runtime of the given fs if it was set up by this
+// process (see __myfs_mount_implem), else NULL (ex: the fs was never 
+// mounted, or was mounted by some other process). Called several times per
+// path component, so it only scans the process's few mounts, w/out a lock.
+static FSRuntime* fs_runtime(FSHandle *fs) {
+    size_t used = __atomic_load_n(&fs_mounts_used, __ATOMIC_ACQUIRE);
 
-/* End Directory helpers ------------------------------------------------- */
-/* Begin File helpers ---------------------------------------------------- */
+    for (size_t i = 0; i < used; i++)
+        if (__atomic_load_n(&fs_mounts[i].fs, __ATOMIC_ACQUIRE) == fs)
+            return __atomic_load_n(&fs_mounts[i].rt, __ATOMIC_RELAXED);
+    return NULL;
+}
 
+// Adds n to the given counter of the given fs's mount, if it was set up by 
+// this process. Counters are also bumped by ops holding the fs lock shared,
+// so atomically (there's no ordering to keep between them, so relaxed).
+static void fs_count(FSHandle *fs, FSCounter ctr, size_t n) {
+    FSRuntime *rt = fs_runtime(fs);
+    if (rt)
+        __atomic_fetch_add(&rt->counters[ctr], n, __ATOMIC_RELAXED);
+}
 
-// Creates a new file in the fs having the given properties.
-// Note: path is parent dir path, fname is the file name. Ex: '/' and 'file1'.
-// Returns: A ptr to the newly created file's I-node (or NULL on fail).
-static Inode *file_new(FSHandle *fs, char *path, char *fname, char *data,
-                       size_t data_sz) {
-    Inode *parent = resolve_path(fs, path);
+// Notes an access to the given inode's data by setting its last access time
+// to the current time, as the mount's atime mode has it (ATIME_RELATIME if
+// not mounted by this process), unless it's frozen. Accesses hold the fs 
+// lock shared, so the time is read & set atomically, and not logged to the 
+// journal (so it isn't restored after a crash, as only the data's times 
+// matter).
+static void inode_acctime_set(FSHandle *fs, Inode *inode) {
+    FSRuntime *rt = fs_runtime(fs);
+    int mode = rt ? rt->atime_mode : ATIME_RELATIME;
+    int64_t acc, now;
+
+    if (mode == ATIME_NONE || inode_isfrozen(inode))
+        return;
+    acc = __atomic_load_n(&inode->last_acc_ns, __ATOMIC_RELAXED);
+    if (mode == ATIME_RELATIME && acc > inode->last_mod_ns &&
+        time_now_ns(CLOCK_REALTIME_COARSE) - acc < ATIME_RELATIME_NS)
+        return;
+    now = time_now_ns(CLOCK_REALTIME);
+    if (now != acc)
+        __atomic_store_n(&inode->last_acc_ns, now, __ATOMIC_RELAXED);
+}
 
-    if (!parent) {
-        // printf("ERROR: invalid path\n");
-        return NULL;
+// Returns a handle to a myfs filesystem on success.
+// On fail, sets errnoptr to EFAULT and returns NULL.
+static FSHandle *fs_handle(void *fsptr, size_t fssize, int *errnoptr) {
+    FSHandle *fs = fs_init(fsptr, fssize);
+    if (!fs && errnoptr) *errnoptr = EFAULT;
+    return fs;
+}
+
+// A debug function to simulate a resolve_path() call. 
+// Returns some hardcoded test inode (ex: the root dir).
+// On fail, sets errnoptr to ENOENT and returns NULL.
+// Assumes: path is absolute.
+static Inode *fs_pathresolve(FSHandle *fs, const char *path, int *errnoptr) {
+    // Ensure at least root dir symbol present
+    if (strncmp(path, FS_PATH_SEP, 1) != 0) {
+        *errnoptr = EINVAL;
+        return NULL;                
     }
-    
-    if(dir_subitem_get(fs, parent, fname) != NULL) {
-        printf("ERROR: File already exists\n");
+
+    Inode *inode = resolve_path(fs, path);
+    if (!inode && errnoptr) *errnoptr = ENOENT;
+    return inode;
+}
+
+
+// Returns the inode denoted by the given file handle (as set by open/create
+// w/ inode_fh_get).
+// On fail, sets errnoptr to EBADF (handle denotes no inode) or ESTALE (the
+// inode was freed, and maybe reused, since the handle was set) and returns 
+// NULL.
+static Inode *fs_fhresolve(FSHandle *fs, uint64_t fh, int *errnoptr) {
+    uint64_t index = (fh & ((UINT64_C(1) << FH_INDEX_BITS) - 1));
+    Inode *inode;
+
+    if (index == 0 || index > fs->num_inodes) {
+        if (errnoptr) *errnoptr = EBADF;
         return NULL;
     }
 
-    Inode *inode = inode_nextfree(fs);
-    if (!inode) {
-        printf("ERROR: Failed getting free inode for new file %s\n", fname);
+    inode = inode_at(fs, index - 1);
+    if (inode_isfree(fs, inode) || 
+        (inode->generation & (UINT64_MAX >> FH_INDEX_BITS)) != 
+        fh >> FH_INDEX_BITS) {
+        if (errnoptr) *errnoptr = ESTALE;
         return NULL;
     }
+    return inode;
+}
 
-    MemHead *memblock = memblock_nextfree(fs);
-    if (!memblock) {
-        printf("ERROR: Failed getting free memblock for new file %s\n", fname);
-        return NULL;
+
+/* End Filesystem Helpers ------------------------------------------------- */
+/* Begin Journal helpers -------------------------------------------------- */
+
+// The journal makes each group of ops atomic w/ respect to a crash. The ops
+// of a group run as one txn, which before its first change to each cache line
+// of metadata (the handle, bitmaps, inodes, extents & dirs' data) appends a
+// JREC_UNDO of the line's bytes to the journal and flushes it. On commit, it
+// appends a JREC_REDO of each line's new bytes & a JREC_COMMIT, and flushes 
+// just the journal. As the mapping's dirty pages may be written back at any
+// time, mount replay redoes the committed txns and undoes an incomplete one.
+
+// Line set entries: the txn's tag in the high bits, the line index + 1 (or 
+// JOURNAL_LINE_TOMB if vacated) in the low JOURNAL_LINE_BITS bits
+#define JOURNAL_LINE_BITS (40)
+#define JOURNAL_LINE_MASK ((UINT64_C(1) << JOURNAL_LINE_BITS) - 1)
+#define JOURNAL_LINE_TOMB JOURNAL_LINE_MASK
+#define JOURNAL_TAG_MAX (UINT64_MAX >> JOURNAL_LINE_BITS)
+
+// Returns a ptr to the given fs's journal header.
+static JournalHeader* journal_header(FSHandle *fs) {
+    return (JournalHeader*)((char*)fs + FS_JOURNAL_OFFSET);
+}
+
+// Returns a ptr to the record at byte pos of the given fs's journal records.
+static JournalRec* journal_rec_at(FSHandle *fs, size_t pos) {
+    return (JournalRec*)((char*)fs + FS_JOURNAL_OFFSET + JOURNAL_HDR_SZ_B + 
+                         pos);
+}
+
+// Returns 1 iff a journal record of the given type is followed by the bytes
+// of its range, else 0.
+static int journal_rec_hasdata(uint32_t type) {
+    return type == JREC_UNDO || type == JREC_REDO;
+}
+
+// Returns the num bytes the given journal record takes, incl. its range's.
+static size_t journal_rec_sz(JournalRec *rec) {
+    return ST_SZ_JOURNALREC + 
+           (journal_rec_hasdata(rec->type) ? ALIGN_UP(rec->len, 8) : 0);
+}
+
+// Returns the checksum of the given journal record (& its range's bytes).
+static uint32_t journal_rec_csum(JournalRec *rec) {
+    JournalRec tmp = *rec;
+    tmp.csum = 0;
+
+    uint32_t hash = mem_hash(&tmp, ST_SZ_JOURNALREC, HASH_SEED);
+    if (journal_rec_hasdata(rec->type))
+        hash = mem_hash(rec + 1, rec->len, hash);
+    return hash;
+}
+
+// Returns 1 iff the record at byte pos of the given fs's journal is an intact
+// record of txn seq, w/ a range outside the journal, else 0.
+static int journal_rec_isvalid(FSHandle *fs, size_t pos, uint64_t seq) {
+    JournalRec *rec = journal_rec_at(fs, pos);
+    size_t capacity = JOURNAL_CAPACITY(fs);
+    size_t fs_end = fs->size_b + FS_START_OFFSET;
+
+    if (rec->magic != JOURNAL_REC_MAGIC || rec->seq != seq || 
+        rec->type < JREC_UNDO || rec->type > JREC_COMMIT ||
+        rec->offset > fs_end || rec->len > fs_end - rec->offset)
+        return 0;
+    if (rec->offset + rec->len > FS_JOURNAL_OFFSET &&
+        rec->offset < FS_BITMAP_OFFSET(fs->journal_sz_b))
+        return 0;                           // Overlaps the journal
+    if (journal_rec_hasdata(rec->type) && 
+        (rec->len > capacity || rec->offset % CACHELINE_SZ_B || 
+         rec->len % CACHELINE_SZ_B))
+        return 0;
+    if (journal_rec_sz(rec) > capacity - pos)
+        return 0;
+    return (rec->csum == journal_rec_csum(rec));
+}
+
+// Appends a record of the given type for the len bytes at offset (from 
+// fsptr) to the given fs's journal, w/ their bytes if of a type having them.
+// Returns: 1 on success, else 0 (the journal is full).
+static int journal_append(FSHandle *fs, FSRuntime *rt, uint32_t type,
+                          size_t offset, size_t len) {
+    size_t sz = ST_SZ_JOURNALREC + 
+                (journal_rec_hasdata(type) ? ALIGN_UP(len, 8) : 0);
+    if (sz > JOURNAL_CAPACITY(fs) - rt->jrnl_tail)
+        return 0;
+
+    JournalRec *rec = journal_rec_at(fs, rt->jrnl_tail);
+    rec->magic = JOURNAL_REC_MAGIC;
+    rec->type = type;
+    rec->seq = rt->txn_seq;
+    rec->offset = offset;
+    rec->len = len;
+    rec->reserved = 0;
+    if (journal_rec_hasdata(type))
+        memcpy(rec + 1, (char*)fs + offset, len);
+    rec->csum = journal_rec_csum(rec);
+
+    rt->jrnl_tail += sz;
+    return 1;
+}
+
+// Returns the running txn's line set slot for the given line: the slot 
+// holding it (w/ found = 1), else the first vacated or empty slot of its 
+// probe sequence (w/ found = 0).
+static uint64_t* journal_line_slot(FSRuntime *rt, size_t line, int *found) {
+    uint64_t tag = rt->txn_tag << JOURNAL_LINE_BITS;
+    uint64_t *vacated = NULL;
+    size_t i = (line * UINT64_C(0x9e3779b97f4a7c15)) >> 24;
+
+    for (;; i++) {
+        uint64_t *slot = &rt->txn_lines[i & rt->txn_lines_mask];
+        if ((*slot & ~JOURNAL_LINE_MASK) != tag) {
+            *found = 0;
+            return vacated ? vacated : slot;    // Empty (i.e. other txn's)
+        }
+        if ((*slot & JOURNAL_LINE_MASK) == line + 1) {
+            *found = 1;
+            return slot;
+        }
+        if ((*slot & JOURNAL_LINE_MASK) == JOURNAL_LINE_TOMB && !vacated)
+            vacated = slot;
     }
+}
 
-    if (!inode_name_set(inode, fname)) {
-        printf("ERROR: Invalid file name\n");
-        return NULL;
+// Returns 1 iff the given line is in the running txn's line set, else 0.
+static int journal_line_has(FSRuntime *rt, size_t line) {
+    int found;
+    journal_line_slot(rt, line, &found);
+    return found;
+}
+
+// Adds the given line to the running txn's line set & runs, unless there.
+// Returns: 1 if added, 0 if already there, or -1 if out of room.
+static int journal_line_add(FSRuntime *rt, size_t line) {
+    int found;
+    uint64_t *slot = journal_line_slot(rt, line, &found);
+    JournalRun *last = rt->txn_runs_num ? 
+        &rt->txn_runs[rt->txn_runs_num - 1] : NULL;
+
+    if (found)
+        return 0;
+    if (4 * (rt->txn_lines_used + 1) > 3 * (rt->txn_lines_mask + 1))
+        return -1;                          // Keep load factor <= 3/4
+
+    if (last && last->line + last->num == line) {
+        last->num++;
+    } else {
+        if (rt->txn_runs_num == rt->txn_runs_cap) {
+            size_t cap = rt->txn_runs_cap ? 2 * rt->txn_runs_cap : 64;
+            JournalRun *runs = realloc(rt->txn_runs, cap * sizeof(JournalRun));
+            if (!runs)
+                return -1;
+            rt->txn_runs = runs;
+            rt->txn_runs_cap = cap;
+        }
+        rt->txn_runs[rt->txn_runs_num].line = line;
+        rt->txn_runs[rt->txn_runs_num++].num = 1;
     }
-    
-    // Associate first memblock with the inode (by it's offset)
-    size_t offset_firstblk = offset_from_ptr(fs, (void*)memblock);
-    inode->offset_firstblk = (size_t*)offset_firstblk;
-    inode_data_set(fs, inode, data, data_sz);
-    
-    // Get the new file's inode offset and convert to str
-    size_t offset = offset_from_ptr(fs, inode);
-    char offset_str[digits_count(offset) + 1];      
-    snprintf(offset_str, sizeof(offset_str), "%zu", offset);
-
-    // Build new file's lookup line: "filename:offset\n"
-    size_t fileline_sz = 0;
-    fileline_sz = str_len(fname) + str_len(offset_str) + 2; // +2 for : and \n
-
-    char *fileline_data = malloc(fileline_sz);
-    strcpy(fileline_data, fname);
-    strcat(fileline_data, FS_DIRDATA_SEP);
-    strcat(fileline_data, offset_str);
-    strcat(fileline_data, FS_DIRDATA_END);
-    
-    // Append the lookup line to the parent dir's existing lookup data
-    inode_data_append(fs, parent, fileline_data);
-    free(fileline_data);
 
-    return inode;
+    if ((*slot & JOURNAL_LINE_MASK) != JOURNAL_LINE_TOMB || 
+        (*slot >> JOURNAL_LINE_BITS) != rt->txn_tag)
+        rt->txn_lines_used++;               // Not reusing a vacated slot
+    *slot = (rt->txn_tag << JOURNAL_LINE_BITS) | (line + 1);
+    return 1;
+}
+
+// Flushes the journal's records not yet flushed to its backing file.
+// Returns: 0 on success, else -1 w/ errno set.
+static int journal_flush(FSHandle *fs, FSRuntime *rt) {
+    if (rt->jrnl_synced == rt->jrnl_tail)
+        return 0;
+    if (mem_msync(journal_rec_at(fs, rt->jrnl_synced), 
+                  rt->jrnl_tail - rt->jrnl_synced) != 0)
+        return -1;
+    rt->jrnl_synced = rt->jrnl_tail;
+    return 0;
 }
 
+// Logs the len bytes at ptr (in the given fs) as about to be changed by the
+// running txn, if any: the bytes of each of their cache lines not yet logged
+// by it are appended to the journal (as JREC_UNDO records), and the lines are
+// noted for its JREC_REDO records. The new records are flushed before this
+// returns, as the kernel may write the lines back as soon as they change, and
+// replay can only undo them if their records got to the file first. A txn 
+// that outgrows the journal (or fails to flush it) stops logging, and is not
+// crash-atomic (see journal_commit).
+static void journal_log(FSHandle *fs, void *ptr, size_t len) {
+    FSRuntime *rt = fs_runtime(fs);
+    if (!rt || !rt->txn_active || rt->txn_overflow || !len)
+        return;
+
+    size_t offset = offset_from_ptr(fs, ptr);
+    size_t end = (offset + len - 1) / CACHELINE_SZ_B;
+
+    for (size_t line = offset / CACHELINE_SZ_B; line <= end; line++) {
+        // Gather the run of lines from here not yet logged, then log them
+        size_t first = line;
+        int added = 1;
+
+        for (; line <= end && (added = journal_line_add(rt, line)) > 0; line++)
+            ;
+        if (added < 0 || (line > first && 
+            !journal_append(fs, rt, JREC_UNDO, first * CACHELINE_SZ_B, 
+                            (line - first) * CACHELINE_SZ_B))) {
+            rt->txn_overflow = 1;
+            return;
+        }
+    }
+    if (journal_flush(fs, rt) != 0)
+        rt->txn_overflow = 1;
+}
 
-// Resolves the given file or directory path and returns its associated inode.
-static Inode* resolve_path(FSHandle *fs, const char *path) {
-    Inode* root_dir = fs_rootnode_get(fs);
+// Notes in the running txn (if any) that the len memblocks from index start
+// no longer hold metadata (i.e. dir data or an extent table), so that no 
+// prior JREC_REDO of them is replayed over what they hold next. Their bytes
+// are logged first, as they may hold file data before the txn commits, and
+// undoing it must bring them back.
+static void journal_revoke(FSHandle *fs, size_t start, size_t len) {
+    FSRuntime *rt = fs_runtime(fs);
+    if (!rt || !rt->txn_active || rt->txn_overflow || !len)
+        return;
+
+    size_t offset = offset_from_ptr(fs, memblock_at(fs, start));
+    size_t sz = len * MEMBLOCK_SZ_B(fs);
+
+    journal_log(fs, memblock_at(fs, start), sz);
+    if (rt->txn_overflow || !journal_append(fs, rt, JREC_REVOKE, offset, sz)) {
+        rt->txn_overflow = 1;
+        return;
+    }
 
-    // If path is root
-    if (strcmp(path, root_dir->name) == 0)
-        return root_dir;
-
-    Inode* curr_dir = root_dir;
-    int curr_ind = 1;
-    int path_ind = 0;
-    int path_len = strlen(path);
-    char curr_path_part[path_len];
-    while (curr_ind < path_len) {
-        path_ind = 0;
-        while (1) {
-            curr_path_part[path_ind] = path[curr_ind];
-            curr_ind = curr_ind + 1;
-            path_ind = path_ind + 1;
-            if (path[curr_ind] == '/' || path[curr_ind] == '\0') {
-                curr_ind = curr_ind + 1;
+    // Nor are the txn's own changes to them redone
+    for (size_t line = offset / CACHELINE_SZ_B; 
+         line < (offset + sz) / CACHELINE_SZ_B; line++) {
+        int found;
+        uint64_t *slot = journal_line_slot(rt, line, &found);
+        if (found)
+            *slot = (rt->txn_tag << JOURNAL_LINE_BITS) | JOURNAL_LINE_TOMB;
+    }
+}
+
+// Empties the given fs's journal, once the metadata changed by its (all 
+// committed) txns has been flushed in place, as they then need no replay.
+// Returns: 0 on success, else -1 w/ errno set.
+static int journal_checkpoint(FSHandle *fs, FSRuntime *rt) {
+    JournalHeader *hdr = journal_header(fs);
+
+    for (size_t pos = 0; pos < rt->jrnl_tail; ) {
+        JournalRec *rec = journal_rec_at(fs, pos);
+        if (rec->type == JREC_REDO && 
+            mem_msync((char*)fs + rec->offset, rec->len) != 0)
+            return -1;
+        pos += journal_rec_sz(rec);
+    }
+
+    hdr->seq_base = rt->txn_seq;
+    if (mem_msync(hdr, sizeof(JournalHeader)) != 0)
+        return -1;
+    rt->jrnl_tail = 0;
+    rt->jrnl_synced = 0;
+    fs_count(fs, CTR_JOURNAL_CHECKPOINTS, 1);
+    return 0;
+}
+
+// Commits the given fs's running txn (if any): appends a JREC_REDO of each 
+// range of lines it logged (save those since revoked) & a JREC_COMMIT, then
+// flushes the journal. A txn that outgrew the journal is instead made durable
+// by flushing the whole fs, after which the journal is emptied.
+// Returns: 0 on success, else -1 w/ errno set.
+static int journal_commit(FSHandle *fs) {
+    FSRuntime *rt = fs_runtime(fs);
+    if (!rt || !rt->txn_active)
+        return 0;
+
+    for (size_t r = 0; r < rt->txn_runs_num && !rt->txn_overflow; r++) {
+        size_t line = rt->txn_runs[r].line;
+        size_t end = line + rt->txn_runs[r].num;
+
+        while (line < end) {
+            while (line < end && !journal_line_has(rt, line))
+                line++;                         // Skip revoked lines
+            size_t first = line;
+            while (line < end && journal_line_has(rt, line))
+                line++;
+            if (line > first && 
+                !journal_append(fs, rt, JREC_REDO, first * CACHELINE_SZ_B, 
+                                (line - first) * CACHELINE_SZ_B)) {
+                rt->txn_overflow = 1;
                 break;
             }
         }
-        curr_path_part[path_ind] = '\0';
-        curr_dir = dir_subitem_get(fs, curr_dir, curr_path_part);
     }
+    if (!rt->txn_overflow && !journal_append(fs, rt, JREC_COMMIT, 0, 0))
+        rt->txn_overflow = 1;
 
-    if (curr_dir && strcmp(curr_dir->name, curr_path_part) != 0)
-        return NULL; // Path not found
-    
-    return curr_dir;
+    rt->txn_active = 0;
+    rt->txn_seq++;
+    fs_count(fs, CTR_JOURNAL_COMMITS, 1);
+    if (!rt->txn_overflow)
+        return journal_flush(fs, rt);
+
+    if (mem_msync(fs, fs->size_b + FS_START_OFFSET) != 0)
+        return -1;
+    return journal_checkpoint(fs, rt);
+}
+
+// Returns 1 iff the given fs's running txn is due to be committed, i.e. it 
+// has JOURNAL_GROUP_OPS ops, is JOURNAL_GROUP_MS old, or has filled half the
+// journal, else 0.
+static int journal_commit_isdue(FSHandle *fs, FSRuntime *rt) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    long age_ms = (now.tv_sec - rt->txn_start.tv_sec) * 1000 + 
+                  (now.tv_nsec - rt->txn_start.tv_nsec) / 1000000;
+    return rt->txn_ops >= JOURNAL_GROUP_OPS || age_ms >= JOURNAL_GROUP_MS ||
+           rt->jrnl_tail > JOURNAL_CAPACITY(fs) / 2;
+}
+
+// Starts an op that changes the given fs: commits the running txn first if
+// due, and starts a txn if none is running, so the op's changes join it.
+// Ops are thus committed in groups (see journal_commit_isdue), sharing the
+// flush of their JREC_REDO & JREC_COMMIT records.
+static void journal_op_begin(FSHandle *fs) {
+    FSRuntime *rt = fs_runtime(fs);
+    if (!rt || !fs->journal_sz_b)
+        return;
+
+    if (rt->txn_active && journal_commit_isdue(fs, rt))
+        journal_commit(fs);
+
+    if (!rt->txn_active) {
+        if (rt->jrnl_tail > JOURNAL_CAPACITY(fs) / 2)
+            journal_checkpoint(fs, rt);
+
+        // A new tag empties the line set (clearing it only on wrapping)
+        if (++rt->txn_tag > JOURNAL_TAG_MAX) {
+            memset(rt->txn_lines, 0, 
+                   (rt->txn_lines_mask + 1) * sizeof(uint64_t));
+            rt->txn_tag = 1;
+        }
+        rt->txn_lines_used = 0;
+        rt->txn_runs_num = 0;
+        rt->txn_active = 1;
+        rt->txn_overflow = 0;
+        rt->txn_ops = 0;
+        clock_gettime(CLOCK_MONOTONIC, &rt->txn_start);
+        // Most ops change its counts (but not its inode groups)
+        journal_log(fs, fs, offsetof(FSHandle, groups));
+    }
+    rt->txn_ops++;
+}
+
+// Sets up the given mount runtime's journal state for the given fs (whose 
+// journal must be empty, i.e. replayed).
+// Returns: 1 on success, else 0 (out of memory).
+static int journal_runtime_init(FSHandle *fs, FSRuntime *rt) {
+    size_t slots = 64;
+
+    rt->txn_tag = 0;
+    rt->txn_seq = fs->journal_sz_b ? journal_header(fs)->seq_base : 0;
+    if (!fs->journal_sz_b)
+        return 1;
+
+    // Size the line set for a full journal's worth of lines
+    while (slots < fs->journal_sz_b / CACHELINE_SZ_B)
+        slots *= 2;
+    if (!(rt->txn_lines = calloc(slots, sizeof(uint64_t))))
+        return 0;
+    rt->txn_lines_mask = slots - 1;
+    return 1;
+}
+
+// Returns 1 iff the given byte offset of the given fs is in the range of any
+// of the given JREC_REVOKE records that follow the given record, else 0.
+static int journal_isrevoked(JournalRec **revokes, size_t num_revokes,
+                             JournalRec *rec, size_t offset) {
+    for (size_t i = 0; i < num_revokes; i++)
+        if (revokes[i] > rec && offset >= revokes[i]->offset &&
+            offset - revokes[i]->offset < revokes[i]->len)
+            return 1;
+    return 0;
 }
 
-/* End File helpers ------------------------------------------------------- */
-/* Begin emulation functins ----------------------------------------------- */
+// Returns 1 iff the given fs's journal holds nothing to replay (i.e. the fs
+// was cleanly unmounted or checkpointed), else 0.
+static int journal_isempty(FSHandle *fs) {
+    JournalHeader *hdr = journal_header(fs);
+
+    if (!fs->journal_sz_b)
+        return 1;
+    return hdr->magic == JOURNAL_MAGIC && 
+           !journal_rec_isvalid(fs, 0, hdr->seq_base);
+}
+
+// Replays the given fs's journal, as left by a crash (else it's empty): 
+// redoes its committed txns in log order (save ranges a later committed 
+// record revokes), then undoes the incomplete txn following them (if any), 
+// newest change first. The result is flushed in place and the journal 
+// emptied. Takes time bounded by the journal's size, not the fs's.
+// Returns: 1 on success, else 0 (out of memory).
+static int journal_replay(FSHandle *fs) {
+    JournalHeader *hdr = journal_header(fs);
+    JournalRec **recs;
+    size_t num_revokes = 0, num_undos = 0;
+    size_t pos = 0, committed = 0, valid;
+    uint64_t seq;
+
+    if (!fs->journal_sz_b)
+        return 1;
+    if (hdr->magic != JOURNAL_MAGIC) {
+        hdr->magic = JOURNAL_MAGIC;
+        hdr->seq_base = 1;
+    }
+
+    // Find the intact records, and where the last committed txn ends
+    for (seq = hdr->seq_base; journal_rec_isvalid(fs, pos, seq); ) {
+        JournalRec *rec = journal_rec_at(fs, pos);
+        pos += journal_rec_sz(rec);
+        if (rec->type == JREC_COMMIT) {
+            committed = pos;
+            seq++;
+        }
+    }
+    valid = pos;
+    if (!valid)
+        return 1;                           // Nothing to replay
+
+    if (!(recs = malloc((valid / ST_SZ_JOURNALREC) * sizeof(JournalRec*))))
+        return 0;
+
+    // Redo the committed txns, after gathering the revokes among them
+    for (pos = 0; pos < committed; ) {
+        JournalRec *rec = journal_rec_at(fs, pos);
+        pos += journal_rec_sz(rec);
+        if (rec->type == JREC_REVOKE)
+            recs[num_revokes++] = rec;
+    }
+    for (pos = 0; pos < committed; ) {
+        JournalRec *rec = journal_rec_at(fs, pos);
+        pos += journal_rec_sz(rec);
+        if (rec->type != JREC_REDO)
+            continue;
+
+        for (size_t off = 0; off < rec->len; off += CACHELINE_SZ_B)
+            if (!journal_isrevoked(recs, num_revokes, rec, rec->offset + off))
+                memcpy((char*)fs + rec->offset + off, (char*)(rec + 1) + off,
+                       CACHELINE_SZ_B);
+        mem_msync((char*)fs + rec->offset, rec->len);
+    }
+
+    // Undo the incomplete txn, newest change first
+    for (pos = committed; pos < valid; ) {
+        JournalRec *rec = journal_rec_at(fs, pos);
+        pos += journal_rec_sz(rec);
+        if (rec->type == JREC_UNDO)
+            recs[num_undos++] = rec;
+    }
+    while (num_undos--) {
+        JournalRec *rec = recs[num_undos];
+        memcpy((char*)fs + rec->offset, rec + 1, rec->len);
+        mem_msync((char*)fs + rec->offset, rec->len);
+    }
+    free(recs);
+
+    // Empty the journal, past the incomplete txn's seq
+    hdr->seq_base = seq + 1;
+    mem_msync(hdr, sizeof(JournalHeader));
+    return 1;
+}
+
+// Returns a handle to a myfs filesystem on success, for an op that changes
+// it, so the op's changes join the running journal txn.
+// On fail, sets errnoptr to EFAULT and returns NULL.
+static FSHandle *fs_txn_handle(void *fsptr, size_t fssize, int *errnoptr) {
+    FSHandle *fs = fs_handle(fsptr, fssize, errnoptr);
+    if (fs) journal_op_begin(fs);
+    return fs;
+}
+
+
+/* End Journal helpers ---------------------------------------------------- */
+/* Begin Dirty table helpers ---------------------------------------------- */
+
+
+// Empties the given mount's dirty table, i.e. as all of the fs's file data
+// has been flushed.
+static void dirty_reset(FSRuntime *rt) {
+    memset(rt->dirty, 0, DIRTY_SLOTS * sizeof(DirtyFile));
+    rt->dirty_used = 0;
+    rt->dirty_overflow = 0;
+}
+
+// Rebuilds the given mount's dirty table w/out the slots of files since 
+// flushed. If the dirty files still fill half of it (or there's no memory 
+// for the rebuild), it's emptied instead and dirty_overflow set.
+static void dirty_rebuild(FSRuntime *rt) {
+    DirtyFile *prior = malloc(DIRTY_SLOTS * sizeof(DirtyFile));
+    size_t num_dirty = 0;
+
+    for (size_t i = 0; i < DIRTY_SLOTS; i++)
+        num_dirty += rt->dirty[i].flags != 0;
+
+    if (!prior || num_dirty + 1 > DIRTY_SLOTS / 2) {
+        free(prior);
+        dirty_reset(rt);
+        rt->dirty_overflow = 1;
+        return;
+    }
+
+    memcpy(prior, rt->dirty, DIRTY_SLOTS * sizeof(DirtyFile));
+    dirty_reset(rt);
+    for (size_t i = 0; i < DIRTY_SLOTS; i++) {
+        if (!prior[i].flags)
+            continue;
+        size_t slot = (uint32_t)(prior[i].index * UINT32_C(2654435761)) & 
+                      (DIRTY_SLOTS - 1);
+        while (rt->dirty[slot].index)
+            slot = (slot + 1) & (DIRTY_SLOTS - 1);
+        rt->dirty[slot] = prior[i];
+        rt->dirty_used++;
+    }
+    free(prior);
+}
+
+// Returns the given mount's dirty table slot for the given inode (reset 
+// first if it's of a prior use of the inode), or if it has none, the free 
+// slot the inode is put in if insert, else NULL.
+// The table is rebuilt w/out its clean files when half full, and if still 
+// half full, emptied, as the mount then stops tracking file data (so NULL is
+// returned).
+static DirtyFile* dirty_slot(FSRuntime *rt, FSHandle *fs, Inode *inode, 
+                             int insert) {
+    size_t index = inode_index(fs, inode) + 1;
+    size_t slot = (uint32_t)(index * UINT32_C(2654435761)) & (DIRTY_SLOTS - 1);
+    DirtyFile *file;
+
+    for (;; slot = (slot + 1) & (DIRTY_SLOTS - 1)) {
+        file = &rt->dirty[slot];
+        if (file->index == index || !file->index)
+            break;
+    }
+
+    if (!file->index) {
+        if (!insert)
+            return NULL;
+        if (rt->dirty_used + 1 > DIRTY_SLOTS / 2) {
+            dirty_rebuild(rt);
+            return rt->dirty_overflow ? NULL : dirty_slot(rt, fs, inode, 1);
+        }
+        file->index = index;
+        file->generation = inode->generation;
+        rt->dirty_used++;
+    }
+    if (file->generation != inode->generation) {
+        memset(file, 0, sizeof(DirtyFile));
+        file->index = index;
+        file->generation = inode->generation;
+    }
+    return file;
+}
+
+// Adds the run of len memblocks from start_blk to the given file's dirty 
+// runs, widening the nearest one to cover it if it touches that one or no
+// run is unused.
+static void dirty_run_add(DirtyFile *file, size_t start_blk, size_t len) {
+    size_t end = start_blk + len;
+    size_t nearest = 0, nearest_gap = SIZE_MAX;
+
+    for (size_t i = 0; i < file->num_runs; i++) {
+        DirtyRun *run = &file->runs[i];
+        size_t run_end = run->start_blk + run->len;
+        size_t gap = start_blk > run_end ? start_blk - run_end :
+                     run->start_blk > end ? run->start_blk - end : 0;
+        if (gap < nearest_gap) {
+            nearest = i;
+            nearest_gap = gap;
+        }
+    }
+
+    if (nearest_gap && file->num_runs < DIRTY_RUNS) {
+        file->runs[file->num_runs].start_blk = start_blk;
+        file->runs[file->num_runs].len = len;
+        file->num_runs++;
+        return;
+    }
+
+    DirtyRun *run = &file->runs[nearest];
+    size_t run_end = run->start_blk + run->len;
+    if (start_blk < run->start_blk)
+        run->start_blk = start_blk;
+    run->len = (end > run_end ? end : run_end) - run->start_blk;
+}
+
+// Notes the given file as changed by the running op, as denoted by flags 
+// (DIRTY_*), incl. its data in the run of len memblocks from start_blk (if
+// len), so that its fsync flushes them.
+static void dirty_note(FSHandle *fs, Inode *inode, int flags, 
+                       size_t start_blk, size_t len) {
+    FSRuntime *rt = fs_runtime(fs);
+    DirtyFile *file;
+
+    if (!rt || rt->dirty_overflow || !(file = dirty_slot(rt, fs, inode, 1)))
+        return;
+
+    file->flags |= flags;
+    if (flags & DIRTY_META)
+        file->meta_seq = rt->txn_seq;
+    if (flags & DIRTY_TIME)
+        file->time_seq = rt->txn_seq;
+    if (len)
+        dirty_run_add(file, start_blk, len);
+}
+
+// Flushes the given file's data written since its last fsync to the file 
+// backing the fs's mapping (if any), then commits the running journal txn 
+// if it holds changes to the file's metadata (or, unless datasync, to its 
+// times). I.e. only the file's own pages and the journal are flushed, unless
+// the mount stopped tracking file data, in which case all of it is.
+// Returns: 0 on success, else -1 w/ errno set.
+static int dirty_flush(FSHandle *fs, FSRuntime *rt, Inode *inode, 
+                       int datasync) {
+    size_t blk_sz = MEMBLOCK_SZ_B(fs);
+    DirtyFile *file;
+
+    if (rt->dirty_overflow) {
+        if (mem_msync(fs->mem_seg, fs->num_memblocks * blk_sz) != 0)
+            return -1;
+        dirty_reset(rt);
+        return journal_commit(fs);
+    }
+
+    if (!(file = dirty_slot(rt, fs, inode, 0)))
+        return 0;                               // Unchanged since last fsync
+
+    for (size_t i = 0; i < file->num_runs; i++)
+        if (mem_msync(memblock_at(fs, file->runs[i].start_blk),
+                      file->runs[i].len * blk_sz) != 0)
+            return -1;
+    file->num_runs = 0;
+
+    // Changes of a txn other than the running one are already committed
+    int meta = rt->txn_active && (file->flags & DIRTY_META) && 
+               file->meta_seq == rt->txn_seq;
+    int times = rt->txn_active && (file->flags & DIRTY_TIME) && 
+                file->time_seq == rt->txn_seq;
+
+    if ((meta || (times && !datasync)) && journal_commit(fs) != 0)
+        return -1;
+    file->flags = (times && datasync && !meta) ? DIRTY_TIME : 0;
+    return 0;
+}
+
+
+/* End Dirty table helpers ------------------------------------------------ */
+/* Begin Dentry cache helpers --------------------------------------------- */
+
+
+// Returns the path cache slot for the given full path.
+static DcachePath* dcache_path_slot(FSRuntime *rt, const char *path) {
+    return &rt->paths[str_hash(path) & (DCACHE_PATH_SLOTS - 1)];
+}
+
+// Returns the child cache slot for the given parent dir offset & child name.
+static DcacheChild* dcache_child_slot(FSRuntime *rt, size_t offset_parent,
+                                      const char *name) {
+    uint32_t hash = str_hash(name) ^ 
+        (uint32_t)(offset_parent / ST_SZ_INODE * UINT32_C(2654435761));
+    return &rt->children[hash & (DCACHE_CHILD_SLOTS - 1)];
+}
+
+// Starts reading the cache entry w/ the given seqlock sequence.
+// Returns: The sequence to validate the read against, or 0 if the entry is 
+// being set (so the read is a miss).
+static uint64_t dcache_read_begin(uint64_t *seq) {
+    uint64_t curr = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+    return (curr & 1) ? 0 : curr + 1;
+}
+
+// Ends reading the cache entry w/ the given seqlock sequence, as started w/ 
+// the given read sequence (see dcache_read_begin).
+// Returns: 1 iff the entry wasn't set meanwhile (so what was read holds).
+static int dcache_read_end(uint64_t *seq, uint64_t read) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return read && __atomic_load_n(seq, __ATOMIC_RELAXED) + 1 == read;
+}
+
+// Starts setting the cache entry w/ the given seqlock sequence, unless 
+// another thread is setting it (a lookup then just skips caching, as the
+// entry is being evicted anyway).
+// Returns: 1 iff the entry may be set, in which case dcache_write_end must
+// be called once it is, else 0.
+static int dcache_write_begin(uint64_t *seq) {
+    uint64_t curr = __atomic_load_n(seq, __ATOMIC_RELAXED);
+    if ((curr & 1) || !__atomic_compare_exchange_n(seq, &curr, curr + 1, 0,
+                                                   __ATOMIC_ACQUIRE,
+                                                   __ATOMIC_RELAXED))
+        return 0;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return 1;
+}
+
+// Ends setting the cache entry w/ the given seqlock sequence.
+static void dcache_write_end(uint64_t *seq) {
+    __atomic_fetch_add(seq, 1, __ATOMIC_RELEASE);
+}
+
+// Returns the cached inode for the given full path (or NULL if not cached).
+static Inode* dcache_path_get(FSHandle *fs, const char *path) {
+    FSRuntime *rt = fs_runtime(fs);
+    if (!rt || strlen(path) > DCACHE_PATH_MAXLEN)
+        return NULL;                    // Such a path is never cached
+
+    DcachePath *entry = dcache_path_slot(rt, path);
+    uint64_t gen = __atomic_load_n(&rt->path_gen, __ATOMIC_ACQUIRE);
+    uint64_t read = dcache_read_begin(&entry->seq);
+    size_t offset = __atomic_load_n(&entry->offset_inode, __ATOMIC_RELAXED);
+    int hit = __atomic_load_n(&entry->gen, __ATOMIC_RELAXED) == gen &&
+              strcmp(entry->path, path) == 0;
+
+    if (!dcache_read_end(&entry->seq, read) || !hit) {
+        __atomic_fetch_add(&rt->path_misses, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    __atomic_fetch_add(&rt->path_hits, 1, __ATOMIC_RELAXED);
+    return (Inode*)ptr_from_offset(fs, (size_t*)offset);
+}
+
+// Caches the given full path as resolving to the given inode. Paths longer
+// than DCACHE_PATH_MAXLEN are not cached.
+static void dcache_path_set(FSHandle *fs, const char *path, Inode *inode) {
+    FSRuntime *rt = fs_runtime(fs);
+    size_t len = strlen(path);
+    if (!rt || len > DCACHE_PATH_MAXLEN)
+        return;
+
+    DcachePath *entry = dcache_path_slot(rt, path);
+    uint64_t gen = __atomic_load_n(&rt->path_gen, __ATOMIC_ACQUIRE);
+    if (!dcache_write_begin(&entry->seq))
+        return;
+
+    memcpy(entry->path, path, len + 1);
+    __atomic_store_n(&entry->offset_inode, offset_from_ptr(fs, inode),
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->gen, gen, __ATOMIC_RELAXED);
+    dcache_write_end(&entry->seq);
+}
+
+// Drops the given full path from the path cache, if cached.
+static void dcache_path_invalidate(FSHandle *fs, const char *path) {
+    FSRuntime *rt = fs_runtime(fs);
+    if (!rt)
+        return;
+
+    DcachePath *entry = dcache_path_slot(rt, path);
+    while (!dcache_write_begin(&entry->seq))
+        ;                               // Being set, for an instant
+
+    if (strcmp(entry->path, path) == 0)
+        __atomic_store_n(&entry->gen, 0, __ATOMIC_RELAXED);
+    dcache_write_end(&entry->seq);
+}
+
+// Returns the cached inode of the child having the given name in the given
+// dir (or NULL if not cached).
+static Inode* dcache_child_get(FSHandle *fs, Inode *dir, const char *name) {
+    FSRuntime *rt = fs_runtime(fs);
+    if (!rt || strlen(name) > NAME_MAXLEN)
+        return NULL;                    // Such a name is never cached
+
+    size_t offset_parent = offset_from_ptr(fs, dir);
+    DcacheChild *entry = dcache_child_slot(rt, offset_parent, name);
+    uint64_t gen = __atomic_load_n(&rt->child_gen, __ATOMIC_ACQUIRE);
+    uint64_t read = dcache_read_begin(&entry->seq);
+    size_t offset = __atomic_load_n(&entry->offset_inode, __ATOMIC_RELAXED);
+    int hit = __atomic_load_n(&entry->gen, __ATOMIC_RELAXED) == gen &&
+              __atomic_load_n(&entry->offset_parent, __ATOMIC_RELAXED) ==
+              offset_parent && strcmp(entry->name, name) == 0;
+
+    if (!dcache_read_end(&entry->seq, read) || !hit) {
+        __atomic_fetch_add(&rt->child_misses, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    __atomic_fetch_add(&rt->child_hits, 1, __ATOMIC_RELAXED);
+    return (Inode*)ptr_from_offset(fs, (size_t*)offset);
+}
+
+// Caches the given child inode as having the given name in the given dir.
+static void dcache_child_set(FSHandle *fs, Inode *dir, const char *name,
+                             Inode *child) {
+    FSRuntime *rt = fs_runtime(fs);
+    size_t len = strlen(name);
+    if (!rt || len > NAME_MAXLEN)
+        return;
+
+    size_t offset_parent = offset_from_ptr(fs, dir);
+    DcacheChild *entry = dcache_child_slot(rt, offset_parent, name);
+    uint64_t gen = __atomic_load_n(&rt->child_gen, __ATOMIC_ACQUIRE);
+    if (!dcache_write_begin(&entry->seq))
+        return;
+
+    memcpy(entry->name, name, len + 1);
+    __atomic_store_n(&entry->offset_parent, offset_parent, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->offset_inode, offset_from_ptr(fs, child),
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->gen, gen, __ATOMIC_RELAXED);
+    dcache_write_end(&entry->seq);
+}
+
+// Drops the child having the given name in the given dir from the child
+// cache, if cached.
+static void dcache_child_invalidate(FSHandle *fs, Inode *dir, 
+                                    const char *name) {
+    FSRuntime *rt = fs_runtime(fs);
+    if (!rt)
+        return;
+
+    size_t offset_parent = offset_from_ptr(fs, dir);
+    DcacheChild *entry = dcache_child_slot(rt, offset_parent, name);
+    while (!dcache_write_begin(&entry->seq))
+        ;                               // Being set, for an instant
+
+    if (entry->offset_parent == offset_parent && 
+        strcmp(entry->name, name) == 0)
+        __atomic_store_n(&entry->gen, 0, __ATOMIC_RELAXED);
+    dcache_write_end(&entry->seq);
+}
+
+// Drops every entry of both caches. Used when a non-empty dir goes away, as
+// the paths of all its descendants and the children keyed by its inode are
+// then stale.
+static void dcache_flush(FSHandle *fs) {
+    FSRuntime *rt = fs_runtime(fs);
+    if (!rt)
+        return;
+
+    __atomic_fetch_add(&rt->path_gen, 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&rt->child_gen, 1, __ATOMIC_RELEASE);
+}
+
+
+/* End Dentry cache helpers ----------------------------------------------- */
+/* Begin Inode helpers ---------------------------------------------------- */
+
+
+// Copies up to size bytes of the given inode's data, starting at offset, into
+// buf, w/out updating its access time. Copies each extent's part of the range
+// w/ a single memcpy, as its memblocks are contiguous, and zero-fills any
+// part of it in a hole (or copies it from the inode's inline data).
+// Returns: The number of bytes copied, or 0 if offset is at/beyond EOF.
+static size_t inode_data_copy(FSHandle *fs, Inode *inode, char *buf,
+                              size_t size, size_t offset) {
+    size_t file_sz = inode->file_size_b;
+    size_t blk_sz = MEMBLOCK_SZ_B(fs);
+    size_t total_sz = 0;
+
+    if (offset >= file_sz)
+        return 0;
+    if (size > file_sz - offset)
+        size = file_sz - offset;            // Don't read past EOF
+    if (inode->flags & INODE_INLINE) {
+        memcpy(buf, inode_inline_data(fs, inode) + offset, size);
+        return size;
+    }
+
+    Extent *extents = inode_extents_get(fs, inode);
+    size_t i = inode_extent_seek(fs, inode, offset / blk_sz);
+    size_t end = offset + size;
+
+    while (offset < end) {
+        size_t run_start = end;             // Start of the next extent's run
+        if (i < inode->num_extents && extents[i].file_blk * blk_sz < end)
+            run_start = extents[i].file_blk * blk_sz;
+
+        // If in a hole, zero-fill up to the next extent (or the end)
+        if (offset < run_start) {
+            memset(buf + total_sz, 0, run_start - offset);
+            total_sz += run_start - offset;
+            offset = run_start;
+            continue;
+        }
+
+        size_t run_off = offset - run_start;
+        size_t cpy_sz = extents[i].len * blk_sz - run_off;
+        if (cpy_sz > end - offset)
+            cpy_sz = end - offset;
+
+        memcpy(buf + total_sz, 
+               (char*)memblock_at(fs, extents[i].start_blk) + run_off, cpy_sz);
+        total_sz += cpy_sz;
+        offset += cpy_sz;
+        i++;
+    }
+    return total_sz;
+}
+
+// Copies up to size bytes of the given inode's data, starting at offset, into
+// buf. Returns: The number of bytes copied, or 0 if offset is at/beyond EOF.
+static size_t inode_data_read(FSHandle *fs, Inode *inode, char *buf, 
+                              size_t size, size_t offset) {
+    inode_acctime_set(fs, inode);
+    return inode_data_copy(fs, inode, buf, size, offset);
+}
+
+// Disassociates any data from inode and releases its memblocks. If not keep,
+// the inode is also left unused (i.e. free).
+static void inode_data_remove(FSHandle *fs, Inode *inode, int keep) {
+    inode_blocks_shrink(fs, inode, 0);      // Also logs the inode
+
+    // Update the inode to reflect the disassociation
+    inode->file_size_b = 0;
+    if (!keep)
+        inode_used_set(fs, inode, 0);                   // Inode now unused
+    inode_modtime_set(inode);
+}
+
+// Makes the given inode's mapped data blocks from first up to end (if a 
+// file's) its own, so they may be written in place: each it shares w/ other
+// data blocks (by dedup or a snapshot) is remapped to a copy, and each only
+// it maps is unindexed.
+// Returns: 1 on success, else 0 (out of space for a copy, so only those 
+// before it were made its own).
+static int inode_blocks_unshare(FSHandle *fs, Inode *inode, size_t first, 
+                                size_t end) {
+    size_t blk_sz = MEMBLOCK_SZ_B(fs);
+
+    if (!fs->dedup_len || inode->is_dir || inode->flags & INODE_INLINE)
+        return 1;
+
+    for (size_t blk = first; blk < end; blk++) {
+        size_t i = inode_extent_seek(fs, inode, blk);
+        if (i == inode->num_extents)
+            break;                              // Past the last extent
+        Extent *extent = &inode_extents_get(fs, inode)[i];
+        if (extent->file_blk > blk) {
+            blk = extent->file_blk - 1;         // Skip the hole
+            continue;
+        }
+        size_t index = extent->start_blk + (blk - extent->file_blk);
+        if (!dedup_isshared(fs, index))
+            continue;
+        if (!dedup_refs_get(fs)[index]) {
+            dedup_remove(fs, index, dedup_entry_of(fs, index));
+            continue;
+        }
+
+        // Copy it next to the preceding data block's memblock, if free
+        Extent *prev = blk ? inode_extent_find(fs, inode, blk - 1) : NULL;
+        size_t hint = prev ? prev->start_blk + (blk - prev->file_blk) 
+                           : fs->num_memblocks;
+        size_t len, copy = memblock_run_alloc(fs, hint, 1, &len);
+        if (!len)
+            return 0;                           // Out of space
+        if (!inode_block_remap(fs, inode, blk, copy)) {
+            memblock_run_free(fs, copy, 1);
+            return 0;
+        }
+        memcpy(memblock_at(fs, copy), memblock_at(fs, index), blk_sz);
+        dedup_refs_add(fs, index, 1, -1);
+        dirty_note(fs, inode, DIRTY_DATA | DIRTY_META, copy, 1);
+        fs_count(fs, CTR_BLOCKS_COPIED, 1);
+    }
+    return 1;
+}
+
+// Deduplicates the given inode's (a file's) mapped data blocks from first up
+// to end, as just written in full: each w/ the same content as a memblock 
+// indexed for dedup is remapped to share it (releasing its own memblock), 
+// and each other is indexed (as far as the index has room).
+static void inode_blocks_dedup(FSHandle *fs, Inode *inode, size_t first, 
+                               size_t end) {
+    for (size_t blk = first; blk < end; blk++) {
+        Extent *extent = inode_extent_find(fs, inode, blk);
+        if (!extent)
+            continue;
+        size_t index = extent->start_blk + (blk - extent->file_blk);
+        if (dedup_isindexed(fs, index))
+            continue;
+
+        uint32_t hash = dedup_hash(fs, index);
+        DedupEntry *entry = dedup_match(fs, index, hash);
+        if (!entry) {
+            dedup_insert(fs, index, hash);
+            continue;
+        }
+        if (!inode_block_remap(fs, inode, blk, entry->blk - 1))
+            continue;                           // Out of space to split
+        dedup_refs_add(fs, entry->blk - 1, 1, 1);
+        if (dedup_unref(fs, index))
+            memblock_run_free(fs, index, 1);
+
+        // Its fsync must flush the shared memblock, as its only copy now
+        dirty_note(fs, inode, DIRTY_DATA | DIRTY_META, entry->blk - 1, 1);
+        fs_count(fs, CTR_BLOCKS_DEDUPED, 1);
+    }
+}
+
+// Zeroes the given inode's mapped data bytes from offset from up to offset to
+// (skipping holes), logging them for the journal if a dir's (or inline), else
+// noting them in the dirty table.
+static void inode_data_zero(FSHandle *fs, Inode *inode, size_t from, 
+                            size_t to) {
+    size_t blk_sz = MEMBLOCK_SZ_B(fs);
+    Extent *extents = inode_extents_get(fs, inode);
+
+    if (inode->flags & INODE_INLINE) {
+        if (to > INODE_INLINE_SZ_B)
+            to = INODE_INLINE_SZ_B;
+        if (from < to) {
+            journal_log(fs, inode_inline_data(fs, inode) + from, to - from);
+            memset(inode_inline_data(fs, inode) + from, 0, to - from);
+        }
+        return;
+    }
+
+    for (size_t i = inode_extent_seek(fs, inode, from / blk_sz);
+         i < inode->num_extents && from < to; i++) {
+        size_t run_start = extents[i].file_blk * blk_sz;
+        size_t run_end = run_start + extents[i].len * blk_sz;
+        if (run_start >= to)
+            break;
+        if (run_end <= from)
+            continue;
+
+        size_t start = from > run_start ? from : run_start;
+        size_t end = to < run_end ? to : run_end;
+        char *dst = (char*)memblock_at(fs, extents[i].start_blk) + 
+                    (start - run_start);
+        if (inode->is_dir)
+            journal_log(fs, dst, end - start);
+        else
+            dirty_note(fs, inode, DIRTY_DATA, 
+                       extents[i].start_blk + (start - run_start) / blk_sz,
+                       (end - run_start + blk_sz - 1) / blk_sz - 
+                       (start - run_start) / blk_sz);
+        memset(dst, 0, end - start);
+        from = end;
+    }
+}
+
+// Fills in size bytes of the given inode's inline data starting at offset 
+// (ending within INODE_INLINE_SZ_B), as by inode_data_fill, flagging it 
+// INODE_INLINE if not yet. Inline data is journaled, like the inode.
+// Returns: The num bytes filled (less than size iff the fill failed).
+static size_t inode_inline_fill(FSHandle *fs, Inode *inode, DataFillFn fill, 
+                                void *arg, size_t size, size_t offset) {
+    size_t file_sz = inode->file_size_b;
+    char *data = inode_inline_data(fs, inode);
+
+    journal_log(fs, inode, ST_SZ_INODE);
+    journal_log(fs, data, INODE_INLINE_SZ_B);
+    if (!(inode->flags & INODE_INLINE)) {
+        memset(data, 0, INODE_INLINE_SZ_B); // Held no extents, but stale ones
+        inode->flags |= INODE_INLINE;
+    }
+
+    // Bytes past EOF must stay zeroed, even those a failed fill left
+    size_t filled = fill(arg, data + offset, size);
+    size_t new_sz = offset + filled > file_sz ? offset + filled : file_sz;
+    if (offset + size > new_sz)
+        memset(data + new_sz, 0, offset + size - new_sz);
+    if (!filled)
+        return 0;
+
+    inode->file_size_b = new_sz;
+    inode_modtime_set(inode);
+    if (!inode->is_dir)
+        dirty_note(fs, inode, DIRTY_TIME | DIRTY_META, 0, 0);
+    return filled;
+}
+
+// Moves the given inode's inline data (if any) into a newly mapped data
+// block, so it may grow past INODE_INLINE_SZ_B.
+// Returns: 1 on success, else 0 (i.e. out of free memblocks).
+static int inode_inline_promote(FSHandle *fs, Inode *inode) {
+    char data[INODE_INLINE_SZ_B];
+    size_t file_sz = inode->file_size_b;
+
+    if (!(inode->flags & INODE_INLINE))
+        return 1;
+    if (!fs->free_memblocks)
+        return 0;
+    memcpy(data, inode_inline_data(fs, inode), INODE_INLINE_SZ_B);
+    inode_inline_clear(fs, inode);
+    if (!file_sz)
+        return 1;
+
+    // Block 0 is zeroed past the data, as it holds stale bytes
+    if (!inode_blocks_map(fs, inode, 0, 1)) {
+        memcpy(inode_inline_data(fs, inode), data, INODE_INLINE_SZ_B);
+        inode->flags |= INODE_INLINE;
+        return 0;
+    }
+    char *blk = inode_block_at(fs, inode, 0);
+    if (inode->is_dir)
+        journal_log(fs, blk, MEMBLOCK_SZ_B(fs));
+    else
+        dirty_note(fs, inode, DIRTY_DATA | DIRTY_META, 
+                   inode_extents_get(fs, inode)->start_blk, 1);
+    memcpy(blk, data, file_sz);
+    memset(blk + file_sz, 0, MEMBLOCK_SZ_B(fs) - file_sz);
+    return 1;
+}
+
+// Fills in size bytes of the given inode's data starting at offset, in place,
+// by calling fill w/ each extent's part of the range in turn (to copy into 
+// it, returning the num bytes it did, less if it failed). Any of the range's
+// data blocks not yet mapped (i.e. past the last extent, or in a hole) are 
+// allocated first, in as few runs as possible, and as they hold stale bytes,
+// those the fill leaves are zeroed (as bytes past EOF must read as zeroes, 
+// should the file be extended). Filling past EOF leaves a hole between it 
+// and offset. A file's filled blocks are noted in the dirty table (a dir's 
+// data is journaled instead). Data of up to INODE_INLINE_SZ_B bytes mapping
+// no blocks is held inline in the inode instead, until it grows past that.
+// A file's blocks shared w/ others are copied before they're filled, and 
+// (if the mount dedups) those filled in full are then deduplicated.
+// Returns: The num bytes filled (less than size iff out of free memblocks, or
+// the fill failed).
+static size_t inode_data_fill(FSHandle *fs, Inode *inode, DataFillFn fill, 
+                              void *arg, size_t size, size_t offset) {
+    size_t file_sz = inode->file_size_b;
+    size_t blk_sz = MEMBLOCK_SZ_B(fs);
+    size_t pos = offset;
+    size_t end = offset + size;
+    int remapped = 0;
+    int filled_all = 1;
+
+    if (size && (inode->flags & INODE_INLINE || (!inode->num_extents && 
+                 !inode->ext_table_len && file_sz <= INODE_INLINE_SZ_B))) {
+        if (end <= INODE_INLINE_SZ_B)
+            return inode_inline_fill(fs, inode, fill, arg, size, offset);
+        if (!inode_inline_promote(fs, inode))
+            return 0;                           // Out of space
+    }
+
+    journal_log(fs, inode, ST_SZ_INODE);
+
+    // Blocks shared w/ others are copied before they're written
+    if (!inode_blocks_unshare(fs, inode, offset / blk_sz, 
+                              (end + blk_sz - 1) / blk_sz))
+        return 0;                               // Out of space
+
+    // Fill each hole (after mapping it) or run of mapped blocks in turn
+    while (pos < end && filled_all) {
+        size_t blk = pos / blk_sz;
+        size_t i = inode_extent_seek(fs, inode, blk);
+        Extent *extent = i < inode->num_extents ? 
+            &inode_extents_get(fs, inode)[i] : NULL;
+        size_t seg_end, fresh_end = 0;
+
+        if (extent && extent->file_blk <= blk) {
+            seg_end = (extent->file_blk + extent->len) * blk_sz;
+        } else {
+            size_t hole_end = (extent && extent->file_blk * blk_sz < end) ? 
+                extent->file_blk : (end - 1) / blk_sz + 1;
+            size_t mapped = inode_blocks_map(fs, inode, blk, hole_end - blk);
+            if (!mapped)
+                break;                          // Out of space
+
+            // Fill only what fits if out of space
+            remapped = 1;
+            fresh_end = seg_end = (blk + mapped) * blk_sz;
+            if (mapped < hole_end - blk)
+                end = seg_end;
+            inode_data_zero(fs, inode, blk * blk_sz, pos);
+            extent = inode_extent_find(fs, inode, blk);
+        }
+        if (seg_end > end)
+            seg_end = end;
+
+        // The segment is fully mapped, so each of its extents follows
+        for (; pos < seg_end; extent++) {
+            size_t run_off = pos - extent->file_blk * blk_sz;
+            size_t cpy_sz = extent->len * blk_sz - run_off;
+            char *dst = (char*)memblock_at(fs, extent->start_blk) + run_off;
+            if (cpy_sz > seg_end - pos)
+                cpy_sz = seg_end - pos;
+
+            if (inode->is_dir)
+                journal_log(fs, dst, cpy_sz);
+            else
+                dirty_note(fs, inode, DIRTY_DATA, 
+                           extent->start_blk + run_off / blk_sz,
+                           (run_off % blk_sz + cpy_sz + blk_sz - 1) / blk_sz);
+
+            size_t filled = fill(arg, dst, cpy_sz);
+            pos += filled;
+            if (filled < cpy_sz) {
+                filled_all = 0;
+                break;
+            }
+        }
+        if (fresh_end)
+            inode_data_zero(fs, inode, pos, fresh_end);
+    }
+
+    // Release any blocks mapped past where a failed fill left EOF
+    size_t new_sz = pos > file_sz && pos > offset ? pos : file_sz;
+    if (!filled_all && remapped)
+        inode_blocks_shrink(fs, inode, (new_sz + blk_sz - 1) / blk_sz);
+    if (pos == offset && size)
+        return 0;
+
+    // Deduplicate the blocks filled in full, if the mount does
+    FSRuntime *rt = fs_runtime(fs);
+    if (rt && rt->dedup && fs->dedup_len && !inode->is_dir) {
+        inode_blocks_dedup(fs, inode, (offset + blk_sz - 1) / blk_sz, 
+                           pos / blk_sz);
+        remapped = 1;
+    }
+
+    // Update file size (if grown) and access/mod times
+    int resized = pos > file_sz;
+    if (resized)
+        inode->file_size_b = pos;
+    inode_modtime_set(inode);
+    if (!inode->is_dir)
+        dirty_note(fs, inode, DIRTY_TIME | 
+                   (resized || remapped ? DIRTY_META : 0), 0, 0);
+
+    return pos - offset;
+}
+
+// Fill function for inode_data_fill copying from the buffer at *arg onward.
+static size_t inode_data_fill_buf(void *arg, char *dst, size_t len) {
+    const char **src = (const char**)arg;
+
+    memcpy(dst, *src, len);
+    *src += len;
+    return len;
+}
+
+// Writes size bytes from buf into the given inode's data starting at offset,
+// overwriting existing bytes in place, as by inode_data_fill (so each 
+// extent's part of the range is written w/ a single memcpy).
+// Returns: The num bytes written (less than size iff out of free memblocks).
+static size_t inode_data_write(FSHandle *fs, Inode *inode, const char *buf,
+                               size_t size, size_t offset) {
+    return inode_data_fill(fs, inode, inode_data_fill_buf, &buf, size, 
+                           offset);
+}
+
+// Sets data field and updates size fields for the file or dir denoted by
+// inode, replacing any existing data (and its memblocks).
+// Assumes: Filesystem has enough free memblocks to accomodate data.
+static void inode_data_set(FSHandle *fs, Inode *inode, char *data, size_t sz) {
+    inode_data_remove(fs, inode, 1);
+
+    // Write the data into fresh extents, allocating memblocks as needed
+    inode_data_write(fs, inode, data, sz, 0);
+}
+
+
+/* End Inode helpers ------------------------------------------------------ */
+/* Begin Directory helpers ------------------------------------------------ */
+
+// Byte offsets into a binary directory's data of its hash index slot i and
+// of its record at index i.
+#define DIR_SLOT_OFFSET(i) (ST_SZ_DIRHEADER + (i) * sizeof(size_t))
+#define DIR_RECORD_OFFSET(hdr, i) \
+    (DIR_SLOT_OFFSET((hdr)->num_slots) + (i) * ST_SZ_DIRENTRY)
+
+// Copies sz bytes at offset of the given dir's data into buf, w/out updating
+// the dir's access time (as inode_data_read would for each probe).
+static void dir_data_read(FSHandle *fs, Inode *dir, void *buf, size_t sz,
+                          size_t offset) {
+    inode_data_copy(fs, dir, buf, sz, offset);
+}
+
+// Populates hdr with the given dir's header.
+// Returns: 1 if dir's data is in the binary format, else 0 (i.e. the data is
+// empty, as for a dir that never held an entry).
+static int dir_header_get(FSHandle *fs, Inode *dir, DirHeader *hdr) {
+    if (dir->file_size_b < ST_SZ_DIRHEADER)
+        return 0;
+    dir_data_read(fs, dir, hdr, ST_SZ_DIRHEADER, 0);
+    return (hdr->magic == DIR_MAGIC);
+}
+
+// Reads the hash index slot at index i of the given binary dir.
+static size_t dir_slot_get(FSHandle *fs, Inode *dir, size_t i) {
+    size_t slot;
+    dir_data_read(fs, dir, &slot, sizeof(slot), DIR_SLOT_OFFSET(i));
+    return slot;
+}
+
+// Populates *entries with a malloc'd array of the given dir's live records.
+// The caller must free *entries.
+// Returns: The number of records at *entries.
+static size_t dir_entries_get(FSHandle *fs, Inode *dir, DirEntry **entries) {
+    DirHeader hdr;
+    size_t count = 0;
+
+    *entries = NULL;
+    if (!dir_header_get(fs, dir, &hdr) || !hdr.num_records)
+        return 0;
+
+    // Read the whole record area at once, then compact out the free records
+    *entries = malloc(hdr.num_records * ST_SZ_DIRENTRY);
+    dir_data_read(fs, dir, *entries, hdr.num_records * ST_SZ_DIRENTRY,
+                  DIR_RECORD_OFFSET(&hdr, 0));
+
+    for (size_t i = 0; i < hdr.num_records; i++)
+        if ((*entries)[i].name_len)
+            (*entries)[count++] = (*entries)[i];
+
+    return count;
+}
+
+// Replaces the given dir's data with a binary table holding the given count
+// records at the same indices, sizing its hash index for their live entries.
+// Live records must have unique names. Free ones (name_len of 0) are kept
+// as is, chained from free_record (an index + 1, or 0 for none), so that
+// rebuilding the index moves none of the dir's records (see dir_walk).
+// Returns: 1 on success, else 0 (out of memblocks).
+static int dir_table_build(FSHandle *fs, Inode *dir, DirEntry *entries, 
+                           size_t count, size_t free_record) {
+    DirHeader hdr;
+    size_t num_live = 0;
+    for (size_t i = 0; i < count; i++)
+        num_live += (entries[i].name_len != 0);
+
+    size_t num_slots = DIR_MIN_SLOTS;
+    while (num_slots < 4 * num_live)
+        num_slots *= 2;                     // Keep load factor <= 1/4 at build
+
+    memset(&hdr, 0, ST_SZ_DIRHEADER);
+    hdr.magic = DIR_MAGIC;
+    hdr.version = DIR_VERSION;
+    hdr.num_entries = num_live;
+    hdr.num_slots = num_slots;
+    hdr.num_records = count;
+    hdr.free_record = free_record;
+
+    // Build the table in memory, then write it in one go
+    size_t data_sz = DIR_RECORD_OFFSET(&hdr, count);
+    char *data = calloc(1, data_sz);
+    size_t *slots = (size_t*)(data + DIR_SLOT_OFFSET(0));
+
+    memcpy(data, &hdr, ST_SZ_DIRHEADER);
+    if (count)
+        memcpy(data + DIR_RECORD_OFFSET(&hdr, 0), entries, 
+               count * ST_SZ_DIRENTRY);
+
+    for (size_t i = 0; i < count; i++) {
+        if (!entries[i].name_len)
+            continue;
+        size_t j = entries[i].hash & (num_slots - 1);
+        while (slots[j] != DIR_SLOT_EMPTY)
+            j = (j + 1) & (num_slots - 1);
+        slots[j] = i + 1;
+    }
+
+    inode_data_set(fs, dir, data, data_sz);
+    free(data);
+    return (dir->file_size_b == data_sz);
+}
+
+// Ensures the given dir's data is in the binary format, building an empty 
+// table for a dir w/out data (as empty dirs hold none).
+// Returns: 1 on success, else 0 (out of memblocks, or the data is corrupt).
+static int dir_table_ensure(FSHandle *fs, Inode *dir) {
+    DirHeader hdr;
+
+    if (dir_header_get(fs, dir, &hdr))
+        return 1;
+    if (dir->file_size_b)
+        return 0;
+    return dir_table_build(fs, dir, NULL, 0, 0);
+}
+
+// Finds the record for name in the given binary dir. Sets *slot_idx to the
+// index of the slot referencing it and populates entry (if not NULL).
+// Returns: The record's index + 1, or 0 if not found.
+static size_t dir_entry_find(FSHandle *fs, Inode *dir, DirHeader *hdr, 
+                             const char *name, size_t *slot_idx, 
+                             DirEntry *entry) {
+    uint32_t hash = str_hash(name);
+    size_t mask = hdr->num_slots - 1;
+    size_t slot;
+    DirEntry rec;
+
+    size_t n = 0;
+
+    for (size_t i = hash & mask; n < hdr->num_slots; i = (i+1) & mask) {
+        n++;
+        slot = dir_slot_get(fs, dir, i);
+        if (slot == DIR_SLOT_EMPTY)
+            break;                          // End of probe sequence
+        if (slot == DIR_SLOT_TOMB)
+            continue;
+
+        // Compare the hash first, so we read most records just once
+        dir_data_read(fs, dir, &rec, ST_SZ_DIRENTRY, 
+                      DIR_RECORD_OFFSET(hdr, slot - 1));
+        if (rec.hash == hash && strcmp(rec.name, name) == 0) {
+            if (slot_idx) *slot_idx = i;
+            if (entry) *entry = rec;
+            fs_count(fs, CTR_DIR_PROBES, n);
+            return slot;
+        }
+    }
+    fs_count(fs, CTR_DIR_PROBES, n);
+    return 0;
+}
+
+// Adds a record mapping name to the given inode to the given dir, upgrading 
+// the dir's data to the binary format first if needed.
+// Returns: 1 on success, else 0 (name already exists or out of memblocks).
+static int dir_entry_add(FSHandle *fs, Inode *dir, const char *name, 
+                         Inode *inode) {
+    DirHeader hdr;
+    DirEntry rec;
+    size_t rec_idx, slot, i;
+
+    if (!dir_table_ensure(fs, dir))
+        return 0;
+    dir_header_get(fs, dir, &hdr);
+    if (dir_entry_find(fs, dir, &hdr, name, NULL, NULL))
+        return 0;
+
+    // Keep the load factor (incl. tombstones) <= 1/2 by rebuilding the table
+    // (w/ its records, free ones incl., where they are)
+    if (2 * (hdr.num_entries + hdr.num_tombs + 1) > hdr.num_slots) {
+        DirEntry *entries = malloc(hdr.num_records * ST_SZ_DIRENTRY);
+        if (!entries && hdr.num_records)
+            return 0;
+        dir_data_read(fs, dir, entries, hdr.num_records * ST_SZ_DIRENTRY,
+                      DIR_RECORD_OFFSET(&hdr, 0));
+        int result = dir_table_build(fs, dir, entries, hdr.num_records,
+                                     hdr.free_record);
+        free(entries);
+        if (!result)
+            return 0;
+        dir_header_get(fs, dir, &hdr);
+    }
+
+    // Build the record, reusing a free one if any
+    memset(&rec, 0, ST_SZ_DIRENTRY);
+    rec.hash = str_hash(name);
+    rec.offset_inode = offset_from_ptr(fs, inode);
+    strncpy(rec.name, name, NAME_MAXLEN);
+    rec.name_len = str_len(rec.name);
+
+    if (hdr.free_record) {
+        DirEntry free_rec;
+        rec_idx = hdr.free_record - 1;
+        dir_data_read(fs, dir, &free_rec, ST_SZ_DIRENTRY, 
+                      DIR_RECORD_OFFSET(&hdr, rec_idx));
+        hdr.free_record = free_rec.offset_inode;
+    } else {
+        rec_idx = hdr.num_records++;
+    }
+
+    size_t rec_off = DIR_RECORD_OFFSET(&hdr, rec_idx);
+    if (inode_data_write(fs, dir, (char*)&rec, ST_SZ_DIRENTRY, rec_off) 
+        != ST_SZ_DIRENTRY)
+        return 0;
+
+    // Reference the record from the first empty/vacated slot in its sequence
+    for (i = rec.hash & (hdr.num_slots - 1); ; i = (i+1) & (hdr.num_slots - 1)) {
+        slot = dir_slot_get(fs, dir, i);
+        if (slot == DIR_SLOT_EMPTY || slot == DIR_SLOT_TOMB)
+            break;
+    }
+    if (slot == DIR_SLOT_TOMB)
+        hdr.num_tombs--;
+    slot = rec_idx + 1;
+    inode_data_write(fs, dir, (char*)&slot, sizeof(slot), DIR_SLOT_OFFSET(i));
+
+    hdr.num_entries++;
+    inode_data_write(fs, dir, (char*)&hdr, ST_SZ_DIRHEADER, 0);
+    dcache_child_set(fs, dir, name, inode);
+    return 1;
+}
+
+// Removes the record for name from the given dir.
+// Returns: 1 on success, else 0 (name not found or out of memblocks).
+static int dir_entry_remove(FSHandle *fs, Inode *dir, const char *name) {
+    DirHeader hdr;
+    DirEntry rec;
+    size_t rec_idx, slot_idx;
+    size_t slot = DIR_SLOT_TOMB;
+
+    if (!dir_table_ensure(fs, dir))
+        return 0;
+    dir_header_get(fs, dir, &hdr);
+    if (!(rec_idx = dir_entry_find(fs, dir, &hdr, name, &slot_idx, &rec)))
+        return 0;
+    rec_idx--;
+
+    // Vacate the slot & push the record onto the free list
+    inode_data_write(fs, dir, (char*)&slot, sizeof(slot), 
+                     DIR_SLOT_OFFSET(slot_idx));
+
+    memset(&rec, 0, ST_SZ_DIRENTRY);
+    rec.offset_inode = hdr.free_record;
+    inode_data_write(fs, dir, (char*)&rec, ST_SZ_DIRENTRY, 
+                     DIR_RECORD_OFFSET(&hdr, rec_idx));
+
+    hdr.free_record = rec_idx + 1;
+    hdr.num_entries--;
+    hdr.num_tombs++;
+    inode_data_write(fs, dir, (char*)&hdr, ST_SZ_DIRHEADER, 0);
+    dcache_child_invalidate(fs, dir, name);
+    return 1;
+}
+
+// Callback for dir_walk, given each live record of a dir and the cursor
+// denoting the records following it. Returns nonzero to end the walk.
+typedef int (*DirWalkFn)(void *arg, DirEntry *entry, size_t next);
+
+// Calls fn for each of the given dir's live records in order, starting at
+// the one denoted by cursor (0 denotes the first). A binary dir's records
+// are read DIR_WALK_BATCH at a time, w/out allocating. Records never move
+// while live (see dir_table_build), so each entry present throughout a walk
+// resumed from the cursors fn is given is seen exactly once.
+// Returns: 1 if the walk reached the end of the dir, else 0.
+static int dir_walk(FSHandle *fs, Inode *dir, size_t cursor, DirWalkFn fn,
+                    void *arg) {
+    DirHeader hdr;
+    DirEntry batch[DIR_WALK_BATCH];
+
+    if (!dir_header_get(fs, dir, &hdr))
+        return 1;                           // Empty dir
+
+    for (size_t i = cursor; i < hdr.num_records; i += DIR_WALK_BATCH) {
+        size_t n = hdr.num_records - i;
+        if (n > DIR_WALK_BATCH)
+            n = DIR_WALK_BATCH;
+        dir_data_read(fs, dir, batch, n * ST_SZ_DIRENTRY, 
+                      DIR_RECORD_OFFSET(&hdr, i));
+        for (size_t j = 0; j < n; j++)
+            if (batch[j].name_len && fn(arg, &batch[j], i + j + 1))
+                return 0;
+    }
+    return 1;
+}
+
+// Points the record for name in the given dir at the given inode instead,
+// rewriting just the record's inode offset.
+// Returns: 1 on success, else 0 (name not found or out of memblocks).
+static int dir_entry_repoint(FSHandle *fs, Inode *dir, const char *name,
+                             Inode *inode) {
+    DirHeader hdr;
+    size_t rec_idx;
+    size_t offset_inode = offset_from_ptr(fs, inode);
+
+    if (!dir_table_ensure(fs, dir))
+        return 0;
+    dir_header_get(fs, dir, &hdr);
+    if (!(rec_idx = dir_entry_find(fs, dir, &hdr, name, NULL, NULL)))
+        return 0;
+
+    inode_data_write(fs, dir, (char*)&offset_inode, sizeof(offset_inode),
+                     DIR_RECORD_OFFSET(&hdr, rec_idx - 1) + 
+                     offsetof(DirEntry, offset_inode));
+    dcache_child_set(fs, dir, name, inode);
+    return 1;
+}
+
+// Returns 1 if the given dir contains no files or sub-directories, else 0.
+static int dir_isempty(FSHandle *fs, Inode *dir) {
+    DirHeader hdr;
+
+    if (!dir_header_get(fs, dir, &hdr))
+        return 1;
+    return (hdr.num_entries == 0);
+}
+
+// Returns the inode for the given item (a sub-directory or file) having the
+// parent directory given by inode (Or NULL if item could not be found).
+static Inode* dir_subitem_get(FSHandle *fs, Inode *inode, char *name) {
+    DirHeader hdr;
+    DirEntry rec;
+    Inode *subitem = NULL;
+
+    if (!inode || !inode_isdir(inode))
+        return NULL;
+
+    // If looked up recently, no need to touch the table
+    if ((subitem = dcache_child_get(fs, inode, name)))
+        return subitem;
+
+    // Probe the hash index
+    if (dir_header_get(fs, inode, &hdr) &&
+        dir_entry_find(fs, inode, &hdr, name, NULL, &rec))
+        subitem = (Inode*)ptr_from_offset(fs, (size_t*)rec.offset_inode);
+
+    if (subitem)
+        dcache_child_set(fs, inode, name, subitem);
+    return subitem;
+}
+
+// Creates a new/empty sub-directory under the parent dir specified by inode.
+// Returns: A ptr to the newly created dir's inode on success, else NULL.
+static Inode* dir_new(FSHandle *fs, Inode *inode, char *dirname) {
+    // Validate...
+    if (!inode || !inode_isdir(inode)) {
+        // printf("ERROR: %s is not a directory\n", dirname);
+        return NULL; 
+    } 
+    if (!inode_name_isvalid(dirname)) {
+        // printf("ERROR: %s is not a valid directory name\n", dirname);
+        return NULL;
+    }
+    if(dir_subitem_get(fs, inode, dirname) != NULL) {
+        // printf("ERROR: %s already exists\n", dirname);
+        return NULL;
+    }
+
+    // Begin creating the new directory...
+    Inode *newdir_inode = inode_nextfree(fs);
+
+    if (newdir_inode == NULL) {
+        printf("ERROR: Failed to get resources adding %s\n", dirname);
+        return NULL;
+    }
+
+    inode_used_set(fs, newdir_inode, 1);
+
+    // Add the new directory's record to the parent dir's lookup table
+    if (!dir_entry_add(fs, inode, dirname, newdir_inode)) {
+        printf("ERROR: Failed adding %s to its parent directory\n", dirname);
+        inode_data_remove(fs, newdir_inode, 0);         // Release inode
+        return NULL;
+    }
+    
+    // Update parent dir properties
+    journal_log(fs, inode, ST_SZ_INODE);
+    inode->subdirs++;
+    
+    // Set new dir's properties (its inode was logged when claimed)
+    newdir_inode->is_dir = 1;
+    newdir_inode->subdirs = 0;
+    inode_data_set(fs, newdir_inode, "", 0); 
+
+    return newdir_inode;
+}
+
+// Resolves the parent dir of the given (absolute) path, copying the path's
+// last element into name (which must hold NAME_MAXLEN + 1 chars).
+// Returns: The parent's inode, or NULL if it does not exist or the path has
+// no valid last element (ex: the root dir).
+static Inode* path_parent_resolve(FSHandle *fs, const char *path, char *name) {
+    const char *sep = strrchr(path, *FS_PATH_SEP);
+    if (!sep || sep[1] == '\0' || str_len((char*)sep + 1) > NAME_MAXLEN)
+        return NULL;
+    strcpy(name, sep + 1);
+
+    if (sep == path)
+        return fs_rootnode_get(fs);       // Parent is root
+
+    char *par_path = strndup(path, sep - path);
+    Inode *parent = par_path ? resolve_path(fs, par_path) : NULL;
+    free(par_path);
+    return parent;
+}
+
+// Returns 1 iff the parent dir of the given path is frozen, so no item may be
+// made in it, else 0 (incl. if it doesn't exist).
+static int path_parent_isfrozen(FSHandle *fs, const char *path) {
+    char name[NAME_MAXLEN + 1];
+    Inode *parent = path_parent_resolve(fs, path, name);
+
+    return parent && inode_isfrozen(parent);
+}
+
+// Removes the directory denoted by the given inode from the file system.
+// Returns 1 on success, else 0.
+static int child_remove(FSHandle *fs, const char *path) {
+    Inode *parent;
+    Inode *child;
+
+    // Split the given path into seperate path and filename elements
+    char *par_path, *name, *start, *token, *next;
+    int result = 0;
+
+    start = next = strdup(path);        // Duplicate path so we can manipulate
+    next++;                             // Skip initial seperator
+    par_path = malloc(str_len(start) + 2); // Init abs path str
+    *par_path = '\0';
+    name = NULL;
+
+    while ((token = strsep(&next, FS_PATH_SEP))) {
+        if (next) {
+            strcat(par_path, FS_PATH_SEP);
+            strcat(par_path, token);
+        } else {
+            name = token;
+        }
+    }
+
+    if (*par_path == '\0')
+        strcat(par_path, FS_PATH_SEP);  // Path is root
+
+    // Get the parent and child inode's
+    parent = resolve_path(fs, par_path);
+    child = resolve_path(fs, path);
+
+    // If valid parent/child, remove child's record from the parent's table
+    if (parent && child && dir_entry_remove(fs, parent, name)) {
+        journal_log(fs, parent, ST_SZ_INODE);
+        if (child->is_dir)
+            parent->subdirs--;
+
+        // Drop cached lookups through the child (all of them if it still had
+        // children, as when a dir is moved by rename)
+        if (child->is_dir && !dir_isempty(fs, child))
+            dcache_flush(fs);
+        else
+            dcache_path_invalidate(fs, path);
+
+        // Format/release the child's inode
+        inode_data_remove(fs, child, 0); 
+        child->is_dir = 0;
+        child->subdirs = 0;
+        result = 1;     // Success
+    }
+
+    free(par_path);
+    free(start);
+    return result;      // 0 = Fail (bad path)
+}
+
+
+/* End Directory helpers ------------------------------------------------- */
+/* Begin File helpers ---------------------------------------------------- */
+
+
+// Creates a new file in the fs having the given properties.
+// Note: path is parent dir path, fname is the file name. Ex: '/' and 'file1'.
+// Returns: A ptr to the newly created file's I-node (or NULL on fail).
+static Inode *file_new(FSHandle *fs, char *path, char *fname, char *data,
+                       size_t data_sz) {
+    Inode *parent = resolve_path(fs, path);
+
+    if (!parent || !inode_isdir(parent)) {
+        // printf("ERROR: invalid path\n");
+        return NULL;
+    }
+    
+    if(dir_subitem_get(fs, parent, fname) != NULL) {
+        printf("ERROR: File already exists\n");
+        return NULL;
+    }
+
+    Inode *inode = inode_nextfree(fs);
+    if (!inode) {
+        printf("ERROR: Failed getting free inode for new file %s\n", fname);
+        return NULL;
+    }
+
+    if (!inode_name_isvalid(fname)) {
+        printf("ERROR: Invalid file name\n");
+        return NULL;
+    }
+
+    // Claim the inode (its memblocks are allocated as data is written)
+    inode_used_set(fs, inode, 1);
+    dirty_note(fs, inode, DIRTY_META, 0, 0);
+    inode_data_set(fs, inode, data, data_sz);
+    
+    // Add the new file's record to the parent dir's lookup table
+    if (!dir_entry_add(fs, parent, fname, inode)) {
+        printf("ERROR: Failed adding %s to its parent directory\n", fname);
+        inode_data_remove(fs, inode, 0);                // Release inode
+        return NULL;
+    }
+
+    return inode;
+}
+
+
+// Resolves the given file or directory path and returns its associated inode
+// (or NULL if any element of the path does not exist).
+static Inode* resolve_path(FSHandle *fs, const char *path) {
+    Inode* curr_dir = fs_rootnode_get(fs);
+
+    // If path is root
+    if (strcmp(path, FS_PATH_SEP) == 0)
+        return curr_dir;
+
+    // If path was resolved recently (only canonical paths are cached, so each
+    // item has a single key to invalidate)
+    int cacheable = 1;
+    for (const char *c = path; *c != '\0'; c++)
+        if (*c == *FS_PATH_SEP && (c[1] == *FS_PATH_SEP || c[1] == '\0'))
+            cacheable = 0;
+    Inode *inode = cacheable ? dcache_path_get(fs, path) : NULL;
+    if (inode)
+        return inode;
+
+    // Else, walk the path from the root dir, one element at a time
+    char name[NAME_MAXLEN + 1];
+    const char *start = path;
+    const char *end;
+    size_t len;
+
+    while (curr_dir) {
+        while (*start == *FS_PATH_SEP)
+            start++;                            // Skip seperator(s)
+        if (*start == '\0')
+            break;                              // Path fully walked
+
+        end = strchr(start, *FS_PATH_SEP);
+        len = end ? (size_t)(end - start) : strlen(start);
+        if (len > NAME_MAXLEN)
+            return NULL;                        // No such name can exist
+        
+        memcpy(name, start, len);
+        name[len] = '\0';
+        curr_dir = dir_subitem_get(fs, curr_dir, name);
+        start += len;
+    }
+
+    if (curr_dir && cacheable)
+        dcache_path_set(fs, path, curr_dir);
+    return curr_dir;
+}
+
+// Copies up to size bytes of the given file's data, starting at offset, into
+// buf. Shared by the path & file handle based read calls.
+// Returns: The num bytes read, or on fail, -1 w/ errnoptr set.
+static int file_read(FSHandle *fs, Inode *inode, int *errnoptr, char *buf,
+                     size_t size, off_t offset) {
+    // Ensure inode denotes a file
+    if (inode->is_dir) {
+        *errnoptr = EISDIR;
+        return -1;
+    }
+    
+    // Copy only the requested window, straight from the memblock data fields
+    return inode_data_read(fs, inode, buf, size, offset);
+}
+
+// Sets up to iovcnt of iov to the parts of the fs's mapping holding the given
+// file's data from offset onward, up to size bytes (or EOF): one per extent's
+// part of the range, or per hole (w/ a NULL iov_base, as it reads as zeroes),
+// or just one if the data is inline.
+// Returns: The num of iov set (0 at/beyond EOF), or on fail, -1 w/ errnoptr
+// set.
+static int file_readmap(FSHandle *fs, Inode *inode, int *errnoptr, 
+                        size_t size, off_t offset, struct iovec *iov, 
+                        int iovcnt) {
+    size_t file_sz = inode->file_size_b;
+    size_t blk_sz = MEMBLOCK_SZ_B(fs);
+    size_t pos = (size_t)offset;
+    int num_iov = 0;
+
+    // Ensure inode denotes a file
+    if (inode->is_dir) {
+        *errnoptr = EISDIR;
+        return -1;
+    }
+
+    if (offset < 0 || pos >= file_sz)
+        return 0;
+    if (size > file_sz - pos)
+        size = file_sz - pos;               // Don't read past EOF
+    if (inode->flags & INODE_INLINE && iovcnt) {
+        iov[0].iov_base = inode_inline_data(fs, inode) + pos;
+        iov[0].iov_len = size;
+        inode_acctime_set(fs, inode);
+        return 1;
+    }
+
+    Extent *extents = inode_extents_get(fs, inode);
+    size_t i = inode_extent_seek(fs, inode, pos / blk_sz);
+    size_t end = pos + size;
+
+    for (; pos < end && num_iov < iovcnt; num_iov++) {
+        size_t run_start = end;             // Start of the next extent's run
+        if (i < inode->num_extents && extents[i].file_blk * blk_sz < end)
+            run_start = extents[i].file_blk * blk_sz;
+
+        // If in a hole, it runs up to the next extent (or the end)
+        if (pos < run_start) {
+            iov[num_iov].iov_base = NULL;
+            iov[num_iov].iov_len = run_start - pos;
+            pos = run_start;
+            continue;
+        }
+
+        size_t run_off = pos - run_start;
+        size_t len = extents[i].len * blk_sz - run_off;
+        if (len > end - pos)
+            len = end - pos;
+
+        iov[num_iov].iov_base = 
+            (char*)memblock_at(fs, extents[i].start_blk) + run_off;
+        iov[num_iov].iov_len = len;
+        pos += len;
+        i++;
+    }
+
+    inode_acctime_set(fs, inode);
+    return num_iov;
+}
+
+// Copies size bytes from buf into the given file's data, starting at offset.
+// Shared by the path & file handle based write calls.
+// Returns: The num bytes written, or on fail, -1 w/ errnoptr set.
+static int file_write(FSHandle *fs, Inode *inode, int *errnoptr, 
+                      const char *buf, size_t size, off_t offset) {
+    // Ensure inode denotes a file, which may change
+    if (inode->is_dir) {
+        *errnoptr = EISDIR;
+        return -1;
+    }
+    if (inode_isfrozen(inode)) {
+        *errnoptr = EROFS;
+        return -1;
+    }
+
+    // Overwrite in place, allocating memblocks only for unmapped blocks
+    size_t written = inode_data_write(fs, inode, buf, size, offset);
+
+    if (!written) {
+        *errnoptr = ENOSPC;
+        return -1;
+    }
+
+    return written;  // num bytes written
+}
+
+// A caller's fill function, as wrapped by file_fill to note if it failed
+typedef struct FileFill {
+    DataFillFn fill;                    // The caller's fill function
+    void *arg;                          // Its arg
+    int failed;                         // 1 iff it filled less than asked
+} FileFill;
+
+// Fill function for file_fill, calling the caller's.
+static size_t file_fill_call(void *arg, char *dst, size_t len) {
+    FileFill *ff = (FileFill*)arg;
+    size_t filled = ff->fill(ff->arg, dst, len);
+
+    ff->failed |= filled < len;
+    return filled;
+}
+
+// Fills in size bytes of the given file's data starting at offset in place, 
+// by calling fill w/ each extent's part of the range (see inode_data_fill).
+// Returns: The num bytes filled, or on fail, -1 w/ errnoptr set (EIO if the
+// fill failed before filling any, else ENOSPC).
+static int file_fill(FSHandle *fs, Inode *inode, int *errnoptr, 
+                     DataFillFn fill, void *arg, size_t size, off_t offset) {
+    FileFill ff = { fill, arg, 0 };
+
+    // Ensure inode denotes a file, which may change
+    if (inode->is_dir) {
+        *errnoptr = EISDIR;
+        return -1;
+    }
+    if (inode_isfrozen(inode)) {
+        *errnoptr = EROFS;
+        return -1;
+    }
+
+    size_t filled = inode_data_fill(fs, inode, file_fill_call, &ff, size, 
+                                    offset);
+    if (!filled) {
+        *errnoptr = ff.failed ? EIO : ENOSPC;
+        return -1;
+    }
+    return filled;
+}
+
+// Sets the size of the given file's data to offset bytes. Only metadata is
+// touched: growing leaves a hole (reading as zeroes) past the old EOF, and 
+// shrinking releases just the data blocks wholly past the new EOF. Shared by
+// the path & file handle based truncate calls.
+// Returns: 0 on success, or on fail, -1 w/ errnoptr set.
+static int file_truncate(FSHandle *fs, Inode *inode, int *errnoptr, 
+                         off_t offset) {
+    size_t blk_sz = MEMBLOCK_SZ_B(fs);
+
+    // Ensure inode denotes a file, which may change
+    if (inode->is_dir) {
+        *errnoptr = EISDIR;
+        return -1;
+    }
+    if (inode_isfrozen(inode)) {
+        *errnoptr = EROFS;
+        return -1;
+    }
+
+    if (offset < 0) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
+
+    // Inline data can't grow past INODE_INLINE_SZ_B, so move it to a block
+    journal_log(fs, inode, ST_SZ_INODE);
+    if ((size_t)offset > INODE_INLINE_SZ_B && 
+        !inode_inline_promote(fs, inode)) {
+        *errnoptr = ENOSPC;
+        return -1;
+    }
+
+    // If shrinking, release the tail blocks & zero the rest of the new last
+    // block (or of the inline data), as bytes past EOF must read as zeroes 
+    // should the file regrow, copying that block first if it's shared
+    if ((size_t)offset < inode->file_size_b) {
+        if (offset % blk_sz && 
+            !inode_blocks_unshare(fs, inode, offset / blk_sz, 
+                                  offset / blk_sz + 1)) {
+            *errnoptr = ENOSPC;
+            return -1;
+        }
+        if (inode->flags & INODE_INLINE)
+            inode_data_zero(fs, inode, offset, inode->file_size_b);
+        inode_blocks_shrink(fs, inode, (offset + blk_sz - 1) / blk_sz);
+
+        char *block = inode_block_at(fs, inode, offset / blk_sz);
+        if (block && offset % blk_sz) {
+            memset(block + offset % blk_sz, 0, blk_sz - offset % blk_sz);
+            dirty_note(fs, inode, DIRTY_DATA, 
+                       (block - fs->mem_seg) / blk_sz, 1);
+        }
+    }
+
+    inode->file_size_b = (size_t)offset;
+    inode_modtime_set(inode);
+    dirty_note(fs, inode, DIRTY_META | DIRTY_TIME, 0, 0);
+
+    return 0;  // Success
+}
+
+// Populates stbuf w/ the attributes of the given inode, as reported by
+// __myfs_getattr_implem (w/ the given owner).
+static void inode_stat_get(FSHandle *fs, Inode *inode, uid_t uid, gid_t gid,
+                           struct stat *stbuf) {
+    int64_t acc;
+
+    //Reset the memory of the results container
+    memset(stbuf, 0, sizeof(struct stat));
+
+    //Populate stdbuf with the atrributes of the inode
+    stbuf->st_uid = uid;
+    stbuf->st_gid = gid;
+    acc = __atomic_load_n(&inode->last_acc_ns, __ATOMIC_RELAXED);
+    stbuf->st_atim.tv_sec = acc / INT64_C(1000000000);
+    stbuf->st_atim.tv_nsec = acc % INT64_C(1000000000);
+    stbuf->st_mtim.tv_sec = inode->last_mod_ns / INT64_C(1000000000);
+    stbuf->st_mtim.tv_nsec = inode->last_mod_ns % INT64_C(1000000000);
+    stbuf->st_ctim = stbuf->st_mtim;            // Changes aren't timed apart
+    
+    if (inode->is_dir) {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = inode->subdirs + 2;  // "+ 2" for . and .. 
+    } else {
+        stbuf->st_mode = S_IFREG | 0755;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = inode->file_size_b;
+        stbuf->st_blocks = inode_blocks_mapped(fs, inode) * 
+                           (MEMBLOCK_SZ_B(fs) / 512);   // Excludes holes
+    }
+}
+
+/* End File helpers ------------------------------------------------------- */
+/* Begin Snapshot helpers ------------------------------------------------- */
+
+
+// Claims the given free inode as a frozen clone of the given one (a file's or
+// a dir's): its size, times and inline data or extents are copied, so it 
+// shares each memblock of a file's data (see dedup_refs_add), which is thus
+// copied on the next write to either. A dir's clone is left empty.
+// Returns: 1 on success, else 0 (out of space for an extent table).
+static int snapshot_inode_clone(FSHandle *fs, Inode *src, Inode *dst) {
+    inode_used_set(fs, dst, 1);                         // Also logs it
+    dst->is_dir = src->is_dir;
+    dst->subdirs = 0;
+    dst->flags = INODE_FROZEN;
+    dst->last_acc_ns = src->last_acc_ns;
+    dst->last_mod_ns = src->last_mod_ns;
+    if (src->is_dir)
+        return 1;
+
+    // Inline data & extents share the inline extents slot, copied as is
+    size_t ext_sz = src->ext_table_len ? src->num_extents * ST_SZ_EXTENT 
+                                       : INODE_INLINE_SZ_B;
+    if (src->ext_table_len && 
+        !inode_extents_reserve(fs, dst, src->num_extents))
+        return 0;
+    Extent *extents = inode_extents_get(fs, dst);
+    journal_log(fs, extents, ext_sz);
+    memcpy(extents, inode_extents_get(fs, src), ext_sz);
+    dst->num_extents = src->num_extents;
+    dst->flags |= src->flags & INODE_INLINE;
+    dst->file_size_b = src->file_size_b;
+
+    for (size_t i = 0; i < dst->num_extents; i++)
+        dedup_refs_add(fs, extents[i].start_blk, extents[i].len, 1);
+    return 1;
+}
+
+// Removes the given frozen inode (as by unlink or rmdir), along w/ all of 
+// the items under it if a dir.
+static void snapshot_inode_remove(FSHandle *fs, Inode *inode) {
+    if (inode->is_dir) {
+        DirEntry *entries;
+        size_t count = dir_entries_get(fs, inode, &entries);
+        for (size_t i = 0; i < count; i++)
+            snapshot_inode_remove(fs, (Inode*)ptr_from_offset(fs, 
+                (size_t*)entries[i].offset_inode));
+        free(entries);
+    }
+
+    inode_data_remove(fs, inode, 0);
+    inode->is_dir = 0;
+    inode->subdirs = 0;
+}
+
+// Clones the items of the given dir src (save the one named skip, if not 
+// NULL), and all those under them, into the given (empty) clone of it, whose
+// table is then written in one go.
+// Returns: 1 on success, else 0 (out of inodes or memblocks), in which case
+// dst is left empty.
+static int snapshot_tree_clone(FSHandle *fs, Inode *src, Inode *dst, 
+                               const char *skip) {
+    DirEntry *entries;
+    size_t count = dir_entries_get(fs, src, &entries);
+    size_t num = 0;                     // Num items cloned, at entries' head
+    int result = 1;
+
+    journal_log(fs, dst, ST_SZ_INODE);
+    for (size_t i = 0; i < count; i++) {
+        if (skip && strcmp(entries[i].name, skip) == 0)
+            continue;
+        Inode *item = (Inode*)ptr_from_offset(fs, 
+                                              (size_t*)entries[i].offset_inode);
+        Inode *clone = inode_nextfree(fs);
+        if (!clone || !snapshot_inode_clone(fs, item, clone) ||
+            (item->is_dir && !snapshot_tree_clone(fs, item, clone, NULL))) {
+            if (clone)
+                snapshot_inode_remove(fs, clone);   // Left empty, if a dir
+            result = 0;
+            break;
+        }
+        entries[num] = entries[i];
+        entries[num++].offset_inode = offset_from_ptr(fs, clone);
+        dst->subdirs += item->is_dir;
+    }
+    if (result && num && !dir_table_build(fs, dst, entries, num, 0))
+        result = 0;
+
+    // On fail, remove what was cloned
+    if (!result) {
+        for (size_t i = 0; i < num; i++)
+            snapshot_inode_remove(fs, (Inode*)ptr_from_offset(fs, 
+                (size_t*)entries[i].offset_inode));
+        dst->subdirs = 0;
+        inode_data_remove(fs, dst, 1);
+    }
+    free(entries);
+    return result;
+}
+
+
+/* End Snapshot helpers --------------------------------------------------- */
+/* Begin Import helpers --------------------------------------------------- */
+
+// Codes for why an item is left out of an import
+#define IMPORT_IN (0)                       // It's imported
+#define IMPORT_BADNAME (1)                  // Its name is invalid
+#define IMPORT_DUPNAME (2)                  // An earlier item has its name
+#define IMPORT_EXISTS (3)                   // Its dir already has its name
+#define IMPORT_UNDER (4)                    // Its dir is left out
+
+// An item of an import, keyed by its dir & name, so that the items of each 
+// dir sort together (and duplicate names next to each other).
+typedef struct ImportKey {
+    size_t parent;                      // Index + 1 of its dir, or 0 for the
+                                        // dir imported into
+    size_t item;                        // Its index
+    const char *name;                   // Its name
+    uint32_t hash;                      // Hash of its name
+} ImportKey;
+
+// State of an import (see __myfs_import_implem), shared by the threads filling
+// in its data. They take the files' data from a cursor, a chunk of up to 
+// IMPORT_CHUNK_SZ_B bytes at a time, so a large file is split across them.
+typedef struct FSImport {
+    FSHandle *fs;                       // The fs imported into
+    size_t num;                         // Num items
+    const char **names;                 // Each item's name
+    const size_t *parents;              // Each item's dir (see ImportKey)
+    const struct stat *stats;           // Each item's attributes
+    uint8_t *left;                      // Each item's IMPORT_* code
+    Inode **inodes;                     // Each item's inode, once claimed
+    size_t (*fill)(void *, size_t, char *, size_t, off_t);
+    void *arg;                          // Arg for fill
+    pthread_mutex_t lock;               // Guards the cursor
+    size_t cur_item;                    // Cursor: item next filled in, and
+    size_t cur_offset;                  // offset into its data
+    int failed;                         // 1 iff a fill filled less than asked
+} FSImport;
+
+// Orders import keys by dir, then name (by hash first), then item.
+static int import_key_cmp(const void *a, const void *b) {
+    const ImportKey *x = (const ImportKey*)a;
+    const ImportKey *y = (const ImportKey*)b;
+    int cmp;
+
+    if (x->parent != y->parent)
+        return x->parent < y->parent ? -1 : 1;
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    if ((cmp = strcmp(x->name, y->name)) != 0)
+        return cmp;
+    return x->item < y->item ? -1 : x->item > y->item;
+}
+
+// Reports the given item, left out of the given import for the given reason,
+// on stdout, by its path from the dir imported into.
+static void import_report(FSImport *imp, size_t item, const char *why) {
+    size_t len = 0;
+
+    for (size_t i = item; i != SIZE_MAX; i = imp->parents[i])
+        len += str_len((char*)imp->names[i]) + (len != 0);
+    char *path = malloc(len + 1);
+    if (!path)
+        return;
+
+    // Fill the path in from its end
+    path[len] = '\0';
+    for (size_t i = item; i != SIZE_MAX; i = imp->parents[i]) {
+        size_t name_len = str_len((char*)imp->names[i]);
+        len -= name_len;
+        memcpy(path + len, imp->names[i], name_len);
+        if (len)
+            path[--len] = *FS_PATH_SEP;
+    }
+    printf("import: %s: %s, left out\n", path, why);
+    free(path);
+}
+
+// Sets up the given import's keys (one per item, sorted) and leaves out each
+// item w/ an invalid name, whose name an earlier item of its dir has (or the
+// given dir imported into already holds), or whose dir is left out, 
+// reporting each one not under one left out.
+// Returns: The num items left out.
+static size_t import_prepare(FSImport *imp, Inode *dir, ImportKey *keys) {
+    FSHandle *fs = imp->fs;
+    size_t num_left = 0;
+
+    for (size_t i = 0; i < imp->num; i++) {
+        keys[i].parent = imp->parents[i] + 1;      // SIZE_MAX wraps to 0
+        keys[i].item = i;
+        keys[i].name = imp->names[i];
+        keys[i].hash = str_hash(imp->names[i]);
+        if (!inode_name_isvalid((char*)imp->names[i]))
+            imp->left[i] = IMPORT_BADNAME;
+    }
+    qsort(keys, imp->num, sizeof(ImportKey), import_key_cmp);
+
+    for (size_t k = 0; k < imp->num; k++) {
+        size_t item = keys[k].item;
+        if (imp->left[item])
+            continue;
+        if (k && keys[k - 1].parent == keys[k].parent && 
+            keys[k - 1].hash == keys[k].hash &&
+            strcmp(keys[k - 1].name, keys[k].name) == 0)
+            imp->left[item] = IMPORT_DUPNAME;
+        else if (!keys[k].parent && 
+                 dir_subitem_get(fs, dir, (char*)keys[k].name))
+            imp->left[item] = IMPORT_EXISTS;
+    }
+
+    // A dir precedes its items, so is left out (or not) before them
+    for (size_t i = 0; i < imp->num; i++) {
+        if (!imp->left[i] && imp->parents[i] != SIZE_MAX && 
+            imp->left[imp->parents[i]])
+            imp->left[i] = IMPORT_UNDER;
+        if (imp->left[i] == IMPORT_BADNAME)
+            import_report(imp, i, "invalid name");
+        else if (imp->left[i] == IMPORT_DUPNAME)
+            import_report(imp, i, "duplicate name");
+        else if (imp->left[i] == IMPORT_EXISTS)
+            import_report(imp, i, "already exists");
+        num_left += imp->left[i] != IMPORT_IN;
+    }
+    return num_left;
+}
+
+// Claims an inode for each of the given import's items (save those left 
+// out), in order, as the inode cursor follows the last one claimed, and maps
+// each file's data blocks in as few runs as are free (one, in a fresh fs), 
+// or holds its data inline (zeroed) if it fits.
+// Returns: 1 on success, else 0 (out of inodes or memblocks).
+static int import_inodes_claim(FSImport *imp) {
+    FSHandle *fs = imp->fs;
+    size_t blk_sz = MEMBLOCK_SZ_B(fs);
+
+    for (size_t i = 0; i < imp->num; i++) {
+        if (imp->left[i])
+            continue;
+        Inode *inode = inode_nextfree(fs);
+        if (!inode)
+            return 0;
+        inode_used_set(fs, inode, 1);               // Also logs it
+        imp->inodes[i] = inode;
+        inode->is_dir = S_ISDIR(imp->stats[i].st_mode) != 0;
+        inode->subdirs = 0;
+
+        size_t size = (size_t)imp->stats[i].st_size;
+        if (inode->is_dir || !size)
+            continue;
+        if (size <= INODE_INLINE_SZ_B) {
+            char *data = inode_inline_data(fs, inode);
+            journal_log(fs, data, INODE_INLINE_SZ_B);
+            memset(data, 0, INODE_INLINE_SZ_B);
+            inode->flags |= INODE_INLINE;
+        } else if (inode_blocks_map(fs, inode, 0, (size + blk_sz - 1) / 
+                                    blk_sz) < (size + blk_sz - 1) / blk_sz) {
+            return 0;
+        }
+        inode->file_size_b = size;
+    }
+    return 1;
+}
+
+// Sets the given dir entry to the given (claimed) item of the given import.
+static void import_entry_set(FSImport *imp, ImportKey *key, DirEntry *entry) {
+    memset(entry, 0, ST_SZ_DIRENTRY);
+    entry->offset_inode = offset_from_ptr(imp->fs, imp->inodes[key->item]);
+    entry->hash = key->hash;
+    strncpy(entry->name, key->name, NAME_MAXLEN);
+    entry->name_len = str_len(entry->name);
+}
+
+// Writes the table of each dir of the given import in one go, from its items'
+// keys (sorted, see import_prepare), and counts its subdirs. Then sets each
+// item's times (as writing a table sets the dir's).
+// Returns: 1 on success, else 0 (out of memory or memblocks).
+static int import_tables_build(FSImport *imp, ImportKey *keys) {
+    FSHandle *fs = imp->fs;
+    DirEntry *entries = NULL;
+    size_t cap = 0;
+    int result = 1;
+
+    for (size_t k = 0, end; k < imp->num && result; k = end) {
+        size_t parent = keys[k].parent;
+        size_t num = 0;
+
+        for (end = k; end < imp->num && keys[end].parent == parent; end++)
+            ;
+        if (!parent || imp->left[parent - 1])
+            continue;                   // The dir imported into is linked last
+        if (end - k > cap) {
+            free(entries);
+            cap = end - k;
+            if (!(entries = malloc(cap * ST_SZ_DIRENTRY))) {
+                result = 0;
+                break;
+            }
+        }
+
+        Inode *dir = imp->inodes[parent - 1];
+        journal_log(fs, dir, ST_SZ_INODE);
+        for (size_t j = k; j < end; j++) {
+            if (imp->left[keys[j].item])
+                continue;
+            import_entry_set(imp, &keys[j], &entries[num++]);
+            dir->subdirs += imp->inodes[keys[j].item]->is_dir;
+        }
+        if (num && !dir_table_build(fs, dir, entries, num, 0))
+            result = 0;
+    }
+    free(entries);
+
+    for (size_t i = 0; i < imp->num && result; i++) {
+        if (!imp->inodes[i])
+            continue;
+        const struct stat *st = &imp->stats[i];
+        imp->inodes[i]->last_acc_ns = st->st_atim.tv_sec * INT64_C(1000000000)
+                                      + st->st_atim.tv_nsec;
+        imp->inodes[i]->last_mod_ns = st->st_mtim.tv_sec * INT64_C(1000000000)
+                                      + st->st_mtim.tv_nsec;
+    }
+    return result;
+}
+
+// Fills in the part [offset, end) of the data of the given item of the given
+// import, by calling its fill w/ each extent's part of it in turn (or w/ its
+// inline data), zeroing the rest of the last block if that's the data's end.
+static void import_fill_range(FSImport *imp, size_t item, size_t offset, 
+                              size_t end) {
+    FSHandle *fs = imp->fs;
+    Inode *inode = imp->inodes[item];
+    size_t file_sz = inode->file_size_b;
+    size_t blk_sz = MEMBLOCK_SZ_B(fs);
+
+    if (inode->flags & INODE_INLINE) {
+        if (imp->fill(imp->arg, item, inode_inline_data(fs, inode), file_sz,
+                      0) < file_sz)
+            __atomic_store_n(&imp->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    // The data is mapped w/out holes, so each of its extents follows
+    Extent *extent = &inode_extents_get(fs, inode)[
+        inode_extent_seek(fs, inode, offset / blk_sz)];
+    for (size_t pos = offset; pos < end; extent++) {
+        size_t run_off = pos - extent->file_blk * blk_sz;
+        size_t len = extent->len * blk_sz - run_off;
+        char *dst = (char*)memblock_at(fs, extent->start_blk) + run_off;
+        if (len > end - pos)
+            len = end - pos;
+
+        if (imp->fill(imp->arg, item, dst, len, (off_t)pos) < len) {
+            __atomic_store_n(&imp->failed, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        pos += len;
+        if (pos == file_sz && pos % blk_sz)
+            memset(dst + len, 0, blk_sz - pos % blk_sz);
+    }
+}
+
+// Fills in the given import's data, a chunk at a time from its cursor, 
+// until none is left (or a fill failed).
+static void* import_fill_run(void *arg) {
+    FSImport *imp = (FSImport*)arg;
+
+    while (!__atomic_load_n(&imp->failed, __ATOMIC_RELAXED)) {
+        size_t item, offset, end = 0;
+
+        // Take the next chunk of a file's data, skipping the other items
+        pthread_mutex_lock(&imp->lock);
+        for (; imp->cur_item < imp->num; imp->cur_item++) {
+            Inode *inode = imp->inodes[imp->cur_item];
+            end = inode ? inode->file_size_b : 0;
+            if (inode && !inode->is_dir && imp->cur_offset < end)
+                break;
+            imp->cur_offset = 0;
+        }
+        item = imp->cur_item;
+        offset = imp->cur_offset;
+        if (end - offset > IMPORT_CHUNK_SZ_B)
+            end = offset + IMPORT_CHUNK_SZ_B;
+        imp->cur_offset = end;
+        pthread_mutex_unlock(&imp->lock);
+
+        if (item >= imp->num)
+            break;
+        import_fill_range(imp, item, offset, end);
+    }
+    return NULL;
+}
+
+// Fills in the given import's data on up to threads threads (the calling one
+// included), or on fewer if no more could be started.
+// Returns: 1 on success, else 0 (a fill failed).
+static int import_fill(FSImport *imp, int threads) {
+    pthread_t ids[IMPORT_THREADS_MAX];
+    int started = 0;
+
+    if (threads > IMPORT_THREADS_MAX)
+        threads = IMPORT_THREADS_MAX;
+    imp->cur_item = 0;
+    imp->cur_offset = 0;
+    for (int t = 1; t < threads; t++)
+        if (pthread_create(&ids[started], NULL, import_fill_run, imp) == 0)
+            started++;
+    import_fill_run(imp);
+    for (int t = 0; t < started; t++)
+        pthread_join(ids[t], NULL);
+    return !imp->failed;
+}
+
+// Releases the inodes (and their data) claimed by the given import so far.
+static void import_undo(FSImport *imp) {
+    for (size_t i = imp->num; i-- > 0; ) {
+        Inode *inode = imp->inodes[i];
+        if (!inode)
+            continue;
+        inode_data_remove(imp->fs, inode, 0);
+        inode->is_dir = 0;
+        inode->subdirs = 0;
+        imp->inodes[i] = NULL;
+    }
+}
+
+// Runs the given import (w/ its items' keys) into the given dir, filling in 
+// its data on up to threads threads. On fail, the fs is left as it was.
+// Returns: The num items left out, or on fail, -1 w/ errnoptr set.
+static long import_run(FSImport *imp, Inode *dir, ImportKey *keys, 
+                       int threads, int *errnoptr) {
+    FSHandle *fs = imp->fs;
+    size_t blk_sz = MEMBLOCK_SZ_B(fs);
+    DirEntry *entries;
+
+    // Ensure each item is a dir or file, in a dir that comes before it
+    for (size_t i = 0; i < imp->num; i++) {
+        mode_t mode = imp->stats[i].st_mode;
+        size_t p = imp->parents[i];
+        if ((!S_ISDIR(mode) && !S_ISREG(mode)) || (p != SIZE_MAX && 
+            (p >= i || !S_ISDIR(imp->stats[p].st_mode)))) {
+            *errnoptr = EINVAL;
+            return -1;
+        }
+    }
+
+    // Ensure there are enough inodes & data blocks for the items imported
+    size_t num_left = import_prepare(imp, dir, keys);
+    size_t num_blocks = 0;
+    for (size_t i = 0; i < imp->num; i++) {
+        size_t size = (size_t)imp->stats[i].st_size;
+        if (!imp->left[i] && S_ISREG(imp->stats[i].st_mode) && 
+            size > INODE_INLINE_SZ_B)
+            num_blocks += (size + blk_sz - 1) / blk_sz;
+    }
+    if (imp->num - num_left > fs->free_inodes || 
+        num_blocks > fs->free_memblocks) {
+        *errnoptr = ENOSPC;
+        return -1;
+    }
+
+    // Claim the items, write their dirs' tables and fill in their data
+    if (!import_inodes_claim(imp) || !import_tables_build(imp, keys)) {
+        import_undo(imp);
+        *errnoptr = ENOSPC;
+        return -1;
+    }
+    if (!import_fill(imp, threads)) {
+        import_undo(imp);
+        *errnoptr = EIO;
+        return -1;
+    }
+
+    // Link the items into the dir, rebuilding its table w/ them (or w/out, 
+    // should that run out of space, which the table then had before)
+    size_t count = dir_entries_get(fs, dir, &entries);
+    size_t num_old = count;
+    size_t subdirs = 0;
+    DirEntry *all = realloc(entries, (count + imp->num) * ST_SZ_DIRENTRY);
+    if (!all) {
+        free(entries);
+        import_undo(imp);
+        *errnoptr = ENOMEM;
+        return -1;
+    }
+    entries = all;
+    for (size_t k = 0; k < imp->num && !keys[k].parent; k++) {
+        if (imp->left[keys[k].item])
+            continue;
+        import_entry_set(imp, &keys[k], &entries[count++]);
+        subdirs += imp->inodes[keys[k].item]->is_dir;
+    }
+    int linked = count == num_old || 
+                 dir_table_build(fs, dir, entries, count, 0);
+    if (!linked) {
+        import_undo(imp);
+        if (num_old)
+            dir_table_build(fs, dir, entries, num_old, 0);
+        else
+            inode_data_remove(fs, dir, 1);
+        *errnoptr = ENOSPC;
+    }
+    free(entries);
+    dcache_flush(fs);                   // Drop lookups made meanwhile
+    if (!linked)
+        return -1;
+
+    journal_log(fs, dir, ST_SZ_INODE);
+    dir->subdirs += subdirs;
+    return (long)num_left;
+}
+
+
+/* End Import helpers ----------------------------------------------------- */
+/* Begin Check helpers ---------------------------------------------------- */
+
+// State of a consistency check of a fs (see __myfs_check_implem), shared by
+// the threads it runs on. Each pass of the check splits the fs's inodes (or
+// memblocks) into a range per thread, and the threads reconcile which 
+// memblocks are owned, and how often each inode is referred to, atomically.
+typedef struct FSCheck {
+    FSHandle *fs;                       // The fs being checked
+    size_t num_threads;                 // Num threads to check it on
+    uint64_t *owned;                    // Bitmap of memblocks found owned
+    uint32_t *refs;                     // Num dir entries referring to each
+                                        // inode
+    uint8_t *sound;                     // 1 per inode whose extents are sound
+                                        // (so whose data may be read)
+    uint32_t *shares;                   // Num data blocks found mapping each
+                                        // shared (or indexed) memblock
+    size_t problems;                    // Num problems found
+    size_t free_memblocks;              // Num memblocks found free
+    size_t free_inodes;                 // Num inodes found free
+    size_t dedup_used;                  // Num dedup index entries found
+    size_t dedup_tombs;                 // Num dedup index tombs found
+} FSCheck;
+
+// A pass of a check, over the items [first, end) of its range
+typedef void (*CheckPassFn)(FSCheck *chk, size_t first, size_t end);
+
+// A thread's range of a pass of a check
+typedef struct CheckRange {
+    pthread_t thread;                   // The thread checking it
+    FSCheck *chk;                       // The check
+    CheckPassFn fn;                     // The pass
+    size_t first;                       // Index of its 1st item
+    size_t end;                         // Index past its last item
+} CheckRange;
+
+// Reports a problem found by the given check, as by printf (past the first
+// CHECK_REPORT_MAX, they're only counted).
+static void check_report(FSCheck *chk, const char *fmt, ...) {
+    char msg[CHECK_MSG_MAXLEN];
+    va_list args;
+
+    size_t n = __atomic_fetch_add(&chk->problems, 1, __ATOMIC_RELAXED);
+    if (n > CHECK_REPORT_MAX)
+        return;
+    if (n == CHECK_REPORT_MAX) {
+        printf("fsck: (further problems are not shown)\n");
+        return;
+    }
+    va_start(args, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+    printf("fsck: %s\n", msg);
+}
+
+// Runs the given thread's range of a pass.
+static void* check_range_run(void *arg) {
+    CheckRange *range = (CheckRange*)arg;
+    range->fn(range->chk, range->first, range->end);
+    return NULL;
+}
+
+// Runs the given pass of a check over num items, split evenly across its 
+// threads (the calling one included). A range no thread could be started for
+// is checked by the calling thread.
+static void check_pass(FSCheck *chk, size_t num, CheckPassFn fn) {
+    CheckRange ranges[CHECK_THREADS_MAX];
+    size_t num_ranges = chk->num_threads < num ? chk->num_threads : num;
+    if (!num_ranges)
+        return;
+
+    size_t per_range = (num + num_ranges - 1) / num_ranges;
+    for (size_t t = 0; t < num_ranges; t++) {
+        ranges[t].chk = chk;
+        ranges[t].fn = fn;
+        ranges[t].first = t * per_range;
+        ranges[t].end = (t + 1) * per_range < num ? (t + 1) * per_range : num;
+    }
+    for (size_t t = 1; t < num_ranges; t++)
+        if (pthread_create(&ranges[t].thread, NULL, check_range_run, 
+                           &ranges[t]) != 0)
+            ranges[t].fn = NULL;
+
+    check_range_run(&ranges[0]);
+    for (size_t t = 1; t < num_ranges; t++) {
+        if (ranges[t].fn)
+            pthread_join(ranges[t].thread, NULL);
+        else
+            fn(chk, ranges[t].first, ranges[t].end);
+    }
+}
+
+// Checks the given fs's handle against the fssize bytes of its image: its 
+// layout version, geometry (that each segment lies within the fs), inode
+// groups and counters, reading nothing else.
+// Returns: 1 iff the fs's segments may be bound (see fs_segs_bind), else 0.
+static int check_handle(FSCheck *chk, FSHandle *fs, size_t fssize) {
+    size_t fs_end = fs->size_b + FS_START_OFFSET;
+
+    if (fs->version != FS_VERSION) {
+        check_report(chk, "unsupported layout version %lu", (lui)fs->version);
+        return 0;
+    }
+    if (fs->size_b > fssize - FS_START_OFFSET) {
+        check_report(chk, "fs of %lu bytes is larger than its image", 
+                     (lui)fs_end);
+        return 0;
+    }
+    if (!fs_format_isvalid(fs->block_sz_b, fs->inode_ratio)) {
+        check_report(chk, "bad block size %lu or inode ratio %lu", 
+                     (lui)fs->block_sz_b, (lui)fs->inode_ratio);
+        return 0;
+    }
+    if (fs->journal_sz_b && (fs->journal_sz_b <= JOURNAL_HDR_SZ_B || 
+                             fs->journal_sz_b > fs->size_b)) {
+        check_report(chk, "bad journal size %lu", (lui)fs->journal_sz_b);
+        return 0;
+    }
+    if (!fs->base_inodes || fs->base_inodes > fs->num_inodes || 
+        fs->num_inodes > fs->inode_bitmap_cap || 
+        fs->num_memblocks > fs->blk_bitmap_cap ||
+        fs->inode_bitmap_cap > fs->size_b || 
+        fs->blk_bitmap_cap > fs->size_b) {
+        check_report(chk, "%lu inodes & %lu memblocks don't fit the bitmaps "
+                     "(of %lu & %lu)", (lui)fs->num_inodes, 
+                     (lui)fs->num_memblocks, (lui)fs->inode_bitmap_cap,
+                     (lui)fs->blk_bitmap_cap);
+        return 0;
+    }
+
+    size_t mem_off = FS_MEMSEG_OFFSET(fs->journal_sz_b, fs->inode_bitmap_cap,
+                                      fs->blk_bitmap_cap, fs->base_inodes, 
+                                      fs->block_sz_b);
+    if (mem_off > fs_end || 
+        fs->num_memblocks > (fs_end - mem_off) / fs->block_sz_b) {
+        check_report(chk, "%lu memblocks run past the end of the fs", 
+                     (lui)fs->num_memblocks);
+        return 0;
+    }
+
+    // The groups hold the inodes past the inodes segment, in order
+    size_t per_blk = INODES_PER_BLK(fs);
+    size_t next = fs->base_inodes;
+    if (fs->num_groups > FS_GROUPS_MAX) {
+        check_report(chk, "%lu inode groups", (lui)fs->num_groups);
+        return 0;
+    }
+    for (size_t i = 0; i < fs->num_groups; i++) {
+        InodeGroup *group = &fs->groups[i];
+        if (group->first_inode != next || !group->num_inodes || 
+            group->num_inodes > fs->num_inodes - next ||
+            group->len != (group->num_inodes + per_blk - 1) / per_blk ||
+            group->start_blk > fs->num_memblocks || 
+            group->len > fs->num_memblocks - group->start_blk) {
+            check_report(chk, "inode group %lu is malformed", (lui)i);
+            return 0;
+        }
+        next += group->num_inodes;
+    }
+    if (next != fs->num_inodes) {
+        check_report(chk, "inode groups hold %lu of the %lu inodes", 
+                     (lui)next, (lui)fs->num_inodes);
+        return 0;
+    }
+
+    // The dedup index, if any, is a run of memblocks holding its slots
+    if (fs->dedup_len && 
+        (!fs->dedup_slots || (fs->dedup_slots & (fs->dedup_slots - 1)) ||
+         fs->dedup_slots > fs->blk_bitmap_cap * 2 ||
+         fs->dedup_len != dedup_index_len(fs, fs->dedup_slots) ||
+         fs->dedup_blk > fs->num_memblocks || 
+         fs->dedup_len > fs->num_memblocks - fs->dedup_blk ||
+         fs->dedup_used + fs->dedup_tombs > fs->dedup_slots)) {
+        check_report(chk, "dedup index is malformed");
+        return 0;
+    }
+
+    // Counters & cursors (a mount would go wrong by them, but may bind)
+    if (fs->free_memblocks > fs->num_memblocks || 
+        fs->free_inodes > fs->num_inodes)
+        check_report(chk, "%lu free memblocks & %lu free inodes exceed the "
+                     "fs's", (lui)fs->free_memblocks, (lui)fs->free_inodes);
+    if (fs->blk_cursor > fs->num_memblocks || 
+        fs->inode_cursor > fs->num_inodes)
+        check_report(chk, "allocation cursors past the end of the fs");
+    return 1;
+}
+
+// Checks the given fs's journal header, and reports (as no problem) what 
+// mounting the fs would replay from the journal or undo.
+static void check_journal(FSCheck *chk, FSHandle *fs) {
+    JournalHeader *hdr = journal_header(fs);
+    size_t pos = 0, committed = 0, num_txns = 0;
+
+    if (!fs->journal_sz_b)
+        return;
+    if (hdr->magic != JOURNAL_MAGIC) {
+        check_report(chk, "journal header is corrupt");
+        return;
+    }
+
+    for (uint64_t seq = hdr->seq_base; journal_rec_isvalid(fs, pos, seq); ) {
+        JournalRec *rec = journal_rec_at(fs, pos);
+        pos += journal_rec_sz(rec);
+        if (rec->type == JREC_COMMIT) {
+            committed = pos;
+            num_txns++;
+            seq++;
+        }
+    }
+    if (num_txns)
+        printf("fsck: journal holds %lu committed txn(s) to replay\n", 
+               (lui)num_txns);
+    if (pos > committed)
+        printf("fsck: journal holds an incomplete txn to undo\n");
+}
+
+// Notes the given run of memblocks as owned by the given inode, reporting 
+// any already owned (by another inode or this one) or marked free. Those
+// shared or indexed for dedup may be owned any num of times, which are 
+// tallied (see check_shares).
+static void check_claim(FSCheck *chk, size_t index, size_t start, 
+                        size_t len) {
+    FSHandle *fs = chk->fs;
+
+    for (size_t i = start; i < start + len; i++) {
+        uint64_t bit = UINT64_C(1) << (i % BITMAP_WORD_BITS);
+        if (chk->shares && dedup_isshared(fs, i) &&
+            __atomic_fetch_add(&chk->shares[i], 1, __ATOMIC_RELAXED))
+            continue;
+        if (__atomic_fetch_or(&chk->owned[i / BITMAP_WORD_BITS], bit, 
+                              __ATOMIC_RELAXED) & bit)
+            check_report(chk, "memblock %lu: owned twice (by inode %lu)", 
+                         (lui)i, (lui)index);
+        else if (fs->bitmap_valid && memblock_isfree(fs, i))
+            check_report(chk, "memblock %lu: owned by inode %lu but free", 
+                         (lui)i, (lui)index);
+    }
+}
+
+// Returns 1 iff the len bytes at data are all 0, else 0.
+static int check_iszero(const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        if (data[i])
+            return 0;
+    return 1;
+}
+
+// Pass checking the inodes [first, end): that free ones map nothing, and 
+// that used ones have sound inline data, or extents & extent table, which 
+// are claimed (see check_claim).
+static void check_inodes(FSCheck *chk, size_t first, size_t end) {
+    FSHandle *fs = chk->fs;
+    size_t blk_sz = MEMBLOCK_SZ_B(fs);
+    size_t num_free = 0;
+
+    for (size_t i = first; i < end; i++) {
+        Inode *inode = inode_at(fs, i);
+        size_t size = inode->file_size_b;
+
+        if (!bitmap_get(fs->inode_bitmap, i)) {
+            num_free++;
+            if (inode->num_extents || inode->ext_table_len || inode->flags)
+                check_report(chk, "inode %lu: free, but maps data", (lui)i);
+            continue;
+        }
+        if (inode->is_dir > 1 || 
+            (inode->flags & ~(INODE_INLINE | INODE_FROZEN))) {
+            check_report(chk, "inode %lu: bad type %u or flags %#x", (lui)i, 
+                         inode->is_dir, inode->flags);
+            continue;
+        }
+
+        // Inline data maps no blocks, and is zeroed past its end
+        if (inode->flags & INODE_INLINE) {
+            if (inode->num_extents || inode->ext_table_len || 
+                size > INODE_INLINE_SZ_B)
+                check_report(chk, "inode %lu: bad inline data", (lui)i);
+            else if (!check_iszero(inode_inline_data(fs, inode) + size, 
+                                   INODE_INLINE_SZ_B - size))
+                check_report(chk, "inode %lu: inline data past its end",
+                             (lui)i);
+            else
+                chk->sound[i] = 1;
+            continue;
+        }
+
+        // The extent table, if any, holds all of the (over INODE_EXTENTS)
+        // extents
+        if (inode->ext_table_len) {
+            if (inode->num_extents <= INODE_EXTENTS || 
+                inode->ext_table_blk > fs->num_memblocks ||
+                inode->ext_table_len > fs->num_memblocks - 
+                                       inode->ext_table_blk ||
+                inode->num_extents > inode->ext_table_len * 
+                                     EXTENTS_PER_BLK(fs)) {
+                check_report(chk, "inode %lu: bad extent table", (lui)i);
+                continue;
+            }
+            check_claim(chk, i, inode->ext_table_blk, inode->ext_table_len);
+        } else if (inode->num_extents > INODE_EXTENTS) {
+            check_report(chk, "inode %lu: %lu extents w/out a table", (lui)i,
+                         (lui)inode->num_extents);
+            continue;
+        }
+
+        // The extents are sorted, disjoint and within the memblocks
+        Extent *extents = inode_extents_get(fs, inode);
+        size_t file_blk = 0;
+        int sound = 1;
+        for (size_t j = 0; j < inode->num_extents && sound; j++) {
+            Extent *extent = &extents[j];
+            if (!extent->len || extent->file_blk < file_blk ||
+                extent->start_blk > fs->num_memblocks ||
+                extent->len > fs->num_memblocks - extent->start_blk) {
+                check_report(chk, "inode %lu: extent %lu is malformed",
+                             (lui)i, (lui)j);
+                sound = 0;
+                break;
+            }
+            check_claim(chk, i, extent->start_blk, extent->len);
+            file_blk = extent->file_blk + extent->len;
+        }
+        if (!sound)
+            continue;
+
+        // & map no data past its end, which a dir's has zeroed in its last
+        // block (a file's data isn't journaled, so a crash may leave bytes 
+        // there that its size was to cover)
+        if (file_blk > (size + blk_sz - 1) / blk_sz) {
+            check_report(chk, "inode %lu: maps blocks past its end", (lui)i);
+            continue;
+        }
+        char *last = size % blk_sz && inode->is_dir ? 
+                     inode_block_at(fs, inode, size / blk_sz) : NULL;
+        if (last && !check_iszero(last + size % blk_sz, 
+                                  blk_sz - size % blk_sz))
+            check_report(chk, "inode %lu: data past its end", (lui)i);
+        chk->sound[i] = 1;
+    }
+    __atomic_fetch_add(&chk->free_inodes, num_free, __ATOMIC_RELAXED);
+}
+
+// Sets *index to the index of the inode at the given offset (from fsptr) of
+// the given fs.
+// Returns: 1 on success, else 0 (no inode is there).
+static int check_inode_of(FSHandle *fs, size_t offset, size_t *index) {
+    size_t seg = offset_from_ptr(fs, fs->inode_seg);
+    if (offset >= seg && offset < seg + fs->base_inodes * ST_SZ_INODE) {
+        *index = (offset - seg) / ST_SZ_INODE;
+        return (offset - seg) % ST_SZ_INODE == 0;
+    }
+
+    for (size_t i = 0; i < fs->num_groups; i++) {
+        InodeGroup *group = &fs->groups[i];
+        size_t start = offset_from_ptr(fs, memblock_at(fs, group->start_blk));
+        if (offset >= start && 
+            offset < start + group->num_inodes * ST_SZ_INODE) {
+            *index = group->first_inode + (offset - start) / ST_SZ_INODE;
+            return (offset - start) % ST_SZ_INODE == 0;
+        }
+    }
+    return 0;
+}
+
+// Checks the given live record of the given dir (of header hdr, inode 
+// index) and refers to its inode (see check_dirs).
+// Returns: 1 if the record's inode is a dir, else 0.
+static int check_dir_entry(FSCheck *chk, Inode *dir, size_t index, 
+                           DirHeader *hdr, DirEntry *entry, size_t rec) {
+    FSHandle *fs = chk->fs;
+    size_t child = 0;
+
+    if (entry->name_len > NAME_MAXLEN || entry->name[entry->name_len] ||
+        strlen(entry->name) != entry->name_len) {
+        check_report(chk, "dir inode %lu: record %lu has a bad name",
+                     (lui)index, (lui)rec);
+        return 0;
+    }
+    if (entry->hash != str_hash(entry->name) ||
+        dir_entry_find(fs, dir, hdr, entry->name, NULL, NULL) != rec + 1)
+        check_report(chk, "dir inode %lu: '%s' is not indexed", 
+                     (lui)index, entry->name);
+
+    if (!check_inode_of(fs, entry->offset_inode, &child) || child == 0) {
+        check_report(chk, "dir inode %lu: '%s' refers to no inode",
+                     (lui)index, entry->name);
+        return 0;
+    }
+    if (!bitmap_get(fs->inode_bitmap, child)) {
+        check_report(chk, "dir inode %lu: '%s' refers to free inode %lu",
+                     (lui)index, entry->name, (lui)child);
+        return 0;
+    }
+    __atomic_fetch_add(&chk->refs[child], 1, __ATOMIC_RELAXED);
+    return inode_at(fs, child)->is_dir == 1;
+}
+
+// Pass checking the dirs among the inodes [first, end): that their headers,
+// hash indexes and records are sound, and that each record refers to an 
+// inode in use (counting the references, see check_refs), as many of which 
+// are dirs as the dir's subdir count.
+static void check_dirs(FSCheck *chk, size_t first, size_t end) {
+    FSHandle *fs = chk->fs;
+
+    for (size_t i = first; i < end; i++) {
+        Inode *dir = inode_at(fs, i);
+        size_t size = dir->file_size_b;
+        size_t subdirs = 0;
+        DirHeader hdr;
+
+        if (!chk->sound[i] || !dir->is_dir)
+            continue;
+
+        // An empty dir holds no data, else its data is a binary table
+        if (!dir_header_get(fs, dir, &hdr)) {
+            if (size) {
+                check_report(chk, "dir inode %lu: data is not a dir table", 
+                             (lui)i);
+                continue;
+            }
+        } else {
+            if (hdr.version != DIR_VERSION || !hdr.num_slots || 
+                (hdr.num_slots & (hdr.num_slots - 1)) || 
+                hdr.num_slots > size / sizeof(size_t) || 
+                hdr.num_records > size / ST_SZ_DIRENTRY ||
+                DIR_RECORD_OFFSET(&hdr, hdr.num_records) > size ||
+                hdr.num_entries > hdr.num_records) {
+                check_report(chk, "dir inode %lu: bad header", (lui)i);
+                continue;
+            }
+
+            size_t *slots = malloc(hdr.num_slots * sizeof(size_t));
+            DirEntry *entries = malloc(hdr.num_records * ST_SZ_DIRENTRY + 1);
+            if (!slots || !entries) {
+                free(slots);
+                free(entries);
+                check_report(chk, "dir inode %lu: out of memory", (lui)i);
+                continue;
+            }
+            dir_data_read(fs, dir, slots, hdr.num_slots * sizeof(size_t), 
+                          DIR_SLOT_OFFSET(0));
+            dir_data_read(fs, dir, entries, hdr.num_records * ST_SZ_DIRENTRY,
+                          DIR_RECORD_OFFSET(&hdr, 0));
+
+            // Each live record is indexed by 1 slot, & each slot used
+            // indexes a live record
+            size_t live = 0, indexed = 0, tombs = 0;
+            for (size_t j = 0; j < hdr.num_records; j++) {
+                if (!entries[j].name_len)
+                    continue;
+                live++;
+                subdirs += check_dir_entry(chk, dir, i, &hdr, &entries[j], j);
+            }
+            for (size_t j = 0; j < hdr.num_slots; j++) {
+                if (slots[j] == DIR_SLOT_TOMB)
+                    tombs++;
+                else if (slots[j] != DIR_SLOT_EMPTY && 
+                         (slots[j] > hdr.num_records ||
+                          !entries[slots[j] - 1].name_len))
+                    check_report(chk, "dir inode %lu: slot %lu indexes no "
+                                 "record", (lui)i, (lui)j);
+                else if (slots[j] != DIR_SLOT_EMPTY)
+                    indexed++;
+            }
+            if (live != hdr.num_entries || indexed != live || 
+                tombs != hdr.num_tombs)
+                check_report(chk, "dir inode %lu: %lu entries (%lu indexed, "
+                             "%lu tombs) vs header's %lu (%lu tombs)", (lui)i,
+                             (lui)live, (lui)indexed, (lui)tombs, 
+                             (lui)hdr.num_entries, (lui)hdr.num_tombs);
+            free(slots);
+            free(entries);
+        }
+
+        if (subdirs != dir->subdirs)
+            check_report(chk, "dir inode %lu: has %lu subdirs, but counts %lu", 
+                         (lui)i, (lui)subdirs, (lui)dir->subdirs);
+    }
+}
+
+// Pass checking that each used inode of [first, end) but the root dir is in
+// exactly one dir.
+static void check_refs(FSCheck *chk, size_t first, size_t end) {
+    FSHandle *fs = chk->fs;
+
+    for (size_t i = first ? first : 1; i < end; i++) {
+        if (!bitmap_get(fs->inode_bitmap, i))
+            continue;
+        if (!chk->refs[i])
+            check_report(chk, "inode %lu: in no dir", (lui)i);
+        else if (chk->refs[i] > 1)
+            check_report(chk, "inode %lu: in %lu dirs", (lui)i, 
+                         (lui)chk->refs[i]);
+    }
+}
+
+// Pass checking that each memblock of [first, end) not owned is free.
+static void check_blocks(FSCheck *chk, size_t first, size_t end) {
+    FSHandle *fs = chk->fs;
+    size_t num_free = 0;
+
+    for (size_t i = first; i < end; i++) {
+        if (memblock_isfree(fs, i))
+            num_free++;
+        else if (!bitmap_get(chk->owned, i))
+            check_report(chk, "memblock %lu: used, but owned by no inode", 
+                         (lui)i);
+    }
+    __atomic_fetch_add(&chk->free_memblocks, num_free, __ATOMIC_RELAXED);
+}
+
+// Pass checking the dedup index's slots [first, end): that each entry is of
+// a memblock indexed in the dedup bitmap. Hashes aren't checked, as a crash
+// may leave them stale.
+static void check_dedup(FSCheck *chk, size_t first, size_t end) {
+    FSHandle *fs = chk->fs;
+    DedupEntry *slots = dedup_slots_get(fs);
+    size_t num_used = 0, num_tombs = 0;
+
+    for (size_t i = first; i < end; i++) {
+        size_t blk = slots[i].blk;
+        if (blk == DEDUP_SLOT_EMPTY)
+            continue;
+        if (blk == DEDUP_SLOT_TOMB) {
+            num_tombs++;
+            continue;
+        }
+
+        num_used++;
+        if (blk > fs->num_memblocks || !dedup_isindexed(fs, blk - 1))
+            check_report(chk, "dedup slot %lu: memblock %lu is not indexed",
+                         (lui)i, (lui)(blk - 1));
+    }
+    __atomic_fetch_add(&chk->dedup_used, num_used, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&chk->dedup_tombs, num_tombs, __ATOMIC_RELAXED);
+}
+
+// Pass checking that each memblock of [first, end) shared or indexed for 
+// dedup is mapped by as many data blocks as it counts (so one if only 
+// indexed).
+static void check_shares(FSCheck *chk, size_t first, size_t end) {
+    FSHandle *fs = chk->fs;
+    uint32_t *refs = dedup_refs_get(fs);
+
+    for (size_t i = first; i < end; i++)
+        if (dedup_isshared(fs, i) && chk->shares[i] != refs[i] + 1)
+            check_report(chk, "memblock %lu: mapped by %lu data blocks, but "
+                         "counts %lu", (lui)i, (lui)chk->shares[i], 
+                         (lui)refs[i] + 1);
+}
+
+// Returns 1 iff the padding bits of the given bitmap of num_bits bits (those
+// past its last bit in its last word) are all set, else 0.
+static int check_padding(uint64_t *bitmap, size_t num_bits) {
+    for (size_t i = num_bits; i % BITMAP_WORD_BITS; i++)
+        if (!bitmap_get(bitmap, i))
+            return 0;
+    return 1;
+}
+
+// Checks the given (bound) fs in full on chk's threads: the inodes, dirs, 
+// references to inodes, memblock ownership and sharing, and the free counts.
+// Returns: 1 on success, else 0 (out of memory).
+static int check_full(FSCheck *chk, FSHandle *fs) {
+    chk->owned = calloc(BITMAP_SZ_B(fs->num_memblocks), 1);
+    chk->refs = calloc(fs->num_inodes, sizeof(uint32_t));
+    chk->sound = calloc(fs->num_inodes, 1);
+    if (fs->dedup_len)
+        chk->shares = calloc(fs->num_memblocks, sizeof(uint32_t));
+    if (!chk->owned || !chk->refs || !chk->sound || 
+        (fs->dedup_len && !chk->shares)) {
+        free(chk->owned);
+        free(chk->refs);
+        free(chk->sound);
+        free(chk->shares);
+        return 0;
+    }
+
+    // Inode groups & the dedup index own their runs (claimed 1st, so no 
+    // inode may own them)
+    for (size_t i = 0; i < fs->num_groups; i++)
+        for (size_t j = 0; j < fs->groups[i].len; j++)
+            bitmap_mark(chk->owned, fs->groups[i].start_blk + j, 1);
+    for (size_t j = 0; j < fs->dedup_len; j++)
+        bitmap_mark(chk->owned, fs->dedup_blk + j, 1);
+
+    Inode *root = fs_rootnode_get(fs);
+    if (!bitmap_get(fs->inode_bitmap, 0) || root->is_dir != 1)
+        check_report(chk, "root dir (inode 0) is missing");
+
+    check_pass(chk, fs->num_inodes, check_inodes);
+    check_pass(chk, fs->num_inodes, check_dirs);
+    check_pass(chk, fs->num_inodes, check_refs);
+
+    if (!check_padding(fs->inode_bitmap, fs->num_inodes))
+        check_report(chk, "inode bitmap's padding bits are clear");
+    if (chk->free_inodes != fs->free_inodes)
+        check_report(chk, "%lu inodes are free, but the handle counts %lu", 
+                     (lui)chk->free_inodes, (lui)fs->free_inodes);
+
+    // Each memblock shared counts the data blocks sharing it, and each 
+    // memblock indexed has an entry in the dedup index
+    if (fs->dedup_len) {
+        size_t num_indexed = 0;
+        check_pass(chk, fs->num_memblocks, check_shares);
+        check_pass(chk, fs->dedup_slots, check_dedup);
+        for (size_t i = 0; i < fs->num_memblocks; i++)
+            num_indexed += dedup_isindexed(fs, i);
+        if (chk->dedup_used != fs->dedup_used || 
+            chk->dedup_tombs != fs->dedup_tombs)
+            check_report(chk, "dedup index holds %lu entries & %lu tombs, "
+                         "but the handle counts %lu & %lu", 
+                         (lui)chk->dedup_used, (lui)chk->dedup_tombs, 
+                         (lui)fs->dedup_used, (lui)fs->dedup_tombs);
+        else if (num_indexed != chk->dedup_used)
+            check_report(chk, "%lu memblocks are indexed for dedup, but %lu "
+                         "have entries", (lui)num_indexed, 
+                         (lui)chk->dedup_used);
+    }
+
+    // W/ the memblock bitmap flagged for a rebuild, it's derived on mount
+    if (fs->bitmap_valid) {
+        check_pass(chk, fs->num_memblocks, check_blocks);
+        if (!check_padding(fs->blk_bitmap, fs->num_memblocks))
+            check_report(chk, "memblock bitmap's padding bits are clear");
+        if (chk->free_memblocks != fs->free_memblocks)
+            check_report(chk, "%lu memblocks are free, but the handle counts %lu", 
+                         (lui)chk->free_memblocks, (lui)fs->free_memblocks);
+    }
+
+    free(chk->owned);
+    free(chk->refs);
+    free(chk->sound);
+    free(chk->shares);
+    return 1;
+}
+
+
+/* End Check helpers ------------------------------------------------------ */
+/* Begin emulation functins ----------------------------------------------- */
+
+/* -- __myfs_format_implem -- */
+/* Formats the filesystem of size fssize pointed to by fsptr w/ memblocks of
+   block_sz bytes and inode_ratio memblocks per inode, unless it is already 
+   formatted (in which case its image is left as is, as both are fixed at 
+   format time and recorded in the fs). A block_sz or inode_ratio of 0 
+   denotes the default (FS_BLOCK_SZ_KB and BLOCKS_TO_INODES, respectively),
+   which is also what the other calls format an unformatted fs with.
+
+   block_sz must be a power of 2 from FS_BLOCK_SZ_MIN_B to FS_BLOCK_SZ_MAX_B,
+   and inode_ratio from 1 to INODE_RATIO_MAX.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately (EINVAL for
+   an unsupported block_sz or inode_ratio, EFAULT if fssize is too small).
+
+*/
+int __myfs_format_implem(void *fsptr, size_t fssize, int *errnoptr,
+                         size_t block_sz, size_t inode_ratio) {
+    FSHandle *fs = (FSHandle*)fsptr;
+
+    if (!block_sz)
+        block_sz = FS_BLOCK_SZ_KB * BYTES_IN_KB;
+    if (!inode_ratio)
+        inode_ratio = BLOCKS_TO_INODES;
+
+    if (!fs_format_isvalid(block_sz, inode_ratio)) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
+
+    // If already formatted, just validate it (sets errnoptr = EFAULT on fail)
+    if (fssize >= MIN_FS_SZ_B(FS_BLOCK_SZ_MIN_B) && fs->magic == MAGIC_NUM)
+        return fs_handle(fsptr, fssize, errnoptr) ? 0 : -1;
+
+    if (!fs_format(fsptr, fssize, block_sz, inode_ratio)) {
+        *errnoptr = EFAULT;
+        return -1;
+    }
+    return 0;
+}
+
+/* -- __myfs_mount_implem -- */
+/* Prepares the filesystem of size fssize pointed to by fsptr for use by the
+   calling process, formatting it first if needed, and sets up the mount's 
+   in-memory state (ex: the dentry cache & journal txn).
+
+   If the fs was not unmounted cleanly, its journal is replayed first, so its
+   metadata reflects exactly the ops committed before (see 
+   __myfs_fsync_implem). Replay takes time bounded by the journal's size.
+
+   The fs layout is computed here only when formatting; later calls just 
+   validate it. The in-memory state belongs to the calling process, so a 
+   process that forks after mounting should call this again in the child 
+   (which then gets its own state). The other calls also work unmounted, only
+   uncached. The state is released by __myfs_unmount_implem.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+*/
+int __myfs_mount_implem(void *fsptr, size_t fssize, int *errnoptr) {
+    FSHandle *fs;       // Handle to the file system
+    FSRuntime *rt;      // The mount's in-memory state
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1;
+
+    // If already mounted by this process, keep the existing state
+    if (fs_runtime(fs))
+        return 0;
+
+    // Replay the journal (which may restore the handle, so rebind it)
+    if (!journal_replay(fs)) {
+        *errnoptr = ENOMEM;
+        return -1;
+    }
+    fs_segs_bind(fs, fsptr);
+
+    if (!(rt = calloc(1, sizeof(FSRuntime)))) {
+        *errnoptr = ENOMEM;
+        return -1;
+    }
+    if (!(rt->dirty = calloc(DIRTY_SLOTS, sizeof(DirtyFile))) ||
+        !journal_runtime_init(fs, rt)) {
+        free(rt->dirty);
+        free(rt);
+        *errnoptr = ENOMEM;
+        return -1;
+    }
+    if (pthread_mutex_init(&rt->jrnl_lock, NULL) != 0) {
+        free(rt->txn_lines);
+        free(rt->dirty);
+        free(rt);
+        *errnoptr = ENOMEM;
+        return -1;
+    }
+    rt->path_gen = 1;
+    rt->child_gen = 1;
+    rt->atime_mode = ATIME_RELATIME;
+
+    if (!fs_mount_set(fs, rt)) {
+        pthread_mutex_destroy(&rt->jrnl_lock);
+        free(rt->txn_lines);
+        free(rt->txn_runs);
+        free(rt->dirty);
+        free(rt);
+        *errnoptr = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+/* -- __myfs_unmount_implem -- */
+/* Releases the in-memory state set up by __myfs_mount_implem for the 
+   filesystem of size fssize pointed to by fsptr, after committing the 
+   running journal txn and emptying the journal (so the next mount has 
+   nothing to replay). Does nothing if the calling process did not set up 
+   any.
+
+*/
+void __myfs_unmount_implem(void *fsptr, size_t fssize) {
+    FSHandle *fs;       // Handle to the file system
+    FSRuntime *rt;      // The mount's in-memory state
+
+    if (!(fs = fs_handle(fsptr, fssize, NULL)) || !(rt = fs_runtime(fs)))
+        return;
+
+    journal_commit(fs);
+    if (fs->journal_sz_b)
+        journal_checkpoint(fs, rt);
+
+    fs_mount_set(fs, NULL);
+    pthread_mutex_destroy(&rt->jrnl_lock);
+    free(rt->txn_lines);
+    free(rt->txn_runs);
+    free(rt->dirty);
+    free(rt);
+}
+
+/* -- __myfs_atime_implem -- */
+/* Sets how the calling process's mount of the filesystem of size fssize
+   pointed to by fsptr updates access times on reads of a file's data and
+   listings of a dir: mode 0 (strict) updates it on every one, 1 (relatime,
+   the default) only if it is not after the last modified time or is a day
+   old, and 2 (noatime) never does, so reads change nothing in the fs.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set to EINVAL (unknown mode),
+   ENXIO (the fs was not mounted by the calling process) or EFAULT.
+
+*/
+int __myfs_atime_implem(void *fsptr, size_t fssize, int *errnoptr, int mode) {
+    FSHandle *fs;       // Handle to the file system
+    FSRuntime *rt;      // The mount's in-memory state
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1;
+
+    if (mode != ATIME_STRICT && mode != ATIME_RELATIME && mode != ATIME_NONE) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
+    if (!(rt = fs_runtime(fs))) {
+        *errnoptr = ENXIO;
+        return -1;
+    }
+    rt->atime_mode = mode;
+    return 0;
+}
+
+/* -- __myfs_dedup_implem -- */
+/* Sets whether the calling process's mount of the filesystem of size fssize
+   pointed to by fsptr deduplicates file data (it's off by default). If on,
+   each (memory block sized & aligned) data block a write fills in full is
+   hashed and looked up in the fs's dedup index: if an indexed block holds
+   the same bytes, the data block is remapped to share it (releasing its 
+   own), else its own is indexed. Shared blocks are counted by the index,
+   copied when written (or truncated into), and released once no data block
+   maps them. Dirs' data is never deduplicated.
+
+   Turning it on for the 1st time sets up the index (unless a snapshot did),
+   w/ a slot per memory block (rounded up to a power of 2, so about 0.5% of
+   the fs w/ 4kB blocks) in a run of them. The index stays in the fs, so its
+   blocks are still shared (but no more are) when mounted w/ dedup off. 
+   Blocks are no longer indexed once DEDUP_LOAD_PCT percent of its slots are
+   in use (ex: after growing the fs).
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set to ENXIO (the fs was not
+   mounted by the calling process), ENOSPC (no room for the index), EIO 
+   (the index could not be committed) or EFAULT.
+
+*/
+int __myfs_dedup_implem(void *fsptr, size_t fssize, int *errnoptr, int on) {
+    FSHandle *fs;       // Handle to the file system
+    FSRuntime *rt;      // The mount's in-memory state
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1;
+
+    if (!(rt = fs_runtime(fs))) {
+        *errnoptr = ENXIO;
+        return -1;
+    }
+    if (on && !fs->dedup_len) {
+        if ((!(fs = fs_txn_handle(fsptr, fssize, errnoptr)))) return -1;
+        if (!dedup_create(fs)) {
+            *errnoptr = ENOSPC;
+            return -1;
+        }
+        if (journal_commit(fs) != 0) {
+            *errnoptr = EIO;
+            return -1;
+        }
+    }
+    rt->dedup = !!on;
+    return 0;
+}
+
+/* -- __myfs_snapshot_implem -- */
+/* Takes a snapshot named name of the filesystem of size fssize pointed to 
+   by fsptr: a frozen (i.e. read-only) copy of the tree under the root dir, 
+   as it is now, at /.snapshots/name. The dir holding the snapshots is made 
+   on the 1st one (and removed w/ the last one), and is left out of them.
+
+   Only metadata is copied: each dir's and file's inode is cloned and the 
+   dirs' tables rebuilt, while the clones of files map the same memory 
+   blocks as the files, which are counted as shared in the dedup index (set
+   up on the 1st snapshot, or once dedup is turned on, see 
+   __myfs_dedup_implem). A shared block is copied on the next write to it,
+   so a snapshot takes about as long as listing the tree, and blocks only 
+   as its data changes. The snapshot is committed to the journal before this
+   returns, so it survives a crash.
+
+   Frozen items can be read and listed, but any call that would change one 
+   (or the snapshots dir) fails w/ EROFS, and reads leave their access 
+   times as they were. A snapshot is deleted w/ 
+   __myfs_snapshot_delete_implem.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set to EINVAL (name is not a
+   valid file name), EEXIST (there is a snapshot of that name, or /.snapshots
+   is not the snapshots dir), ENOSPC (out of inodes or memory blocks for it,
+   in which case none was taken), EIO (it could not be committed) or EFAULT.
+
+*/
+int __myfs_snapshot_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           const char *name) {
+    FSHandle *fs;       // Handle to the file system
+    char snap_name[NAME_MAXLEN + 1];
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_txn_handle(fsptr, fssize, errnoptr)))) return -1;
+
+    if (str_len((char*)name) > NAME_MAXLEN || 
+        !inode_name_isvalid(strcpy(snap_name, name))) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
+
+    // Get the snapshots dir, making it if need be
+    Inode *root = fs_rootnode_get(fs);
+    Inode *snaps = dir_subitem_get(fs, root, SNAPSHOT_DIR);
+    if ((snaps && !inode_isfrozen(snaps)) || 
+        (snaps && dir_subitem_get(fs, snaps, snap_name))) {
+        *errnoptr = EEXIST;
+        return -1;
+    }
+    if (!snaps && (snaps = dir_new(fs, root, SNAPSHOT_DIR))) {
+        journal_log(fs, snaps, ST_SZ_INODE);
+        snaps->flags |= INODE_FROZEN;
+    }
+
+    // Clone the tree into the snapshot, removing what was cloned on fail
+    Inode *snap = snaps && dedup_create(fs) ? inode_nextfree(fs) : NULL;
+    if (snap && snapshot_inode_clone(fs, root, snap) && 
+        snapshot_tree_clone(fs, root, snap, SNAPSHOT_DIR) && 
+        dir_entry_add(fs, snaps, snap_name, snap)) {
+        journal_log(fs, snaps, ST_SZ_INODE);
+        snaps->subdirs++;
+    } else {
+        if (snap)
+            snapshot_inode_remove(fs, snap);
+        if (snaps && dir_isempty(fs, snaps))
+            child_remove(fs, SNAPSHOT_PATH);
+        *errnoptr = ENOSPC;
+        return -1;
+    }
+
+    if (journal_commit(fs) != 0) {
+        *errnoptr = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/* -- __myfs_snapshot_delete_implem -- */
+/* Deletes the snapshot named name (see __myfs_snapshot_implem) of the 
+   filesystem of size fssize pointed to by fsptr, along w/ the snapshots dir
+   if it was the last one. Memory blocks its files shared are released once 
+   no other file maps them.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set to ENOENT (there is no 
+   snapshot of that name) or EFAULT.
+
+*/
+int __myfs_snapshot_delete_implem(void *fsptr, size_t fssize, int *errnoptr,
+                                  const char *name) {
+    FSHandle *fs;       // Handle to the file system
+    char snap_name[NAME_MAXLEN + 1];
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_txn_handle(fsptr, fssize, errnoptr)))) return -1;
+
+    Inode *snaps = dir_subitem_get(fs, fs_rootnode_get(fs), SNAPSHOT_DIR);
+    Inode *snap = NULL;
+    if (snaps && inode_isfrozen(snaps) && str_len((char*)name) <= NAME_MAXLEN)
+        snap = dir_subitem_get(fs, snaps, strcpy(snap_name, name));
+    if (!snap || !dir_entry_remove(fs, snaps, snap_name)) {
+        *errnoptr = ENOENT;
+        return -1;
+    }
+
+    journal_log(fs, snaps, ST_SZ_INODE);
+    snaps->subdirs--;
+    dcache_flush(fs);                   // Drop lookups of all under it
+    snapshot_inode_remove(fs, snap);
+    if (dir_isempty(fs, snaps))
+        child_remove(fs, SNAPSHOT_PATH);
+    return 0;
+}
+
+/* -- __myfs_import_implem -- */
+/* Imports num items (dirs and files) into the dir at path of the filesystem
+   of size fssize pointed to by fsptr, in bulk, as an offline tool populating
+   an image would (ex: from a tree or archive of files).
+
+   Item i is named names[i], and is in the dir that is item parents[i] (which
+   must come before it), or in the dir at path if parents[i] is SIZE_MAX. 
+   stats[i] gives its type (S_ISDIR or S_ISREG of st_mode), a file's size 
+   (st_size) and its times (st_atim and st_mtim). Each file's data is filled 
+   in by fill(arg, i, dst, len, offset), which must copy the len bytes at 
+   offset of item i's data to dst, returning the num bytes it did. 
+
+   An item w/ an invalid name, or whose name an earlier item in its dir has
+   (or the dir at path already holds), is left out, along w/ all those under
+   it, and reported on stdout.
+
+   Rather than creating each item as by its own calls, inodes are claimed 
+   in one sweep, each file's data blocks are allocated at once (in a single
+   run, in a fresh fs), and each dir's table is written in one go, w/ the
+   items linked into the dir at path last. Then the files' data is filled in
+   in place, on up to threads threads (the calling one included), each 
+   taking a chunk of up to IMPORT_CHUNK_SZ_B bytes of a file's data at a 
+   time, so fill is called concurrently (for distinct ranges). These blocks
+   are not noted for __myfs_ffsync_implem: the caller should flush them 
+   (ex: msync the whole fs). Nothing else may use the fs meanwhile.
+
+   The import is committed to the journal before returning. If the calling 
+   process has not mounted the fs, it is mounted (replaying its journal) for
+   the import, and unmounted after.
+
+   On success, the num items left out is returned.
+
+   On failure, none of the items are imported, -1 is returned and *errnoptr
+   is set to ENOENT, ENOTDIR or EROFS (path denotes no dir, or a frozen one),
+   EINVAL (an item's dir or type is invalid), ENOSPC (out of inodes or 
+   memory blocks for them), EIO (fill failed, or the import could not be 
+   committed), ENOMEM or EFAULT.
+
+*/
+int __myfs_import_implem(void *fsptr, size_t fssize, int *errnoptr,
+                         const char *path, size_t num, const char **names,
+                         const size_t *parents, const struct stat *stats,
+                         size_t (*fill)(void *, size_t, char *, size_t, 
+                                        off_t),
+                         void *arg, int threads) {
+    FSHandle *fs;       // Handle to the file system
+    Inode *dir;         // Inode of the dir imported into
+    FSImport imp;       // The import's state
+    int mounted;        // 1 iff mounted by the caller
+    long result = -1;
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1;
+
+    mounted = fs_runtime(fs) != NULL;
+    if (!mounted && __myfs_mount_implem(fsptr, fssize, errnoptr) != 0)
+        return -1;
+
+    memset(&imp, 0, sizeof(imp));
+    imp.num = num;
+    imp.names = names;
+    imp.parents = parents;
+    imp.stats = stats;
+    imp.fill = fill;
+    imp.arg = arg;
+    imp.left = calloc(num ? num : 1, sizeof(uint8_t));
+    imp.inodes = calloc(num ? num : 1, sizeof(Inode*));
+    ImportKey *keys = malloc((num ? num : 1) * sizeof(ImportKey));
+
+    if (!imp.left || !imp.inodes || !keys) {
+        *errnoptr = ENOMEM;
+    } else if ((imp.fs = fs_txn_handle(fsptr, fssize, errnoptr)) &&
+               (dir = fs_pathresolve(imp.fs, path, errnoptr))) {
+        if (!dir->is_dir || inode_isfrozen(dir)) {
+            *errnoptr = dir->is_dir ? EROFS : ENOTDIR;
+        } else if (pthread_mutex_init(&imp.lock, NULL) != 0) {
+            *errnoptr = ENOMEM;
+        } else {
+            result = import_run(&imp, dir, keys, threads, errnoptr);
+            pthread_mutex_destroy(&imp.lock);
+        }
+        if (result >= 0 && journal_commit(imp.fs) != 0) {
+            *errnoptr = EIO;
+            result = -1;
+        }
+    }
+
+    free(keys);
+    free(imp.inodes);
+    free(imp.left);
+    if (!mounted)
+        __myfs_unmount_implem(fsptr, fssize);
+    return result > INT_MAX ? INT_MAX : (int)result;
+}
+
+/* -- __myfs_grow_implem -- */
+/* Grows the filesystem held in the memory of size fssize pointed to by 
+   fsptr to fill all of it, if it was smaller (ex: its backup-file was 
+   extended and mapped further). Memory blocks are appended, along w/ inodes
+   (keeping the fs's inode ratio), w/out moving any existing data, so it 
+   takes time in proportion to the growth, not to the fs. A fs may grow to 
+   up to FS_GROW_MAX times the num memory blocks it was formatted w/; until
+   grown, a fs in larger memory leaves the rest of it unused.
+   
+   The growth is committed to the journal before returning. If the calling
+   process has not mounted the fs, it is mounted (replaying its journal) 
+   for the growth, and unmounted after; an fs that already fills the memory
+   (w/ nothing to replay) is left untouched, not mounted.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set to EINVAL (fsptr holds no
+   filesystem), EFBIG (the fs cannot grow that far, so is left as is), EIO 
+   (the growth could not be committed) or EFAULT.
+
+*/
+int __myfs_grow_implem(void *fsptr, size_t fssize, int *errnoptr) {
+    FSHandle *fs = (FSHandle*)fsptr;    // Handle to the file system
+    int mounted;                        // 1 iff mounted by the caller
+    int result = 0;
+
+    // Check the fs 1st, as binding a handle would format unformatted memory
+    if (fssize < MIN_FS_SZ_B(FS_BLOCK_SZ_MIN_B) || fs->magic != MAGIC_NUM) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
+
+    // Leave an fs already filling the memory as is, unless mounting it would
+    // change its size (ex: replaying a crashed growth)
+    mounted = fs_runtime(fs) != NULL;
+    if (!mounted && fs->version == FS_VERSION && 
+        fs->size_b + FS_START_OFFSET >= fssize && journal_isempty(fs))
+        return 0;
+    if (!mounted && __myfs_mount_implem(fsptr, fssize, errnoptr) != 0)
+        return -1;
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_txn_handle(fsptr, fssize, errnoptr)))) return -1;
+
+    if (fs->size_b + FS_START_OFFSET < fssize) {
+        if (!fs_grow(fs, fssize)) {
+            *errnoptr = EFBIG;
+            result = -1;
+        } else if (journal_commit(fs) != 0) {
+            *errnoptr = EIO;
+            result = -1;
+        }
+    }
+
+    if (!mounted)
+        __myfs_unmount_implem(fsptr, fssize);
+    return result;
+}
+
+/* -- __myfs_layout_implem -- */
+/* Gets the layout of the filesystem of size fssize pointed to by fsptr, as
+   the caller may advise the kernel of how each part of the memory is used:
+   *meta_sz is set to the num bytes from fsptr to its memory blocks segment,
+   i.e. those holding all of the fs's metadata (the handle, journal, bitmaps,
+   inodes and their inline extents and data). The rest holds dirs' and 
+   files' data blocks and extent tables.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set to EFAULT.
+
+*/
+int __myfs_layout_implem(void *fsptr, size_t fssize, int *errnoptr,
+                         size_t *meta_sz) {
+    FSHandle *fs;       // Handle to the file system
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1;
+
+    *meta_sz = (size_t)(fs->mem_seg - (char*)fsptr);
+    return 0;
+}
+
+/* -- __myfs_check_implem -- */
+/* Checks the consistency of the filesystem of size fssize pointed to by 
+   fsptr, reporting each problem found on stdout (up to CHECK_REPORT_MAX of
+   them, counting the rest).
+
+   A fast check (full = 0) looks only at the fs's handle - its layout 
+   version, geometry, inode groups and counters - and at its journal, 
+   reporting what mounting would replay or undo from it. It takes time 
+   bounded by the journal's size, not the fs's.
+
+   A full check then replays the journal, as mounting would (unless the 
+   calling process has mounted the fs, so it's done), and checks every 
+   inode's inline data or extents and extent table, every dir's header, 
+   hash index and records, that each inode in use is in exactly one dir, 
+   that each memblock is owned at most once (or, if shared by dedup or a
+   snapshot, by as many data blocks as it counts) and is used iff owned, and
+   the free counts. It runs on up to threads threads (the calling one 
+   included), each checking a range of the inodes (or memblocks) in turn, 
+   which reconcile memblock ownership through an atomic bitmap. The fs must
+   not change during the check; to leave an image as is, check a private 
+   copy of it (ex: mapped MAP_PRIVATE).
+
+   On success, the num problems found is returned (0 iff the fs is sound).
+
+   On failure, -1 is returned and *errnoptr is set to EINVAL (fsptr holds no
+   filesystem) or ENOMEM.
+
+*/
+int __myfs_check_implem(void *fsptr, size_t fssize, int *errnoptr, int full,
+                        int threads) {
+    FSHandle *fs = (FSHandle*)fsptr;    // Handle to the file system
+    FSCheck chk;                        // The check's state
+
+    if (fssize < MIN_FS_SZ_B(FS_BLOCK_SZ_MIN_B) || fs->magic != MAGIC_NUM) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
+
+    memset(&chk, 0, sizeof(chk));
+    chk.fs = fs;
+    chk.num_threads = threads < 1 ? 1 : 
+                      threads > CHECK_THREADS_MAX ? CHECK_THREADS_MAX : 
+                      (size_t)threads;
+
+    if (!check_handle(&chk, fs, fssize))
+        return (int)chk.problems;
+    check_journal(&chk, fs);
+    if (!full || chk.problems)
+        return (int)chk.problems;
+
+    // Check the fs as mounting leaves it, which may restore the handle
+    if (!fs_runtime(fs)) {
+        if (!journal_replay(fs)) {
+            *errnoptr = ENOMEM;
+            return -1;
+        }
+        if (!check_handle(&chk, fs, fssize))
+            return (int)chk.problems;
+    }
+    fs_segs_bind(fs, fsptr);
+
+    if (!check_full(&chk, fs)) {
+        *errnoptr = ENOMEM;
+        return -1;
+    }
+    return chk.problems > INT_MAX ? INT_MAX : (int)chk.problems;
+}
+
+/* -- __myfs_fsync_implem -- */
+/* Makes the changes to the metadata of the filesystem of size fssize pointed
+   to by fsptr so far durable: commits the running journal txn (if any) and
+   flushes the journal to the file backing the fs's mapping (if any). Only 
+   the journal is flushed - file data, written in place, is not journaled.
+
+   Ops are otherwise committed in groups, i.e. a txn is committed as another
+   op starts once it has JOURNAL_GROUP_OPS ops or is JOURNAL_GROUP_MS old.
+   Unlike the other calls that change the fs, this one may run concurrently
+   w/ those that only look at it. To also flush a file's data, see 
+   __myfs_ffsync_implem.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately (EIO if the
+   journal could not be flushed).
+
+*/
+int __myfs_fsync_implem(void *fsptr, size_t fssize, int *errnoptr) {
+    FSHandle *fs;       // Handle to the file system
+    FSRuntime *rt;      // The mount's in-memory state
+    int result;
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+
+    // If not mounted, nothing is journaled
+    if (!(rt = fs_runtime(fs)))
+        return 0;
+
+    pthread_mutex_lock(&rt->jrnl_lock);
+    result = journal_commit(fs);
+    pthread_mutex_unlock(&rt->jrnl_lock);
+
+    if (result != 0) {
+        *errnoptr = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/* -- __myfs_ffsync_implem -- */
+/* Implements an emulation of the fsync (or, if datasync, the fdatasync) 
+   system call on the filesystem of size fssize pointed to by fsptr, for the
+   file denoted by the handle fh (as set by __myfs_open_implem or 
+   __myfs_create_implem).
+
+   Only the pages of the fs's mapping written for the file since its last 
+   fsync are flushed to the file backing the mapping (if any), followed by 
+   the journal if the running txn holds changes to the file's metadata (see 
+   __myfs_fsync_implem). If datasync, a txn changing only the file's times 
+   is left running. The other files' data is left to be flushed by their own
+   fsync (or the kernel), unless too many files were changed since theirs 
+   for the mount to track (DIRTY_SLOTS / 2), in which case all file data is 
+   flushed. A fs w/out a journal (or not mounted) is flushed as a whole.
+
+   May run concurrently w/ the calls that only look at the fs.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately (EBADF or 
+   ESTALE for a bad fh, EIO if the flush failed).
+
+*/
+int __myfs_ffsync_implem(void *fsptr, size_t fssize, int *errnoptr,
+                         uint64_t fh, int datasync) {
+    FSHandle *fs;       // Handle to the file system
+    FSRuntime *rt;      // The mount's in-memory state
+    Inode *inode;       // Inode for the given handle
+    int result;
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+
+    // Get inode for the handle (sets erronoptr and returns -1 on fail)
+    if ((!(inode = fs_fhresolve(fs, fh, errnoptr)))) return -1;
+
+    if (!(rt = fs_runtime(fs)) || !fs->journal_sz_b) {
+        result = mem_msync(fs, fs->size_b + FS_START_OFFSET);
+    } else {
+        pthread_mutex_lock(&rt->jrnl_lock);
+        result = dirty_flush(fs, rt, inode, datasync);
+        pthread_mutex_unlock(&rt->jrnl_lock);
+    }
+
+    if (result != 0) {
+        *errnoptr = EIO;
+        return -1;
+    }
+    return 0;
+}
 
 /* -- __myfs_getattr_implem -- */
 /* Implements the "stat" system call on the filesystem 
@@ -918,23 +5794,7 @@ int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr,
     // Get inode for the path (sets erronoptr = ENOENT and returns -1 on fail)
     if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) return -1;
 
-    //Reset the memory of the results container
-    memset(stbuf, 0, sizeof(struct stat));
-
-    //Populate stdbuf with the atrributes of the inode
-    stbuf->st_uid = uid;
-    stbuf->st_gid = gid;
-    stbuf->st_atim = *(struct timespec*)(&inode->last_acc); 
-    stbuf->st_mtim = *(struct timespec*)(&inode->last_mod);    
-    
-    if (inode->is_dir) {
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = *(int*)(&inode->subdirs) + 2;  // "+ 2" for . and .. 
-    } else {
-        stbuf->st_mode = S_IFREG | 0755;
-        stbuf->st_nlink = 1;
-        stbuf->st_size = *(int*)(&inode->file_size_b);
-    } 
+    inode_stat_get(fs, inode, uid, gid, stbuf);
 
     return 0;  // Success  
 }
@@ -993,55 +5853,116 @@ int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
         return -1;
     }
 
-    // Get the directory's lookup table and add an extra end char to help parse
-    char *data = malloc(*(int*)(&inode->file_size_b) + 1);
-    size_t data_sz = inode_data_get(fs, inode, data);
-    memcpy(data + data_sz + 1, FS_DIRDATA_END, 1);
-
-    // Denote count and build content string from lookup table data
-    char *token, *name, *next;
-    size_t names_count = 0;
-    size_t names_len = 0;
+    // Get the directory's records (from either table format)
+    DirEntry *entries;
+    size_t names_count = dir_entries_get(fs, inode, &entries);
+    inode_acctime_set(fs, inode);
 
-    char *names = malloc(0);
-    next = name = data;
-    while ((token = strsep(&next, FS_DIRDATA_END))) {
-        if (!next || *token <= 64 || !inode_name_charvalid(*token)) break;
+    if (!names_count) {
+        free(entries);
+        return 0;   // Empty dir - no names are output
+    }
 
-        name = token;                               // Extract file/dir name
-        name = strsep(&name, FS_DIRDATA_SEP);
-        int nlen = strlen(name) + 1;                // +1 for null term
-        names_len += nlen;            
+    // Copy each record's name into namesptr
+    *namesptr = calloc(names_count, sizeof(char*));
 
-        // Append the file/dir name
-        names = realloc(names, names_len);  
-        memcpy(names + names_len - nlen, name, nlen - 1);
-        memset(names + names_len - 1, '\0', 1);
-        names_count++;
+    if (!*namesptr) {
+        *errnoptr = EINVAL;
+        free(entries);
+        return -1;
     }
+    for (size_t i = 0; i < names_count; i++)
+        (*namesptr)[i] = strdup(entries[i].name);
+    
+    free(entries);
 
-    // Copy the items into namesptr (should combine with above, otherwise O(n^2)
-    *namesptr = calloc(names_count, 1);
+    return names_count;
+}
 
-    if (!namesptr) {
-        *errnoptr = EFAULT;
+// State of a walk of a dir by __myfs_readdir_cursor_implem
+typedef struct ReaddirWalk {
+    FSHandle *fs;                           // The fs
+    uid_t uid;                              // Owner to report
+    gid_t gid;                              // Group to report
+    int want_attrs;                         // Whether to report attributes
+    int (*fill)(void *, const char *, const struct stat *, off_t);
+    void *arg;                              // Arg for fill
+} ReaddirWalk;
+
+// DirWalkFn for __myfs_readdir_cursor_implem, handing each entry to fill.
+static int readdir_walk_call(void *arg, DirEntry *entry, size_t next) {
+    ReaddirWalk *walk = (ReaddirWalk*)arg;
+    struct stat st;
+
+    if (walk->want_attrs)
+        inode_stat_get(walk->fs, 
+                       (Inode*)ptr_from_offset(walk->fs, 
+                                               (size_t*)entry->offset_inode),
+                       walk->uid, walk->gid, &st);
+    return walk->fill(walk->arg, entry->name, walk->want_attrs ? &st : NULL,
+                      (off_t)next);
+}
+
+/* -- __myfs_readdir_cursor_implem -- */
+/* Lists the dir at path like __myfs_readdir_implem, but streams its names
+   to fill rather than allocating an array of them, and may be resumed.
+
+   fill(arg, name, stbuf, next) is called for each name (. and .. excluded),
+   in order, until it returns nonzero (ex: once the caller's buffer is full)
+   or the dir's names run out. next is the cursor to pass to resume the 
+   listing after that name; cursor 0 starts it. If want_attrs, stbuf holds
+   the name's attributes as by __myfs_getattr_implem (w/ the given owner),
+   so a listing may give them w/out a getattr per name; else it's NULL.
+
+   An entry that is in the dir for the duration of a listing (i.e. across
+   its resumed calls) is given exactly once. One added or removed meanwhile
+   may or may not be given.
+
+   Allocates nothing.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately (as for
+   __myfs_readdir_implem, or EINVAL for a negative cursor).
+
+*/
+int __myfs_readdir_cursor_implem(void *fsptr, size_t fssize, int *errnoptr,
+                                 uid_t uid, gid_t gid, const char *path,
+                                 off_t cursor, int want_attrs,
+                                 int (*fill)(void *, const char *, 
+                                             const struct stat *, off_t),
+                                 void *arg) {
+    FSHandle *fs;       // Handle to the file system
+    Inode *inode;       // Inode for the given path
+    ReaddirWalk walk;   // Walk state
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+
+    // Get inode for the path (sets erronoptr = ENOENT and returns -1 on fail)
+    if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) return -1;
+
+    // Ensure path denotes a dir
+    if (!inode->is_dir) {
+        *errnoptr = ENOTDIR;
+        return -1;
     }
-    else {
-        char **curr = *namesptr;  // To keep namesptr static as we iterate
-        next = names;
-        for (int i = 0; i < names_count; i++)
-        {
-            int len = str_len(next);
-            *curr = realloc(*curr, len + 1);
-            strcpy(*curr, next);
-            next += len+1;
-            *curr++;
-        }
+    if (cursor < 0) {
+        *errnoptr = EINVAL;
+        return -1;
     }
-    
-    free(data);
 
-    return names_count;
+    walk.fs = fs;
+    walk.uid = uid;
+    walk.gid = gid;
+    walk.want_attrs = want_attrs;
+    walk.fill = fill;
+    walk.arg = arg;
+
+    dir_walk(fs, inode, (size_t)cursor, readdir_walk_call, &walk);
+    inode_acctime_set(fs, inode);
+
+    return 0;
 }
 
 /* -- __myfs_mknod_implem -- */
@@ -1067,30 +5988,36 @@ int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr,
     FSHandle *fs;       // Handle to the file system
 
     // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
-    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+    if ((!(fs = fs_txn_handle(fsptr, fssize, errnoptr)))) return -1; 
 
-    // Ensure file does not already exist
+    // Ensure file does not already exist, and may be made
     if (fs_pathresolve(fs, path, errnoptr)) {
         *errnoptr = EEXIST;
         return -1;
     }
+    if (path_parent_isfrozen(fs, path)) {
+        *errnoptr = EROFS;
+        return -1;
+    }
 
     // Split the given path into seperate path and filename elements
     char *abspath, *fname, *start, *token, *next;
     
     start = next = strdup(path);    // Duplicate path so we can manipulate it
     next++;                         // Skip initial seperator
-    abspath = malloc(1);            // Init abs path array
+    abspath = malloc(2);            // Init abs path array
     *abspath = '\0';
+    fname = NULL;
 
-    while ((token = strsep(&next, FS_PATH_SEP)))
+    while ((token = strsep(&next, FS_PATH_SEP))) {
         if (!next) {
             fname = token;
         } else {
-            abspath = realloc(abspath, str_len(abspath) + str_len(token) + 1);
+            abspath = realloc(abspath, str_len(abspath) + str_len(token) + 2);
             strcat(abspath, FS_PATH_SEP);
             strcat(abspath, token);
         }
+    }
 
     // If parent is root dir
     if (*abspath == '\0')
@@ -1127,11 +6054,15 @@ int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr,
     Inode *inode;       // Inode for the given path
 
     // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
-    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+    if ((!(fs = fs_txn_handle(fsptr, fssize, errnoptr)))) return -1; 
 
     // Get inode for the path (sets erronoptr = ENOENT and returns -1 on fail)
     if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) return -1;
 
+    if (inode_isfrozen(inode)) {
+        *errnoptr = EROFS;
+        return -1;
+    }
     if (inode->is_dir || !child_remove(fs, path)) {
         *errnoptr = EINVAL;
         return -1;  // Fail
@@ -1162,13 +6093,23 @@ int __myfs_rmdir_implem(void *fsptr, size_t fssize, int *errnoptr,
     Inode *inode;       // Inode for the given path
 
     // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
-    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+    if ((!(fs = fs_txn_handle(fsptr, fssize, errnoptr)))) return -1; 
 
     // Get inode for the path (sets erronoptr = ENOENT and returns -1 on fail)
     if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) return -1;
 
+    // Ensure path denotes a dir, which may change
+    if (!inode->is_dir) {
+        *errnoptr = ENOTDIR;
+        return -1;
+    }
+    if (inode_isfrozen(inode)) {
+        *errnoptr = EROFS;
+        return -1;
+    }
+
     // Ensure dir empty
-    if (inode->file_size_b)  {
+    if (!dir_isempty(fs, inode))  {
         *errnoptr = ENOTEMPTY;
         return -1;  // Fail
     }
@@ -1199,30 +6140,36 @@ int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr,
     FSHandle *fs;       // Handle to the file system
 
     // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
-    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1;
+    if ((!(fs = fs_txn_handle(fsptr, fssize, errnoptr)))) return -1;
 
-    // Ensure file does not already exist
+    // Ensure file does not already exist, and may be made
     if (fs_pathresolve(fs, path, errnoptr)) {
         *errnoptr = EEXIST;
         return -1;
     }
+    if (path_parent_isfrozen(fs, path)) {
+        *errnoptr = EROFS;
+        return -1;
+    }
 
     // Seperate the dir name from the path
     char *par_path, *name, *start, *token, *next;
     
     start = next = strdup(path);    // Duplicate path so we can manipulate it
     next++;                         // Skip initial seperator
-    par_path = malloc(1);           // Parent path buffer
+    par_path = malloc(2);           // Parent path buffer
     *par_path = '\0';
+    name = NULL;
 
-    while ((token = strsep(&next, FS_PATH_SEP)))
+    while ((token = strsep(&next, FS_PATH_SEP))) {
         if (!next) {
             name = token;
         } else {
-            par_path = realloc(par_path, str_len(par_path) + str_len(token) + 1);
+            par_path = realloc(par_path, str_len(par_path) + str_len(token) + 2);
             strcat(par_path, FS_PATH_SEP);
             strcat(par_path, token);
         }
+    }
 
     // If parent is root
     if (*par_path == '\0')
@@ -1230,14 +6177,14 @@ int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr,
 
     // Create the new dir
     Inode *parent = fs_pathresolve(fs, par_path, errnoptr);
-    Inode *newdir = dir_new(fs, parent, name);
+    Inode *newdir = parent ? dir_new(fs, parent, name) : NULL;
     
     // Cleanup
     free(par_path);
     free(start);
 
     if (!newdir) {
-        *errnoptr = EINVAL;
+        if (parent) *errnoptr = EINVAL;     // Else, ENOENT already set
         return -1;  // Fail
     }
 
@@ -1283,91 +6230,97 @@ int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr,
                          const char *from, const char *to) {
     if (strcmp(from, to) == 0) return 0;  // No work required
     
-    FSHandle *fs;           // Handle to the file system
-
-    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
-    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
-
-    // Get the indexes of the file/dir seperators and path sizes
-    size_t from_len, to_len;
-    size_t from_idx = str_name_offset(from, &from_len);
-    size_t to_idx = str_name_offset(to, &to_len);
+    FSHandle *fs;                   // Handle to the file system
+    char from_name[NAME_MAXLEN + 1];
+    char to_name[NAME_MAXLEN + 1];
 
-    char *from_path = strndup(from, (from_idx > 1 ) ? from_idx-1 : from_idx);
-    char *from_name = strndup(from + from_idx, from_len - from_idx);
-    char *to_path = strndup(to, to_idx);
-    char *to_name = strndup(to + to_idx, to_len - to_idx);
-    
-    Inode *from_parent = fs_pathresolve(fs, from_path, errnoptr);
-    Inode *to_parent = fs_pathresolve(fs, to_path, errnoptr);
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail). All of
+    // the rename's changes are then in the same journal txn, so it's atomic.
+    if ((!(fs = fs_txn_handle(fsptr, fssize, errnoptr)))) return -1; 
 
-    Inode *from_child = fs_pathresolve(fs, from, errnoptr);
-    Inode *to_child = fs_pathresolve(fs, to, errnoptr);
-    
-    free(from_name);
-    free(from_path);
+    Inode *from_parent = path_parent_resolve(fs, from, from_name);
+    Inode *to_parent = path_parent_resolve(fs, to, to_name);
+    Inode *from_child = from_parent ? 
+                        dir_subitem_get(fs, from_parent, from_name) : NULL;
 
-    // Ensure all the boys are in the band
+    // Ensure the source exists and the dest is in a dir
     if (!from_parent || !from_child || !to_parent) {
+        *errnoptr = (from_child || !from_parent) && to_parent ? EINVAL : 
+                    ENOENT;
+        return -1;
+    }
+    if (!inode_isdir(to_parent)) {
+        *errnoptr = ENOTDIR;
+        return -1;
+    }
+    if (inode_isfrozen(from_child) || inode_isfrozen(to_parent)) {
+        *errnoptr = EROFS;
+        return -1;
+    }
+    if (!inode_name_isvalid(to_name)) {
         *errnoptr = EINVAL;
-        free(to_name);
-        free(to_path);
         return -1;
     }
 
-    // Begin the move... (Note: This could be done more efficiently) 
-    char *data = malloc(*(int*)(&from_child->file_size_b));
-    size_t sz; 
-
-    // If renaming a directory, it must either not exist or be an empty dir
-    if(from_child->is_dir) {
-        // If destination doesn't exist, create it and move the data
-        if(!to_child) {
-            // printf("Moving !child\n");
-            Inode *dest = dir_new(fs, to_parent, to_name);  // Create dest
-            sz = inode_data_get(fs, from_child, data);      // Get dir's data
-            inode_data_set(fs, dest, data, sz);             // Copy to dest
-            child_remove(fs, from);                         // Remove old dir
-        } 
-        
-        // If dest does exist and is empty, simply overwrite the existing data
-        else if (to_child->is_dir && !to_child->file_size_b) {
-            // printf("moving: to empty existing dir\n");
-            sz = inode_data_get(fs, from_child, data);      // Get dir's data
-            inode_data_set(fs, to_child, data, sz);         // Overwrite dest
-            child_remove(fs, from);                         // Remove old dir
+    // A dir may not be moved into itself or under one of its descendants
+    size_t from_len = str_len((char*)from);
+    if (from_child->is_dir && strncmp(to, from, from_len) == 0 &&
+        to[from_len] == *FS_PATH_SEP) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
+
+    // If replacing the dest, it must be of the same type (and empty, if a dir)
+    Inode *to_child = dir_subitem_get(fs, to_parent, to_name);
+    if (to_child == from_child)
+        return 0;           // Same item (ex: via a non-canonical path)
+    if (to_child) {
+        if (to_child->is_dir != from_child->is_dir) {
+            *errnoptr = to_child->is_dir ? EISDIR : ENOTDIR;
+            return -1;
         }
-        
-        // Else, error
-        else {
-            *errnoptr = EINVAL;
-            free(data);
-            free(to_name);
-            free(to_path);
+        if (to_child->is_dir && !dir_isempty(fs, to_child)) {
+            *errnoptr = ENOTEMPTY;
             return -1;
         }
     }
 
-    // Else, renaming a regular file
-    else {
-        // printf("\nmoving: file\n");
+    // Point the dest's record at the source (replacing the dest atomically,
+    // or adding it). Only this may fail, so it's done first.
+    if (to_child ? !dir_entry_repoint(fs, to_parent, to_name, from_child) :
+                   !dir_entry_add(fs, to_parent, to_name, from_child)) {
+        *errnoptr = ENOSPC;
+        return -1;
+    }
+
+    // Drop the source's record. It's not freed, so its data stays as is.
+    dir_entry_remove(fs, from_parent, from_name);
 
-        sz = inode_data_get(fs, from_child, data);          // Get file's data
-        
-        // If dest exists, overwrite it in an atomic way, else just create it
-        if(to_child)
-            inode_data_set(fs, to_child, data, sz);         // TODO: Atomic
-        else 
-            file_new(fs, to_path, to_name, data, sz);
-        child_remove(fs, from);                             // Remove old file
+    // Moving a dir moves a subdir count between the parents
+    if (from_child->is_dir) {
+        journal_log(fs, from_parent, ST_SZ_INODE);
+        from_parent->subdirs--;
+        if (!to_child) {
+            journal_log(fs, to_parent, ST_SZ_INODE);
+            to_parent->subdirs++;
+        }
     }
 
-    // Cleanup
-    free(data);
-    free(to_name);
-    free(to_path);
+    // Free the replaced dest, as by unlink (so its handles become stale)
+    if (to_child) {
+        inode_data_remove(fs, to_child, 0);
+        to_child->is_dir = 0;
+        to_child->subdirs = 0;
+    }
 
-    // printf("\nrename end\n");
+    // Drop cached lookups of both paths (and of everything under the source,
+    // if a dir w/ children, as their paths changed)
+    if (from_child->is_dir && !dir_isempty(fs, from_child)) {
+        dcache_flush(fs);
+    } else {
+        dcache_path_invalidate(fs, from);
+        dcache_path_invalidate(fs, to);
+    }
 
     return 0;  // Success
 }
@@ -1394,30 +6347,41 @@ int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
     Inode *inode;       // Inode for the given path
 
     // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
-    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+    if ((!(fs = fs_txn_handle(fsptr, fssize, errnoptr)))) return -1; 
 
     // Get inode for the path (sets erronoptr = ENOENT and returns -1 on fail)
     if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) return -1;
 
-    // Read file data
-    char* orig_data = malloc(*(int*)(&inode->file_size_b));
-    size_t data_size = inode_data_get(fs, inode, orig_data);
+    return file_truncate(fs, inode, errnoptr, offset);
+}
 
-    // If request makes file larger
-    if (offset > data_size) {
-        size_t diff = offset- data_size;
-        char *diff_arr = malloc(diff);
-        memset(diff_arr, 0, diff);
-        inode_data_append(fs, inode, diff_arr);  // Pad w/zeroes
-        free(diff_arr);
-    }
-    // Else, if request makes file smaller
-    else if (offset < data_size) {
-        inode_data_set(fs, inode, orig_data, offset);
-    }
-    // Otherwise, file size and contents are unchanged
+/* -- __myfs_ftruncate_implem -- */
+/* Implements an emulation of the ftruncate system call on the filesystem 
+   of size fssize pointed to by fsptr.
 
-    return 0;  // Success
+   Behaves as __myfs_truncate_implem, but for the file denoted by the handle
+   fh (as set by __myfs_open_implem or __myfs_create_implem) instead of a 
+   path, so no path lookup is done.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 ftruncate.
+
+*/
+int __myfs_ftruncate_implem(void *fsptr, size_t fssize, int *errnoptr,
+                            uint64_t fh, off_t offset) {
+    FSHandle *fs;       // Handle to the file system
+    Inode *inode;       // Inode for the given handle
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_txn_handle(fsptr, fssize, errnoptr)))) return -1; 
+
+    // Get inode for the handle (sets erronoptr and returns -1 on fail)
+    if ((!(inode = fs_fhresolve(fs, fh, errnoptr)))) return -1;
+
+    return file_truncate(fs, inode, errnoptr, offset);
 }
 
 /* -- __myfs_open_implem -- */
@@ -1444,11 +6408,15 @@ int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
    conditions. It is also possible to implement more detailed error
    condition answers.
 
+   If fhptr is not NULL, *fhptr is set to a handle for the object that the
+   __myfs_f*_implem calls accept in place of its path (denoting its inode and
+   the inode's generation, so a handle to a since removed object is refused).
+
    The error codes are documented in man 2 open.
 
 */
 int __myfs_open_implem(void *fsptr, size_t fssize, int *errnoptr,
-                       const char *path) {
+                       const char *path, uint64_t *fhptr) {
     FSHandle *fs;       // Handle to the file system
     Inode *inode;       // Inode for the given path
 
@@ -1458,6 +6426,50 @@ int __myfs_open_implem(void *fsptr, size_t fssize, int *errnoptr,
     // Get inode for the path (sets erronoptr = ENOENT and returns -1 on fail)
     if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) return -1;
 
+    if (fhptr) *fhptr = inode_fh_get(fs, inode);
+    return 0; // Success
+}
+
+/* -- __myfs_create_implem -- */
+/* Implements an emulation of the creat system call on the filesystem 
+   of size fssize pointed to by fsptr, i.e. a __myfs_mknod_implem followed 
+   by a __myfs_open_implem of the new file.
+
+   On success, 0 is returned and, if fhptr is not NULL, *fhptr is set to a 
+   handle for the new file.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 open.
+
+*/
+int __myfs_create_implem(void *fsptr, size_t fssize, int *errnoptr,
+                         const char *path, uint64_t *fhptr) {
+    if (__myfs_mknod_implem(fsptr, fssize, errnoptr, path) != 0) return -1;
+    return __myfs_open_implem(fsptr, fssize, errnoptr, path, fhptr);
+}
+
+/* -- __myfs_release_implem -- */
+/* Releases the file handle fh (as set by __myfs_open_implem or 
+   __myfs_create_implem) on the filesystem of size fssize pointed to by 
+   fsptr. The handle must not be used afterwards.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately (EBADF if
+   fh denotes no file, or ESTALE if the file has since been removed).
+
+*/
+int __myfs_release_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          uint64_t fh) {
+    FSHandle *fs;       // Handle to the file system
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+
+    // Nothing is held per handle, so just validate it
+    if (!fs_fhresolve(fs, fh, errnoptr)) return -1;
+
     return 0; // Success
 }
 
@@ -1489,26 +6501,40 @@ int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
 
     // Get inode for the path (sets erronoptr = ENOENT and returns -1 on fail)
     if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) return -1;
-    
-    // Read file data
-    char* full_buf = malloc(*(int*)(&inode->file_size_b));
-    char *cpy_buf = full_buf;
-    int cpy_size = 0;
-    size_t data_size = inode_data_get(fs, inode, full_buf);
 
-    // If offset not beyond end of data
-    if (offset <= data_size) {
-        cpy_buf += offset;              // data index
-        cpy_size = data_size - offset;  // bytes to read
-        memcpy(buf, cpy_buf, cpy_size); 
-    }
-    else {
-            *errnoptr = EFBIG;          // Max offset exceeded
-    }
+    return file_read(fs, inode, errnoptr, buf, size, offset);
+}
+
+/* -- __myfs_fread_implem -- */
+/* Implements an emulation of the pread system call on the filesystem 
+   of size fssize pointed to by fsptr.
+
+   Behaves as __myfs_read_implem, but for the file denoted by the handle fh
+   (as set by __myfs_open_implem or __myfs_create_implem) instead of a path,
+   so no path lookup is done.
+
+   On success, the appropriate number of bytes read into the buffer is
+   returned. The value zero is returned on an end-of-file condition.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 read.
+
+*/
+int __myfs_fread_implem(void *fsptr, size_t fssize, int *errnoptr,
+                        uint64_t fh, char *buf, size_t size, off_t offset) {
+    if (!size) return 0;    // If no bytes to read
+
+    FSHandle *fs;           // Handle to the file system
+    Inode *inode;           // Inode for the given handle
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
 
-    free(full_buf);
+    // Get inode for the handle (sets erronoptr and returns -1 on fail)
+    if ((!(inode = fs_fhresolve(fs, fh, errnoptr)))) return -1;
 
-    return cpy_size;  // Success
+    return file_read(fs, inode, errnoptr, buf, size, offset);
 }
 
 /* -- __myfs_write_implem -- */
@@ -1534,52 +6560,120 @@ int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
     Inode *inode;       // Inode for the given path
 
     // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
-    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+    if ((!(fs = fs_txn_handle(fsptr, fssize, errnoptr)))) return -1; 
 
     // Get inode for the path (sets erronoptr = ENOENT and returns -1 on fail)
     if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) return -1;
 
-    // If offset is 0, we replace all existing data with the given data
-    if (!offset) {
-        char *dup = strndup(buf, size);
-        inode_data_set(fs, inode, dup, size);
-        free(dup);
-    }
-    
+    return file_write(fs, inode, errnoptr, buf, size, offset);
+}
 
-    // Else, append to existing file data, starting at offset
-    else {   
-        // Read file's existing data
-        int new_data_sz;
-        char *new_data;
-        char *orig_data = malloc(*(int*)(&inode->file_size_b));
-        size_t orig_sz = inode_data_get(fs, inode, orig_data);
-
-        // If offset is not beyond end of data
-        if (offset <= orig_sz) { 
-            // Build 1st half of new_data from existing file data, starting at offset
-            new_data = strndup(orig_data, offset);
-
-            // Set 2nd half of new_data: size bytes from the buf param
-            new_data_sz = offset + size;
-            new_data = realloc(new_data, new_data_sz);
-            memcpy(new_data + offset, buf, size);
-
-            // Replace the file's data with the new data
-            inode_data_set(fs, inode, new_data, new_data_sz);
-            free(new_data);
-        } 
-
-        // Else, max offset exceeded
-        else {
-            *errnoptr = EFBIG;
-            size = 0; // Set return value
-        }
+/* -- __myfs_fwrite_implem -- */
+/* Implements an emulation of the pwrite system call on the filesystem 
+   of size fssize pointed to by fsptr.
 
-        free(orig_data);
-    }
+   Behaves as __myfs_write_implem, but for the file denoted by the handle fh
+   (as set by __myfs_open_implem or __myfs_create_implem) instead of a path,
+   so no path lookup is done.
+
+   On success, the appropriate number of bytes written into the file is
+   returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 write.
+*/
+int __myfs_fwrite_implem(void *fsptr, size_t fssize, int *errnoptr,
+                         uint64_t fh, const char *buf, size_t size, 
+                         off_t offset) {
+    if (!size) return 0;  // If no bytes to write
+
+    FSHandle *fs;       // Handle to the file system
+    Inode *inode;       // Inode for the given handle
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_txn_handle(fsptr, fssize, errnoptr)))) return -1; 
+
+    // Get inode for the handle (sets erronoptr and returns -1 on fail)
+    if ((!(inode = fs_fhresolve(fs, fh, errnoptr)))) return -1;
+
+    return file_write(fs, inode, errnoptr, buf, size, offset);
+}
+
+/* -- __myfs_freadmap_implem -- */
+/* Implements a zero-copy emulation of the pread system call on the 
+   filesystem of size fssize pointed to by fsptr, for the file denoted by the
+   handle fh (as set by __myfs_open_implem or __myfs_create_implem).
+
+   Rather than copying the data, sets up to iovcnt of iov to the parts of the
+   fs's mapping holding the file's bytes from offset onward, up to size bytes
+   (or EOF), in order: one per extent's part of the range, each a run of 
+   contiguous memblocks, or per hole, which has a NULL iov_base as it reads
+   as zeroes. Fewer than size bytes are denoted if iovcnt runs out first, in
+   which case the caller may call again for the rest.
+
+   The parts belong to the file only as long as it is not changed, so the
+   caller must be done w/ them before any call that may change the fs.
+
+   On success, the num of iov set is returned. The value zero is returned on
+   an end-of-file condition.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 read.
+
+*/
+int __myfs_freadmap_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           uint64_t fh, size_t size, off_t offset,
+                           struct iovec *iov, int iovcnt) {
+    FSHandle *fs;           // Handle to the file system
+    Inode *inode;           // Inode for the given handle
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+
+    // Get inode for the handle (sets erronoptr and returns -1 on fail)
+    if ((!(inode = fs_fhresolve(fs, fh, errnoptr)))) return -1;
+
+    return file_readmap(fs, inode, errnoptr, size, offset, iov, iovcnt);
+}
+
+/* -- __myfs_fwritefill_implem -- */
+/* Implements a zero-copy emulation of the pwrite system call on the 
+   filesystem of size fssize pointed to by fsptr, for the file denoted by the
+   handle fh (as set by __myfs_open_implem or __myfs_create_implem).
+
+   Rather than copying from a buffer, calls fill(arg, dst, len) w/ each part
+   of the fs's mapping that is to hold the file's bytes from offset onward, 
+   up to size bytes, in order (one per extent's part of the range, i.e. each
+   a run of contiguous memblocks), for it to copy the len bytes into dst. 
+   fill returns the num bytes it copied, and if less than len (i.e. it 
+   failed), the write ends there. Blocks are allocated as for 
+   __myfs_fwrite_implem.
+
+   On success, the num bytes written into the file is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately (EIO if fill
+   failed before copying any bytes).
+
+   The error codes are documented in man 2 write.
+*/
+int __myfs_fwritefill_implem(void *fsptr, size_t fssize, int *errnoptr,
+                             uint64_t fh, 
+                             size_t (*fill)(void *, char *, size_t), 
+                             void *arg, size_t size, off_t offset) {
+    if (!size) return 0;  // If no bytes to write
+
+    FSHandle *fs;       // Handle to the file system
+    Inode *inode;       // Inode for the given handle
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_txn_handle(fsptr, fssize, errnoptr)))) return -1; 
+
+    // Get inode for the handle (sets erronoptr and returns -1 on fail)
+    if ((!(inode = fs_fhresolve(fs, fh, errnoptr)))) return -1;
 
-    return size;  // num bytes written
+    return file_fill(fs, inode, errnoptr, fill, arg, size, offset);
 }
 
 /* -- __myfs_utimens_implem -- */
@@ -1587,7 +6681,9 @@ int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
    of size fssize pointed to by fsptr.
 
    The call changes the access and modification times of the file
-   or directory indicated by path to the values in ts.
+   or directory indicated by path to the values in ts (ts[0] and ts[1],
+   respectively). A tv_nsec of UTIME_NOW denotes the current time, and one
+   of UTIME_OMIT leaves that time unchanged.
 
    On success, 0 is returned.
 
@@ -1602,14 +6698,31 @@ int __myfs_utimens_implem(void *fsptr, size_t fssize, int *errnoptr,
     Inode *inode;       // Inode for the given path
 
     // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
-    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+    if ((!(fs = fs_txn_handle(fsptr, fssize, errnoptr)))) return -1; 
 
     // Get inode for the path (sets erronoptr = ENOENT and returns -1 on fail)
     if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) return -1;
 
-    // Copy time structs to callers structs
-    memcpy(inode->last_acc, &ts[0], sizeof(struct timespec));
-    memcpy(inode->last_mod, &ts[1], sizeof(struct timespec));
+    if (inode_isfrozen(inode)) {
+        *errnoptr = EROFS;
+        return -1;
+    }
+
+    // Set the times (a tv_nsec of UTIME_NOW denotes the current time, and 
+    // one of UTIME_OMIT leaves the time as is)
+    int64_t now = time_now_ns(CLOCK_REALTIME);
+    int64_t *times[2] = { &inode->last_acc_ns, &inode->last_mod_ns };
+    for (int i = 0; i < 2; i++) {
+        if (ts[i].tv_nsec == UTIME_OMIT)
+            continue;
+        if (ts[i].tv_nsec == UTIME_NOW)
+            *times[i] = now;
+        else
+            *times[i] = (int64_t)ts[i].tv_sec * INT64_C(1000000000) + 
+                        ts[i].tv_nsec;
+    }
+    if (!inode->is_dir)
+        dirty_note(fs, inode, DIRTY_TIME, 0, 0);
     
     return 0;
 }
@@ -1645,16 +6758,102 @@ int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr,
     // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
     if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
 
+    // Note: O(1) - free counts are maintained by the allocators
     size_t blocks_free = memblocks_numfree(fs);
-    stbuf->f_bsize = DATAFIELD_SZ_B;
-    stbuf->f_blocks = 0;
+    stbuf->f_bsize = DATAFIELD_SZ_B(fs);
+    stbuf->f_frsize = DATAFIELD_SZ_B(fs);
+    stbuf->f_blocks = fs->num_memblocks;
     stbuf->f_bfree = blocks_free;
     stbuf->f_bavail = blocks_free;
+    stbuf->f_files = fs->num_inodes;
+    stbuf->f_ffree = fs->free_inodes;
+    stbuf->f_favail = fs->free_inodes;
     stbuf->f_namemax = NAME_MAXLEN;
 
     return 0;
 }
 
+// Names of the counters given by __myfs_counters_implem, the FSCounter ones
+// first (in order), followed by those derived from the dentry cache's.
+static const char *fs_counter_names[] = {
+    "blocks_allocated", "blocks_freed", "inodes_allocated", "inodes_freed",
+    "dir_probes", "journal_commits", "journal_checkpoints",
+    "blocks_deduped", "blocks_copied",
+    "dcache_path_hits", "dcache_path_misses", "dcache_child_hits",
+    "dcache_child_misses", "dir_lookups"
+};
+#define NUM_COUNTER_NAMES (sizeof(fs_counter_names) / sizeof(char*))
+
+/* -- __myfs_counters_implem -- */
+/* Gets the internal counters kept by the calling process's mount of the
+   filesystem of size fssize pointed to by fsptr (i.e. since it called 
+   __myfs_mount_implem, or since __myfs_counters_reset_implem): the memblocks
+   and inodes allocated and freed, the dir hash index slots probed, the 
+   journal commits and checkpoints, the dentry cache's hits and misses, and
+   the lookups of a name in a dir (i.e. child cache hits + misses).
+
+   The names (static strings, ex: "blocks_allocated") and values of up to 
+   max of them are copied into names and values.
+
+   Returns the number of counters (which may exceed max), or 0 if the fs was
+   not mounted by the calling process.
+
+   On failure, -1 is returned and *errnoptr is set to EFAULT.
+
+*/
+int __myfs_counters_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           const char **names, uint64_t *values, int max) {
+    FSHandle *fs;       // Handle to the file system
+    FSRuntime *rt;      // The mount's in-memory state
+    uint64_t all[NUM_COUNTER_NAMES];
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+
+    if (!(rt = fs_runtime(fs)))
+        return 0;
+
+    for (int i = 0; i < NUM_COUNTERS; i++)
+        all[i] = __atomic_load_n(&rt->counters[i], __ATOMIC_RELAXED);
+
+    all[NUM_COUNTERS] = __atomic_load_n(&rt->path_hits, __ATOMIC_RELAXED);
+    all[NUM_COUNTERS + 1] = __atomic_load_n(&rt->path_misses,
+                                            __ATOMIC_RELAXED);
+    all[NUM_COUNTERS + 2] = __atomic_load_n(&rt->child_hits,
+                                            __ATOMIC_RELAXED);
+    all[NUM_COUNTERS + 3] = __atomic_load_n(&rt->child_misses,
+                                            __ATOMIC_RELAXED);
+    all[NUM_COUNTERS + 4] = all[NUM_COUNTERS + 2] + all[NUM_COUNTERS + 3];
+
+    for (int i = 0; i < max && i < (int)NUM_COUNTER_NAMES; i++) {
+        names[i] = fs_counter_names[i];
+        values[i] = all[i];
+    }
+    return NUM_COUNTER_NAMES;
+}
+
+/* -- __myfs_counters_reset_implem -- */
+/* Zeroes the counters given by __myfs_counters_implem for the calling
+   process's mount of the filesystem of size fssize pointed to by fsptr, if
+   any.
+
+*/
+void __myfs_counters_reset_implem(void *fsptr, size_t fssize) {
+    FSHandle *fs;       // Handle to the file system
+    FSRuntime *rt;      // The mount's in-memory state
+
+    if (!(fs = fs_handle(fsptr, fssize, NULL)) || !(rt = fs_runtime(fs)))
+        return;
+
+    for (int i = 0; i < NUM_COUNTERS; i++)
+        __atomic_store_n(&rt->counters[i], 0, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&rt->path_hits, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&rt->path_misses, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&rt->child_hits, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&rt->child_misses, 0, __ATOMIC_RELAXED);
+}
+
 /* End emulation functions  ----------------------------------------------- */
 /* Begin DEBUG  ----------------------------------------------------------- */
 
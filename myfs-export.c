@@ -0,0 +1,368 @@
+/*
+
+  myfs-export: Streams a myfs image's (i.e. a backup-file's) tree out to a
+  tar archive, offline.
+
+  Maps the image privately, so it is left as is (even as its journal gets
+  replayed), and walks the tree under DIR (/ by default) w/ the calls of
+  implementation.c, writing each dir and file as a ustar member (w/ a GNU
+  long name record for paths past 100 chars, and binary sizes past 8 GB),
+  dir by dir. Files' data is written straight from the mapping, as
+  __myfs_freadmap_implem sets them out, w/out copying it, and holes are
+  written as zeroes. Snapshots are left out of an export of /, as each
+  holds a copy of the tree; export /.snapshots/NAME to archive one.
+
+  The archive is written to ARCHIVE, or to stdout (so it may be piped, ex:
+  to tar on another node). The exit status is 0 if the whole tree was
+  exported, else 1.
+
+  Compile with:
+    gcc -O2 -Wall myfs-export.c implementation.c -o myfs-export -lpthread
+
+  Usage:
+    ./myfs-export [-o ARCHIVE] IMAGE [DIR]
+
+  Ex:
+    ./myfs-export data.myfs > backup.tar
+    ./myfs-export -o daily.tar data.myfs /.snapshots/daily
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file LICENSE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define EXIT_EXPORTED (0)                   // Exit status: all exported
+#define EXIT_FAILED (1)                     // Exit status: export failed
+#define TAR_BLOCK_SZ_B (512)                // Tar header & data alignment
+#define TAR_NAME_MAXLEN (100)               // Longest ustar name field
+#define TAR_OCTAL_MAX ((uint64_t)077777777777)  // Largest 11-digit octal
+#define EXPORT_IOV (64)                     // Num data parts mapped at once
+#define EXPORT_BUF_SZ_B (1024 * 1024)       // Size of the output's buffer
+#define SNAPSHOT_DIR (".snapshots")         // Root dir item holding snapshots
+#define FS_MAGIC (UINT32_C(0xdeadd0c5))     // Num a formatted image starts w/
+
+/* Declaration for the implementations of the operations used */
+int __myfs_mount_implem(void *, size_t, int *);
+int __myfs_atime_implem(void *, size_t, int *, int);
+int __myfs_getattr_implem(void *, size_t, int *, uid_t, gid_t, const char *,
+                          struct stat *);
+int __myfs_readdir_cursor_implem(void *, size_t, int *, uid_t, gid_t,
+                                 const char *, off_t, int,
+                                 int (*)(void *, const char *,
+                                         const struct stat *, off_t),
+                                 void *);
+int __myfs_open_implem(void *, size_t, int *, const char *, uint64_t *);
+int __myfs_release_implem(void *, size_t, int *, uint64_t);
+int __myfs_freadmap_implem(void *, size_t, int *, uint64_t, size_t, off_t,
+                           struct iovec *, int);
+
+// An export of a fs's tree to an archive
+typedef struct Export {
+    void *mem;                          // The fs's mapping
+    size_t size;                        // Its size
+    FILE *out;                          // The archive
+    size_t dirs;                        // Num dirs written
+    size_t files;                       // Num files written
+    uint64_t bytes;                     // Num bytes of files' data written
+} Export;
+
+// An item of a dir, as listed
+typedef struct ExportItem {
+    char *name;                         // Its name
+    struct stat st;                     // Its attributes
+} ExportItem;
+
+// A dir's listing
+typedef struct ExportList {
+    ExportItem *items;                  // Its items
+    size_t num;                         // Num items
+    size_t cap;                         // Num items there's room for
+    int failed;                         // 1 iff out of memory
+} ExportList;
+
+static const char zeroes[TAR_BLOCK_SZ_B];
+
+// Returns the current monotonic time, in seconds.
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Writes len zeroes to the given export's archive.
+// Returns: 1 on success, else 0.
+static int export_zeroes(Export *exp, size_t len) {
+    while (len) {
+        size_t n = len < sizeof(zeroes) ? len : sizeof(zeroes);
+        if (fwrite(zeroes, 1, n, exp->out) != n)
+            return 0;
+        len -= n;
+    }
+    return 1;
+}
+
+// Sets the given numeric field of a tar header to n: octal, or binary
+// (base-256, w/ the first byte's high bit set) if it doesn't fit.
+static void tar_num_set(char *field, size_t len, uint64_t n) {
+    if (n <= TAR_OCTAL_MAX || len != 12) {
+        field[len - 1] = '\0';
+        for (size_t i = len - 1; i > 0; i--, n >>= 3)
+            field[i - 1] = (char)('0' + (n & 07));
+        return;
+    }
+    field[0] = (char)0x80;
+    for (size_t i = len - 1; i > 0; i--, n >>= 8)
+        field[i] = (char)(n & 0xff);
+}
+
+// Writes a tar header for the member at path (of the given type, size and
+// mtime) to the given export's archive, preceded by a GNU long name record
+// if the path doesn't fit the header.
+// Returns: 1 on success, else 0.
+static int tar_header_put(Export *exp, const char *path, char type,
+                          uint64_t size, time_t mtime) {
+    char hdr[TAR_BLOCK_SZ_B];
+    size_t path_len = strlen(path);
+    unsigned int sum = 0;
+
+    if (path_len > TAR_NAME_MAXLEN &&
+        (!tar_header_put(exp, "././@LongLink", 'L', path_len + 1, 0) ||
+         fwrite(path, 1, path_len + 1, exp->out) != path_len + 1 ||
+         !export_zeroes(exp, (TAR_BLOCK_SZ_B - (path_len + 1) %
+                              TAR_BLOCK_SZ_B) % TAR_BLOCK_SZ_B)))
+        return 0;
+
+    memset(hdr, 0, sizeof(hdr));
+    strncpy(hdr, path, TAR_NAME_MAXLEN);
+    tar_num_set(hdr + 100, 8, type == '5' ? 0755 : 0644);
+    tar_num_set(hdr + 108, 8, getuid() & 07777777);
+    tar_num_set(hdr + 116, 8, getgid() & 07777777);
+    tar_num_set(hdr + 124, 12, size);
+    tar_num_set(hdr + 136, 12, mtime < 0 ? 0 : (uint64_t)mtime);
+    hdr[156] = type;
+    memcpy(hdr + 257, "ustar", 6);
+    memcpy(hdr + 263, "00", 2);
+
+    // The checksum is taken w/ its own field as spaces
+    memset(hdr + 148, ' ', 8);
+    for (size_t i = 0; i < sizeof(hdr); i++)
+        sum += (unsigned char)hdr[i];
+    snprintf(hdr + 148, 8, "%06o", sum);
+    return fwrite(hdr, 1, sizeof(hdr), exp->out) == sizeof(hdr);
+}
+
+// Writes the data of the file at path (of size bytes) to the given export's
+// archive, straight from the fs's mapping, padded to a tar block.
+// Returns: 1 on success, else 0.
+static int export_file_data(Export *exp, const char *path, size_t size) {
+    struct iovec iov[EXPORT_IOV];
+    uint64_t fh;
+    size_t offset = 0;
+    int err, n = 0;
+
+    if (__myfs_open_implem(exp->mem, exp->size, &err, path, &fh) != 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(err));
+        return 0;
+    }
+    while (n >= 0 && offset < size &&
+           (n = __myfs_freadmap_implem(exp->mem, exp->size, &err, fh,
+                                       size - offset, (off_t)offset, iov,
+                                       EXPORT_IOV)) > 0) {
+        for (int i = 0; i < n; i++) {
+            if (iov[i].iov_base ?
+                fwrite(iov[i].iov_base, 1, iov[i].iov_len, exp->out) !=
+                iov[i].iov_len : !export_zeroes(exp, iov[i].iov_len))
+                n = -1;
+            else
+                offset += iov[i].iov_len;
+        }
+    }
+    __myfs_release_implem(exp->mem, exp->size, &err, fh);
+    if (n < 0 || offset < size) {
+        fprintf(stderr, "Cannot export %s: %s\n", path,
+                ferror(exp->out) ? "cannot write archive" : "read failed");
+        return 0;
+    }
+    exp->bytes += size;
+    return export_zeroes(exp, (TAR_BLOCK_SZ_B - size % TAR_BLOCK_SZ_B) %
+                              TAR_BLOCK_SZ_B);
+}
+
+// Fill function for __myfs_readdir_cursor_implem, adding each item to the
+// listing at arg.
+static int export_list_add(void *arg, const char *name, const struct stat *st,
+                           off_t next) {
+    ExportList *list = (ExportList*)arg;
+    (void)next;
+
+    if (list->num == list->cap) {
+        size_t cap = list->cap ? 2 * list->cap : 64;
+        ExportItem *items = realloc(list->items, cap * sizeof(ExportItem));
+        if (!items) {
+            list->failed = 1;
+            return 1;
+        }
+        list->items = items;
+        list->cap = cap;
+    }
+    if (!(list->items[list->num].name = strdup(name))) {
+        list->failed = 1;
+        return 1;
+    }
+    list->items[list->num++].st = *st;
+    return 0;
+}
+
+// Writes the items of the dir at path, and all of those under them, to the
+// given export's archive, as members named prefix followed by their paths
+// from the dir.
+// Returns: 1 on success, else 0.
+static int export_dir(Export *exp, const char *path, const char *prefix) {
+    ExportList list;
+    int err, result = 1;
+
+    memset(&list, 0, sizeof(list));
+    if (__myfs_readdir_cursor_implem(exp->mem, exp->size, &err, getuid(),
+                                     getgid(), path, 0, 1, export_list_add,
+                                     &list) != 0 || list.failed) {
+        fprintf(stderr, "Cannot list %s: %s\n", path,
+                list.failed ? "out of memory" : strerror(err));
+        result = 0;
+    }
+
+    for (size_t i = 0; i < list.num && result; i++) {
+        ExportItem *item = &list.items[i];
+        int is_dir = S_ISDIR(item->st.st_mode);
+        if (is_dir && strcmp(path, "/") == 0 &&
+            strcmp(item->name, SNAPSHOT_DIR) == 0)
+            continue;
+
+        // Its fs path, and its member's (w/ a trailing / if a dir)
+        size_t len = strlen(path) + strlen(item->name) + 2;
+        size_t member_len = strlen(prefix) + strlen(item->name) + 2;
+        char *item_path = malloc(len);
+        char *member = malloc(member_len);
+        if (!item_path || !member) {
+            fprintf(stderr, "Cannot export %s: out of memory\n", item->name);
+            result = 0;
+        } else {
+            snprintf(item_path, len, "%s%s%s", path,
+                     strcmp(path, "/") == 0 ? "" : "/", item->name);
+            snprintf(member, member_len, "%s%s%s", prefix, item->name,
+                     is_dir ? "/" : "");
+            result = tar_header_put(exp, member, is_dir ? '5' : '0',
+                                    is_dir ? 0 : item->st.st_size,
+                                    item->st.st_mtim.tv_sec);
+            if (result && is_dir) {
+                exp->dirs++;
+                result = export_dir(exp, item_path, member);
+            } else if (result) {
+                exp->files++;
+                result = export_file_data(exp, item_path,
+                                          (size_t)item->st.st_size);
+            }
+        }
+        free(member);
+        free(item_path);
+    }
+
+    for (size_t i = 0; i < list.num; i++)
+        free(list.items[i].name);
+    free(list.items);
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    const char *archive = NULL;
+    Export exp;
+    struct stat st;
+    int opt, err;
+
+    while ((opt = getopt(argc, argv, "o:")) != -1) {
+        if (opt == 'o') {
+            archive = optarg;
+        } else {
+            optind = argc + 1;
+            break;
+        }
+    }
+    if (optind != argc - 1 && optind != argc - 2) {
+        printf("usage: %s [-o ARCHIVE] IMAGE [DIR]\n", argv[0]);
+        return EXIT_FAILED;
+    }
+    const char *image = argv[optind];
+    const char *dir = optind == argc - 2 ? argv[optind + 1] : "/";
+
+    // Map the image privately, so the replay of its journal leaves it as is
+    int fd = open(image, O_RDONLY);
+    if (fd < 0) {
+        perror("Cannot open image");
+        return EXIT_FAILED;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "Cannot export image: it is empty or unreadable\n");
+        close(fd);
+        return EXIT_FAILED;
+    }
+    memset(&exp, 0, sizeof(exp));
+    exp.size = (size_t)st.st_size;
+    exp.mem = mmap(NULL, exp.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (exp.mem == MAP_FAILED) {
+        perror("Cannot map image");
+        return EXIT_FAILED;
+    }
+    madvise(exp.mem, exp.size, MADV_SEQUENTIAL);
+    if (*(uint32_t*)exp.mem != FS_MAGIC ||
+        __myfs_mount_implem(exp.mem, exp.size, &err) != 0 ||
+        __myfs_atime_implem(exp.mem, exp.size, &err, 2) != 0) {
+        fprintf(stderr, "Cannot export image: it holds no myfs file "
+                "system\n");
+        munmap(exp.mem, exp.size);
+        return EXIT_FAILED;
+    }
+    if (__myfs_getattr_implem(exp.mem, exp.size, &err, getuid(), getgid(),
+                              dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Cannot export %s: %s\n", dir,
+                strerror(S_ISDIR(st.st_mode) ? err : ENOTDIR));
+        munmap(exp.mem, exp.size);
+        return EXIT_FAILED;
+    }
+
+    exp.out = archive ? fopen(archive, "wb") : stdout;
+    if (!exp.out) {
+        perror("Cannot open archive");
+        munmap(exp.mem, exp.size);
+        return EXIT_FAILED;
+    }
+    setvbuf(exp.out, NULL, _IOFBF, EXPORT_BUF_SZ_B);
+
+    // Walk the tree, then end the archive w/ 2 zeroed blocks
+    double start = now_s();
+    int result = export_dir(&exp, dir, "") &&
+                 export_zeroes(&exp, 2 * TAR_BLOCK_SZ_B);
+    if ((exp.out != stdout ? fclose(exp.out) : fflush(exp.out)) != 0 ||
+        !result) {
+        fprintf(stderr, "Cannot export %s: archive incomplete\n", image);
+        munmap(exp.mem, exp.size);
+        return EXIT_FAILED;
+    }
+    fprintf(stderr, "%s: exported %zu dir(s), %zu file(s), %llu bytes "
+            "(%.3f s)\n", image, exp.dirs, exp.files,
+            (unsigned long long)exp.bytes, now_s() - start);
+
+    munmap(exp.mem, exp.size);
+    return EXIT_EXPORTED;
+}
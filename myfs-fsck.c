@@ -0,0 +1,134 @@
+/*
+
+  myfs-fsck: Checks the consistency of a myfs image (i.e. a backup-file),
+  offline.
+
+  Maps the image privately, so it is left as is (even as its journal gets
+  replayed for the check), and runs the __myfs_check_implem call of
+  implementation.c against it. By default, the check is in full: the handle
+  and journal, then every inode's data mapping, every dir's entries, which
+  dir each inode is in, memblock ownership and the free counts, split across
+  as many threads as there are cores. With -f, it is a fast check of just
+  the handle (geometry, inode groups and counters) and the journal, which
+  takes about as long for a multi-GB image as for a small one.
+
+  Each problem found is reported on stdout. The exit status is 0 if the
+  image is sound, 4 if problems were found (as they are left uncorrected),
+  or 8 if it could not be checked.
+
+  Compile with:
+    gcc -O2 -Wall myfs-fsck.c implementation.c -o myfs-fsck -lpthread
+
+  Usage:
+    ./myfs-fsck [-f] [-j THREADS] IMAGE
+
+  Ex:
+    ./myfs-fsck test.myfs
+    ./myfs-fsck -f -j 1 test.myfs
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file LICENSE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+
+#define EXIT_SOUND (0)                      // Exit status: no problems
+#define EXIT_PROBLEMS (4)                   // Exit status: problems found
+#define EXIT_FAILED (8)                     // Exit status: check not done
+
+/* Declaration for the implementations of the operations used */
+int __myfs_check_implem(void *, size_t, int *, int, int);
+int __myfs_statfs_implem(void *, size_t, int *, struct statvfs *);
+
+// Returns the current monotonic time, in seconds.
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    int full = 1;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt, err;
+
+    while ((opt = getopt(argc, argv, "fj:")) != -1) {
+        if (opt == 'f') {
+            full = 0;
+        } else if (opt == 'j' && atol(optarg) > 0) {
+            threads = atol(optarg);
+        } else {
+            optind = argc + 1;
+            break;
+        }
+    }
+    if (optind != argc - 1) {
+        printf("usage: %s [-f] [-j THREADS] IMAGE\n", argv[0]);
+        return EXIT_FAILED;
+    }
+    if (threads < 1)
+        threads = 1;
+
+    // Map the image privately, so neither the check nor the replay of its
+    // journal change it
+    const char *path = argv[optind];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Cannot open image");
+        return EXIT_FAILED;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "Cannot check image: it is empty or unreadable\n");
+        close(fd);
+        return EXIT_FAILED;
+    }
+    size_t size = (size_t)st.st_size;
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        perror("Cannot map image");
+        return EXIT_FAILED;
+    }
+
+    double start = now_s();
+    int problems = __myfs_check_implem(mem, size, &err, full, (int)threads);
+    double secs = now_s() - start;
+    if (problems < 0) {
+        fprintf(stderr, "Cannot check image: %s\n",
+                err == EINVAL ? "it holds no myfs file system" :
+                                strerror(err));
+        munmap(mem, size);
+        return EXIT_FAILED;
+    }
+
+    if (problems) {
+        printf("%s: %d problem(s) found (%s check, %.3f s)\n", path,
+               problems, full ? "full" : "fast", secs);
+    } else {
+        struct statvfs sv;
+        memset(&sv, 0, sizeof(sv));
+        __myfs_statfs_implem(mem, size, &err, &sv);
+        printf("%s: sound, %lu/%lu inodes, %lu/%lu blocks "
+               "(%s check, %ld thread(s), %.3f s)\n", path,
+               (unsigned long)(sv.f_files - sv.f_ffree),
+               (unsigned long)sv.f_files,
+               (unsigned long)(sv.f_blocks - sv.f_bfree),
+               (unsigned long)sv.f_blocks, full ? "full" : "fast",
+               full ? threads : 1L, secs);
+    }
+
+    munmap(mem, size);
+    return problems ? EXIT_PROBLEMS : EXIT_SOUND;
+}
@@ -0,0 +1,631 @@
+/*
+
+  myfs-import: Populates a myfs image (i.e. a backup-file) offline, in bulk,
+  from a tree of files or a tar archive.
+
+  Maps the image (making it first, if it doesn't exist) and runs the
+  __myfs_import_implem call of implementation.c against it, w/ all of the
+  source's dirs and files at once, so nothing goes through FUSE: inodes
+  are claimed in one sweep, each file's data blocks are allocated in one
+  run and each dir's table is written in one go, and then the files' data
+  is copied in on as many threads as there are cores, straight into the
+  mapping. The source is scanned first, so it must not change meanwhile.
+
+  SOURCE is a dir, whose items are imported (not the dir itself), or a tar
+  archive (ustar, w/ GNU long names or pax paths, such as myfs-export
+  writes), which is mapped, so files' data is copied from it in parallel as
+  well (and so it must be a regular file, not a pipe). Only dirs and
+  regular files are imported: other items (ex: symlinks) are skipped, as
+  reported on stderr, and those w/ a name myfs doesn't allow (or that DIR
+  already holds) are left out, as reported on stdout. Items are imported
+  into DIR (/ by default), which must exist.
+
+  A new image is made w/ SIZE bytes (128 MB by default) and formatted w/
+  the given block size and inode ratio (see myfs --blocksize and
+  --inode-ratio); a smaller existing one is grown to SIZE. The image is
+  flushed before exiting. The exit status is 0 if everything was imported,
+  2 if some items were skipped or left out, or 1 if nothing was imported
+  (ex: the image is out of space), in which case the image holds none of
+  the items.
+
+  Compile with:
+    gcc -O2 -Wall myfs-import.c implementation.c -o myfs-import -lpthread
+
+  Usage:
+    ./myfs-import [-j THREADS] [-s SIZE] [-b BLOCK_SZ] [-i INODE_RATIO]
+                  [-d DIR] IMAGE SOURCE
+
+  Ex:
+    ./myfs-import -s 4294967296 data.myfs ~/dataset
+    ./myfs-import -d /restored new.myfs backup.tar
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file LICENSE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define EXIT_IMPORTED (0)                   // Exit status: all imported
+#define EXIT_FAILED (1)                     // Exit status: none imported
+#define EXIT_SKIPPED (2)                    // Exit status: some skipped
+#define IMAGE_SZ_B ((size_t)128 << 20)      // Size of a new image
+#define TAR_BLOCK_SZ_B (512)                // Tar header & data alignment
+
+/* Declaration for the implementations of the operations used */
+int __myfs_format_implem(void *, size_t, int *, size_t, size_t);
+int __myfs_grow_implem(void *, size_t, int *);
+int __myfs_import_implem(void *, size_t, int *, const char *, size_t,
+                         const char **, const size_t *, const struct stat *,
+                         size_t (*)(void *, size_t, char *, size_t, off_t),
+                         void *, int);
+
+// The items to import, in the arrays __myfs_import_implem takes them in,
+// along w/ where their data is read from: the tree under root, or the
+// mapped archive (whose items are also found by dir & name, from slots).
+typedef struct Source {
+    size_t num;                         // Num items
+    size_t cap;                         // Num items the arrays have room for
+    const char **names;                 // Each item's name
+    size_t *parents;                    // Each item's dir (or SIZE_MAX)
+    struct stat *stats;                 // Each item's attributes
+    size_t *data;                       // Offset of each file's data in the
+                                        // archive
+    const char *root;                   // The tree's root, or NULL
+    const char *archive;                // The archive's mapping, or NULL
+    size_t archive_sz;                  // Its size
+    size_t *slots;                      // Index + 1 of the item in each slot
+    size_t num_slots;                   // Num slots (a power of 2), or 0
+    size_t skipped;                     // Num items skipped
+} Source;
+
+// Returns the current monotonic time, in seconds.
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Parses str as a size (in bytes, or w/ a k, M or G suffix) into *size.
+// Returns: 1 on success, else 0.
+static int size_parse(const char *str, size_t *size) {
+    char *end;
+    unsigned long long n = strtoull(str, &end, 0);
+
+    if (end == str)
+        return 0;
+    if (*end == 'k' || *end == 'K')
+        n <<= 10, end++;
+    else if (*end == 'M')
+        n <<= 20, end++;
+    else if (*end == 'G')
+        n <<= 30, end++;
+    *size = (size_t)n;
+    return *end == '\0';
+}
+
+// Appends an item named name (a copy of which is kept) to the given source,
+// in the dir that is item parent, w/ the given attributes.
+// Returns: Its index, or SIZE_MAX if out of memory.
+static size_t source_add(Source *src, size_t parent, const char *name,
+                         const struct stat *st) {
+    if (src->num == src->cap) {
+        size_t cap = src->cap ? 2 * src->cap : 1024;
+        const char **names = realloc(src->names, cap * sizeof(char*));
+        if (names)
+            src->names = names;
+        size_t *parents = realloc(src->parents, cap * sizeof(size_t));
+        if (parents)
+            src->parents = parents;
+        struct stat *stats = realloc(src->stats, cap * sizeof(struct stat));
+        if (stats)
+            src->stats = stats;
+        size_t *data = realloc(src->data, cap * sizeof(size_t));
+        if (data)
+            src->data = data;
+        if (!names || !parents || !stats || !data)
+            return SIZE_MAX;
+        src->cap = cap;
+    }
+    if (!(src->names[src->num] = strdup(name)))
+        return SIZE_MAX;
+    src->parents[src->num] = parent;
+    src->stats[src->num] = *st;
+    src->data[src->num] = 0;
+    return src->num++;
+}
+
+// Reports the given item of the given source as skipped, w/ why.
+static void source_skip(Source *src, const char *path, const char *why) {
+    fprintf(stderr, "%s: %s, skipped\n", path, why);
+    src->skipped++;
+}
+
+// Writes the host path of the given item of the given tree source (or of
+// its root, for SIZE_MAX) into buf, of size bytes.
+// Returns: 1 on success, else 0 (it doesn't fit).
+static int tree_path(Source *src, size_t item, char *buf, size_t size) {
+    size_t len = strlen(src->root);
+
+    for (size_t i = item; i != SIZE_MAX; i = src->parents[i])
+        len += strlen(src->names[i]) + 1;
+    if (len >= size)
+        return 0;
+
+    // Fill the path in from its end
+    buf[len] = '\0';
+    for (size_t i = item; i != SIZE_MAX; i = src->parents[i]) {
+        size_t name_len = strlen(src->names[i]);
+        len -= name_len;
+        memcpy(buf + len, src->names[i], name_len);
+        buf[--len] = '/';
+    }
+    memcpy(buf, src->root, len);
+    return 1;
+}
+
+// Adds the items of the given dir of the given tree source (SIZE_MAX for
+// its root).
+// Returns: 1 on success, else 0.
+static int tree_scan_dir(Source *src, size_t dir) {
+    char path[PATH_MAX];
+    struct dirent *dent;
+    struct stat st;
+
+    if (!tree_path(src, dir, path, sizeof(path))) {
+        fprintf(stderr, "Cannot scan a dir: its path is too long\n");
+        return 0;
+    }
+    DIR *d = opendir(path);
+    if (!d) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    size_t len = strlen(path);
+    int result = 1;
+    while (result && (dent = readdir(d))) {
+        if (strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0)
+            continue;
+        if (len + 1 + strlen(dent->d_name) >= sizeof(path)) {
+            source_skip(src, dent->d_name, "path too long");
+            continue;
+        }
+        path[len] = '/';
+        strcpy(path + len + 1, dent->d_name);
+        if (lstat(path, &st) != 0) {
+            fprintf(stderr, "Cannot stat %s: %s\n", path, strerror(errno));
+            result = 0;
+        } else if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+            source_skip(src, path, "neither a dir nor a file");
+        } else if (source_add(src, dir, dent->d_name, &st) == SIZE_MAX) {
+            fprintf(stderr, "Cannot scan %s: out of memory\n", path);
+            result = 0;
+        }
+        path[len] = '\0';
+    }
+    closedir(d);
+    return result;
+}
+
+// Adds all of the items under the given tree source's root, dir by dir (so
+// each comes after its dir).
+// Returns: 1 on success, else 0.
+static int tree_scan(Source *src) {
+    if (!tree_scan_dir(src, SIZE_MAX))
+        return 0;
+    for (size_t i = 0; i < src->num; i++)
+        if (S_ISDIR(src->stats[i].st_mode) && !tree_scan_dir(src, i))
+            return 0;
+    return 1;
+}
+
+// Fill function for __myfs_import_implem, reading the len bytes at offset of
+// the given item of the tree source at arg into dst.
+static size_t tree_fill(void *arg, size_t item, char *dst, size_t len,
+                        off_t offset) {
+    Source *src = (Source*)arg;
+    char path[PATH_MAX];
+    size_t done = 0;
+
+    if (!tree_path(src, item, path, sizeof(path)))
+        return 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    while (done < len) {
+        ssize_t n = pread(fd, dst + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr, "Cannot read %s: %s\n", path,
+                    n ? strerror(errno) : "it shrank");
+            break;
+        }
+        done += n;
+    }
+    close(fd);
+    return done;
+}
+
+// Returns the hash of the given dir (item index, or SIZE_MAX) & name.
+static size_t archive_hash(size_t parent, const char *name) {
+    size_t hash = 2166136261u ^ parent;
+    for (const char *c = name; *c != '\0'; c++)
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    return hash;
+}
+
+// Returns the slot of the given archive source holding its item named name
+// in the dir parent, or else the empty slot it would take.
+static size_t* archive_slot(Source *src, size_t parent, const char *name) {
+    size_t mask = src->num_slots - 1;
+    size_t i = archive_hash(parent, name) & mask;
+
+    for (; src->slots[i]; i = (i + 1) & mask)
+        if (src->parents[src->slots[i] - 1] == parent &&
+            strcmp(src->names[src->slots[i] - 1], name) == 0)
+            break;
+    return &src->slots[i];
+}
+
+// Returns the given archive source's item named name in the dir parent,
+// adding it (w/ the given attributes) if there is none.
+// Returns: Its index, or SIZE_MAX if out of memory.
+static size_t archive_item(Source *src, size_t parent, const char *name,
+                           const struct stat *st) {
+    // Keep the slots at most half full
+    if (2 * (src->num + 1) > src->num_slots) {
+        size_t num_slots = src->num_slots ? 2 * src->num_slots : 4096;
+        size_t *slots = calloc(num_slots, sizeof(size_t));
+        if (!slots)
+            return SIZE_MAX;
+        free(src->slots);
+        src->slots = slots;
+        src->num_slots = num_slots;
+        for (size_t i = 0; i < src->num; i++)
+            *archive_slot(src, src->parents[i], src->names[i]) = i + 1;
+    }
+
+    size_t *slot = archive_slot(src, parent, name);
+    if (*slot)
+        return *slot - 1;
+    size_t item = source_add(src, parent, name, st);
+    if (item != SIZE_MAX)
+        *slot = item + 1;
+    return item;
+}
+
+// Adds the archive member at path (a dir or a file, w/ the given attributes
+// and its data at offset data of the archive) to the given archive source,
+// along w/ any dirs on its path not yet added. A later member replaces an
+// earlier (as when extracting).
+// Returns: 1 on success, else 0 (out of memory).
+static int archive_add(Source *src, const char *path, const struct stat *st,
+                       size_t data) {
+    struct stat dir_st = *st;
+    size_t parent = SIZE_MAX;
+    char *copy = strdup(path);
+    char *next = copy, *name;
+    int result = 1;
+
+    if (!copy)
+        return 0;
+    dir_st.st_mode = S_IFDIR | 0755;
+    dir_st.st_size = 0;
+    while ((name = strsep(&next, "/"))) {
+        if (*name == '\0' || strcmp(name, ".") == 0)
+            continue;
+        if (strcmp(name, "..") == 0) {
+            source_skip(src, path, "path has ..");
+            break;
+        }
+        while (next && *next == '/')
+            next++;
+        int last = !next || *next == '\0';
+
+        size_t item = archive_item(src, parent, name, last ? st : &dir_st);
+        if (item == SIZE_MAX) {
+            result = 0;
+            break;
+        }
+        struct stat *item_st = &src->stats[item];
+        if (!last && !S_ISDIR(item_st->st_mode)) {
+            source_skip(src, path, "a file is on its path");
+            break;
+        }
+        if (last) {
+            if ((item_st->st_mode & S_IFMT) != (st->st_mode & S_IFMT)) {
+                source_skip(src, path, "both a dir and a file");
+                break;
+            }
+            *item_st = *st;
+            src->data[item] = data;
+        }
+        parent = item;
+    }
+    free(copy);
+    return result;
+}
+
+// Returns the value of the given numeric field of a tar header: octal, or
+// binary (base-256) if its first byte's high bit is set.
+static uint64_t tar_num(const unsigned char *field, size_t len) {
+    uint64_t n = 0;
+
+    if (field[0] & 0x80) {
+        n = field[0] & 0x7f;
+        for (size_t i = 1; i < len; i++)
+            n = (n << 8) | field[i];
+        return n;
+    }
+    for (size_t i = 0; i < len && field[i] != '\0'; i++)
+        if (field[i] >= '0' && field[i] <= '7')
+            n = (n << 3) | (uint64_t)(field[i] - '0');
+    return n;
+}
+
+// Returns 1 iff the given tar header's checksum matches it, else 0.
+static int tar_csum_isvalid(const unsigned char *hdr) {
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < TAR_BLOCK_SZ_B; i++)
+        sum += (i >= 148 && i < 156) ? ' ' : hdr[i];
+    return sum == tar_num(hdr + 148, 8);
+}
+
+// Returns a malloc'd copy of the value of the given key of the given pax
+// extended header's records (of len bytes), or NULL if it has none.
+static char* tar_pax_get(const char *recs, size_t len, const char *key) {
+    size_t key_len = strlen(key);
+    size_t pos = 0;
+
+    // Each record is "LEN KEY=VALUE\n", LEN counting all of it
+    while (pos < len) {
+        char *end;
+        unsigned long rec_len = strtoul(recs + pos, &end, 10);
+        if (!rec_len || pos + rec_len > len || *end != ' ')
+            break;
+        const char *kv = end + 1;
+        size_t kv_len = recs + pos + rec_len - 1 - kv;
+        if (kv_len > key_len && strncmp(kv, key, key_len) == 0 &&
+            kv[key_len] == '=')
+            return strndup(kv + key_len + 1, kv_len - key_len - 1);
+        pos += rec_len;
+    }
+    return NULL;
+}
+
+// Adds the members of the given archive source's archive, up to its end
+// (2 zeroed headers, or the end of the file).
+// Returns: 1 on success, else 0.
+static int archive_scan(Source *src) {
+    const unsigned char *tar = (const unsigned char*)src->archive;
+    char *long_name = NULL;             // Next member's path, if given
+    char *pax_size = NULL;              // Next member's size, if given
+    size_t pos = 0;
+    int result = 1;
+
+    while (result && pos + TAR_BLOCK_SZ_B <= src->archive_sz) {
+        const unsigned char *hdr = tar + pos;
+        char path[TAR_BLOCK_SZ_B];
+        struct stat st;
+
+        size_t i = 0;
+        while (i < TAR_BLOCK_SZ_B && !hdr[i])
+            i++;
+        if (i == TAR_BLOCK_SZ_B)
+            break;                              // End of archive
+        if (!tar_csum_isvalid(hdr)) {
+            fprintf(stderr, "Cannot read archive: bad header at %zu\n", pos);
+            result = 0;
+            break;
+        }
+
+        uint64_t size = tar_num(hdr + 124, 12);
+        if (pax_size)
+            size = strtoull(pax_size, NULL, 10);
+        size_t data = pos + TAR_BLOCK_SZ_B;
+        if (size > src->archive_sz - data) {
+            fprintf(stderr, "Cannot read archive: it is truncated\n");
+            result = 0;
+            break;
+        }
+        pos = data + (size + TAR_BLOCK_SZ_B - 1) / TAR_BLOCK_SZ_B *
+                     TAR_BLOCK_SZ_B;
+
+        // GNU long names & pax paths (or sizes) apply to the next member
+        char type = (char)hdr[156];
+        if (type == 'L' || type == 'x') {
+            free(long_name);
+            long_name = type == 'L' ?
+                strndup(src->archive + data, size) :
+                tar_pax_get(src->archive + data, size, "path");
+            if (type == 'x') {
+                free(pax_size);
+                pax_size = tar_pax_get(src->archive + data, size, "size");
+            }
+            continue;
+        }
+        if (type == 'g')
+            continue;                           // Global pax header
+
+        // Get its path: ustar's prefix (if any) & name, unless given
+        char *name = long_name;
+        if (!name) {
+            name = path;
+            *path = '\0';
+            if (memcmp(hdr + 257, "ustar\0", 6) == 0 && hdr[345])
+                sprintf(path, "%.155s/", (const char*)hdr + 345);
+            strncat(path, (const char*)hdr, 100);
+        }
+
+        memset(&st, 0, sizeof(st));
+        st.st_mtim.tv_sec = (time_t)tar_num(hdr + 136, 12);
+        st.st_atim = st.st_mtim;
+        if (type == '5') {
+            st.st_mode = S_IFDIR | 0755;
+            result = archive_add(src, name, &st, 0);
+        } else if (type == '0' || type == '\0' || type == '7') {
+            st.st_mode = S_IFREG | 0644;
+            st.st_size = (off_t)size;
+            result = archive_add(src, name, &st, data);
+        } else {
+            source_skip(src, name, "neither a dir nor a file");
+        }
+        if (!result)
+            fprintf(stderr, "Cannot read archive: out of memory\n");
+
+        free(long_name);
+        free(pax_size);
+        long_name = pax_size = NULL;
+    }
+    free(long_name);
+    free(pax_size);
+    return result;
+}
+
+// Fill function for __myfs_import_implem, copying the len bytes at offset of
+// the given item of the archive source at arg into dst.
+static size_t archive_fill(void *arg, size_t item, char *dst, size_t len,
+                           off_t offset) {
+    Source *src = (Source*)arg;
+
+    memcpy(dst, src->archive + src->data[item] + offset, len);
+    return len;
+}
+
+int main(int argc, char *argv[]) {
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t size = 0, block_sz = 0, inode_ratio = 0;
+    const char *dir = "/";
+    Source src;
+    struct stat st;
+    int opt, err;
+
+    while ((opt = getopt(argc, argv, "j:s:b:i:d:")) != -1) {
+        if (opt == 'j' && atol(optarg) > 0) {
+            threads = atol(optarg);
+        } else if ((opt == 's' && size_parse(optarg, &size)) ||
+                   (opt == 'b' && size_parse(optarg, &block_sz)) ||
+                   (opt == 'i' && size_parse(optarg, &inode_ratio))) {
+            continue;
+        } else if (opt == 'd') {
+            dir = optarg;
+        } else {
+            optind = argc + 1;
+            break;
+        }
+    }
+    if (optind != argc - 2) {
+        printf("usage: %s [-j THREADS] [-s SIZE] [-b BLOCK_SZ] "
+               "[-i INODE_RATIO] [-d DIR] IMAGE SOURCE\n", argv[0]);
+        return EXIT_FAILED;
+    }
+    if (threads < 1)
+        threads = 1;
+    const char *image = argv[optind];
+    const char *source = argv[optind + 1];
+
+    // Scan the source: a tree, or a mapped archive
+    double start = now_s();
+    memset(&src, 0, sizeof(src));
+    if (stat(source, &st) != 0) {
+        perror("Cannot stat source");
+        return EXIT_FAILED;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        src.root = source;
+        if (!tree_scan(&src))
+            return EXIT_FAILED;
+    } else {
+        int fd = open(source, O_RDONLY);
+        if (fd < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+            fprintf(stderr, "Cannot read archive: %s\n",
+                    fd < 0 ? strerror(errno) :
+                             "it is empty or not a regular file");
+            return EXIT_FAILED;
+        }
+        src.archive_sz = (size_t)st.st_size;
+        src.archive = mmap(NULL, src.archive_sz, PROT_READ, MAP_PRIVATE,
+                           fd, 0);
+        close(fd);
+        if (src.archive == MAP_FAILED) {
+            perror("Cannot map archive");
+            return EXIT_FAILED;
+        }
+        if (!archive_scan(&src))
+            return EXIT_FAILED;
+    }
+    double scanned = now_s();
+
+    // Map the image, making (or growing) it first if need be
+    int fd = open(image, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("Cannot open image");
+        return EXIT_FAILED;
+    }
+    size_t len = (size_t)st.st_size;
+    if (!size)
+        size = len ? len : IMAGE_SZ_B;
+    if (size < len)
+        size = len;
+    if (size > len && ftruncate(fd, (off_t)size) != 0) {
+        perror("Cannot size image");
+        close(fd);
+        return EXIT_FAILED;
+    }
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        perror("Cannot map image");
+        return EXIT_FAILED;
+    }
+    if (__myfs_format_implem(mem, size, &err, block_sz, inode_ratio) != 0 ||
+        (len && size > len && __myfs_grow_implem(mem, size, &err) != 0)) {
+        fprintf(stderr, "Cannot %s image: %s\n",
+                len && size > len ? "grow" : "format", strerror(err));
+        munmap(mem, size);
+        return EXIT_FAILED;
+    }
+
+    // Import it all, then flush the image
+    int left = __myfs_import_implem(mem, size, &err, dir, src.num,
+                                    src.names, src.parents, src.stats,
+                                    src.root ? tree_fill : archive_fill, &src,
+                                    (int)threads);
+    if (left < 0) {
+        fprintf(stderr, "Cannot import into %s: %s\n", dir,
+                err == ENOSPC ? "out of space (see -s)" : strerror(err));
+        munmap(mem, size);
+        return EXIT_FAILED;
+    }
+    if (msync(mem, size, MS_SYNC) != 0) {
+        perror("Cannot flush image");
+        munmap(mem, size);
+        return EXIT_FAILED;
+    }
+    munmap(mem, size);
+
+    size_t bytes = 0;
+    for (size_t i = 0; i < src.num; i++)
+        bytes += S_ISREG(src.stats[i].st_mode) ? src.stats[i].st_size : 0;
+    printf("%s: imported %zu of %zu item(s) (%zu bytes scanned), %zu "
+           "skipped (scan %.3f s, import %.3f s, %ld thread(s))\n", image,
+           src.num - left, src.num, bytes, src.skipped + left,
+           scanned - start, now_s() - scanned, threads);
+    return src.skipped || left ? EXIT_SKIPPED : EXIT_IMPORTED;
+}
@@ -36,7 +36,7 @@
   
 */
 
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 29
 
 #include <fuse.h>
 #include <stdio.h>
@@ -44,17 +44,33 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <assert.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <signal.h>
+#include <time.h>
 
 
 struct __myfs_options_struct_t {
         const char *filename;
         const char *size;
+        const char *blocksize;
+        const char *inode_ratio;
+        const char *writebuf;
+        const char *atime;
+        const char *prefault;
+        const char *readahead;
+        const char *fsck;
+        int zero_copy;
+        int single_thread;
+        int readdir_plus;
+        int hugepages;
+        int dedup;
         int show_help;
 };
 
@@ -63,6 +79,17 @@ struct __myfs_options_struct_t {
 static const struct fuse_opt __myfs_option_spec[] = {
         OPTION("--backupfile=%s", filename),
         OPTION("--size=%s", size),
+        OPTION("--blocksize=%s", blocksize),
+        OPTION("--inode-ratio=%s", inode_ratio),
+        OPTION("--writebuf=%s", writebuf),
+        OPTION("--atime=%s", atime),
+        OPTION("--prefault=%s", prefault),
+        OPTION("--readahead=%s", readahead),
+        OPTION("--fsck=%s", fsck),
+        OPTION("--zerocopy", zero_copy),
+        OPTION("--readdirplus", readdir_plus),
+        OPTION("--hugepages", hugepages),
+        OPTION("--dedup", dedup),
         OPTION("-h", show_help),
         OPTION("--help", show_help),
         FUSE_OPT_END
@@ -74,18 +101,158 @@ struct __memory_block_struct_t {
 };
 typedef struct __memory_block_struct_t memory_block_t;
 
+/* Operations whose calls are timed, each w/ its own stats */
+enum __myfs_op_t {
+  MYFS_OP_GETATTR,
+  MYFS_OP_READDIR,
+  MYFS_OP_MKNOD,
+  MYFS_OP_UNLINK,
+  MYFS_OP_MKDIR,
+  MYFS_OP_RMDIR,
+  MYFS_OP_RENAME,
+  MYFS_OP_TRUNCATE,
+  MYFS_OP_OPEN,
+  MYFS_OP_CREATE,
+  MYFS_OP_RELEASE,
+  MYFS_OP_READ,
+  MYFS_OP_WRITE,
+  MYFS_OP_STATFS,
+  MYFS_OP_UTIMENS,
+  MYFS_OP_FSYNC,
+  MYFS_OP_FLUSH,
+  MYFS_OP_WRITEBACK,
+  MYFS_OP_GROW,
+  MYFS_NUM_OPS
+};
+
+static const char *__myfs_op_names[MYFS_NUM_OPS] = {
+  "getattr", "readdir", "mknod", "unlink", "mkdir", "rmdir", "rename",
+  "truncate", "open", "create", "release", "read", "write", "statfs",
+  "utimens", "fsync", "flush", "writeback", "grow"
+};
+
+/* Latency histogram bucket i counts calls taking up to 2^(i + 10)ns (about
+   1us * 2^i); the last one counts all slower ones */
+#define MYFS_HIST_BUCKETS  (24)
+#define MYFS_HIST_SHIFT    (10)
+
+/* Per-operation stats, all in ns or bytes. Updated w/ relaxed atomics, as
+   calls holding env_lock shared update them concurrently. */
+struct __myfs_op_stats_struct_t {
+  uint64_t calls;
+  uint64_t errors;
+  uint64_t bytes;
+  uint64_t wait_ns;                         /* Waiting to get env_lock */
+  uint64_t hold_ns;                         /* Holding env_lock */
+  uint64_t hist[MYFS_HIST_BUCKETS];
+};
+
+/* Num of counters in the stats of all operations, seen as one array */
+#define MYFS_STATS_WORDS (MYFS_NUM_OPS * (sizeof(struct __myfs_op_stats_struct_t) / sizeof(uint64_t)))
+
+/* An open file, denoted by its fi->fh. Adjacent writes to it are gathered
+   in its buffer (guarded by its lock, so env_lock is not needed for them),
+   in one run of len bytes from offset off, and written to the file-system
+   as one write once it fills up, or the file is flushed, synced or closed.
+   As they are written later, an error doing so is kept in err and returned
+   by the next call on the file that can report it. */
+struct __myfs_file_struct_t {
+  uint64_t        fh;                       /* As set by open/create */
+  pthread_mutex_t lock;
+  char            *buf;                     /* Of env->wb_size bytes, or NULL */
+  size_t          len;
+  off_t           off;
+  int             err;
+  off_t           next_read;                /* Offset following its last read */
+  struct __myfs_file_struct_t *prev;        /* In env->files */
+  struct __myfs_file_struct_t *next;
+};
+
+/* Operations that only look at the filesystem (getattr, readdir, open, read,
+   statfs, fsync, release) take env_lock shared and may run concurrently; all others
+   take it exclusive. The open files are listed at files, guarded by files_lock,
+   and wb_pending is the num of them whose buffer holds writes. Taking a file's
+   lock while holding env_lock is not allowed. The mapping is of map_size
+   bytes (size rounded up to a huge page w/ --hugepages, or w/ a backup-file,
+   the address space reserved for growing it), and the file data part of it
+   starts at data_off. Reads and seq_reads count the reads of
+   open files and those continuing the file's last one, as of seq_mark
+   when the readahead advice in use was last chosen. */
 struct __myfs_environment_struct_t {
-  pthread_mutex_t env_lock;
+  pthread_rwlock_t env_lock;
   uid_t           uid;
   gid_t           gid;
   void            *memory;
   size_t          size;
+  size_t          map_size;
+  size_t          data_off;
   int             using_backup;
   int             backup_fd;
+  int             zero_copy;
+  int             splice_reads;
+  int             readdir_plus;
+  size_t          wb_size;
+  int             atime_mode;
+  int             dedup;
+  int             readahead;
+  int             advice;
+  uint64_t        reads;
+  uint64_t        seq_reads;
+  uint64_t        seq_mark;
+  pthread_mutex_t files_lock;
+  struct __myfs_file_struct_t *files;
+  int             wb_pending;
+  int             stats_thread_running;
+  pthread_t       stats_thread;
+  struct __myfs_op_stats_struct_t stats[MYFS_NUM_OPS];
 };
 
 #define MYFS_DEFAULT_SIZE  ((size_t) (128 << 20))   /* 128MB */
 #define MYFS_MIN_SIZE      ((size_t) (2048))        /* 2kB */
+#define MYFS_DEFAULT_WRITEBUF ((size_t) (64 << 10)) /* 64kB */
+#define MYFS_MAX_WRITEBUF  ((size_t) (16 << 20))    /* 16MB */
+
+/* Modes of access time updates, as taken by __myfs_atime_implem */
+static const char *__myfs_atime_modes[] = { "strict", "relatime", "noatime" };
+#define MYFS_ATIME_MODES   ((int) (sizeof(__myfs_atime_modes) / sizeof(char *)))
+#define MYFS_ATIME_DEFAULT (1)                      /* relatime */
+
+/* Parts of the mapping faulted in on mount: none, the metadata (i.e. all but
+   the file data blocks), or all of it */
+static const char *__myfs_prefault_modes[] = { "none", "meta", "all" };
+#define MYFS_PREFAULT_MODES ((int) (sizeof(__myfs_prefault_modes) / sizeof(char *)))
+#define MYFS_PREFAULT_NONE (0)
+#define MYFS_PREFAULT_META (1)
+#define MYFS_PREFAULT_ALL  (2)
+
+/* Readahead advice given for the file data part of the mapping (and the
+   backup-file), w/ auto choosing one of the others by the pattern of the
+   last MYFS_READAHEAD_WINDOW reads */
+static const char *__myfs_readahead_modes[] = { "auto", "normal", "sequential", "random" };
+static const int __myfs_readahead_madvice[] = { MADV_NORMAL, MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM };
+static const int __myfs_readahead_fadvice[] = { POSIX_FADV_NORMAL, POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL, POSIX_FADV_RANDOM };
+#define MYFS_READAHEAD_MODES ((int) (sizeof(__myfs_readahead_modes) / sizeof(char *)))
+#define MYFS_READAHEAD_AUTO   (0)
+#define MYFS_READAHEAD_NORMAL (1)
+#define MYFS_READAHEAD_SEQ    (2)
+#define MYFS_READAHEAD_RANDOM (3)
+#define MYFS_READAHEAD_WINDOW (256)
+
+#define MYFS_HUGEPAGE_SIZE ((size_t) (2 << 20))     /* 2MB */
+
+/* Checks of an existing file system in a backup-file, before mounting it:
+   none, a fast one (of its geometry and journal) or a full one (on as many
+   threads as there are cores), see __myfs_check_implem */
+static const char *__myfs_fsck_modes[] = { "none", "fast", "full" };
+#define MYFS_FSCK_MODES    ((int) (sizeof(__myfs_fsck_modes) / sizeof(char *)))
+#define MYFS_FSCK_NONE     (0)
+#define MYFS_FSCK_FAST     (1)
+#define MYFS_FSCK_FULL     (2)
+
+/* Address space reserved for a backup-file's mapping, as a multiple of its
+   size, so the file system can grow online (as far as it can, see
+   __myfs_grow_implem) */
+#define MYFS_GROW_MAX      (16)
 
 static int __myfs_parse_size(size_t *size, const char *str) {
   unsigned long long int tmp, t;
@@ -102,15 +269,65 @@ static int __myfs_parse_size(size_t *size, const char *str) {
   return 1;
 }
 
+/* Sets *mode to the index of str in the num modes given */
+static int __myfs_parse_mode(int *mode, const char *str, const char **modes, int num) {
+  int i;
+
+  for (i = 0; i < num; i++) {
+    if (strcmp(str, modes[i]) == 0) {
+      *mode = i;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Advises the kernel how the file data part of the mapping will be read
+   (and of the backup-file, as zero-copy reads are spliced from it), as by
+   the given readahead mode. Both are hints, so failing to is harmless. */
+static void __myfs_advise(struct __myfs_environment_struct_t *env, int readahead) {
+  if (!env->using_backup || (env->data_off >= env->size)) return;
+  madvise((char *) env->memory + env->data_off, env->size - env->data_off,
+          __myfs_readahead_madvice[readahead]);
+  posix_fadvise(env->backup_fd, (off_t) env->data_off,
+                (off_t) (env->size - env->data_off),
+                __myfs_readahead_fadvice[readahead]);
+}
+
+/* Declaration for the mount-time implementations */
+
+int __myfs_format_implem(void *, size_t, int *, size_t, size_t);
+int __myfs_mount_implem(void *, size_t, int *);
+int __myfs_atime_implem(void *, size_t, int *, int);
+int __myfs_dedup_implem(void *, size_t, int *, int);
+int __myfs_layout_implem(void *, size_t, int *, size_t *);
+int __myfs_grow_implem(void *, size_t, int *);
+int __myfs_check_implem(void *, size_t, int *, int, int);
+void __myfs_unmount_implem(void *, size_t);
+
 // Setup the fs environment, including loading/seeking backup file & doing mmap
 static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, struct __myfs_options_struct_t *opts) {
   int size_specified, using_backup;
   size_t size;
   int fd;
   void *memory;
+  void *reserved;
   off_t off;
   size_t len;
   size_t orig_size;
+  size_t block_size;
+  size_t inode_ratio;
+  size_t wb_size;
+  int atime_mode;
+  int prefault;
+  int readahead;
+  int fsck;
+  int problems;
+  int populate;
+  size_t map_size;
+  size_t meta_size;
+  size_t page_size;
+  int mount_errno;
 
   /* Handle size */
   if (opts->size != NULL) {
@@ -132,11 +349,65 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
     size = MYFS_MIN_SIZE;
   }
 
+  /* Handle format options (0 = the default) */
+  block_size = 0;
+  if (opts->blocksize != NULL &&
+      !__myfs_parse_size(&block_size, opts->blocksize)) {
+    fprintf(stderr, "Cannot parse block size indication\n");
+    return 0;
+  }
+  inode_ratio = 0;
+  if (opts->inode_ratio != NULL &&
+      !__myfs_parse_size(&inode_ratio, opts->inode_ratio)) {
+    fprintf(stderr, "Cannot parse inode ratio indication\n");
+    return 0;
+  }
+  wb_size = MYFS_DEFAULT_WRITEBUF;
+  if (opts->writebuf != NULL &&
+      !__myfs_parse_size(&wb_size, opts->writebuf)) {
+    fprintf(stderr, "Cannot parse write buffer size indication\n");
+    return 0;
+  }
+  if (wb_size > MYFS_MAX_WRITEBUF) {
+    wb_size = MYFS_MAX_WRITEBUF;
+  }
+  atime_mode = MYFS_ATIME_DEFAULT;
+  if (opts->atime != NULL &&
+      !__myfs_parse_mode(&atime_mode, opts->atime, __myfs_atime_modes, MYFS_ATIME_MODES)) {
+    fprintf(stderr, "Cannot parse access time mode indication\n");
+    return 0;
+  }
+  prefault = MYFS_PREFAULT_NONE;
+  if (opts->prefault != NULL &&
+      !__myfs_parse_mode(&prefault, opts->prefault, __myfs_prefault_modes, MYFS_PREFAULT_MODES)) {
+    fprintf(stderr, "Cannot parse prefault indication\n");
+    return 0;
+  }
+  readahead = MYFS_READAHEAD_AUTO;
+  if (opts->readahead != NULL &&
+      !__myfs_parse_mode(&readahead, opts->readahead, __myfs_readahead_modes, MYFS_READAHEAD_MODES)) {
+    fprintf(stderr, "Cannot parse readahead indication\n");
+    return 0;
+  }
+  fsck = MYFS_FSCK_FAST;
+  if (opts->fsck != NULL &&
+      !__myfs_parse_mode(&fsck, opts->fsck, __myfs_fsck_modes, MYFS_FSCK_MODES)) {
+    fprintf(stderr, "Cannot parse fsck indication\n");
+    return 0;
+  }
+
   /* Setup lock for the threads */
-  if (pthread_mutex_init(&(env->env_lock), NULL) != 0) {
-    perror("Cannot setup mutex");
+  if (pthread_rwlock_init(&(env->env_lock), NULL) != 0) {
+    perror("Cannot setup lock");
     return 0;    
   }
+  if (pthread_mutex_init(&(env->files_lock), NULL) != 0) {
+    perror("Cannot setup lock");
+    if (pthread_rwlock_destroy(&(env->env_lock)) != 0) {
+      perror("Cannot destroy lock");
+    }
+    return 0;
+  }
   
   /* Handle backup file */
   if (opts->filename != NULL) {
@@ -144,16 +415,22 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
     fd = open(opts->filename, O_CREAT | O_RDWR, 00644);
     if (fd < 0) {
       perror("Cannot open backup-file");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
+      if (pthread_rwlock_destroy(&(env->env_lock)) != 0) {
+        perror("Cannot destroy lock");
+      }
+      if (pthread_mutex_destroy(&(env->files_lock)) != 0) {
+        perror("Cannot destroy lock");
       }
       return 0;
     }
     off = lseek(fd, 0, SEEK_END);
     if (off < ((off_t) 0)) {
       perror("Cannot seek in backup-file");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
+      if (pthread_rwlock_destroy(&(env->env_lock)) != 0) {
+        perror("Cannot destroy lock");
+      }
+      if (pthread_mutex_destroy(&(env->files_lock)) != 0) {
+        perror("Cannot destroy lock");
       }
       return 0;
     }
@@ -162,8 +439,11 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
     off = lseek(fd, 0, SEEK_SET);
     if (off < ((off_t) 0)) {
       perror("Cannot seek in backup-file");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
+      if (pthread_rwlock_destroy(&(env->env_lock)) != 0) {
+        perror("Cannot destroy lock");
+      }
+      if (pthread_mutex_destroy(&(env->files_lock)) != 0) {
+        perror("Cannot destroy lock");
       }
       return 0;
     }
@@ -181,8 +461,11 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
     }
     if (ftruncate(fd, size) != 0) {
       perror("Cannot seek in backup-file");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
+      if (pthread_rwlock_destroy(&(env->env_lock)) != 0) {
+        perror("Cannot destroy lock");
+      }
+      if (pthread_mutex_destroy(&(env->files_lock)) != 0) {
+        perror("Cannot destroy lock");
       }
       return 0;
     }
@@ -192,49 +475,183 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
     orig_size = 0;
   }
 
-  /* Do the mmap */
+  /* Do the mmap, faulting it all in if asked to. W/out a backup-file, use
+     huge pages if asked to: reserved ones if any are free, else have the
+     kernel back it w/ transparent ones where it can. */
+  populate = (prefault == MYFS_PREFAULT_ALL) ? MAP_POPULATE : 0;
+  map_size = size;
   if (using_backup) {
-    memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    /* Reserve address space past it to grow into, if there's room */
+    if (((size_t) -1) / MYFS_GROW_MAX >= size) {
+      map_size = MYFS_GROW_MAX * size;
+    }
+    memory = mmap(NULL, map_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED) {
+      map_size = size;
+      memory = NULL;
+    }
+    reserved = memory;
+    memory = mmap(memory, size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | populate | ((memory != NULL) ? MAP_FIXED : 0), fd, 0);
     if (memory == MAP_FAILED) {
       perror("Cannot map backup-file into memory");
+      if ((reserved != NULL) && (munmap(reserved, map_size) != 0)) {
+        perror("Cannot unmap memory");
+      }
       if (close(fd) != 0) {
         perror("Cannot close backup-file");
       }
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
+      if (pthread_rwlock_destroy(&(env->env_lock)) != 0) {
+        perror("Cannot destroy lock");
+      }
+      if (pthread_mutex_destroy(&(env->files_lock)) != 0) {
+        perror("Cannot destroy lock");
       }
       return 0;
     }
   } else {
-    memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    memory = MAP_FAILED;
+    if (opts->hugepages) {
+      map_size = (size + MYFS_HUGEPAGE_SIZE - 1) & ~(MYFS_HUGEPAGE_SIZE - 1);
+      memory = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | populate, -1, 0);
+    }
+    if (memory == MAP_FAILED) {
+      map_size = size;
+      memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | populate, -1, 0);
+      if ((memory != MAP_FAILED) && opts->hugepages &&
+          (madvise(memory, size, MADV_HUGEPAGE) != 0)) {
+        perror("Cannot use huge pages");
+      }
+    }
     if (memory == MAP_FAILED) {
       perror("Cannot map in memory");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
+      if (pthread_rwlock_destroy(&(env->env_lock)) != 0) {
+        perror("Cannot destroy lock");
+      }
+      if (pthread_mutex_destroy(&(env->files_lock)) != 0) {
+        perror("Cannot destroy lock");
       }
       return 0;
     }
   }
 
-  /* If the original size is different from the current size, we
-     changed the filesystem and we need to wipe out the old filesystem
+  /* Check the filesystem the backup-file holds, if any, as asked to, and
+     refuse to mount it if it has problems (which myfs-fsck details). This
+     comes before anything mounts it, so the check sees the image as it was
+     left (ex: w/ its journal not yet replayed).
+  */
+  problems = 0;
+  if (using_backup && (orig_size != ((size_t) 0)) && (fsck != MYFS_FSCK_NONE)) {
+    problems = __myfs_check_implem(memory, size, &mount_errno, fsck == MYFS_FSCK_FULL,
+                                   (int) sysconf(_SC_NPROCESSORS_ONLN));
+    if (problems > 0) {
+      fprintf(stderr, "File system has %d problem(s), see myfs-fsck\n", problems);
+      mount_errno = EUCLEAN;
+    } else if ((problems < 0) && (mount_errno != EINVAL)) {
+      fprintf(stderr, "Cannot check file system: %s\n", strerror(mount_errno));
+    }
+  }
+
+  /* Grow the filesystem to fill the backup-file, if it was extended (by us
+     or since it was last mounted). If the original size is different from
+     the current size and it holds no filesystem, we need to wipe it out
      completely.
   */
-  if (using_backup) {
-    if (orig_size != size) {
-      if (orig_size != ((size_t) 0)) {
-        memset(memory, 0, orig_size);
+  if (using_backup && (problems <= 0)) {
+    if (orig_size != ((size_t) 0)) {
+      if (__myfs_grow_implem(memory, size, &mount_errno) != 0) {
+        if (mount_errno != EINVAL) {
+          fprintf(stderr, "Cannot grow file system: %s\n", strerror(mount_errno));
+        } else if (orig_size != size) {
+          memset(memory, 0, orig_size);
+        }
       }
     }
   }
   
+  /* Format (w/ the given block size & inode ratio) or validate the
+     filesystem. This is the only place its layout gets computed; afterwards
+     each call validates it in O(1).
+  */
+  if ((problems > 0) ||
+      __myfs_format_implem(memory, size, &mount_errno, block_size,
+                           inode_ratio) != 0 ||
+      __myfs_mount_implem(memory, size, &mount_errno) != 0) {
+    fprintf(stderr, "Cannot mount file system: %s\n", strerror(mount_errno));
+    if (munmap(memory, map_size) != 0) {
+      perror("Cannot unmap memory");
+    }
+    if (using_backup) {
+      if (close(fd) != 0) {
+        perror("Cannot close backup-file");
+      }
+    }
+    if (pthread_rwlock_destroy(&(env->env_lock)) != 0) {
+      perror("Cannot destroy lock");
+    }
+    if (pthread_mutex_destroy(&(env->files_lock)) != 0) {
+      perror("Cannot destroy lock");
+    }
+    return 0;
+  }
+
+  /* Fault in the metadata if asked to (as it's touched by each op, unlike
+     the file data), and find where the file data starts */
+  page_size = (size_t) sysconf(_SC_PAGESIZE);
+  meta_size = size;
+  __myfs_layout_implem(memory, size, &mount_errno, &meta_size);
+  meta_size = (meta_size + page_size - 1) & ~(page_size - 1);
+  if (meta_size > size) meta_size = size;
+  if (using_backup && (prefault == MYFS_PREFAULT_META)) {
+    madvise(memory, meta_size, MADV_WILLNEED);
+#ifdef MADV_POPULATE_READ
+    madvise(memory, meta_size, MADV_POPULATE_READ);
+#endif
+  }
+
   /* Get uid and gid, write back and succeed */
   env->uid = getuid();
   env->gid = getgid();
   env->memory = memory;
   env->size = size;
+  env->map_size = map_size;
+  env->data_off = meta_size;
   env->using_backup = using_backup;
   env->backup_fd = fd;
+  env->zero_copy = opts->zero_copy && using_backup;
+  if (opts->zero_copy && !using_backup) {
+    fprintf(stderr, "Ignoring --zerocopy, as it requires a backup-file\n");
+  }
+
+  /* FUSE sends the blocks a zero-copy read hands it only after the read
+     returns (and the lock is released), so they may have been freed and
+     given to another file by then, unless no op can run meanwhile, i.e.
+     unless FUSE is single-threaded. Otherwise, reads are copied. */
+  env->splice_reads = env->zero_copy && opts->single_thread;
+  if (env->zero_copy && !opts->single_thread) {
+    fprintf(stderr, "Copying reads despite --zerocopy, as only a "
+            "single-threaded (-s) mount splices them\n");
+  }
+  env->readdir_plus = opts->readdir_plus;
+  env->wb_size = wb_size;
+  env->atime_mode = atime_mode;
+  env->dedup = opts->dedup;
+  if (opts->hugepages && using_backup) {
+    fprintf(stderr, "Ignoring --hugepages, as it requires no backup-file\n");
+  }
+  env->readahead = readahead;
+  env->advice = MYFS_READAHEAD_NORMAL;
+  env->reads = 0;
+  env->seq_reads = 0;
+  env->seq_mark = 0;
+  if (using_backup && (readahead != MYFS_READAHEAD_AUTO)) {
+    __myfs_advise(env, readahead);
+  }
+  env->files = NULL;
+  env->wb_pending = 0;
+  env->stats_thread_running = 0;
+  memset(env->stats, 0, sizeof(env->stats));
   return 1;
 }
 
@@ -244,7 +661,7 @@ static void __myfs_clear_environment(struct __myfs_environment_struct_t *env) {
       perror("Cannot synchronize memory map with backup-file");
     }
   }
-  if (munmap(env->memory, env->size) != 0) {
+  if (munmap(env->memory, env->map_size) != 0) {
     perror("Cannot unmap memory");
   }
   if (env->using_backup) {
@@ -252,8 +669,11 @@ static void __myfs_clear_environment(struct __myfs_environment_struct_t *env) {
       perror("Cannot close backup-file");
     }
   }
-  if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-    perror("Cannot destroy mutex");
+  if (pthread_rwlock_destroy(&(env->env_lock)) != 0) {
+    perror("Cannot destroy lock");
+  }
+  if (pthread_mutex_destroy(&(env->files_lock)) != 0) {
+    perror("Cannot destroy lock");
   }
 }
 
@@ -269,34 +689,544 @@ static int __myfs_sync_environment(struct __myfs_environment_struct_t *env) {
 
 int __myfs_getattr_implem(void *, size_t, int *, uid_t, gid_t, const char *, struct stat *);
 int __myfs_readdir_implem(void *, size_t, int *, const char *, char ***);
+int __myfs_readdir_cursor_implem(void *, size_t, int *, uid_t, gid_t, const char *, off_t, int, int (*)(void *, const char *, const struct stat *, off_t), void *);
 int __myfs_mknod_implem(void *, size_t, int *, const char *);
 int __myfs_unlink_implem(void *, size_t, int *, const char *);
 int __myfs_mkdir_implem(void *, size_t, int *, const char *);
 int __myfs_rmdir_implem(void *, size_t, int *, const char *);
 int __myfs_rename_implem(void *, size_t, int *, const char *, const char*);
 int __myfs_truncate_implem(void *, size_t, int *, const char *, off_t);
-int __myfs_open_implem(void *, size_t, int *, const char *);
+int __myfs_open_implem(void *, size_t, int *, const char *, uint64_t *);
+int __myfs_create_implem(void *, size_t, int *, const char *, uint64_t *);
+int __myfs_release_implem(void *, size_t, int *, uint64_t);
+int __myfs_fread_implem(void *, size_t, int *, uint64_t, char *, size_t, off_t);
+int __myfs_fwrite_implem(void *, size_t, int *, uint64_t, const char *, size_t, off_t);
+int __myfs_ftruncate_implem(void *, size_t, int *, uint64_t, off_t);
 int __myfs_read_implem(void *, size_t, int *, const char *, char *, size_t, off_t);
 int __myfs_write_implem(void *, size_t, int *, const char *, const char *, size_t, off_t);
 int __myfs_statfs_implem(void *, size_t, int *, struct statvfs*);
 int __myfs_utimens_implem(void *, size_t, int *, const char *, const struct timespec [2]);
+int __myfs_fsync_implem(void *, size_t, int *);
+int __myfs_ffsync_implem(void *, size_t, int *, uint64_t, int);
+int __myfs_freadmap_implem(void *, size_t, int *, uint64_t, size_t, off_t, struct iovec *, int);
+int __myfs_fwritefill_implem(void *, size_t, int *, uint64_t, size_t (*)(void *, char *, size_t), void *, size_t, off_t);
+int __myfs_counters_implem(void *, size_t, int *, const char **, uint64_t *, int);
+int __myfs_snapshot_implem(void *, size_t, int *, const char *);
+int __myfs_snapshot_delete_implem(void *, size_t, int *, const char *);
+void __myfs_counters_reset_implem(void *, size_t);
 
 /* End of declarations */
 
+/* Stats part */
+
+static uint64_t __myfs_now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec) * ((uint64_t) 1000000000) + ((uint64_t) ts.tv_nsec);
+}
+
+/* When an operation's call began and got env_lock (or the lock it needs) */
+struct __myfs_timer_struct_t {
+  uint64_t start;
+  uint64_t locked;
+};
+
+/* Takes env_lock (shared unless exclusive) for a timed call */
+static void __myfs_lock(struct __myfs_environment_struct_t *env, int exclusive,
+                        struct __myfs_timer_struct_t *timer) {
+  timer->start = __myfs_now_ns();
+  if (exclusive) {
+    pthread_rwlock_wrlock(&(env->env_lock));
+  } else {
+    pthread_rwlock_rdlock(&(env->env_lock));
+  }
+  timer->locked = __myfs_now_ns();
+}
+
+/* Records the call to operation op, now done, that returned res and moved
+   the given num of bytes */
+static void __myfs_record(struct __myfs_environment_struct_t *env,
+                          struct __myfs_timer_struct_t *timer,
+                          enum __myfs_op_t op, int res, size_t bytes) {
+  struct __myfs_op_stats_struct_t *stats;
+  uint64_t end, t;
+  int b;
+
+  end = __myfs_now_ns();
+
+  stats = &(env->stats[op]);
+  for (b = 0, t = (end - timer->start) >> MYFS_HIST_SHIFT;
+       (t != 0) && (b < MYFS_HIST_BUCKETS - 1); t >>= 1, b++);
+  __atomic_fetch_add(&(stats->calls), 1, __ATOMIC_RELAXED);
+  if (res < 0) __atomic_fetch_add(&(stats->errors), 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&(stats->bytes), (uint64_t) bytes, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&(stats->wait_ns), timer->locked - timer->start, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&(stats->hold_ns), end - timer->locked, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&(stats->hist[b]), 1, __ATOMIC_RELAXED);
+}
+
+/* Releases env_lock and records the call, as __myfs_record */
+static void __myfs_unlock(struct __myfs_environment_struct_t *env,
+                          struct __myfs_timer_struct_t *timer,
+                          enum __myfs_op_t op, int res, size_t bytes) {
+  pthread_rwlock_unlock(&(env->env_lock));
+  __myfs_record(env, timer, op, res, bytes);
+}
+
+/* Zeroes all stats, including those kept by the implementation */
+static void __myfs_stats_reset(struct __myfs_environment_struct_t *env) {
+  uint64_t *field;
+  size_t i;
+
+  field = (uint64_t *) env->stats;
+  for (i = 0; i < MYFS_STATS_WORDS; i++)
+    __atomic_store_n(&(field[i]), 0, __ATOMIC_RELAXED);
+  pthread_rwlock_rdlock(&(env->env_lock));
+  __myfs_counters_reset_implem(env->memory, env->size);
+  pthread_rwlock_unlock(&(env->env_lock));
+}
+
+/* Resets the stats whenever the process gets MYFS_STATS_RESET_SIGNAL, which
+   main keeps blocked in every other thread */
+#define MYFS_STATS_RESET_SIGNAL SIGUSR1
+
+static void *__myfs_stats_thread(void *arg) {
+  struct __myfs_environment_struct_t *env;
+  sigset_t set;
+  int sig;
+
+  env = (struct __myfs_environment_struct_t *) arg;
+  sigemptyset(&set);
+  sigaddset(&set, MYFS_STATS_RESET_SIGNAL);
+  for (;;) {
+    if (sigwait(&set, &sig) == 0) __myfs_stats_reset(env);
+  }
+  return NULL;
+}
+
+/* The read-only control file giving the stats, in Prometheus' text format,
+   and the one giving the file system's size, which grows it when a larger
+   one is written to it. They live in a directory of their own that shadows
+   any entry of the same name in the root directory. */
+#define MYFS_CTL_DIR    "/.myfs"
+#define MYFS_CTL_STATS  "/.myfs/stats"
+#define MYFS_CTL_SIZE   "/.myfs/size"
+
+#define MYFS_MAX_COUNTERS  (32)
+
+/* Returns nonzero iff path is the control directory or inside it */
+static int __myfs_is_ctl(const char *path) {
+  size_t len = sizeof(MYFS_CTL_DIR) - 1;
+
+  return (strncmp(path, MYFS_CTL_DIR, len) == 0) &&
+    ((path[len] == '\0') || (path[len] == '/'));
+}
+
+/* Snapshots of the file system are read-only directories in the snapshots
+   directory, taken by making one there and deleted by removing it */
+#define MYFS_SNAPSHOTS_DIR "/.snapshots"
+
+/* Returns nonzero iff path is the snapshots directory or inside it */
+static int __myfs_is_snapshot(const char *path) {
+  size_t len = sizeof(MYFS_SNAPSHOTS_DIR) - 1;
+
+  return (strncmp(path, MYFS_SNAPSHOTS_DIR, len) == 0) &&
+    ((path[len] == '\0') || (path[len] == '/'));
+}
+
+/* Returns the name of the snapshot path denotes (a directory right in the
+   snapshots directory), or NULL if none */
+static const char *__myfs_snapshot_name(const char *path) {
+  const char *name = path + sizeof(MYFS_SNAPSHOTS_DIR);
+
+  if (!__myfs_is_snapshot(path) ||
+      (path[sizeof(MYFS_SNAPSHOTS_DIR) - 1] == '\0') ||
+      (*name == '\0') || (strchr(name, '/') != NULL)) return NULL;
+  return name;
+}
+
+/* A snapshot of the stats, taken when the control file is opened so all of
+   what one reader gets is consistent */
+struct __myfs_snapshot_struct_t {
+  char *data;
+  size_t size;
+};
+
+static struct __myfs_snapshot_struct_t *__myfs_stats_render(struct __myfs_environment_struct_t *env) {
+  struct __myfs_snapshot_struct_t *snap;
+  struct __myfs_op_stats_struct_t stats[MYFS_NUM_OPS];
+  const char *names[MYFS_MAX_COUNTERS];
+  uint64_t values[MYFS_MAX_COUNTERS];
+  uint64_t *src, *dst, cum;
+  FILE *out;
+  size_t i;
+  int op, b, n, __myfs_errno;
+
+  snap = malloc(sizeof(struct __myfs_snapshot_struct_t));
+  if (snap == NULL) return NULL;
+  out = open_memstream(&(snap->data), &(snap->size));
+  if (out == NULL) {
+    free(snap);
+    return NULL;
+  }
+
+  src = (uint64_t *) env->stats;
+  dst = (uint64_t *) stats;
+  for (i = 0; i < MYFS_STATS_WORDS; i++)
+    dst[i] = __atomic_load_n(&(src[i]), __ATOMIC_RELAXED);
+
+  fprintf(out, "# TYPE myfs_ops_total counter\n");
+  for (op = 0; op < MYFS_NUM_OPS; op++)
+    fprintf(out, "myfs_ops_total{op=\"%s\"} %llu\n", __myfs_op_names[op],
+            (unsigned long long) stats[op].calls);
+  fprintf(out, "# TYPE myfs_op_errors_total counter\n");
+  for (op = 0; op < MYFS_NUM_OPS; op++)
+    fprintf(out, "myfs_op_errors_total{op=\"%s\"} %llu\n", __myfs_op_names[op],
+            (unsigned long long) stats[op].errors);
+  fprintf(out, "# TYPE myfs_op_bytes_total counter\n");
+  for (op = 0; op < MYFS_NUM_OPS; op++)
+    fprintf(out, "myfs_op_bytes_total{op=\"%s\"} %llu\n", __myfs_op_names[op],
+            (unsigned long long) stats[op].bytes);
+  fprintf(out, "# TYPE myfs_lock_wait_seconds_total counter\n");
+  for (op = 0; op < MYFS_NUM_OPS; op++)
+    fprintf(out, "myfs_lock_wait_seconds_total{op=\"%s\"} %.9f\n", __myfs_op_names[op],
+            ((double) stats[op].wait_ns) * 1e-9);
+  fprintf(out, "# TYPE myfs_lock_hold_seconds_total counter\n");
+  for (op = 0; op < MYFS_NUM_OPS; op++)
+    fprintf(out, "myfs_lock_hold_seconds_total{op=\"%s\"} %.9f\n", __myfs_op_names[op],
+            ((double) stats[op].hold_ns) * 1e-9);
+
+  fprintf(out, "# TYPE myfs_op_latency_seconds histogram\n");
+  for (op = 0; op < MYFS_NUM_OPS; op++) {
+    if (stats[op].calls == 0) continue;
+    for (b = 0, cum = 0; b < MYFS_HIST_BUCKETS - 1; b++) {
+      cum += stats[op].hist[b];
+      fprintf(out, "myfs_op_latency_seconds_bucket{op=\"%s\",le=\"%.9g\"} %llu\n",
+              __myfs_op_names[op], ((double) (((uint64_t) 1) << (b + MYFS_HIST_SHIFT))) * 1e-9,
+              (unsigned long long) cum);
+    }
+    cum += stats[op].hist[b];
+    fprintf(out, "myfs_op_latency_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n",
+            __myfs_op_names[op], (unsigned long long) cum);
+    fprintf(out, "myfs_op_latency_seconds_sum{op=\"%s\"} %.9f\n", __myfs_op_names[op],
+            ((double) (stats[op].wait_ns + stats[op].hold_ns)) * 1e-9);
+    fprintf(out, "myfs_op_latency_seconds_count{op=\"%s\"} %llu\n", __myfs_op_names[op],
+            (unsigned long long) cum);
+  }
+
+  /* The implementation's own counters, kept by the mount's in-memory state */
+  __myfs_errno = 0;
+  pthread_rwlock_rdlock(&(env->env_lock));
+  n = __myfs_counters_implem(env->memory, env->size, &__myfs_errno,
+                             names, values, MYFS_MAX_COUNTERS);
+  pthread_rwlock_unlock(&(env->env_lock));
+  for (i = 0; (int) i < n; i++) {
+    fprintf(out, "# TYPE myfs_%s_total counter\n", names[i]);
+    fprintf(out, "myfs_%s_total %llu\n", names[i], (unsigned long long) values[i]);
+  }
+
+  if (fclose(out) != 0) {
+    free(snap);
+    return NULL;
+  }
+  return snap;
+}
+
+static struct __myfs_snapshot_struct_t *__myfs_size_render(struct __myfs_environment_struct_t *env) {
+  struct __myfs_snapshot_struct_t *snap;
+  size_t size;
+
+  snap = malloc(sizeof(struct __myfs_snapshot_struct_t));
+  if (snap == NULL) return NULL;
+  snap->data = malloc(32);
+  if (snap->data == NULL) {
+    free(snap);
+    return NULL;
+  }
+  pthread_rwlock_rdlock(&(env->env_lock));
+  size = env->size;
+  pthread_rwlock_unlock(&(env->env_lock));
+  snap->size = (size_t) snprintf(snap->data, 32, "%llu\n", (unsigned long long) size);
+  return snap;
+}
+
+static void __myfs_snapshot_free(struct __myfs_snapshot_struct_t *snap) {
+  if (snap == NULL) return;
+  free(snap->data);
+  free(snap);
+}
+
+/* Copies up to size bytes of the snapshot, from offset on, into buf */
+static int __myfs_snapshot_read(struct __myfs_snapshot_struct_t *snap, char *buf,
+                                size_t size, off_t offset) {
+  if ((offset < 0) || ((size_t) offset >= snap->size)) return 0;
+  if (size > snap->size - (size_t) offset) size = snap->size - (size_t) offset;
+  memcpy(buf, snap->data + offset, size);
+  return (int) size;
+}
+
+/* End of stats part */
+
+/* Write buffer part */
+
+static struct __myfs_file_struct_t *__myfs_file(struct fuse_file_info *fi) {
+  return (struct __myfs_file_struct_t *) (uintptr_t) fi->fh;
+}
+
+/* Sets up an open file for the handle fh and lists it, in fi->fh.
+   Returns 0 on success, -ENOMEM on failure. */
+static int __myfs_file_open(struct __myfs_environment_struct_t *env,
+                            struct fuse_file_info *fi, uint64_t fh) {
+  struct __myfs_file_struct_t *file;
+
+  file = malloc(sizeof(struct __myfs_file_struct_t));
+  if (file == NULL) return -ENOMEM;
+  if (pthread_mutex_init(&(file->lock), NULL) != 0) {
+    free(file);
+    return -ENOMEM;
+  }
+  file->fh = fh;
+  file->buf = NULL;
+  file->len = 0;
+  file->off = 0;
+  file->err = 0;
+  file->next_read = 0;
+  file->prev = NULL;
+  pthread_mutex_lock(&(env->files_lock));
+  file->next = env->files;
+  if (env->files != NULL) env->files->prev = file;
+  env->files = file;
+  pthread_mutex_unlock(&(env->files_lock));
+  fi->fh = (uint64_t) (uintptr_t) file;
+  return 0;
+}
+
+/* Notes a read of len bytes at off of the open file. W/ --readahead=auto, 
+   every MYFS_READAHEAD_WINDOW reads the advice is chosen again: sequential
+   if most of them continued their file's last one, random if few did, else
+   normal. Called w/ env_lock held shared, so only atomics are used. */
+static void __myfs_note_read(struct __myfs_environment_struct_t *env,
+                             struct __myfs_file_struct_t *file,
+                             off_t off, size_t len) {
+  uint64_t reads, seq;
+  int advice;
+
+  if (!env->using_backup || (env->readahead != MYFS_READAHEAD_AUTO)) return;
+  if (__atomic_exchange_n(&(file->next_read), off + (off_t) len, __ATOMIC_RELAXED) == off) {
+    __atomic_add_fetch(&(env->seq_reads), 1, __ATOMIC_RELAXED);
+  }
+  reads = __atomic_add_fetch(&(env->reads), 1, __ATOMIC_RELAXED);
+  if (reads % MYFS_READAHEAD_WINDOW != 0) return;
+
+  seq = __atomic_load_n(&(env->seq_reads), __ATOMIC_RELAXED);
+  seq -= __atomic_exchange_n(&(env->seq_mark), seq, __ATOMIC_RELAXED);
+  advice = MYFS_READAHEAD_NORMAL;
+  if (4 * seq >= 3 * MYFS_READAHEAD_WINDOW) advice = MYFS_READAHEAD_SEQ;
+  if (4 * seq <= MYFS_READAHEAD_WINDOW) advice = MYFS_READAHEAD_RANDOM;
+  if (__atomic_exchange_n(&(env->advice), advice, __ATOMIC_RELAXED) != advice) {
+    __myfs_advise(env, advice);
+  }
+}
+
+/* Writes the writes gathered in the (locked) file's buffer to the 
+   file-system as one. Returns 0 on success, -errno on failure, in which
+   case they are dropped. */
+static int __myfs_file_writeback(struct __myfs_environment_struct_t *env,
+                                 struct __myfs_file_struct_t *file) {
+  struct __myfs_timer_struct_t timer;
+  int __myfs_errno, res;
+
+  if (file->len == 0) return 0;
+  __myfs_errno = ENOENT;
+  __myfs_lock(env, 1, &timer);
+  res = __myfs_fwrite_implem(env->memory,
+                             env->size,
+                             &__myfs_errno,
+                             file->fh,
+                             file->buf,
+                             file->len,
+                             file->off);
+  __myfs_unlock(env, &timer, MYFS_OP_WRITEBACK, res, (res > 0) ? (size_t) res : 0);
+  if ((res >= 0) && ((size_t) res < file->len)) {
+    __myfs_errno = ENOSPC;
+    res = -1;
+  }
+  file->len = 0;
+  __atomic_fetch_sub(&(env->wb_pending), 1, __ATOMIC_RELEASE);
+  if (res >= 0)
+    return 0;
+  return -__myfs_errno;
+}
+
+/* As __myfs_file_writeback, but also returns (and clears) any error left
+   by an earlier write back */
+static int __myfs_file_flush(struct __myfs_environment_struct_t *env,
+                             struct __myfs_file_struct_t *file) {
+  int res;
+
+  res = __myfs_file_writeback(env, file);
+  if ((res == 0) && (file->err != 0)) res = -(file->err);
+  file->err = 0;
+  return res;
+}
+
+/* Gathers the write to the (locked) file in its buffer, writing back the
+   buffer first if the write does not follow on from (and fit after) its
+   writes. A write as big as the buffer is written straight away. Returns
+   the num of bytes written, or -errno. */
+static int __myfs_file_write(struct __myfs_environment_struct_t *env,
+                             struct __myfs_file_struct_t *file,
+                             const char *buf, size_t size, off_t offset) {
+  struct __myfs_timer_struct_t timer;
+  int __myfs_errno, res;
+
+  if (file->err != 0) {
+    res = -(file->err);
+    file->err = 0;
+    return res;
+  }
+  if (size == 0) return 0;
+  if ((file->len != 0) &&
+      ((offset != file->off + (off_t) file->len) ||
+       (size > env->wb_size - file->len))) {
+    if ((res = __myfs_file_writeback(env, file)) < 0) return res;
+  }
+  if ((size >= env->wb_size) ||
+      ((file->buf == NULL) && ((file->buf = malloc(env->wb_size)) == NULL))) {
+    __myfs_errno = ENOENT;
+    __myfs_lock(env, 1, &timer);
+    res = __myfs_fwrite_implem(env->memory,
+                               env->size,
+                               &__myfs_errno,
+                               file->fh,
+                               buf,
+                               size,
+                               offset);
+    __myfs_unlock(env, &timer, MYFS_OP_WRITEBACK, res, (res > 0) ? (size_t) res : 0);
+    if (res >= 0)
+      return res;
+    return -__myfs_errno;
+  }
+  if (file->len == 0) {
+    file->off = offset;
+    __atomic_fetch_add(&(env->wb_pending), 1, __ATOMIC_RELEASE);
+  }
+  memcpy(file->buf + file->len, buf, size);
+  file->len += size;
+  if (file->len == env->wb_size) {
+    if ((res = __myfs_file_writeback(env, file)) < 0) return res;
+  }
+  return (int) size;
+}
+
+#define MYFS_FH_INDEX_MASK (UINT64_C(0xffffffff))  /* A handle's inode bits */
+
+/* Writes back the buffers of the open files whose handle denotes the same
+   inode as fh (or of all open files, if fh is 0), so a call seeing the 
+   file (or changing it w/out a handle) comes after all the writes to it 
+   that returned. Must be called w/out holding env_lock. */
+static void __myfs_sync_file(struct __myfs_environment_struct_t *env, uint64_t fh) {
+  struct __myfs_file_struct_t *file;
+  int res;
+
+  if (__atomic_load_n(&(env->wb_pending), __ATOMIC_ACQUIRE) == 0) return;
+  pthread_mutex_lock(&(env->files_lock));
+  for (file = env->files; file != NULL; file = file->next) {
+    if ((fh != 0) && 
+        ((file->fh & MYFS_FH_INDEX_MASK) != (fh & MYFS_FH_INDEX_MASK))) continue;
+    pthread_mutex_lock(&(file->lock));
+    res = __myfs_file_writeback(env, file);
+    if ((res < 0) && (file->err == 0)) file->err = -res;
+    pthread_mutex_unlock(&(file->lock));
+  }
+  pthread_mutex_unlock(&(env->files_lock));
+}
+
+/* Writes back the buffers of the open files of the file at path, if any
+   (see __myfs_sync_file). Must be called w/out holding env_lock. */
+static void __myfs_sync_path(struct __myfs_environment_struct_t *env, const char *path) {
+  uint64_t fh;
+  int __myfs_errno, res;
+
+  if (__atomic_load_n(&(env->wb_pending), __ATOMIC_ACQUIRE) == 0) return;
+  pthread_rwlock_rdlock(&(env->env_lock));
+  res = __myfs_open_implem(env->memory,
+                           env->size,
+                           &__myfs_errno,
+                           path,
+                           &fh);
+  pthread_rwlock_unlock(&(env->env_lock));
+  if (res == 0) __myfs_sync_file(env, fh);
+}
+
+/* Writes back the buffers of all open files, so a call seeing all of the
+   file-system comes after all the writes that returned. Must be called 
+   w/out holding env_lock. */
+static void __myfs_sync_files(struct __myfs_environment_struct_t *env) {
+  __myfs_sync_file(env, 0);
+}
+
+/* Unlists the open file, writes back its buffer and frees it. Returns its
+   handle. */
+static uint64_t __myfs_file_close(struct __myfs_environment_struct_t *env,
+                                  struct __myfs_file_struct_t *file) {
+  uint64_t fh;
+
+  pthread_mutex_lock(&(env->files_lock));
+  if (file->prev != NULL) {
+    file->prev->next = file->next;
+  } else {
+    env->files = file->next;
+  }
+  if (file->next != NULL) file->next->prev = file->prev;
+  pthread_mutex_unlock(&(env->files_lock));
+
+  pthread_mutex_lock(&(file->lock));
+  __myfs_file_writeback(env, file);
+  pthread_mutex_unlock(&(file->lock));
+  pthread_mutex_destroy(&(file->lock));
+  fh = file->fh;
+  free(file->buf);
+  free(file);
+  return fh;
+}
+
+/* End of write buffer part */
+
 /* FUSE operations part */
 
 static int __myfs_getattr(const char *path, struct stat *st) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
+  struct __myfs_timer_struct_t timer;
   int __myfs_errno, res;
 
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
 
   memset(st, 0, sizeof(struct stat));
+  if (__myfs_is_ctl(path)) {
+    st->st_uid = env->uid;
+    st->st_gid = env->gid;
+    if (strcmp(path, MYFS_CTL_DIR) == 0) {
+      st->st_mode = S_IFDIR | 0555;
+      st->st_nlink = 2;
+    } else if (strcmp(path, MYFS_CTL_STATS) == 0) {
+      st->st_mode = S_IFREG | 0444;
+      st->st_nlink = 1;
+    } else if (strcmp(path, MYFS_CTL_SIZE) == 0) {
+      st->st_mode = S_IFREG | 0644;
+      st->st_nlink = 1;
+    } else {
+      return -ENOENT;
+    }
+    return 0;
+  }
   
+  __myfs_sync_path(env, path);
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
+  __myfs_lock(env, 0, &timer);
   res = __myfs_getattr_implem(env->memory,
                               env->size,
                               &__myfs_errno,
@@ -304,76 +1234,102 @@ static int __myfs_getattr(const char *path, struct stat *st) {
                               env->gid,
                               path,
                               st);
-  pthread_mutex_unlock(&(env->env_lock));  
+  __myfs_unlock(env, &timer, MYFS_OP_GETATTR, res, 0);
   if (res >= 0)
     return res;
   return -__myfs_errno;
 }
 
+/* Offsets of a listing given to FUSE: 0 begins it, 1 and 2 follow . and ..
+   respectively, and MYFS_READDIR_OFFSET + c follows the entry after which
+   __myfs_readdir_cursor_implem resumes at cursor c. */
+#define MYFS_READDIR_OFFSET ((off_t) 2)
+
+struct __myfs_readdir_fill_struct_t {
+  void *buf;
+  fuse_fill_dir_t filler;
+};
+
+/* Hands an entry streamed by __myfs_readdir_cursor_implem to FUSE. Returns
+   nonzero once FUSE's buffer is full. */
+static int __myfs_readdir_fill(void *arg, const char *name,
+                               const struct stat *st, off_t next) {
+  struct __myfs_readdir_fill_struct_t *fill;
+
+  fill = (struct __myfs_readdir_fill_struct_t *) arg;
+  return fill->filler(fill->buf, name, st, MYFS_READDIR_OFFSET + next);
+}
+
+/* Lists the directory in chunks: FUSE calls this again w/ the offset
+   following the last entry it took whenever its buffer fills up. */
 static int __myfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                           off_t offset, struct fuse_file_info *fi) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
-  int __myfs_errno, res, i;
-  char **names;
+  struct __myfs_readdir_fill_struct_t fill;
+  struct __myfs_timer_struct_t timer;
+  int __myfs_errno, res;
   
-  (void) offset;
   (void) fi;
   
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
 
-  names = NULL;
-  __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_readdir_implem(env->memory,
-                              env->size,
-                              &__myfs_errno,
-                              path,
-                              &names);
-  pthread_mutex_unlock(&(env->env_lock));
-  if (res >= 0) {
-    if (res == 0) {
-      filler(buf, ".", NULL, 0);
-      filler(buf, "..", NULL, 0);
-      return 0;
-    } else {
-      if (names != NULL) {
-        filler(buf, ".", NULL, 0);
-        filler(buf, "..", NULL, 0);
-        for (i=0;i<res;i++) {
-          filler(buf, names[i], NULL, 0);
-          free(names[i]);
-        }
-        free(names);
-        return 0;
-      } else {
-        return -ENOENT;
-      }
-    }
+  if (offset < 1 && filler(buf, ".", NULL, 1)) return 0;
+  if (offset < 2 && filler(buf, "..", NULL, 2)) return 0;
+  if (__myfs_is_ctl(path)) {
+    if (strcmp(path, MYFS_CTL_DIR) != 0) return -ENOTDIR;
+    if (offset < 3) filler(buf, MYFS_CTL_STATS + sizeof(MYFS_CTL_DIR), NULL, 3);
+    if (offset < 4) filler(buf, MYFS_CTL_SIZE + sizeof(MYFS_CTL_DIR), NULL, 4);
+    return 0;
   }
+  if (offset < MYFS_READDIR_OFFSET) offset = MYFS_READDIR_OFFSET;
+
+  /* Only the attributes listed w/ --readdirplus depend on the items' data,
+     which may be in any open file's buffer */
+  if (env->readdir_plus) __myfs_sync_files(env);
+  fill.buf = buf;
+  fill.filler = filler;
+  __myfs_errno = ENOENT;
+  __myfs_lock(env, 0, &timer);
+  res = __myfs_readdir_cursor_implem(env->memory,
+                                     env->size,
+                                     &__myfs_errno,
+                                     env->uid,
+                                     env->gid,
+                                     path,
+                                     offset - MYFS_READDIR_OFFSET,
+                                     env->readdir_plus,
+                                     __myfs_readdir_fill,
+                                     &fill);
+  __myfs_unlock(env, &timer, MYFS_OP_READDIR, res, 0);
+  if (res >= 0)
+    return 0;
   return -__myfs_errno;
 }
 
 static int __myfs_mknod(const char* path, mode_t mode, dev_t dev) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
+  struct __myfs_timer_struct_t timer;
   int __myfs_errno, res;
 
   (void) dev;
 
   if (!S_ISREG(mode)) return -EPERM;
   
+  if (__myfs_is_ctl(path)) return -EACCES;
+
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
+  __myfs_lock(env, 1, &timer);
   res = __myfs_mknod_implem(env->memory,
                             env->size,
                             &__myfs_errno,
                             path);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_unlock(env, &timer, MYFS_OP_MKNOD, res, 0);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -382,18 +1338,21 @@ static int __myfs_mknod(const char* path, mode_t mode, dev_t dev) {
 static int __myfs_unlink(const char* path) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
+  struct __myfs_timer_struct_t timer;
   int __myfs_errno, res;
   
+  if (__myfs_is_ctl(path)) return -EACCES;
+
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
+  __myfs_lock(env, 1, &timer);
   res = __myfs_unlink_implem(env->memory,
                              env->size,
                              &__myfs_errno,
                              path);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_unlock(env, &timer, MYFS_OP_UNLINK, res, 0);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -402,18 +1361,30 @@ static int __myfs_unlink(const char* path) {
 static int __myfs_mkdir(const char* path, mode_t mode) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
+  struct __myfs_timer_struct_t timer;
   int __myfs_errno, res;
   
+  if (__myfs_is_ctl(path)) return -EACCES;
+
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
+  /* A snapshot holds every write that has returned */
+  if (__myfs_snapshot_name(path) != NULL) __myfs_sync_files(env);
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_mkdir_implem(env->memory,
-                            env->size,
-                            &__myfs_errno,
-                            path);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_lock(env, 1, &timer);
+  if (__myfs_snapshot_name(path) != NULL) {
+    res = __myfs_snapshot_implem(env->memory,
+                                 env->size,
+                                 &__myfs_errno,
+                                 __myfs_snapshot_name(path));
+  } else {
+    res = __myfs_mkdir_implem(env->memory,
+                              env->size,
+                              &__myfs_errno,
+                              path);
+  }
+  __myfs_unlock(env, &timer, MYFS_OP_MKDIR, res, 0);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -422,18 +1393,28 @@ static int __myfs_mkdir(const char* path, mode_t mode) {
 static int __myfs_rmdir(const char* path) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
+  struct __myfs_timer_struct_t timer;
   int __myfs_errno, res;
 
+  if (__myfs_is_ctl(path)) return -EACCES;
+
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_rmdir_implem(env->memory,
-                            env->size,
-                            &__myfs_errno,
-                            path);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_lock(env, 1, &timer);
+  if (__myfs_snapshot_name(path) != NULL) {
+    res = __myfs_snapshot_delete_implem(env->memory,
+                                        env->size,
+                                        &__myfs_errno,
+                                        __myfs_snapshot_name(path));
+  } else {
+    res = __myfs_rmdir_implem(env->memory,
+                              env->size,
+                              &__myfs_errno,
+                              path);
+  }
+  __myfs_unlock(env, &timer, MYFS_OP_RMDIR, res, 0);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -442,19 +1423,22 @@ static int __myfs_rmdir(const char* path) {
 static int __myfs_rename(const char* from, const char* to) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
+  struct __myfs_timer_struct_t timer;
   int __myfs_errno, res;
 
+  if (__myfs_is_ctl(from) || __myfs_is_ctl(to)) return -EACCES;
+
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
+  __myfs_lock(env, 1, &timer);
   res = __myfs_rename_implem(env->memory,
                              env->size,
                              &__myfs_errno,
                              from,
                              to);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_unlock(env, &timer, MYFS_OP_RENAME, res, 0);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -463,19 +1447,66 @@ static int __myfs_rename(const char* from, const char* to) {
 static int __myfs_truncate(const char* path, off_t size) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
+  struct __myfs_timer_struct_t timer;
   int __myfs_errno, res;
 
+  /* Truncating the size control file (as done before writing to it) does
+     nothing */
+  if (__myfs_is_ctl(path))
+    return (strcmp(path, MYFS_CTL_SIZE) == 0) ? 0 : -EACCES;
+
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
+  __myfs_sync_path(env, path);
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
+  __myfs_lock(env, 1, &timer);
   res = __myfs_truncate_implem(env->memory,
                                env->size,
                                &__myfs_errno,
                                path,
                                size);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_unlock(env, &timer, MYFS_OP_TRUNCATE, res, 0);
+  if (res >= 0)
+    return res;
+  return -__myfs_errno;
+}
+
+static int __myfs_ftruncate(const char* path, off_t size, struct fuse_file_info* fi) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+  struct __myfs_timer_struct_t timer;
+  int __myfs_errno, res;
+
+  /* Truncating the size control file (as done before writing to it) does
+     nothing */
+  if (__myfs_is_ctl(path))
+    return (strcmp(path, MYFS_CTL_SIZE) == 0) ? 0 : -EACCES;
+
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+  
+  if ((fi != NULL) && (fi->fh != 0)) {
+    __myfs_sync_file(env, __myfs_file(fi)->fh);
+  } else {
+    __myfs_sync_path(env, path);
+  }
+  __myfs_errno = ENOENT;
+  __myfs_lock(env, 1, &timer);
+  if ((fi != NULL) && (fi->fh != 0)) {
+    res = __myfs_ftruncate_implem(env->memory,
+                                  env->size,
+                                  &__myfs_errno,
+                                  __myfs_file(fi)->fh,
+                                  size);
+  } else {
+    res = __myfs_truncate_implem(env->memory,
+                                 env->size,
+                                 &__myfs_errno,
+                                 path,
+                                 size);
+  }
+  __myfs_unlock(env, &timer, MYFS_OP_TRUNCATE, res, 0);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -484,23 +1515,108 @@ static int __myfs_truncate(const char* path, off_t size) {
 static int __myfs_open(const char* path, struct fuse_file_info* fi) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
+  struct __myfs_timer_struct_t timer;
+  uint64_t fh;
   int __myfs_errno, res;
 
   if (!(((fi->flags & O_ACCMODE) == O_RDONLY) ||
         ((fi->flags & O_ACCMODE) == O_WRONLY) ||
         ((fi->flags & O_ACCMODE) == O_RDWR))) return -EINVAL;
   if (fi->flags & O_TRUNC) return -EINVAL;
+  if (__myfs_is_snapshot(path) && ((fi->flags & O_ACCMODE) != O_RDONLY)) return -EROFS;
   
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
+
+  /* A control file is read from a snapshot the handle refers to */
+  if (__myfs_is_ctl(path)) {
+    if (strcmp(path, MYFS_CTL_SIZE) == 0) {
+      fi->fh = (uint64_t) (uintptr_t) __myfs_size_render(env);
+      if (fi->fh == 0) return -ENOMEM;
+      fi->direct_io = 1;
+      return 0;
+    }
+    if (strcmp(path, MYFS_CTL_STATS) != 0) return -EISDIR;
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EACCES;
+    fi->fh = (uint64_t) (uintptr_t) __myfs_stats_render(env);
+    if (fi->fh == 0) return -ENOMEM;
+    fi->direct_io = 1;
+    return 0;
+  }
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
+  __myfs_lock(env, 0, &timer);
   res = __myfs_open_implem(env->memory,
                            env->size,
                            &__myfs_errno,
-                           path);
-  pthread_mutex_unlock(&(env->env_lock));
+                           path,
+                           &fh);
+  __myfs_unlock(env, &timer, MYFS_OP_OPEN, res, 0);
+  if (res < 0)
+    return -__myfs_errno;
+  if ((res = __myfs_file_open(env, fi, fh)) < 0) {
+    __myfs_release_implem(env->memory, env->size, &__myfs_errno, fh);
+  }
+  return res;
+}
+
+static int __myfs_create(const char* path, mode_t mode, struct fuse_file_info* fi) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+  struct __myfs_timer_struct_t timer;
+  uint64_t fh;
+  int __myfs_errno, res;
+
+  (void) mode;
+
+  if (!(((fi->flags & O_ACCMODE) == O_RDONLY) ||
+        ((fi->flags & O_ACCMODE) == O_WRONLY) ||
+        ((fi->flags & O_ACCMODE) == O_RDWR))) return -EINVAL;
+
+  if (__myfs_is_ctl(path)) return -EACCES;
+
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+  
+  __myfs_errno = ENOENT;
+  __myfs_lock(env, 1, &timer);
+  res = __myfs_create_implem(env->memory,
+                             env->size,
+                             &__myfs_errno,
+                             path,
+                             &fh);
+  __myfs_unlock(env, &timer, MYFS_OP_CREATE, res, 0);
+  if (res < 0)
+    return -__myfs_errno;
+  if ((res = __myfs_file_open(env, fi, fh)) < 0) {
+    __myfs_release_implem(env->memory, env->size, &__myfs_errno, fh);
+  }
+  return res;
+}
+
+static int __myfs_release(const char* path, struct fuse_file_info* fi) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+  struct __myfs_timer_struct_t timer;
+  uint64_t fh;
+  int __myfs_errno, res;
+
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+
+  if (__myfs_is_ctl(path)) {
+    __myfs_snapshot_free((struct __myfs_snapshot_struct_t *) (uintptr_t) fi->fh);
+    return 0;
+  }
+  
+  fh = __myfs_file_close(env, __myfs_file(fi));
+  __myfs_errno = EBADF;
+  __myfs_lock(env, 0, &timer);
+  res = __myfs_release_implem(env->memory,
+                              env->size,
+                              &__myfs_errno,
+                              fh);
+  __myfs_unlock(env, &timer, MYFS_OP_RELEASE, res, 0);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -509,23 +1625,92 @@ static int __myfs_open(const char* path, struct fuse_file_info* fi) {
 static int __myfs_read(const char* path, char *buf, size_t size, off_t offset, struct fuse_file_info* fi) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
+  struct __myfs_timer_struct_t timer;
   int __myfs_errno, res;
 
-  (void) fi;
-  
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
+
+  if (__myfs_is_ctl(path)) {
+    if ((fi == NULL) || (fi->fh == 0)) return -EBADF;
+    return __myfs_snapshot_read((struct __myfs_snapshot_struct_t *) (uintptr_t) fi->fh,
+                                buf, size, offset);
+  }
   
+  if ((fi != NULL) && (fi->fh != 0)) {
+    __myfs_sync_file(env, __myfs_file(fi)->fh);
+  } else {
+    __myfs_sync_path(env, path);
+  }
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_read_implem(env->memory,
-                           env->size,
-                           &__myfs_errno,
-                           path,
-                           buf,
-                           size,
-                           offset);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_lock(env, 0, &timer);
+  if ((fi != NULL) && (fi->fh != 0)) {
+    res = __myfs_fread_implem(env->memory,
+                              env->size,
+                              &__myfs_errno,
+                              __myfs_file(fi)->fh,
+                              buf,
+                              size,
+                              offset);
+    if (res > 0) __myfs_note_read(env, __myfs_file(fi), offset, (size_t) res);
+  } else {
+    res = __myfs_read_implem(env->memory,
+                             env->size,
+                             &__myfs_errno,
+                             path,
+                             buf,
+                             size,
+                             offset);
+  }
+  __myfs_unlock(env, &timer, MYFS_OP_READ, res, (res > 0) ? (size_t) res : 0);
+  if (res >= 0)
+    return res;
+  return -__myfs_errno;
+}
+
+/* Grows the file system online to the given size: extends the backup-file,
+   maps what was added to it into the address space reserved past the
+   mapping, and has the file system grow into it. The mapping stays where it
+   is, so nothing pointing into it needs to change. Returns 0 on success,
+   else -errno, leaving the file system as it was. */
+static int __myfs_grow(struct __myfs_environment_struct_t *env, size_t size) {
+  struct __myfs_timer_struct_t timer;
+  size_t page_size, start;
+  void *added;
+  int __myfs_errno, res;
+
+  if (!env->using_backup) return -EOPNOTSUPP;
+
+  __myfs_sync_files(env);
+  __myfs_lock(env, 1, &timer);
+  res = -1;
+  if (size < env->size) {
+    __myfs_errno = EINVAL;
+  } else if (size > env->map_size) {
+    __myfs_errno = EFBIG;
+  } else if (size == env->size) {
+    res = 0;
+  } else if (ftruncate(env->backup_fd, (off_t) size) != 0) {
+    __myfs_errno = errno;
+  } else {
+    page_size = (size_t) sysconf(_SC_PAGESIZE);
+    start = env->size & ~(page_size - 1);
+    added = mmap((char *) env->memory + start, size - start, 
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, 
+                 env->backup_fd, (off_t) start);
+    if (added == MAP_FAILED) {
+      __myfs_errno = errno;
+    } else {
+      res = __myfs_grow_implem(env->memory, size, &__myfs_errno);
+    }
+    if (res == 0) {
+      env->size = size;
+      if (env->advice != MYFS_READAHEAD_NORMAL) __myfs_advise(env, env->advice);
+    } else if (ftruncate(env->backup_fd, (off_t) env->size) != 0) {
+      perror("Cannot truncate backup-file");
+    }
+  }
+  __myfs_unlock(env, &timer, MYFS_OP_GROW, res, 0);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -534,15 +1719,49 @@ static int __myfs_read(const char* path, char *buf, size_t size, off_t offset, s
 static int __myfs_write(const char* path, const char *buf, size_t size, off_t offset, struct fuse_file_info* fi) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
+  struct __myfs_file_struct_t *file;
+  struct __myfs_timer_struct_t timer;
+  char str[32], *end;
+  unsigned long long new_size;
   int __myfs_errno, res;
 
-  (void) fi;
-  
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
-  
+
+  /* A size written to the size control file (all at once) grows the file
+     system to it */
+  if (__myfs_is_ctl(path)) {
+    if (strcmp(path, MYFS_CTL_SIZE) != 0) return -EACCES;
+    if ((offset != 0) || (size >= sizeof(str))) return -EINVAL;
+    memcpy(str, buf, size);
+    str[size] = '\0';
+    errno = 0;
+    new_size = strtoull(str, &end, 10);
+    while ((*end == '\n') || (*end == ' ')) end++;
+    if ((errno != 0) || (end == str) || (*end != '\0') ||
+        (((unsigned long long) ((size_t) new_size)) != new_size)) return -EINVAL;
+    res = __myfs_grow(env, (size_t) new_size);
+    if (res < 0)
+      return res;
+    return (int) size;
+  }
+
+  /* Writes to an open file only need its lock, as they're gathered in its
+     buffer */
+  if ((fi != NULL) && (fi->fh != 0)) {
+    file = __myfs_file(fi);
+    timer.start = __myfs_now_ns();
+    pthread_mutex_lock(&(file->lock));
+    timer.locked = __myfs_now_ns();
+    res = __myfs_file_write(env, file, buf, size, offset);
+    pthread_mutex_unlock(&(file->lock));
+    __myfs_record(env, &timer, MYFS_OP_WRITE, res, (res > 0) ? (size_t) res : 0);
+    return res;
+  }
+
+  __myfs_sync_path(env, path);
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
+  __myfs_lock(env, 1, &timer);
   res = __myfs_write_implem(env->memory,
                             env->size,
                             &__myfs_errno,
@@ -550,15 +1769,211 @@ static int __myfs_write(const char* path, const char *buf, size_t size, off_t of
                             buf,
                             size,
                             offset);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_unlock(env, &timer, MYFS_OP_WRITE, res, (res > 0) ? (size_t) res : 0);
   if (res >= 0)
     return res;
   return -__myfs_errno;
 }
 
+#define MYFS_READ_IOVS (64)   /* Num mapping parts got per freadmap call */
+
+/* Hands FUSE the parts of the backup-file holding the data (as it's what's
+   mapped), so it can splice them to the kernel w/out copying them. Holes
+   get zeroed buffers, as FUSE frees a buffer's memory once done. FUSE 
+   splices the parts only after this returns, so they must stay the file's
+   until then: this holds only if FUSE is single-threaded, as then no other
+   op (and so no truncate, unlink or dedup remap freeing or reusing them) 
+   runs before the reply is sent. Without --zerocopy, or if multi-threaded,
+   the data is read into a buffer instead, under the lock. */
+static int __myfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+  struct fuse_bufvec *vec, *bigger;
+  struct iovec iov[MYFS_READ_IOVS];
+  size_t cap, done;
+  struct __myfs_timer_struct_t timer;
+  int __myfs_errno, res, i;
+
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+
+  if (!env->splice_reads || (fi == NULL) || (fi->fh == 0) || __myfs_is_ctl(path)) {
+    vec = malloc(sizeof(struct fuse_bufvec));
+    if (vec == NULL) return -ENOMEM;
+    *vec = FUSE_BUFVEC_INIT(size);
+    vec->buf[0].mem = malloc(size);
+    if ((size != 0) && (vec->buf[0].mem == NULL)) {
+      free(vec);
+      return -ENOMEM;
+    }
+    res = __myfs_read(path, vec->buf[0].mem, size, offset, fi);
+    if (res < 0) {
+      free(vec->buf[0].mem);
+      free(vec);
+      return res;
+    }
+    vec->buf[0].size = res;
+    *bufp = vec;
+    return 0;
+  }
+
+  cap = MYFS_READ_IOVS;
+  vec = malloc(sizeof(struct fuse_bufvec) + (cap - 1) * sizeof(struct fuse_buf));
+  if (vec == NULL) return -ENOMEM;
+  vec->count = 0;
+  vec->idx = 0;
+  vec->off = 0;
+
+  __myfs_sync_file(env, __myfs_file(fi)->fh);
+  __myfs_errno = ENOENT;
+  res = 0;
+  done = 0;
+  __myfs_lock(env, 0, &timer);
+  while (done < size) {
+    res = __myfs_freadmap_implem(env->memory,
+                                 env->size,
+                                 &__myfs_errno,
+                                 __myfs_file(fi)->fh,
+                                 size - done,
+                                 offset + done,
+                                 iov,
+                                 MYFS_READ_IOVS);
+    if (res <= 0) break;
+    if (vec->count + res > cap) {
+      cap *= 2;
+      bigger = realloc(vec, sizeof(struct fuse_bufvec) + (cap - 1) * sizeof(struct fuse_buf));
+      if (bigger == NULL) {
+        __myfs_errno = ENOMEM;
+        res = -1;
+        break;
+      }
+      vec = bigger;
+    }
+    for (i = 0; i < res; i++) {
+      struct fuse_buf *buf = &(vec->buf[vec->count]);
+      buf->size = iov[i].iov_len;
+      buf->flags = (enum fuse_buf_flags) 0;
+      buf->mem = NULL;
+      buf->fd = -1;
+      buf->pos = 0;
+      if (iov[i].iov_base != NULL) {
+        buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        buf->fd = env->backup_fd;
+        buf->pos = (off_t) ((char *) iov[i].iov_base - (char *) env->memory);
+      } else if ((buf->mem = calloc(1, iov[i].iov_len)) == NULL) {
+        __myfs_errno = ENOMEM;
+        res = -1;
+        break;
+      }
+      vec->count++;
+      done += iov[i].iov_len;
+    }
+    if (res < 0) break;
+  }
+  if (done > 0) __myfs_note_read(env, __myfs_file(fi), offset, done);
+  __myfs_unlock(env, &timer, MYFS_OP_READ, res, done);
+
+  if (res < 0) {
+    for (i = 0; i < (int) vec->count; i++)
+      free(vec->buf[i].mem);
+    free(vec);
+    return -__myfs_errno;
+  }
+  *bufp = vec;
+  return 0;
+}
+
+/* Source of the data written by __myfs_write_buf */
+struct __myfs_buf_fill_struct_t {
+  struct fuse_bufvec *src;
+  int err;
+};
+
+/* Copies the next len bytes of the data being written straight into dst (a
+   part of the mapping), as FUSE may hand them over in a pipe */
+static size_t __myfs_buf_fill(void *arg, char *dst, size_t len) {
+  struct __myfs_buf_fill_struct_t *fill = (struct __myfs_buf_fill_struct_t *) arg;
+  struct fuse_bufvec dst_vec = FUSE_BUFVEC_INIT(len);
+  ssize_t res;
+
+  dst_vec.buf[0].mem = dst;
+  res = fuse_buf_copy(&dst_vec, fill->src, (enum fuse_buf_copy_flags) 0);
+  if (res < 0) {
+    fill->err = (int) -res;
+    return 0;
+  }
+  return (size_t) res;
+}
+
+static int __myfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+  struct __myfs_buf_fill_struct_t fill;
+  struct fuse_bufvec src_vec;
+  size_t size;
+  char *mem;
+  struct __myfs_file_struct_t *file;
+  struct __myfs_timer_struct_t timer;
+  int __myfs_errno, res;
+
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+  size = fuse_buf_size(buf);
+  if (__myfs_is_ctl(path) && (strcmp(path, MYFS_CTL_SIZE) != 0)) return -EACCES;
+
+  /* A single buffer in memory is written as is */
+  if ((buf->count == 1) && (buf->idx == 0) && 
+      !(buf->buf[0].flags & FUSE_BUF_IS_FD)) {
+    return __myfs_write(path, (const char *) buf->buf[0].mem + buf->off, 
+                        size - buf->off, offset, fi);
+  }
+
+  /* Without a file's handle, gather the data into a buffer first */
+  if ((fi == NULL) || (fi->fh == 0) || __myfs_is_ctl(path)) {
+    mem = malloc(size);
+    if ((size != 0) && (mem == NULL)) return -ENOMEM;
+    src_vec = FUSE_BUFVEC_INIT(size);
+    src_vec.buf[0].mem = mem;
+    res = (int) fuse_buf_copy(&src_vec, buf, (enum fuse_buf_copy_flags) 0);
+    if (res >= 0)
+      res = __myfs_write(path, mem, (size_t) res, offset, fi);
+    free(mem);
+    return res;
+  }
+
+  /* Else have the data copied straight into place, after the writes
+     gathered in the file's buffer */
+  file = __myfs_file(fi);
+  pthread_mutex_lock(&(file->lock));
+  if ((res = __myfs_file_flush(env, file)) < 0) {
+    pthread_mutex_unlock(&(file->lock));
+    return res;
+  }
+  fill.src = buf;
+  fill.err = 0;
+  __myfs_errno = ENOENT;
+  __myfs_lock(env, 1, &timer);
+  res = __myfs_fwritefill_implem(env->memory,
+                                 env->size,
+                                 &__myfs_errno,
+                                 file->fh,
+                                 __myfs_buf_fill,
+                                 &fill,
+                                 size,
+                                 offset);
+  __myfs_unlock(env, &timer, MYFS_OP_WRITE, res, (res > 0) ? (size_t) res : 0);
+  pthread_mutex_unlock(&(file->lock));
+  if (res >= 0)
+    return res;
+  if (fill.err != 0)
+    return -fill.err;
+  return -__myfs_errno;
+}
+
 static int __myfs_statfs(const char* path, struct statvfs* stbuf) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
+  struct __myfs_timer_struct_t timer;
   int __myfs_errno, res;
 
   (void) path;
@@ -569,12 +1984,12 @@ static int __myfs_statfs(const char* path, struct statvfs* stbuf) {
   memset(stbuf, 0, sizeof(struct statvfs));
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
+  __myfs_lock(env, 0, &timer);
   res = __myfs_statfs_implem(env->memory,
                              env->size,
                              &__myfs_errno,
                              stbuf);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_unlock(env, &timer, MYFS_OP_STATFS, res, 0);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -583,19 +1998,23 @@ static int __myfs_statfs(const char* path, struct statvfs* stbuf) {
 static int __myfs_utimens(const char* path, const struct timespec ts[2]) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
+  struct __myfs_timer_struct_t timer;
   int __myfs_errno, res;
 
+  if (__myfs_is_ctl(path)) return -EACCES;
+
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
+  __myfs_sync_path(env, path);
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
+  __myfs_lock(env, 1, &timer);
   res = __myfs_utimens_implem(env->memory,
                               env->size,
                               &__myfs_errno,
                               path,
                               ts);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_unlock(env, &timer, MYFS_OP_UTIMENS, res, 0);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -604,29 +2023,128 @@ static int __myfs_utimens(const char* path, const struct timespec ts[2]) {
 static int __myfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
+  struct __myfs_file_struct_t *file;
+  struct __myfs_timer_struct_t timer;
   int __myfs_errno, res;
   
-  (void) path;
-  (void) datasync;
-  (void) fi;
+  if (__myfs_is_ctl(path)) return 0;
 
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
+  /* Write back what's gathered in the file's buffer (or those of all files)
+     first */
+  if ((fi != NULL) && (fi->fh != 0)) {
+    file = __myfs_file(fi);
+    pthread_mutex_lock(&(file->lock));
+    res = __myfs_file_flush(env, file);
+    pthread_mutex_unlock(&(file->lock));
+    if (res < 0) return res;
+  } else {
+    __myfs_sync_files(env);
+  }
+
+  /* Flush just the file's own pages & the metadata journal if it has a
+     handle, else commit & flush the journal, then all of the data */
   __myfs_errno = EIO;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_sync_environment(env);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_lock(env, 0, &timer);
+  if ((fi != NULL) && (fi->fh != 0)) {
+    res = __myfs_ffsync_implem(env->memory,
+                               env->size,
+                               &__myfs_errno,
+                               __myfs_file(fi)->fh,
+                               datasync);
+  } else {
+    res = __myfs_fsync_implem(env->memory, env->size, &__myfs_errno);
+    if (res >= 0) {
+      __myfs_errno = EIO;
+      res = __myfs_sync_environment(env);
+    }
+  }
+  __myfs_unlock(env, &timer, MYFS_OP_FSYNC, res, 0);
   if (res >= 0)
     return res;
   return -__myfs_errno;  
 }
 
+/* Called on each close of the file, so a write back error is returned by
+   close */
+static int __myfs_flush(const char *path, struct fuse_file_info *fi) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+  struct __myfs_file_struct_t *file;
+  struct __myfs_timer_struct_t timer;
+  int res;
+
+  if (__myfs_is_ctl(path) || (fi == NULL) || (fi->fh == 0)) return 0;
+
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+
+  file = __myfs_file(fi);
+  timer.start = __myfs_now_ns();
+  pthread_mutex_lock(&(file->lock));
+  timer.locked = __myfs_now_ns();
+  res = __myfs_file_flush(env, file);
+  pthread_mutex_unlock(&(file->lock));
+  __myfs_record(env, &timer, MYFS_OP_FLUSH, res, 0);
+  return res;
+}
+
+/* Runs in the process serving the requests (i.e. after FUSE daemonizes), so
+   the mount's in-memory state belongs to that process */
+static void *__myfs_init(struct fuse_conn_info *conn) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+  int __myfs_errno, res;
+
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+  if (env == NULL) return NULL;
+
+  /* Have FUSE move data to and from the kernel by splicing where it can */
+  if (env->zero_copy) {
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | 
+                                   FUSE_CAP_SPLICE_MOVE |
+                                   FUSE_CAP_SPLICE_READ);
+  }
+
+  __myfs_errno = 0;
+  pthread_rwlock_wrlock(&(env->env_lock));
+  res = __myfs_mount_implem(env->memory, env->size, &__myfs_errno);
+  if (res >= 0) {
+    res = __myfs_atime_implem(env->memory, env->size, &__myfs_errno, env->atime_mode);
+  }
+  if (res >= 0 && env->dedup &&
+      __myfs_dedup_implem(env->memory, env->size, &__myfs_errno, 1) < 0) {
+    fprintf(stderr, "Cannot turn on deduplication: %s\n", strerror(__myfs_errno));
+  }
+  pthread_rwlock_unlock(&(env->env_lock));
+  if (res < 0) {
+    fprintf(stderr, "Cannot set up file-system state, running uncached: %s\n",
+            strerror(__myfs_errno));
+  }
+
+  if (pthread_create(&(env->stats_thread), NULL, __myfs_stats_thread, env) == 0) {
+    env->stats_thread_running = 1;
+  } else {
+    fprintf(stderr, "Cannot start stats thread, stats cannot be reset\n");
+  }
+  return env;
+}
+
 static void __myfs_destroy(void *private_data) {
   struct __myfs_environment_struct_t *env;
   
   if (private_data == NULL) return;
   env = (struct __myfs_environment_struct_t *) private_data;
+  if (env->stats_thread_running) {
+    pthread_cancel(env->stats_thread);
+    pthread_join(env->stats_thread, NULL);
+    env->stats_thread_running = 0;
+  }
+  __myfs_sync_files(env);
+  __myfs_unmount_implem(env->memory, env->size);
   __myfs_clear_environment(env);
 }
 
@@ -639,12 +2157,19 @@ static struct fuse_operations __myfs_operations = {
   .rmdir = __myfs_rmdir,
   .rename = __myfs_rename,
   .truncate = __myfs_truncate,
+  .ftruncate = __myfs_ftruncate,
   .open = __myfs_open,
+  .create = __myfs_create,
+  .release = __myfs_release,
   .read = __myfs_read,
   .write = __myfs_write,
+  .read_buf = __myfs_read_buf,
+  .write_buf = __myfs_write_buf,
   .statfs = __myfs_statfs,
   .utimens = __myfs_utimens,
   .fsync = __myfs_fsync,
+  .flush = __myfs_flush,
+  .init = __myfs_init,
   .destroy = __myfs_destroy
 };
 
@@ -660,9 +2185,59 @@ static void __myfs_show_help(const char *name) {
                "                                     Size of the backup-file otherwise.\n"
                "                            If both a backup-file and a size are specified,\n"
                "                            the actual size is the maximum of the size of the\n"
-               "                            backup-file and the size specified.\n"
+               "                            backup-file and the size specified. A file system\n"
+               "                            in a larger backup-file is grown to fill it (up\n"
+               "                            to 16 times its size when formatted), as it is\n"
+               "                            when a larger size is written to .myfs/size.\n"
                "                            The minimum size of a filesystem is 2kB. If a\n"
                "                            lesser size is used, it is increased to 2kB.\n"
+               "    --blocksize=<s>         Size of each block of a newly formatted file\n"
+               "                            system, in bytes (a power of 2, 512B to 1MB).\n"
+               "                            Default: 4kB\n"
+               "    --inode-ratio=<s>       Num of blocks per inode of a newly formatted\n"
+               "                            file system (1 to 1024). Default: 1\n"
+               "                            Both are recorded in the file system when it\n"
+               "                            is formatted and ignored for an existing one.\n"
+               "    --zerocopy              Have FUSE splice file data straight from (and\n"
+               "                            to) the backup-file's pages, w/out copying it.\n"
+               "                            Requires a backup-file. Reads are spliced only\n"
+               "                            if single-threaded (-s), as else another op may\n"
+               "                            reuse their blocks before they are sent.\n"
+               "    --writebuf=<s>          Size of the buffer gathering adjacent writes to\n"
+               "                            each open file, written to the file system as\n"
+               "                            one when full, or on flush, fsync or close\n"
+               "                            (up to 16MB). Default: 64kB, 0 disables it\n"
+               "    --atime=<s>             When reads and listings update access times:\n"
+               "                            strict (always), relatime (only if not after\n"
+               "                            the last modification, or a day old) or\n"
+               "                            noatime (never). Default: relatime\n"
+               "    --readdirplus           Give each entry's attributes along with its\n"
+               "                            name when listing a directory.\n"
+               "    --prefault=<s>          Parts of the file system faulted in when\n"
+               "                            mounting: none, meta (all but the file data,\n"
+               "                            if a backup-file is given) or all.\n"
+               "                            Default: none\n"
+               "    --readahead=<s>         How the kernel is told file data will be read\n"
+               "                            from the backup-file: normal, sequential,\n"
+               "                            random, or auto (by the pattern of the last\n"
+               "                            reads of open files). Default: auto\n"
+               "    --hugepages             Back the file system w/ huge pages (reserved\n"
+               "                            ones if free, else transparent ones).\n"
+               "                            Requires no backup-file.\n"
+               "    --fsck=<s>              Check of the file system in the backup-file\n"
+               "                            before mounting it: none, fast (its geometry\n"
+               "                            and journal) or full (all of it, w/ a thread\n"
+               "                            per core). Default: fast\n"
+               "    --dedup                 Share the blocks of file data holding the same\n"
+               "                            bytes, copying them when written. Blocks shared\n"
+               "                            stay so when mounted w/out it.\n"
+               "\n"
+               "Per-operation stats can be read from <mountpoint>/.myfs/stats and are\n"
+               "reset by sending the process SIGUSR1.\n"
+               "\n"
+               "A read-only snapshot of the file system is taken by making a directory\n"
+               "in <mountpoint>/.snapshots (ex: mkdir .snapshots/daily), and deleted by\n"
+               "removing it. Its blocks are shared until written.\n"
                "\n");
 }
 
@@ -671,16 +2246,35 @@ int main(int argc, char *argv[]) {
   struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
   struct __myfs_environment_struct_t __myfs_environment;
   struct __myfs_environment_struct_t *env_ptr = NULL;
+  sigset_t __myfs_signals;
+  int i;
   
   /* Initialize defaults */
   __myfs_options.filename = NULL;
   __myfs_options.size = NULL;
+  __myfs_options.blocksize = NULL;
+  __myfs_options.inode_ratio = NULL;
+  __myfs_options.writebuf = NULL;
+  __myfs_options.atime = NULL;
+  __myfs_options.prefault = NULL;
+  __myfs_options.readahead = NULL;
+  __myfs_options.fsck = NULL;
+  __myfs_options.zero_copy = 0;
+  __myfs_options.single_thread = 0;
+  __myfs_options.readdir_plus = 0;
+  __myfs_options.hugepages = 0;
+  __myfs_options.dedup = 0;
   __myfs_options.show_help = 0;
         
   /* Parse options */
   if (fuse_opt_parse(&args, &__myfs_options, __myfs_option_spec, NULL) == -1)
     return 1;
 
+  /* Note whether FUSE is to run single-threaded, leaving -s for FUSE */
+  for (i = 1; i < args.argc; i++) {
+    if (strcmp(args.argv[i], "-s") == 0) __myfs_options.single_thread = 1;
+  }
+
   /* If we are not just handling help texts, we need to setup the
      file-system environment.
   */
@@ -688,6 +2282,12 @@ int main(int argc, char *argv[]) {
     env_ptr = &__myfs_environment;
     if (!__myfs_setup_environment(env_ptr, &__myfs_options))
       return 1;
+
+    /* Leave the stats reset signal to the thread waiting for it, as all the
+       threads FUSE starts inherit this mask */
+    sigemptyset(&__myfs_signals);
+    sigaddset(&__myfs_signals, MYFS_STATS_RESET_SIGNAL);
+    pthread_sigmask(SIG_BLOCK, &__myfs_signals, NULL);
   } else {
     /* Handle displaying of help text */
     __myfs_show_help(argv[0]);
@@ -0,0 +1,180 @@
+/*
+
+  readbench: Measures read throughput vs. thread count on a mounted myfs.
+
+  Each thread repeatedly pread()s fixed-size chunks at random (chunk aligned)
+  offsets of the given file for the given duration. The run is repeated for
+  1, 2, 4, ... up to the given max number of threads, and the aggregate
+  throughput of each run is reported. With myfs in multi-threaded mode (i.e.
+  mounted without -s), reads take the fs lock shared, so throughput should
+  grow with the thread count until the cores (or FUSE) are saturated.
+
+  Compile with:
+    gcc -O2 -Wall readbench.c -o readbench -lpthread
+
+  Usage:
+    ./readbench FILE [MAX_THREADS] [SECONDS] [CHUNK_KB]
+
+  Ex: (w/ myfs mounted at ~/fuse-mnt)
+    dd if=/dev/urandom of=~/fuse-mnt/bench bs=1M count=32
+    ./readbench ~/fuse-mnt/bench 8 3 64
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file LICENSE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define MAX_THREADS (256)                   // Most threads that may be run
+
+// Per-thread benchmark state
+typedef struct BenchThread {
+    pthread_t thread;                       // The thread
+    int fd;                                 // Its own fd for the file
+    size_t chunk_sz;                        // Num bytes per read
+    size_t num_chunks;                      // Num chunks in the file
+    double seconds;                         // Duration to read for
+    unsigned int seed;                      // Offset generator state
+    size_t bytes;                           // Num bytes read (result)
+    size_t reads;                           // Num reads done (result)
+    int err;                                // errno of a failed read, or 0
+} BenchThread;
+
+// Returns the current monotonic time, in seconds.
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Reads random chunks of the file until the thread's duration has elapsed.
+static void* bench_thread_run(void *arg) {
+    BenchThread *bt = (BenchThread*)arg;
+    char *buf = malloc(bt->chunk_sz);
+    double end = now_s() + bt->seconds;
+
+    if (!buf) {
+        bt->err = ENOMEM;
+        return NULL;
+    }
+
+    while (now_s() < end) {
+        // Check the clock only every few reads, as it's not free either
+        for (int i = 0; i < 16; i++) {
+            off_t off = (off_t)(rand_r(&bt->seed) % bt->num_chunks) *
+                        bt->chunk_sz;
+            ssize_t n = pread(bt->fd, buf, bt->chunk_sz, off);
+            if (n < 0) {
+                bt->err = errno;
+                free(buf);
+                return NULL;
+            }
+            bt->bytes += n;
+            bt->reads++;
+        }
+    }
+
+    free(buf);
+    return NULL;
+}
+
+// Runs the benchmark w/ the given num of threads and prints its results.
+// Returns 0 on success, else -1.
+static int bench_run(const char *path, int n_threads, double seconds,
+                     size_t chunk_sz, size_t num_chunks) {
+    BenchThread bts[MAX_THREADS];
+    size_t bytes = 0, reads = 0;
+    int result = 0;
+    int started = 0;
+
+    memset(bts, 0, sizeof(bts));
+    double start = now_s();
+
+    for (int i = 0; i < n_threads; i++) {
+        bts[i].fd = open(path, O_RDONLY);
+        bts[i].chunk_sz = chunk_sz;
+        bts[i].num_chunks = num_chunks;
+        bts[i].seconds = seconds;
+        bts[i].seed = (unsigned int)(i + 1);
+        if (bts[i].fd < 0 ||
+            pthread_create(&bts[i].thread, NULL, bench_thread_run, &bts[i])) {
+            perror("Cannot start benchmark thread");
+            if (bts[i].fd >= 0)
+                close(bts[i].fd);
+            result = -1;
+            break;
+        }
+        started++;
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(bts[i].thread, NULL);
+        close(bts[i].fd);
+        if (bts[i].err) {
+            fprintf(stderr, "Read failed: %s\n", strerror(bts[i].err));
+            result = -1;
+        }
+        bytes += bts[i].bytes;
+        reads += bts[i].reads;
+    }
+
+    double elapsed = now_s() - start;
+    if (result == 0)
+        printf("%7d %12.1f %12.0f\n", n_threads,
+               bytes / elapsed / (1024 * 1024), reads / elapsed);
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    struct stat st;
+
+    if (argc < 2) {
+        printf("usage: %s FILE [MAX_THREADS] [SECONDS] [CHUNK_KB]\n", argv[0]);
+        return 1;
+    }
+
+    const char *path = argv[1];
+    int max_threads = (argc > 2) ? atoi(argv[2]) : 8;
+    double seconds = (argc > 3) ? atof(argv[3]) : 2.0;
+    size_t chunk_sz = ((argc > 4) ? (size_t)atol(argv[4]) : 64) * 1024;
+
+    if (max_threads < 1 || max_threads > MAX_THREADS || seconds <= 0 ||
+        chunk_sz == 0) {
+        fprintf(stderr, "Invalid argument(s)\n");
+        return 1;
+    }
+    if (stat(path, &st) != 0) {
+        perror("Cannot stat file");
+        return 1;
+    }
+    if ((size_t)st.st_size < chunk_sz) {
+        fprintf(stderr, "File must be at least one chunk (%lu bytes) long\n",
+                (unsigned long)chunk_sz);
+        return 1;
+    }
+
+    size_t num_chunks = st.st_size / chunk_sz;
+    printf("%s: %lu bytes, %lu KB reads, %.1f s per run\n", path,
+           (unsigned long)st.st_size, (unsigned long)(chunk_sz / 1024),
+           seconds);
+    printf("%7s %12s %12s\n", "threads", "MB/s", "reads/s");
+
+    for (int n = 1; n <= max_threads; n *= 2) {
+        if (bench_run(path, n, seconds, chunk_sz, num_chunks) != 0)
+            return 1;
+        if (n < max_threads && n * 2 > max_threads)
+            n = max_threads / 2;    // Ensure the max itself gets run
+    }
+
+    return 0;
+}